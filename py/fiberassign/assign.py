@@ -121,7 +121,8 @@ def result_path(tile_id, dir=".", prefix="fba-",
     return path
 
 
-def write_assignment_fits_tile(asgn, fulltarget, overwrite, params):
+def write_assignment_fits_tile(asgn, fulltarget, overwrite, params,
+                               header_extra=None):
     """Write a single tile assignment to a FITS file.
 
     Args:
@@ -132,6 +133,7 @@ def write_assignment_fits_tile(asgn, fulltarget, overwrite, params):
         overwrite (bool): overwrite output files or not
         params (tuple):  tuple containing the tile ID, RA, DEC, rotation,
             output path, and GFA targets
+        header_extra (dict):  optional extra keywords for the primary header.
 
     Returns:
         None
@@ -298,6 +300,9 @@ def write_assignment_fits_tile(asgn, fulltarget, overwrite, params):
                         os.environ['DESI_ROOT'], '$DESI_ROOT', 1)
         setdep(header, 'SKYBRICKS_DIR', skybricks)
 
+        if header_extra is not None:
+            header.update(header_extra)
+
         fd.write(None, header=header, extname="PRIMARY")
 
         # FIXME:  write "-1" for unassigned targets.  Write all other fiber
@@ -549,7 +554,8 @@ def write_assignment_fits_tile(asgn, fulltarget, overwrite, params):
 
 def write_assignment_fits(tiles, asgn, out_dir=".", out_prefix="fba-",
                           split_dir=False, all_targets=False,
-                          gfa_targets=None, overwrite=False, stucksky=None):
+                          gfa_targets=None, overwrite=False, stucksky=None,
+                          header_extra=None):
     """Write out assignment results in FITS format.
 
     For each tile, all available targets (not only the assigned targets) and
@@ -568,6 +574,8 @@ def write_assignment_fits(tiles, asgn, out_dir=".", out_prefix="fba-",
             properties of assigned targets.
         gfa_targets (list of numpy arrays): Include these as GFA_TARGETS HDUs
         overwrite (bool): overwrite pre-existing output files
+        header_extra (dict): optional extra keywords for the primary header
+            of every tile file.
 
     Returns:
         None
@@ -586,7 +594,8 @@ def write_assignment_fits(tiles, asgn, out_dir=".", out_prefix="fba-",
     tileha = tiles.obshourang
 
     write_tile = partial(write_assignment_fits_tile,
-                         asgn, all_targets, overwrite)
+                         asgn, all_targets, overwrite,
+                         header_extra=header_extra)
 
     for i, tid in enumerate(tileids):
         tra = tilera[tileorder[tid]]
@@ -1630,7 +1639,10 @@ def run(
     start_tile=-1,
     stop_tile=-1,
     redistribute=True,
-    use_zero_obsremain=True
+    use_zero_obsremain=True,
+    solver="greedy",
+    refine=None,
+    fused_sky=False
 ):
     """Run fiber assignment.
 
@@ -1650,6 +1662,18 @@ def run(
         stop_tile (int):  If specified, the last tile ID to assign.
         redistribute (bool):  If True, attempt to shift science targets to unassigned
             fibers on later tiles in order to balance the number per petal.
+        use_zero_obsremain (bool):  If True, assign leftover fibers to science
+            targets with no remaining observations.
+        solver (str):  The per-tile method used when assigning science targets,
+            either "greedy", "petal" or "matching".  "petal" is also used for
+            the other target types, since it gives the same result as
+            "greedy".  See Assignment.assign_unused().
+        refine (float):  If not None, run a local search over the science
+            assignment before assigning standards and sky, for at most this
+            many seconds (<= 0 means no limit).  See Assignment.refine().
+        fused_sky (bool):  If True, assign sky and suppsky targets to unused
+            fibers with one call to Assignment.assign_unused_sky(), which
+            computes the availability of each type once per tile.
 
     Returns:
         None
@@ -1660,31 +1684,44 @@ def run(
     log = Logger.get()
 
     def print_counts(when=None):
-        counts = asgn.get_counts(start_tile, stop_tile)
-        tiles = list(counts.keys())
-        tiles.sort()
-        for tile in tiles:
-            msg = 'Tile %i: ' % tile
+        counts = asgn.counts(start_tile, stop_tile)
+        types = list(counts["types"])
+
+        def type_counts(tgtype):
+            return counts["type"][:, types.index(tgtype)]
+
+        # (name, counts per tile, always print)
+        keys = [
+            ('SCIENCE', type_counts(TARGET_TYPE_SCIENCE), True),
+            ('SCIENCE not STANDARD', counts["science_only"], False),
+            ('STANDARD', type_counts(TARGET_TYPE_STANDARD), True),
+            ('SKY', type_counts(TARGET_TYPE_SKY), True),
+            ('SUPPSKY', type_counts(TARGET_TYPE_SUPPSKY), False),
+            ('SAFE', type_counts(TARGET_TYPE_SAFE), False),
+        ]
+        for t in np.argsort(counts["tile"], kind="stable"):
+            msg = 'Tile %i: ' % counts["tile"][t]
             if when is not None:
                 msg += when
-            tilecounts = counts[tile]
-            keys = [('SCIENCE',True), ('SCIENCE not STANDARD',False), ('STANDARD',True),
-                    ('SKY',True), ('SUPPSKY',False), ('SAFE',False)]
             ss = []
-            for k,always in keys:
-                n = tilecounts.get(k, None)
-                if n is None:
-                    log.warning('Key', k, 'missing from Assignment.get_counts return value')
-                else:
-                    if n>0 or always:
-                        ss.append('%s: %i' % (k,n))
+            for k, n, always in keys:
+                if n[t] > 0 or always:
+                    ss.append('%s: %i' % (k, n[t]))
             log.info(msg + ', '.join(ss))
 
     print_counts('Start: ')
 
     # First-pass assignment of science targets
     gt.start("Assign unused fibers to science targets")
-    asgn.assign_unused(TARGET_TYPE_SCIENCE, -1, -1, "POS", start_tile, stop_tile)
+    asgn.assign_unused(
+        TARGET_TYPE_SCIENCE,
+        -1,
+        -1,
+        "POS",
+        start_tile,
+        stop_tile,
+        solver=solver
+    )
     gt.stop("Assign unused fibers to science targets")
     print_counts('After assigning unused fibers to science targets: ')
 
@@ -1695,10 +1732,22 @@ def run(
         gt.stop("Redistribute science targets")
         print_counts('After redistributing science targets: ')
 
+    # Local search for science targets that can be placed by moving others
+    if refine is not None:
+        gt.start("Refine science targets")
+        asgn.refine(refine, 2, start_tile, stop_tile)
+        gt.stop("Refine science targets")
+        print_counts('After refining science targets: ')
+
+    # The other target types use the greedy method, optionally with petals in
+    # parallel.
+    calib_solver = "petal" if solver == "petal" else "greedy"
+
     # Assign standards, up to some limit
     gt.start("Assign unused fibers to standards")
     asgn.assign_unused(
-        TARGET_TYPE_STANDARD, std_per_petal, -1, "POS", start_tile, stop_tile
+        TARGET_TYPE_STANDARD, std_per_petal, -1, "POS", start_tile, stop_tile,
+        solver=calib_solver
     )
     gt.stop("Assign unused fibers to standards")
     print_counts('After assigning standards: ')
@@ -1709,7 +1758,7 @@ def run(
             # more specific
             asgn.assign_unused(
                 ttype, -1, sky_per_slitblock, "POS",
-                start_tile, stop_tile
+                start_tile, stop_tile, solver=calib_solver
             )
             print_counts('After assigning [supp]sky per-slitblock: ')
 
@@ -1717,25 +1766,34 @@ def run(
             # more fibers overall.
             asgn.assign_unused(
                 ttype, sky_per_petal, -1, "POS",
-                start_tile, stop_tile
+                start_tile, stop_tile, solver=calib_solver
             )
             print_counts('After assigning [supp]sky per-petal: ')
         else:
             asgn.assign_unused(
                 ttype, sky_per_petal, sky_per_slitblock, "POS",
-                start_tile, stop_tile
+                start_tile, stop_tile, solver=calib_solver
             )
             print_counts('After assigning [supp]sky: ')
 
-    # Assign sky to unused fibers, up to some limit
-    gt.start("Assign unused fibers to sky")
-    do_assign_unused_sky(TARGET_TYPE_SKY)
-    gt.stop("Assign unused fibers to sky")
+    if fused_sky:
+        # Assign sky and suppsky to unused fibers, up to some limit
+        gt.start("Assign unused fibers to sky and supp_sky")
+        asgn.assign_unused_sky(
+            sky_per_petal, sky_per_slitblock, "POS", start_tile, stop_tile
+        )
+        gt.stop("Assign unused fibers to sky and supp_sky")
+        print_counts('After assigning sky and suppsky: ')
+    else:
+        # Assign sky to unused fibers, up to some limit
+        gt.start("Assign unused fibers to sky")
+        do_assign_unused_sky(TARGET_TYPE_SKY)
+        gt.stop("Assign unused fibers to sky")
 
-    # Assign suppsky to unused fibers, up to some limit
-    gt.start("Assign unused fibers to supp_sky")
-    do_assign_unused_sky(TARGET_TYPE_SUPPSKY)
-    gt.stop("Assign unused fibers to supp_sky")
+        # Assign suppsky to unused fibers, up to some limit
+        gt.start("Assign unused fibers to supp_sky")
+        do_assign_unused_sky(TARGET_TYPE_SUPPSKY)
+        gt.stop("Assign unused fibers to supp_sky")
 
     # Force assignment if needed
     gt.start("Force assignment of sufficient standards")
@@ -1784,26 +1842,38 @@ def run(
         "POS",
         start_tile,
         stop_tile,
-        use_zero_obsremain=use_zero_obsremain
+        use_zero_obsremain=use_zero_obsremain,
+        solver=solver
     )
     print_counts('After assigning reobservations of science targets: ')
 
-    asgn.assign_unused(TARGET_TYPE_STANDARD, -1, -1, "POS", start_tile, stop_tile)
-    asgn.assign_unused(TARGET_TYPE_SKY, -1, -1, "POS", start_tile, stop_tile)
-    asgn.assign_unused(TARGET_TYPE_SUPPSKY, -1, -1, "POS", start_tile, stop_tile)
+    asgn.assign_unused(TARGET_TYPE_STANDARD, -1, -1, "POS", start_tile, stop_tile,
+                       solver=calib_solver)
+    asgn.assign_unused(TARGET_TYPE_SKY, -1, -1, "POS", start_tile, stop_tile,
+                       solver=calib_solver)
+    asgn.assign_unused(TARGET_TYPE_SUPPSKY, -1, -1, "POS", start_tile, stop_tile,
+                       solver=calib_solver)
 
     # Assign safe location to unused fibers (no maximum).  There should
     # always be at least one safe location (i.e. "BAD_SKY") for each fiber.
     # So after this is run every fiber should be assigned to something.
-    asgn.assign_unused(TARGET_TYPE_SAFE, -1, -1, "POS", start_tile, stop_tile)
+    asgn.assign_unused(TARGET_TYPE_SAFE, -1, -1, "POS", start_tile, stop_tile,
+                       solver=calib_solver)
     gt.stop("Assign remaining unassigned fibers")
     print_counts('Final assignments: ')
 
     # Assign sky monitor fibers
     gt.start("Assign sky monitor fibers")
-    asgn.assign_unused(TARGET_TYPE_SKY, -1, -1, "ETC", start_tile, stop_tile)
-    asgn.assign_unused(TARGET_TYPE_SUPPSKY, -1, -1, "ETC", start_tile, stop_tile)
-    asgn.assign_unused(TARGET_TYPE_SAFE, -1, -1, "ETC", start_tile, stop_tile)
+    asgn.assign_unused(TARGET_TYPE_SKY, -1, -1, "ETC", start_tile, stop_tile,
+                       solver=calib_solver)
+    asgn.assign_unused(TARGET_TYPE_SUPPSKY, -1, -1, "ETC", start_tile, stop_tile,
+                       solver=calib_solver)
+    asgn.assign_unused(TARGET_TYPE_SAFE, -1, -1, "ETC", start_tile, stop_tile,
+                       solver=calib_solver)
     gt.stop("Assign sky monitor fibers")
 
+    stats = asgn.pass_stats()
+    log.debug("Assignment pass counters: {}".format(
+        ", ".join(["{} = {}".format(k, v) for k, v in sorted(stats.items())])))
+
     return asgn
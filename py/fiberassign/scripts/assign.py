@@ -13,8 +13,10 @@ import os
 import sys
 import argparse
 import re
+import json
 
-from ..utils import GlobalTimers, Logger
+from ..utils import (GlobalTimers, Logger, Environment, TaskPool,
+                     rss_current_bytes, rss_peak_bytes)
 
 from ..hardware import load_hardware
 
@@ -185,6 +187,54 @@ def parse_assign(optlist=None):
                         action="store_true",
                         help="Disable oversubscription of science targets with leftover fibers.")
 
+    parser.add_argument("--compact_xy", required=False, default=False,
+                        action="store_true",
+                        help="Store projected target positions in single "
+                        "precision to reduce memory use.")
+
+    parser.add_argument("--refine", type=float, required=False,
+                        default=None,
+                        help="Run a local search over the science assignment "
+                        "for at most this many seconds (<= 0 for no limit).")
+
+    parser.add_argument("--solver", required=False, default="greedy",
+                        choices=["greedy", "petal", "matching"],
+                        help="Per-tile method for assigning science targets. "
+                        "\"petal\" gives the same result as \"greedy\" using "
+                        "one thread per petal.  \"matching\" may place more "
+                        "targets than \"greedy\" at some extra cost.")
+
+    parser.add_argument("--fused_sky", required=False, default=False,
+                        action="store_true",
+                        help="Assign sky and suppsky targets to unused fibers "
+                        "in a single pass over the tiles.")
+
+    parser.add_argument("--timer_trace", type=str, required=False,
+                        default=None,
+                        help="Write every interval of the global timers to "
+                        "this Chrome trace JSON file, and a summary of the "
+                        "nested timers to the same name with a "
+                        "\".summary.json\" suffix.")
+
+    parser.add_argument("--affinity", required=False, default=None,
+                        choices=["none", "compact", "spread"],
+                        help="Pin the threads to CPUs, filling one NUMA "
+                        "domain at a time (\"compact\") or alternating "
+                        "between domains (\"spread\").  The default is "
+                        "taken from $FIBERASSIGN_AFFINITY, or \"none\".")
+
+    parser.add_argument("--memory", required=False, default=False,
+                        action="store_true",
+                        help="Track the peak RSS of every timed phase and log "
+                        "the estimated memory of the main data structures.  "
+                        "These are also added to the --timer_trace summary.")
+
+    parser.add_argument("--memory_header", required=False, default=False,
+                        action="store_true",
+                        help="Record the peak RSS and the estimated memory "
+                        "of the main data structures (in MB) in the primary "
+                        "header of the output files.")
+
     args = None
     if optlist is None:
         args = parser.parse_args()
@@ -280,6 +330,17 @@ def run_assign_init(args):
 
     """
     log = Logger.get()
+
+    # Thread placement, which also decides how the per-tile data is spread
+    # over the NUMA domains.
+    env = Environment.get()
+    if args.affinity is not None:
+        env.set_affinity(args.affinity)
+    if env.affinity() == "none":
+        log.debug("Thread topology: {}".format(env.topology()))
+    else:
+        log.info("Thread topology: {}".format(env.topology()))
+
     # Read hardware properties
     hw = load_hardware(rundate=args.rundate, add_margins=args.margins)
 
@@ -358,6 +419,10 @@ def run_assign_full(args):
 
     """
     gt = GlobalTimers.get()
+    if args.timer_trace is not None:
+        gt.set_trace(True)
+    if args.memory:
+        gt.set_memory(True)
     gt.start("run_assign_full calculation")
 
     # Load data
@@ -370,10 +435,15 @@ def run_assign_full(args):
 
     # Compute the targets available to each fiber for each tile.
     gt.start("Compute Targets Available")
-    tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+    tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y,
+                                compact_xy=args.compact_xy)
     gt.stop("Compute Targets Available")
 
     # Free the target locations
+    tile_xy_bytes = sum(
+        [v.nbytes for d in (tile_targetids, tile_x, tile_y)
+         for v in d.values()]
+    )
     del tile_targetids, tile_x, tile_y
 
     # Compute the fibers on all tiles available for each target and sky
@@ -401,10 +471,23 @@ def run_assign_full(args):
         args.sky_per_petal,
         args.sky_per_slitblock,
         redistribute=(not args.no_redistribute),
-        use_zero_obsremain=(not args.no_zero_obsremain)
+        use_zero_obsremain=(not args.no_zero_obsremain),
+        solver=args.solver,
+        refine=args.refine,
+        fused_sky=args.fused_sky
     )
 
     gt.stop("run_assign_full calculation")
+
+    memory = None
+    header_extra = None
+    if args.memory or args.memory_header:
+        memory = memory_usage(tgs, tgsavail, favail, asgn, tile_xy_bytes)
+        if args.memory:
+            log_memory_usage(memory)
+        if args.memory_header:
+            header_extra = memory_header(memory)
+
     gt.start("run_assign_full write output")
 
     # Make sure that output directory exists
@@ -421,15 +504,125 @@ def run_assign_full(args):
                           out_prefix=args.prefix, split_dir=args.split,
                           all_targets=args.write_all_targets,
                           gfa_targets=gfa_targets, overwrite=args.overwrite,
-                          stucksky=stucksky)
+                          stucksky=stucksky, header_extra=header_extra)
 
     gt.stop("run_assign_full write output")
 
     gt.report()
+    TaskPool.get().report()
+    write_timer_trace(args, memory=memory)
+
+    return
+
+
+def write_timer_trace(args, memory=None):
+    """Write the global timer trace and summary, if requested.
+
+    Args:
+        args (namespace): The parsed arguments.
+        memory (dict): Optional memory usage from memory_usage(), added to
+            the summary under the "memory" key.
+
+    Returns:
+        None
+
+    """
+    if args.timer_trace is None:
+        return
+    gt = GlobalTimers.get()
+    gt.write_trace(args.timer_trace)
+    root, ext = os.path.splitext(args.timer_trace)
+    summary = gt.summary_json()
+    if memory is not None:
+        props = json.loads(summary)
+        props["memory"] = memory
+        summary = json.dumps(props, indent=2)
+    with open("{}.summary.json".format(root), "w") as f:
+        f.write(summary)
+    return
 
+
+def memory_usage(tgs, tgsavail, favail, asgn, tile_xy_bytes=0):
+    """Estimate the memory used by the main assignment data structures.
+
+    The byte counts of the C++ objects are estimates of their heap usage
+    (see the memory_usage() methods), not exact allocator totals.
+
+    Args:
+        tgs (Targets): The targets.
+        tgsavail (TargetsAvailable): The targets available to each location.
+        favail (LocationsAvailable): The locations available to each target.
+        asgn (Assignment): The assignment.
+        tile_xy_bytes (int): The bytes used by the (already freed) arrays of
+            target positions returned by targets_in_tiles().
+
+    Returns:
+        (dict): The bytes used by each component of each object, keyed by
+            object name, plus the current and peak RSS of the process.
+
+    """
+    mem = dict()
+    mem["Targets"] = dict(tgs.memory_usage())
+    mem["TargetsAvailable"] = dict(tgsavail.memory_usage())
+    mem["LocationsAvailable"] = dict(favail.memory_usage())
+    mem["Assignment"] = dict(asgn.memory_usage())
+    mem["targets_in_tiles"] = int(tile_xy_bytes)
+    mem["rss_current"] = rss_current_bytes()
+    mem["rss_peak"] = rss_peak_bytes()
+    return mem
+
+
+def _memory_mb(value):
+    if isinstance(value, dict):
+        value = sum(value.values())
+    return value / 1048576.0
+
+
+def log_memory_usage(memory):
+    """Log the memory usage returned by memory_usage().
+
+    Args:
+        memory (dict): The memory usage.
+
+    Returns:
+        None
+
+    """
+    log = Logger.get()
+    for key in ["Targets", "TargetsAvailable", "LocationsAvailable",
+                "Assignment"]:
+        parts = ", ".join(
+            ["{} {:0.1f} MB".format(k, _memory_mb(v))
+             for k, v in sorted(memory[key].items())]
+        )
+        log.info("Memory {}: {:0.1f} MB ({})".format(
+            key, _memory_mb(memory[key]), parts))
+    log.info("Memory targets_in_tiles (freed): {:0.1f} MB".format(
+        _memory_mb(memory["targets_in_tiles"])))
+    log.info("Memory RSS: current {:0.1f} MB, peak {:0.1f} MB".format(
+        _memory_mb(memory["rss_current"]), _memory_mb(memory["rss_peak"])))
     return
 
 
+def memory_header(memory):
+    """Build output header keywords from the memory usage.
+
+    Args:
+        memory (dict): The memory usage returned by memory_usage().
+
+    Returns:
+        (dict): The header keywords, with values in MB.
+
+    """
+    header = dict()
+    header["MEMPEAK"] = round(_memory_mb(memory["rss_peak"]), 1)
+    header["MEMTGS"] = round(_memory_mb(memory["Targets"]), 1)
+    header["MEMTGAV"] = round(_memory_mb(memory["TargetsAvailable"]), 1)
+    header["MEMLCAV"] = round(_memory_mb(memory["LocationsAvailable"]), 1)
+    header["MEMASGN"] = round(_memory_mb(memory["Assignment"]), 1)
+    return header
+
+
 def run_assign_bytile(args):
     """Run fiber assignment tile-by-tile.
 
@@ -445,6 +638,10 @@ def run_assign_bytile(args):
 
     """
     gt = GlobalTimers.get()
+    if args.timer_trace is not None:
+        gt.set_trace(True)
+    if args.memory:
+        gt.set_memory(True)
     gt.start("run_assign_bytile calculation")
 
     # Load data
@@ -457,10 +654,15 @@ def run_assign_bytile(args):
 
     # Compute the targets available to each fiber for each tile.
     gt.start("Compute Targets Available")
-    tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+    tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y,
+                                compact_xy=args.compact_xy)
     gt.stop("Compute Targets Available")
 
     # Free the target locations
+    tile_xy_bytes = sum(
+        [v.nbytes for d in (tile_targetids, tile_x, tile_y)
+         for v in d.values()]
+    )
     del tile_targetids, tile_x, tile_y
 
     # Compute the fibers on all tiles available for each target and sky
@@ -494,10 +696,23 @@ def run_assign_bytile(args):
             start_tile=tile_id,
             stop_tile=tile_id,
             redistribute=(not args.no_redistribute),
-            use_zero_obsremain=(not args.no_zero_obsremain)
+            use_zero_obsremain=(not args.no_zero_obsremain),
+            solver=args.solver,
+            refine=args.refine,
+            fused_sky=args.fused_sky
         )
 
     gt.stop("run_assign_bytile calculation")
+
+    memory = None
+    header_extra = None
+    if args.memory or args.memory_header:
+        memory = memory_usage(tgs, tgsavail, favail, asgn, tile_xy_bytes)
+        if args.memory:
+            log_memory_usage(memory)
+        if args.memory_header:
+            header_extra = memory_header(memory)
+
     gt.start("run_assign_bytile write output")
 
     # Make sure that output directory exists
@@ -514,10 +729,12 @@ def run_assign_bytile(args):
                           out_prefix=args.prefix, split_dir=args.split,
                           all_targets=args.write_all_targets,
                           gfa_targets=gfa_targets, overwrite=args.overwrite,
-                          stucksky=stucksky)
+                          stucksky=stucksky, header_extra=header_extra)
 
     gt.stop("run_assign_bytile write output")
 
     gt.report()
+    TaskPool.get().report()
+    write_timer_trace(args, memory=memory)
 
     return
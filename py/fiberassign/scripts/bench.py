@@ -0,0 +1,445 @@
+# Licensed under a 3-clause BSD style license - see LICENSE.rst
+# -*- coding: utf-8 -*-
+"""
+fiberassign.scripts.bench
+==========================
+
+End-to-end performance benchmarks on simulated inputs.
+
+Each case runs the full assignment (load, targets_in_tiles, TargetsAvailable,
+LocationsAvailable, Assignment, run, write) in a fresh process, and records
+the time of every global timer, the peak resident memory and a checksum of
+the assignments written.  The results can be saved as a baseline and later
+runs compared against it.
+
+"""
+from __future__ import absolute_import, division, print_function
+
+import os
+import sys
+import argparse
+import hashlib
+import json
+import glob
+import time
+import resource
+import multiprocessing
+
+import numpy as np
+
+import fitsio
+
+from .._version import __version__
+
+from ..utils import Logger, option_list
+
+from ..targets import (TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY,
+                       TARGET_TYPE_SUPPSKY, TARGET_TYPE_STANDARD)
+
+
+# Targets per square degree of each type for the density presets.
+bench_densities = {
+    "low": {
+        TARGET_TYPE_SCIENCE: 1000.0,
+        TARGET_TYPE_STANDARD: 300.0,
+        TARGET_TYPE_SKY: 1000.0,
+        TARGET_TYPE_SUPPSKY: 300.0,
+    },
+    "high": {
+        TARGET_TYPE_SCIENCE: 5000.0,
+        TARGET_TYPE_STANDARD: 1000.0,
+        TARGET_TYPE_SKY: 4000.0,
+        TARGET_TYPE_SUPPSKY: 2000.0,
+    },
+}
+
+# Spacing of the simulated tile centers in degrees.  This is a bit smaller
+# than the tile diameter, so that neighboring tiles overlap.
+bench_tile_spacing = 1.4
+
+# Margin around the tiles covered by targets, in degrees.
+bench_target_margin = 1.7
+
+
+def parse_bench(optlist=None):
+    """Parse benchmark options.
+
+    This parses either sys.argv or a list of strings passed in.  If passing
+    an option list, you can create that more easily using the
+    :func:`option_list` function.
+
+    Args:
+        optlist (list, optional): Optional list of arguments to parse instead
+            of using sys.argv.
+
+    Returns:
+        (namespace):  an ArgumentParser namespace.
+
+    """
+    parser = argparse.ArgumentParser()
+
+    parser.add_argument("--dir", type=str, required=True, default=None,
+                        help="Working directory for the simulated inputs and "
+                        "the outputs of each case.")
+
+    parser.add_argument("--tiles", type=int, required=False, nargs="+",
+                        default=[1], help="Number of tiles of each case, for "
+                        "example '--tiles 1 100 1000'.")
+
+    parser.add_argument("--density", type=str, required=False, nargs="+",
+                        default=["low"], choices=sorted(bench_densities.keys()),
+                        help="Target density presets to run with each number "
+                        "of tiles.")
+
+    parser.add_argument("--rundate", type=str, required=False,
+                        default="2020-01-01T00:00:00+00:00",
+                        help="The date used to select the focalplane.")
+
+    parser.add_argument("--seed", type=int, required=False, default=123456789,
+                        help="Random seed for the simulated inputs.")
+
+    parser.add_argument("--regenerate", required=False, default=False,
+                        action="store_true",
+                        help="Simulate the inputs again even if they exist.")
+
+    parser.add_argument("--assign_opts", type=str, required=False,
+                        default=None, help="Extra options passed to the "
+                        "assignment, in quotes (for example "
+                        "'--sky_per_slitblock 1 --fused_sky').")
+
+    parser.add_argument("--baseline", type=str, required=False, default=None,
+                        help="JSON file with the results of a previous run "
+                        "to compare against.")
+
+    parser.add_argument("--save_baseline", type=str, required=False,
+                        default=None, help="Write the results of this run to "
+                        "this JSON file, for use as a later baseline.")
+
+    parser.add_argument("--threshold", type=float, required=False,
+                        default=0.2, help="Fractional increase in time or "
+                        "peak memory over the baseline that is reported as "
+                        "a regression.")
+
+    parser.add_argument("--min_seconds", type=float, required=False,
+                        default=0.5, help="Timers which took less than this "
+                        "in the baseline are not compared.")
+
+    args = None
+    if optlist is None:
+        args = parser.parse_args()
+    else:
+        args = parser.parse_args(optlist)
+
+    return args
+
+
+def bench_case_name(ntile, density):
+    """The name of a benchmark case.
+    """
+    return "{}_tiles_{}".format(ntile, density)
+
+
+def sim_bench_tiles(path, ntile):
+    """Write a footprint of tiles on a square grid near the equator.
+
+    Args:
+        path (str): The output FITS file.
+        ntile (int): The number of tiles.
+
+    Returns:
+        (tuple): The (RA min, RA max, DEC min, DEC max) covered by the tiles,
+            including a margin for the targets.
+
+    """
+    tile_dtype = np.dtype([
+        ("TILEID", "i4"),
+        ("RA", "f8"),
+        ("DEC", "f8"),
+        ("IN_DESI", "i4"),
+        ("PROGRAM", "S6"),
+        ("OBSCONDITIONS", "i4")
+    ])
+    nside = int(np.ceil(np.sqrt(ntile)))
+    fdata = np.zeros(ntile, dtype=tile_dtype)
+    for t in range(ntile):
+        fdata[t] = (
+            1000 + t,
+            150.0 + bench_tile_spacing * (t % nside),
+            bench_tile_spacing * ((t // nside) - 0.5 * (nside - 1)),
+            1,
+            "DARK",
+            1
+        )
+    if os.path.isfile(path):
+        os.remove(path)
+    fd = fitsio.FITS(path, "rw")
+    header = dict()
+    header["FBAVER"] = __version__
+    fd.write(fdata, header=header)
+    fd.close()
+    return (
+        np.min(fdata["RA"]) - bench_target_margin,
+        np.max(fdata["RA"]) + bench_target_margin,
+        np.min(fdata["DEC"]) - bench_target_margin,
+        np.max(fdata["DEC"]) + bench_target_margin,
+    )
+
+
+def sim_bench_inputs(dir, ntile, density, seed, regenerate=False):
+    """Simulate the tiles and target files of one benchmark case.
+
+    The inputs are kept in a subdirectory of dir and reused by later runs.
+
+    Args:
+        dir (str): The benchmark working directory.
+        ntile (int): The number of tiles.
+        density (str): The density preset.
+        seed (int): The random seed.
+        regenerate (bool): If True, simulate the inputs even if they exist.
+
+    Returns:
+        (tuple): The footprint file and the list of target files.
+
+    """
+    # Only needed here, and this pulls in desimodel / desitarget.
+    from ..test.simulate import sim_targets
+
+    log = Logger.get()
+    indir = os.path.join(dir, "inputs_{}_seed{}".format(
+        bench_case_name(ntile, density), seed))
+    footprint = os.path.join(indir, "footprint.fits")
+    names = [
+        (TARGET_TYPE_SCIENCE, "mtl.fits"),
+        (TARGET_TYPE_STANDARD, "standards.fits"),
+        (TARGET_TYPE_SKY, "sky.fits"),
+        (TARGET_TYPE_SUPPSKY, "suppsky.fits"),
+    ]
+    tgfiles = [os.path.join(indir, x[1]) for x in names]
+    done = os.path.join(indir, "done")
+    if os.path.isfile(done) and not regenerate:
+        return footprint, tgfiles
+
+    log.info("Simulating inputs in {}".format(indir))
+    os.makedirs(indir, exist_ok=True)
+    np.random.seed(seed)
+    bounds = sim_bench_tiles(footprint, ntile)
+    tgoff = 0
+    for (tgtype, name), path in zip(names, tgfiles):
+        tgoff += sim_targets(
+            path,
+            tgtype,
+            tgoff,
+            density=bench_densities[density][tgtype],
+            bounds=bounds
+        )
+    with open(done, "w") as f:
+        f.write("{}\n".format(tgoff))
+    return footprint, tgfiles
+
+
+def assignment_checksum(dir):
+    """Checksum of the assigned targets in all output files of a directory.
+
+    Args:
+        dir (str): The directory with the fba-*.fits files.
+
+    Returns:
+        (str): The hex digest.
+
+    """
+    hsh = hashlib.sha256()
+    for path in sorted(glob.glob(os.path.join(dir, "fba-*.fits"))):
+        fdata = fitsio.read(path, ext="FASSIGN", columns=["LOCATION",
+                                                          "TARGETID"])
+        order = np.argsort(fdata["LOCATION"], kind="stable")
+        hsh.update(os.path.basename(path).encode())
+        hsh.update(np.ascontiguousarray(
+            fdata["LOCATION"][order], dtype=np.int64).tobytes())
+        hsh.update(np.ascontiguousarray(
+            fdata["TARGETID"][order], dtype=np.int64).tobytes())
+    return hsh.hexdigest()
+
+
+def peak_rss_mb():
+    """The peak resident memory of this process in MB.
+    """
+    maxrss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    if sys.platform.lower() == "darwin":
+        # Reported in bytes
+        return maxrss / 1024.0**2
+    # Reported in kB
+    return maxrss / 1024.0
+
+
+def run_bench_case(optlist, outdir, result_file):
+    """Run one benchmark case in the current process.
+
+    This is the entry point of the process started for each case.
+
+    Args:
+        optlist (list): The options for the assignment.
+        outdir (str): The output directory of the assignment.
+        result_file (str): The JSON file for the results.
+
+    Returns:
+        None
+
+    """
+    from ..utils import GlobalTimers
+    from .assign import parse_assign, run_assign_full
+
+    args = parse_assign(optlist)
+    start = time.perf_counter()
+    run_assign_full(args)
+    wall = time.perf_counter() - start
+
+    # Combine the timers of the main thread by path.
+    phases = dict()
+    for st in GlobalTimers.get().summary():
+        if st["thread"] == 0:
+            phases[st["path"]] = phases.get(st["path"], 0.0) + st["total"]
+
+    result = {
+        "wall": wall,
+        "peak_rss_mb": peak_rss_mb(),
+        "checksum": assignment_checksum(outdir),
+        "phases": phases,
+    }
+    with open(result_file, "w") as f:
+        json.dump(result, f, indent=2)
+    return
+
+
+def compare_bench(results, baseline, threshold, min_seconds):
+    """Compare benchmark results to a baseline.
+
+    Args:
+        results (dict): The cases of this run.
+        baseline (dict): The cases of the baseline run.
+        threshold (float): Fractional increase which counts as a regression.
+        min_seconds (float): Times below this in the baseline are ignored.
+
+    Returns:
+        (list): One string describing each regression.
+
+    """
+    regress = list()
+    for name, res in results.items():
+        if name not in baseline:
+            continue
+        base = baseline[name]
+        if res["checksum"] != base["checksum"]:
+            regress.append("{}: output checksum changed".format(name))
+        checks = [("wall time", res["wall"], base["wall"], min_seconds)]
+        checks.append(
+            ("peak RSS", res["peak_rss_mb"], base["peak_rss_mb"], 0.0)
+        )
+        for path, tm in sorted(res["phases"].items()):
+            if path in base["phases"]:
+                checks.append((path, tm, base["phases"][path], min_seconds))
+        for what, cur, prev, floor in checks:
+            if prev < floor or prev <= 0:
+                continue
+            ratio = cur / prev
+            if ratio > 1.0 + threshold:
+                regress.append("{}: {} {:0.2f} -> {:0.2f} ({:+0.1f}%)".format(
+                    name, what, prev, cur, 100.0 * (ratio - 1.0)))
+    return regress
+
+
+def run_bench(args):
+    """Run all benchmark cases.
+
+    Args:
+        args (namespace): The parsed arguments.
+
+    Returns:
+        (dict): The results of each case and the list of regressions.
+
+    """
+    log = Logger.get()
+    os.makedirs(args.dir, exist_ok=True)
+
+    # Each case runs in a new process, so that the peak memory and the
+    # global timers only include that case.
+    ctx = multiprocessing.get_context("spawn")
+
+    results = dict()
+    for ntile in args.tiles:
+        for density in args.density:
+            name = bench_case_name(ntile, density)
+            footprint, tgfiles = sim_bench_inputs(
+                args.dir, ntile, density, args.seed,
+                regenerate=args.regenerate
+            )
+            outdir = os.path.join(args.dir, name)
+            os.makedirs(outdir, exist_ok=True)
+            for path in glob.glob(os.path.join(outdir, "fba-*.fits")):
+                os.remove(path)
+            opts = {
+                "targets": tgfiles,
+                "footprint": footprint,
+                "dir": outdir,
+                "rundate": args.rundate,
+                "overwrite": True,
+                "timer_trace": os.path.join(outdir, "timers.json"),
+            }
+            optlist = option_list(opts)
+            if args.assign_opts is not None:
+                optlist.extend(args.assign_opts.split())
+            result_file = os.path.join(outdir, "bench.json")
+            if os.path.isfile(result_file):
+                os.remove(result_file)
+
+            log.info("Running benchmark case {}".format(name))
+            proc = ctx.Process(target=run_bench_case,
+                               args=(optlist, outdir, result_file))
+            proc.start()
+            proc.join()
+            if proc.exitcode != 0:
+                msg = "Benchmark case {} failed with exit code {}".format(
+                    name, proc.exitcode)
+                log.error(msg)
+                raise RuntimeError(msg)
+            with open(result_file, "r") as f:
+                results[name] = json.load(f)
+
+    print("{:<24} {:>10} {:>12}  {}".format("case", "seconds", "peak MB",
+                                           "checksum"), flush=True)
+    for name, res in results.items():
+        print("{:<24} {:>10.2f} {:>12.1f}  {}".format(
+            name, res["wall"], res["peak_rss_mb"], res["checksum"][:16]),
+            flush=True)
+
+    regress = list()
+    if args.baseline is not None:
+        with open(args.baseline, "r") as f:
+            baseline = json.load(f)
+        if baseline["config"]["seed"] != args.seed:
+            log.warning("Baseline used seed {}, checksums will differ".format(
+                baseline["config"]["seed"]))
+        regress = compare_bench(results, baseline["cases"], args.threshold,
+                                args.min_seconds)
+        missing = [x for x in results.keys() if x not in baseline["cases"]]
+        for name in missing:
+            log.warning("Case {} is not in the baseline".format(name))
+        if len(regress) == 0:
+            log.info("No regressions over {:0.0f}% against {}".format(
+                100.0 * args.threshold, args.baseline))
+        for msg in regress:
+            log.warning("REGRESSION {}".format(msg))
+
+    out = {
+        "config": {
+            "version": __version__,
+            "rundate": args.rundate,
+            "seed": args.seed,
+            "assign_opts": args.assign_opts,
+        },
+        "cases": results,
+        "regressions": regress,
+    }
+    if args.save_baseline is not None:
+        with open(args.save_baseline, "w") as f:
+            json.dump(out, f, indent=2)
+    return out
@@ -38,7 +38,7 @@ from ._internal import (TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY,
                         TARGET_TYPE_STANDARD, TARGET_TYPE_SAFE,
                         TARGET_TYPE_SUPPSKY,
                         Target, Targets, TargetTree, TargetsAvailable,
-                        LocationsAvailable)
+                        LocationsAvailable, sort_target_weights)
 
 
 def str_to_target_type(input):
@@ -939,10 +939,15 @@ def load_target_file(tgs, tfile, survey=None, typeforce=None, typecol=None,
 
     return survey
 
-def targets_in_tiles(hw, tgs, tiles):
+def targets_in_tiles(hw, tgs, tiles, targetids=None):
     '''
     Returns tile_targetids, tile_x, tile_y
+
+    If targetids is given, only those targets are projected.  This is used to
+    compute the inputs to Assignment.add_targets() for newly appended targets.
     '''
+    if targetids is not None:
+        targetids = np.asarray(targetids)
     tile_targetids = {}
     tile_x = {}
     tile_y = {}
@@ -963,6 +968,11 @@ def targets_in_tiles(hw, tgs, tiles):
         tids = np.array(tids)
         ras  = np.array(ras)
         decs = np.array(decs)
+        if targetids is not None:
+            keep = np.isin(tids, targetids)
+            tids = tids[keep]
+            ras = ras[keep]
+            decs = decs[keep]
 
         fx,fy = radec2xy(hw, tile_ra, tile_dec, tile_obstime, tile_obstheta,
                          tile_ha, ras, decs, False)
@@ -198,11 +198,14 @@ def sim_tiles(path, selectfile=None):
     return
 
 
-def sim_targets(path, tgtype, tgoffset, density=5000.0, science_frac=None):
+def sim_targets(path, tgtype, tgoffset, density=5000.0, science_frac=None,
+                bounds=None):
     ramin = 147.0
     ramax = 153.0
     decmin = 28.0
     decmax = 34.0
+    if bounds is not None:
+        ramin, ramax, decmin, decmax = bounds
     target_cols = OrderedDict([
         ("TARGETID", "i8"),
         ("RA", "f8"),
@@ -13,15 +13,22 @@ from datetime import datetime
 
 import json
 
+import threading
+
+from types import SimpleNamespace
+
 import numpy as np
 
 import fitsio
 
 import desimodel
 
-from fiberassign.utils import option_list, GlobalTimers
+from fiberassign.utils import (option_list, GlobalTimers, Logger,
+                               Environment, TaskPool, ScratchArena,
+                               read_trace, TRACE_ASSIGN)
 
-from fiberassign.hardware import load_hardware
+from fiberassign.hardware import (load_hardware, FIBER_STATE_OK,
+                                  FIBER_STATE_STUCK)
 
 from fiberassign.tiles import load_tiles, Tiles
 
@@ -48,6 +55,8 @@ from fiberassign.scripts.qa import parse_qa, run_qa
 
 from fiberassign.scripts.qa_plot import parse_plot_qa, run_plot_qa
 
+from fiberassign.scripts.bench import parse_bench, run_bench, compare_bench
+
 
 from .simulate import (test_subdir_create, sim_tiles, sim_targets,
                        sim_focalplane, petal_rotation, test_assign_date,
@@ -70,6 +79,52 @@ class TestAssign(unittest.TestCase):
         if self.saved_skybricks is not None:
             os.environ['STUCKSKY_DIR'] = self.saved_skybricks
 
+    def _sim_assignment(self, name, tgtypes, assign=True):
+        """Simulate the inputs of one test and load them.
+
+        A target file is simulated for each of the given target types, along
+        with the focalplane and the footprint.  Unless assign is False, the
+        available targets and an empty Assignment are also constructed.
+        """
+        sim = SimpleNamespace()
+        sim.test_dir = test_subdir_create(name)
+        np.random.seed(123456789)
+        sim_files = {
+            TARGET_TYPE_SCIENCE: ("mtl.fits", self.density_science),
+            TARGET_TYPE_STANDARD: ("standards.fits", self.density_standards),
+            TARGET_TYPE_SKY: ("sky.fits", self.density_sky),
+            TARGET_TYPE_SUPPSKY: ("suppsky.fits", self.density_suppsky),
+        }
+        sim.files = list()
+        sim.tgoff = 0
+        for tt in tgtypes:
+            fname, density = sim_files[tt]
+            path = os.path.join(sim.test_dir, fname)
+            sim.tgoff += sim_targets(path, tt, sim.tgoff, density=density)
+            sim.files.append(path)
+
+        sim.tgs = Targets()
+        for path in sim.files:
+            load_target_file(sim.tgs, path)
+
+        fp, exclude, state = sim_focalplane(rundate=test_assign_date)
+        sim.hw = load_hardware(focalplane=(fp, exclude, state),
+                               rundate=test_assign_date)
+        sim.tfile = os.path.join(sim.test_dir, "footprint.fits")
+        sim_tiles(sim.tfile)
+        sim.tiles = load_tiles(tiles_file=sim.tfile)
+
+        if assign:
+            sim.tile_targetids, sim.tile_x, sim.tile_y = targets_in_tiles(
+                sim.hw, sim.tgs, sim.tiles
+            )
+            sim.tgsavail = TargetsAvailable(sim.hw, sim.tgs, sim.tiles,
+                                            sim.tile_targetids, sim.tile_x,
+                                            sim.tile_y)
+            sim.favail = LocationsAvailable(sim.tgsavail)
+            sim.asgn = Assignment(sim.tgs, sim.tgsavail, sim.favail, {})
+        return sim
+
     def test_io(self):
         np.random.seed(123456789)
         test_dir = test_subdir_create("assign_test_io")
@@ -123,7 +178,7 @@ class TestAssign(unittest.TestCase):
         tiles = load_tiles(tiles_file=tfile)
         # Precompute target positions
         tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
-        tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+        tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y)
 
         # Compute the fibers on all tiles available for each target
         favail = LocationsAvailable(tgsavail)
@@ -352,7 +407,7 @@ class TestAssign(unittest.TestCase):
         tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
 
         # Compute the targets available to each fiber for each tile.
-        tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+        tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y)
 
         del tile_targetids, tile_x, tile_y
 
@@ -403,6 +458,728 @@ class TestAssign(unittest.TestCase):
                 labels=True)
         return
 
+    def test_incremental(self):
+        sim = self._sim_assignment("assign_test_incremental",
+                                   [TARGET_TYPE_SCIENCE])
+        tgs, hw, tiles, tgsavail = sim.tgs, sim.hw, sim.tiles, sim.tgsavail
+        favail, asgn = sim.favail, sim.asgn
+        input_late = os.path.join(sim.test_dir, "mtl_late.fits")
+        sim_targets(
+            input_late,
+            TARGET_TYPE_SCIENCE,
+            sim.tgoff,
+            density=0.1 * self.density_science
+        )
+        late_ids = fitsio.read(input_late, columns=["TARGETID"])["TARGETID"]
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+
+        before = {t: dict(asgn.tile_location_target(t)) for t in tiles.id}
+
+        # Append the late targets and add them to the existing assignment.
+        load_target_file(tgs, input_late)
+        tile_targetids, tile_x, tile_y = targets_in_tiles(
+            hw, tgs, tiles, targetids=late_ids
+        )
+        asgn.add_targets(tile_targetids, tile_x, tile_y)
+
+        for t in tiles.id:
+            self.assertEqual(before[t], dict(asgn.tile_location_target(t)))
+
+        # The availability should match a full rebuild.
+        tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
+        check_avail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x,
+                                       tile_y)
+        check_favail = LocationsAvailable(check_avail)
+        for t in tiles.id:
+            avail = tgsavail.tile_data(t)
+            check = check_avail.tile_data(t)
+            self.assertEqual(sorted(avail.keys()), sorted(check.keys()))
+            for loc, tgids in check.items():
+                self.assertEqual(sorted(avail[loc]), sorted(tgids))
+        for tg in late_ids:
+            self.assertEqual(sorted(favail.target_data(tg)),
+                             sorted(check_favail.target_data(tg)))
+
+        # Fill the remaining locations, then remove some assigned targets.
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        removed = list()
+        for t in tiles.id:
+            tdata = asgn.tile_location_target(t)
+            removed.extend(list(tdata.values())[::10])
+        removed = np.unique(removed)
+        asgn.remove_targets(removed)
+        tgids = set(tgs.ids())
+        for tg in removed:
+            self.assertTrue(tg not in tgids)
+            self.assertEqual(len(favail.target_data(tg)), 0)
+        for t in tiles.id:
+            tdata = asgn.tile_location_target(t)
+            self.assertEqual(len(set(removed) & set(tdata.values())), 0)
+            for loc, avail in tgsavail.tile_data(t).items():
+                self.assertEqual(len(set(removed) & set(avail)), 0)
+
+        # Raise the priority of one target.  Its current assignments are
+        # subtracted from the new number of remaining observations.
+        tg = list(asgn.tile_location_target(tiles.id[0]).values())[0]
+        nassign = np.sum([
+            tg in asgn.tile_location_target(t).values() for t in tiles.id
+        ])
+        asgn.update_targets([tg], [3], [9999], [0.5])
+        props = tgs.get(tg)
+        self.assertEqual(props.priority, 9999)
+        self.assertEqual(props.obsremain, 3 - nassign)
+        return
+
+    def test_update_remain(self):
+        sim = self._sim_assignment(
+            "assign_test_update_remain",
+            [TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD]
+        )
+        tgs, tiles, tgsavail, asgn = sim.tgs, sim.tiles, sim.tgsavail, sim.asgn
+        tid = tiles.id[0]
+
+        def check_partition():
+            # Each type list keeps the order of the full list, and the science
+            # targets with observations remaining are those with obsremain > 0.
+            for t in tiles.id:
+                full = tgsavail.tile_data(t)
+                science = tgsavail.tile_type_data(t, TARGET_TYPE_SCIENCE)
+                remain = tgsavail.tile_type_data(t, TARGET_TYPE_SCIENCE, True)
+                standard = tgsavail.tile_type_data(t, TARGET_TYPE_STANDARD)
+                self.assertEqual(sorted(science.keys()), sorted(full.keys()))
+                props = dict()
+                for tgids in full.values():
+                    for x in tgids:
+                        if x not in props:
+                            props[x] = tgs.get(x)
+                for loc, tgids in full.items():
+                    self.assertEqual(list(science[loc]), [
+                        x for x in tgids if props[x].type & TARGET_TYPE_SCIENCE
+                    ])
+                    self.assertEqual(list(standard[loc]), [
+                        x for x in tgids
+                        if props[x].type & TARGET_TYPE_STANDARD
+                    ])
+                    self.assertEqual(list(remain[loc]), [
+                        x for x in science[loc] if props[x].obsremain > 0
+                    ])
+
+        def remaining_on(tg):
+            # The locations of the tile whose remaining list has the target.
+            remain = tgsavail.tile_type_data(tid, TARGET_TYPE_SCIENCE, True)
+            return [loc for loc, tgids in remain.items() if tg in tgids]
+
+        check_partition()
+
+        # A science target with one observation runs out and gets it back.
+        science = tgsavail.tile_type_data(tid, TARGET_TYPE_SCIENCE)
+        tg = [x for v in science.values() for x in v
+              if tgs.get(x).obsremain == 1][0]
+        props = tgs.get(tg)
+        locs = remaining_on(tg)
+        self.assertGreater(len(locs), 0)
+        asgn.update_targets([tg], [0], [props.priority], [props.subpriority])
+        self.assertEqual(remaining_on(tg), [])
+        check_partition()
+        asgn.update_targets([tg], [1], [props.priority], [props.subpriority])
+        self.assertEqual(remaining_on(tg), locs)
+        check_partition()
+
+        # Assigning the targets of the tile uses up their observations, and
+        # those which are not observed get them back.
+        asgn.assign_unused(TARGET_TYPE_SCIENCE, -1, -1, "POS", tid, tid)
+        assigned = list(asgn.tile_location_target(tid).values())
+        once = [x for x in assigned if tgs.get(x).obsremain == 0]
+        self.assertGreater(len(once), 0)
+        for x in once[:10]:
+            self.assertEqual(remaining_on(x), [])
+        check_partition()
+        observed = assigned[::2]
+        asgn.observe([tid], observed)
+        for x in once[:10]:
+            if x in observed:
+                self.assertEqual(remaining_on(x), [])
+            else:
+                self.assertGreater(len(remaining_on(x)), 0)
+        check_partition()
+        return
+
+    def test_compact_xy(self):
+        sim = self._sim_assignment("assign_test_compact_xy",
+                                   [TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY],
+                                   assign=False)
+        tgs, hw, tiles = sim.tgs, sim.hw, sim.tiles
+
+        tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
+
+        # Single precision positions should not change any decision.
+        result = dict()
+        for compact in [False, True]:
+            # The assignment updates the observations remaining in the
+            # Targets, so each pass starts from freshly loaded targets.
+            tgs = Targets()
+            for path in sim.files:
+                load_target_file(tgs, path)
+            tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids,
+                                        tile_x, tile_y, compact_xy=compact)
+            self.assertEqual(tgsavail.compact_xy(), compact)
+            favail = LocationsAvailable(tgsavail)
+            asgn = Assignment(tgs, tgsavail, favail, {})
+            asgn.assign_unused(TARGET_TYPE_SCIENCE)
+            asgn.assign_unused(TARGET_TYPE_SKY)
+            result[compact] = {
+                t: dict(asgn.tile_location_target(t)) for t in tiles.id
+            }
+        for t in tiles.id:
+            self.assertEqual(result[False][t], result[True][t])
+        return
+
+    def test_affinity(self):
+        sim = self._sim_assignment("assign_test_affinity",
+                                   [TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY],
+                                   assign=False)
+        hw, tiles = sim.hw, sim.tiles
+
+        env = Environment.get()
+        original = env.affinity()
+        self.assertTrue(env.ndomain() >= 1)
+        pool = TaskPool.get()
+        pool.clear_stats()
+
+        # Pinning the threads and splitting the tiles between NUMA domains
+        # should not change any decision.
+        result = dict()
+        for policy in ["none", "compact", "spread"]:
+            env.set_affinity(policy)
+            self.assertEqual(env.affinity(), policy)
+            parts = env.partition(len(tiles.id))
+            self.assertEqual(len(parts), env.current_threads())
+            self.assertEqual(
+                sum([x[1] - x[0] for x in parts]), len(tiles.id)
+            )
+            tgs = Targets()
+            for path in sim.files:
+                load_target_file(tgs, path)
+            tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
+            tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids,
+                                        tile_x, tile_y)
+            favail = LocationsAvailable(tgsavail)
+            asgn = Assignment(tgs, tgsavail, favail, {})
+            asgn.assign_unused(TARGET_TYPE_SCIENCE)
+            asgn.assign_unused(TARGET_TYPE_SKY)
+            result[policy] = {
+                t: dict(asgn.tile_location_target(t)) for t in tiles.id
+            }
+        self.assertTrue(len(env.topology()) > 0)
+        env.set_affinity(original)
+
+        # The per-tile loops ran as tasks, three times.
+        stats = {x["name"]: x for x in pool.stats()}
+        st = stats["TargetsAvailable: tiles"]
+        self.assertEqual(st["runs"], 3)
+        self.assertEqual(st["roots"], 3 * len(tiles.id))
+        self.assertEqual(sum(st["worker_tasks"]), st["tasks"])
+        self.assertTrue(st["imbalance"] >= 1.0)
+        self.assertTrue("LocationsAvailable: tiles" in stats)
+        for t in tiles.id:
+            self.assertEqual(result["none"][t], result["compact"][t])
+            self.assertEqual(result["none"][t], result["spread"][t])
+        return
+
+    def test_scratch_arena(self):
+        arena = ScratchArena(1024)
+        self.assertEqual(arena.capacity(), 0)
+
+        # Allocations are aligned and follow each other in the first block.
+        first = arena.allocate(100, 8)
+        second = arena.allocate(24, 16)
+        self.assertEqual(second % 16, 0)
+        self.assertGreaterEqual(second, first + 100)
+        self.assertEqual(arena.used(), 124)
+        self.assertEqual(arena.capacity(), 1024)
+
+        # More than the first block adds larger ones.
+        for i in range(10):
+            arena.allocate(1000, 8)
+        self.assertEqual(arena.used(), 10124)
+        total = arena.capacity()
+        self.assertGreater(total, 10124)
+
+        # After a reset they are merged into one block, which is reused.
+        arena.reset()
+        self.assertEqual(arena.used(), 0)
+        self.assertEqual(arena.capacity(), total)
+        start = arena.allocate(8, 8)
+        for i in range(10):
+            arena.allocate(1000, 8)
+        self.assertEqual(arena.capacity(), total)
+        arena.reset()
+        self.assertEqual(arena.allocate(8, 8), start)
+
+        # Maps of vectors use the same memory after each reset.
+        data = {loc: list(range(loc % 17)) for loc in range(500)}
+        arena = ScratchArena(4096)
+        self.assertEqual(arena.fill_map(data), data)
+        used = arena.used()
+        total = arena.capacity()
+        self.assertGreater(total, 4096)
+        for i in range(3):
+            arena.reset()
+            self.assertEqual(arena.fill_map(data), data)
+            self.assertEqual(arena.used(), used)
+            self.assertEqual(arena.capacity(), total)
+        return
+
+    def test_solver(self):
+        sim = self._sim_assignment("assign_test_solver", [TARGET_TYPE_SCIENCE])
+        tgs, hw, tiles = sim.tgs, sim.hw, sim.tiles
+        base = sim.asgn
+
+        def priority(tgids):
+            return sum([tgs.get(x).priority for x in tgids])
+
+        # Before collisions are checked, the matching places at least the
+        # priority that greedy assigns on each tile from the same start.
+        for t in tiles.id:
+            greedy = base.fork()
+            greedy.assign_unused(TARGET_TYPE_SCIENCE, -1, -1, "POS", t, t)
+            matched = base.tile_matching(t)
+            self.assertEqual(len(set(matched.values())), len(matched))
+            self.assertGreaterEqual(
+                priority(matched.values()),
+                priority(greedy.tile_location_target(t).values())
+            )
+
+        nassign = dict()
+        result = dict()
+        for solver in ["greedy", "petal", "matching"]:
+            # Each solver starts from the same empty assignment.
+            asgn = base.fork()
+            asgn.assign_unused(TARGET_TYPE_SCIENCE, solver=solver)
+            nassign[solver] = 0
+            result[solver] = dict()
+            for t in tiles.id:
+                tdata = asgn.tile_location_target(t)
+                # No target may be assigned twice on one tile.
+                self.assertEqual(len(set(tdata.values())), len(tdata))
+                nassign[solver] += len(tdata)
+                result[solver][t] = dict(tdata)
+            if solver == "greedy":
+                with self.assertRaises(RuntimeError):
+                    asgn.assign_unused(TARGET_TYPE_SCIENCE, solver="auction")
+        # No two assigned neighbors collide, whichever solver was used.
+        for t in tiles.id:
+            xy = dict(zip(sim.tile_targetids[t],
+                          zip(sim.tile_x[t], sim.tile_y[t])))
+            for solver, tresult in result.items():
+                tdata = tresult[t]
+                for loc, tgid in tdata.items():
+                    self.assertFalse(hw.collide_xy_edges(loc, xy[tgid]))
+                    for nb in hw.neighbors[loc]:
+                        if (nb > loc) and (nb in tdata):
+                            self.assertFalse(hw.collide_xy(
+                                loc, xy[tgid], nb, xy[tdata[nb]]
+                            ))
+        # The petal parallel method makes the same choices as greedy.
+        self.assertEqual(result["petal"], result["greedy"])
+        # Collisions are only resolved after matching, so the totals are not
+        # strictly ordered, but the matching should not do noticeably worse.
+        self.assertGreaterEqual(nassign["matching"], 0.99 * nassign["greedy"])
+        return
+
+    def test_refine(self):
+        sim = self._sim_assignment("assign_test_refine", [TARGET_TYPE_SCIENCE])
+        tiles, asgn = sim.tiles, sim.asgn
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        asgn.redistribute_science()
+
+        before = asgn.get_counts()
+        stats = asgn.refine()
+        after = asgn.get_counts()
+
+        nadded = 0
+        for t in tiles.id:
+            tdata = asgn.tile_location_target(t)
+            self.assertEqual(len(set(tdata.values())), len(tdata))
+            nadded += after[t]["SCIENCE"] - before[t]["SCIENCE"]
+        self.assertEqual(nadded, stats["added"])
+        self.assertGreaterEqual(stats["priority"], 0)
+
+        # A converged assignment has nothing left to change.
+        stats = asgn.refine(time_budget=10.0)
+        self.assertEqual(stats["added"], 0)
+        self.assertEqual(stats["ejected"], 0)
+
+        # Nor does refining a fork of it copy the tiles it shares with the
+        # original.
+        fork = asgn.fork()
+        shared = asgn.memory_usage()["tile_state"]
+        stats = fork.refine(time_budget=10.0)
+        self.assertEqual(stats["added"], 0)
+        self.assertEqual(stats["ejected"], 0)
+        self.assertEqual(asgn.memory_usage()["tile_state"], shared)
+        return
+
+    def test_pass_stats(self):
+        sim = self._sim_assignment("assign_test_pass_stats",
+                                   [TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD,
+                                    TARGET_TYPE_SKY])
+        tgs, hw, tiles = sim.tgs, sim.hw, sim.tiles
+
+        def check_counts(a):
+            # The dense counts are the same as those found from the
+            # assignment of each tile.
+            cnt = a.counts()
+            types = list(cnt["types"])
+            self.assertEqual(list(cnt["tile"]), list(tiles.id))
+            for i, t in enumerate(cnt["tile"]):
+                ntype = np.zeros_like(cnt["type"][i])
+                npetal = np.zeros_like(cnt["petal"][i])
+                nslitblock = np.zeros_like(cnt["slitblock"][i])
+                nsci = 0
+                for loc, tgid in a.tile_location_target(t).items():
+                    tgtype = tgs.get(tgid).type
+                    petal = hw.loc_petal[loc]
+                    slitblock = hw.loc_slitblock[loc]
+                    for c, tt in enumerate(types):
+                        if tgtype & tt:
+                            ntype[c] += 1
+                            npetal[c, petal] += 1
+                            if slitblock >= 0:
+                                nslitblock[c, petal, slitblock] += 1
+                    if ((tgtype & TARGET_TYPE_SCIENCE)
+                            and not (tgtype & TARGET_TYPE_STANDARD)):
+                        nsci += 1
+                self.assertTrue(np.array_equal(cnt["type"][i], ntype))
+                self.assertTrue(np.array_equal(cnt["petal"][i], npetal))
+                self.assertTrue(np.array_equal(cnt["slitblock"][i],
+                                               nslitblock))
+                self.assertEqual(cnt["science_only"][i], nsci)
+
+        def passes(nthread):
+            # The forks do not change the targets, so each starts from the
+            # same state.
+            env.set_threads(nthread)
+            f = sim.asgn.fork()
+            f.reset_pass_stats()
+            f.assign_unused(TARGET_TYPE_SCIENCE, solver="petal")
+            check_counts(f)
+            f.assign_unused(TARGET_TYPE_STANDARD, 10)
+            f.assign_unused(TARGET_TYPE_SKY, 40)
+            check_counts(f)
+            stats = f.refine()
+            check_counts(f)
+
+            # The counters agree with the assignment.
+            pstats = f.pass_stats()
+            nassigned = sum(
+                [len(f.tile_location_target(t)) for t in tiles.id]
+            )
+            self.assertEqual(pstats["assigned"] - pstats["unassigned"],
+                             nassigned)
+            self.assertGreaterEqual(pstats["bumps"], stats["ejected"])
+            self.assertGreaterEqual(pstats["ok_to_assign"],
+                                    pstats["collisions"])
+            return pstats
+
+        # The counters of each thread add up to the same totals.
+        env = Environment.get()
+        original = env.current_threads()
+        serial = passes(1)
+        threaded = passes(env.max_threads())
+        env.set_threads(original)
+        self.assertEqual(threaded, serial)
+        self.assertGreater(serial["candidates"], 0)
+        return
+
+    def test_transaction(self):
+        sim = self._sim_assignment("assign_test_transaction",
+                                   [TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY])
+        tiles, asgn = sim.tiles, sim.asgn
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+
+        def snapshot():
+            return (
+                asgn.get_counts(),
+                {t: dict(asgn.tile_location_target(t)) for t in tiles.id}
+            )
+
+        before = snapshot()
+        asgn.begin()
+        asgn.redistribute_science()
+        asgn.assign_force(TARGET_TYPE_SKY, 40)
+        middle = snapshot()
+        asgn.begin()
+        asgn.assign_unused(TARGET_TYPE_SKY)
+        self.assertEqual(asgn.transaction_depth(), 2)
+        asgn.rollback()
+        self.assertEqual(snapshot(), middle)
+        asgn.rollback()
+        self.assertEqual(snapshot(), before)
+        self.assertEqual(asgn.transaction_depth(), 0)
+
+        with self.assertRaises(RuntimeError):
+            asgn.commit()
+        asgn.begin()
+        with self.assertRaises(RuntimeError):
+            asgn.remove_targets([])
+        asgn.commit()
+        return
+
+    def test_fork(self):
+        sim = self._sim_assignment(
+            "assign_test_fork",
+            [TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD, TARGET_TYPE_SKY]
+        )
+        tiles, asgn = sim.tiles, sim.asgn
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        self.assertFalse(asgn.is_fork())
+
+        def snapshot(a):
+            return (
+                a.get_counts(),
+                {t: dict(a.tile_location_target(t)) for t in tiles.id}
+            )
+
+        def calib(a, nstd, nsky):
+            a.assign_unused(TARGET_TYPE_STANDARD, nstd)
+            a.assign_unused(TARGET_TYPE_SKY, nsky)
+            a.assign_force(TARGET_TYPE_STANDARD, nstd)
+            a.assign_force(TARGET_TYPE_SKY, nsky)
+
+        knobs = [(2, 20), (5, 40), (10, 60)]
+
+        # Reference results, one fork at a time.
+        before = snapshot(asgn)
+        expected = list()
+        for nstd, nsky in knobs:
+            f = asgn.fork()
+            self.assertTrue(f.is_fork())
+            calib(f, nstd, nsky)
+            expected.append(snapshot(f))
+            self.assertEqual(snapshot(asgn), before)
+        self.assertNotEqual(expected[0], expected[-1])
+
+        # The same forks run concurrently.
+        forks = [asgn.fork() for k in knobs]
+        threads = [
+            threading.Thread(target=calib, args=(f, nstd, nsky))
+            for f, (nstd, nsky) in zip(forks, knobs)
+        ]
+        for th in threads:
+            th.start()
+        for th in threads:
+            th.join()
+        for f, exp in zip(forks, expected):
+            self.assertEqual(snapshot(f), exp)
+        self.assertEqual(snapshot(asgn), before)
+
+        # The targets are shared with the forks.
+        with self.assertRaises(RuntimeError):
+            asgn.remove_targets([])
+        with self.assertRaises(RuntimeError):
+            forks[0].remove_targets([])
+        del f
+        del forks
+        asgn.remove_targets([])
+        return
+
+    def test_stream(self):
+        sim = self._sim_assignment("assign_test_stream",
+                                   [TARGET_TYPE_SCIENCE],
+                                   assign=False)
+        tgs, hw, tfile = sim.tgs, sim.hw, sim.tfile
+        all_tiles = sim.tiles
+        half = len(all_tiles.id) // 2
+        first = list(all_tiles.id[:half])
+        second = list(all_tiles.id[half:])
+
+        # The first night.
+        tiles = load_tiles(tiles_file=tfile, select=first)
+        tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
+        tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids,
+                                    tile_x, tile_y)
+        favail = LocationsAvailable(tgsavail)
+        asgn = Assignment(tgs, tgsavail, favail, {})
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+
+        # Every fourth assigned target fails to be observed.
+        assigned = list()
+        for t in first:
+            assigned.extend(asgn.tile_location_target(t).values())
+        failed = set(assigned[::4])
+        observed = [x for x in assigned if x not in failed]
+        before = {t: dict(asgn.tile_location_target(t)) for t in first}
+        remain = {x: tgs.get(x).obsremain for x in failed}
+        asgn.observe(first, observed)
+        for x in failed:
+            nfail = assigned.count(x)
+            self.assertEqual(tgs.get(x).obsremain, remain[x] + nfail)
+
+        # The next night adds new tiles to the same assignment.
+        new_tiles = load_tiles(tiles_file=tfile, select=second)
+        tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, new_tiles)
+        asgn.add_tiles(new_tiles, tile_targetids, tile_x, tile_y)
+        self.assertEqual(list(tiles.id), first + second)
+        with self.assertRaises(RuntimeError):
+            asgn.add_tiles(new_tiles, tile_targetids, tile_x, tile_y)
+
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        asgn.redistribute_science()
+        asgn.refine()
+
+        # Observed tiles are frozen, and failed targets can be assigned
+        # again on the new tiles.
+        for t in first:
+            self.assertEqual(before[t], dict(asgn.tile_location_target(t)))
+        reassigned = set()
+        for t in second:
+            reassigned.update(asgn.tile_location_target(t).values())
+        self.assertTrue(len(reassigned & failed) > 0)
+        return
+
+    def test_fiber_state(self):
+        sim = self._sim_assignment("assign_test_fiber_state",
+                                   [TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY])
+        hw, tiles, asgn = sim.hw, sim.tiles, sim.asgn
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        asgn.assign_unused(TARGET_TYPE_SKY)
+
+        # Some assigned positioners get stuck.
+        stuck = sorted(asgn.tile_location_target(tiles.id[0]).keys())[::20]
+        nstuck = len(stuck)
+        states = [FIBER_STATE_STUCK] * nstuck
+        theta = [0.0] * nstuck
+        phi = [150.0] * nstuck
+        stats = asgn.update_fiber_state(stuck, states, theta, phi)
+        self.assertTrue(stats["unassigned"] >= nstuck)
+        for loc in stuck:
+            self.assertEqual(hw.state[loc], FIBER_STATE_STUCK)
+        for t in tiles.id:
+            tdata = asgn.tile_location_target(t)
+            self.assertEqual(len(set(stuck) & set(tdata.keys())), 0)
+
+        # The repaired assignment has no collisions left to fix.
+        stats = asgn.update_fiber_state(stuck, states, theta, phi)
+        self.assertEqual(stats["unassigned"], 0)
+        self.assertEqual(stats["collisions"], 0)
+
+        # Recovered positioners are refilled from the existing availability.
+        stats = asgn.update_fiber_state(stuck, [FIBER_STATE_OK] * nstuck,
+                                        theta, phi)
+        self.assertEqual(stats["unassigned"], 0)
+        self.assertTrue(stats["refilled"] > 0)
+
+        with self.assertRaises(RuntimeError):
+            asgn.update_fiber_state([-1], [FIBER_STATE_OK], [0.0], [0.0])
+        return
+
+    def test_fiber_state_quota(self):
+        # With only sky targets, every location freed by a repair could be
+        # given a sky target, so the per-petal limit of the original pass
+        # must not be exceeded.
+        sim = self._sim_assignment("assign_test_fiber_state_quota",
+                                   [TARGET_TYPE_SKY])
+        tgs, hw, tiles, asgn = sim.tgs, sim.hw, sim.tiles, sim.asgn
+        sky_per_petal = 2
+        asgn.assign_unused(TARGET_TYPE_SKY, sky_per_petal)
+
+        tid = tiles.id[0]
+
+        def petal_sky():
+            ret = dict()
+            for loc, tgid in asgn.tile_location_target(tid).items():
+                if tgs.get(tgid).type & TARGET_TYPE_SKY:
+                    p = hw.loc_petal[loc]
+                    ret[p] = ret.get(p, 0) + 1
+            return ret
+
+        before = petal_sky()
+        for p, n in before.items():
+            self.assertTrue(n <= sky_per_petal)
+
+        # Fail unused positioners which could reach a sky target, and
+        # recover them again.
+        assigned = asgn.tile_location_target(tid)
+        failed = list()
+        for loc, avail in sorted(sim.tgsavail.tile_data(tid).items()):
+            if (loc not in assigned) and (len(avail) > 0):
+                failed.append(loc)
+        failed = failed[::10]
+        self.assertTrue(len(failed) > 0)
+        nfail = len(failed)
+        theta = [0.0] * nfail
+        phi = [150.0] * nfail
+        for state in [FIBER_STATE_STUCK, FIBER_STATE_OK]:
+            asgn.update_fiber_state(failed, [state] * nfail, theta, phi)
+            for p, n in petal_sky().items():
+                self.assertTrue(n <= before.get(p, 0))
+        return
+
+    def test_trace(self):
+        sim = self._sim_assignment("assign_test_trace", [TARGET_TYPE_SCIENCE])
+        test_dir, tiles, asgn = sim.test_dir, sim.tiles, sim.asgn
+
+        trace_file = os.path.join(test_dir, "trace.bin")
+        log = Logger.get()
+        log.open_trace(trace_file)
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+        log.close_trace()
+
+        events = read_trace(trace_file)
+        assigned = events[events["EVENT"] == TRACE_ASSIGN]
+        for t in tiles.id:
+            tdata = asgn.tile_location_target(t)
+            rows = assigned[assigned["TILEID"] == t]
+            self.assertEqual(len(rows), len(tdata))
+            for loc, tgid in zip(rows["LOCATION"], rows["TARGETID"]):
+                self.assertEqual(tdata[loc], tgid)
+        return
+
+    def test_fused_sky(self):
+        sim = self._sim_assignment(
+            "assign_test_fused_sky",
+            [TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY]
+        )
+        tiles, asgn = sim.tiles, sim.asgn
+        asgn.assign_unused(TARGET_TYPE_SCIENCE)
+
+        # On a single tile the fused pass matches the separate passes.
+        tid = tiles.id[0]
+        seq = asgn.fork()
+        for tt in [TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY]:
+            seq.assign_unused(tt, -1, 2, "POS", tid, tid)
+            seq.assign_unused(tt, 40, -1, "POS", tid, tid)
+        fused = asgn.fork()
+        fused.assign_unused_sky(40, 2, "POS", tid, tid)
+        self.assertEqual(
+            dict(seq.tile_location_target(tid)),
+            dict(fused.tile_location_target(tid))
+        )
+
+        # Over all tiles, run() gives the same sky and suppsky counts per
+        # petal and slitblock either way, with and without a slitblock
+        # limit.
+        def sky_counts(a):
+            cnt = a.counts()
+            types = list(cnt["types"])
+            cols = [types.index(TARGET_TYPE_SKY),
+                    types.index(TARGET_TYPE_SUPPSKY)]
+            return cnt["petal"][:, cols], cnt["slitblock"][:, cols]
+
+        for sky_per_slitblock in [0, 2]:
+            result = list()
+            for fused_sky in [False, True]:
+                f = asgn.fork()
+                run(f, sky_per_petal=40, sky_per_slitblock=sky_per_slitblock,
+                    redistribute=False, fused_sky=fused_sky)
+                result.append(sky_counts(f))
+            (seq_petal, seq_slitblock), (fused_petal, fused_slitblock) = result
+            self.assertGreater(np.sum(seq_petal), 0)
+            self.assertTrue(np.array_equal(seq_petal, fused_petal))
+            self.assertTrue(np.array_equal(seq_slitblock, fused_slitblock))
+        return
+
     def test_cli(self):
         test_dir = test_subdir_create("assign_test_cli")
         np.random.seed(123456789)
@@ -449,12 +1226,41 @@ class TestAssign(unittest.TestCase):
             "standards_per_petal": 10,
             "sky_per_petal": 40,
             "overwrite": True,
-            "rundate": test_assign_date
+            "rundate": test_assign_date,
+            "timer_trace": os.path.join(test_dir, "timers.json"),
+            "memory": True,
+            "memory_header": True
         }
         optlist = option_list(opts)
         args = parse_assign(optlist)
+        # The counters may not be available on this machine.
+        perf = GlobalTimers.get().set_perf_counters(True)
         run_assign_full(args)
 
+        with open(os.path.join(test_dir, "timers.json"), "r") as f:
+            trace = json.load(f)
+        self.assertTrue(len(trace["traceEvents"]) > 0)
+        with open(os.path.join(test_dir, "timers.summary.json"), "r") as f:
+            timers = json.load(f)
+        paths = [x["path"] for x in timers["regions"]]
+        self.assertTrue(
+            "run_assign_full calculation/Construct Assignment" in paths
+        )
+        for x in timers["regions"]:
+            if x["path"] == "run_assign_full calculation":
+                self.assertTrue(x["rss_peak"] > 0)
+                if perf:
+                    self.assertTrue(x["cycles"] > 0)
+                else:
+                    self.assertEqual(x["cycles"], -1)
+        for key in ["Targets", "TargetsAvailable", "LocationsAvailable",
+                    "Assignment"]:
+            self.assertTrue(sum(timers["memory"][key].values()) > 0)
+        self.assertTrue(timers["memory"]["rss_peak"] > 0)
+        GlobalTimers.get().set_trace(False)
+        GlobalTimers.get().set_memory(False)
+        GlobalTimers.get().set_perf_counters(False)
+
         plotpetals = "0"
         #plotpetals = "0,1,2,3,4,5,6,7,8,9"
         opts = {
@@ -491,6 +1297,40 @@ class TestAssign(unittest.TestCase):
             )
         return
 
+    def test_bench(self):
+        test_dir = test_subdir_create("assign_test_bench")
+        base_file = os.path.join(test_dir, "baseline.json")
+        opts = {
+            "dir": test_dir,
+            "tiles": 1,
+            "density": "low",
+            "rundate": test_assign_date,
+            "save_baseline": base_file
+        }
+        args = parse_bench(option_list(opts))
+        base = run_bench(args)
+        self.assertEqual(len(base["regressions"]), 0)
+        case = base["cases"]["1_tiles_low"]
+        self.assertTrue(case["peak_rss_mb"] > 0)
+        self.assertTrue("run_assign_full calculation" in case["phases"])
+
+        # The same inputs give the same assignment.
+        opts["baseline"] = base_file
+        del opts["save_baseline"]
+        args = parse_bench(option_list(opts))
+        result = run_bench(args)
+        self.assertEqual(
+            result["cases"]["1_tiles_low"]["checksum"], case["checksum"]
+        )
+
+        # Slower and changed results are flagged.
+        slow = json.loads(json.dumps(base["cases"]))
+        slow["1_tiles_low"]["wall"] *= 2.0
+        slow["1_tiles_low"]["checksum"] = "0"
+        regress = compare_bench(slow, base["cases"], 0.2, 0.0)
+        self.assertEqual(len(regress), 2)
+        return
+
     def test_fieldrot(self):
         test_dir = test_subdir_create("assign_test_fieldrot")
         np.random.seed(123456789)
@@ -565,7 +1405,7 @@ class TestAssign(unittest.TestCase):
             tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
 
             # Compute the targets available to each fiber for each tile.
-            tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+            tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y)
 
             # Compute the fibers on all tiles available for each target
             favail = LocationsAvailable(tgsavail)
@@ -131,7 +131,7 @@ class TestQA(unittest.TestCase):
         # Precompute target positions
         tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
         # Compute the targets available to each fiber for each tile.
-        tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+        tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y)
 
         # Compute the fibers on all tiles available for each target
         favail = LocationsAvailable(tgsavail)
@@ -148,6 +148,13 @@ class TestQA(unittest.TestCase):
         # Redistribute
         asgn.redistribute_science()
 
+        # Every reassignment attempt examines a subset of the candidates.
+        stats = asgn.reassign_stats()
+        self.assertTrue(stats["calls"] > 0)
+        self.assertTrue(
+            stats["checked"] + stats["skipped"] <= stats["candidates"]
+        )
+
         write_assignment_fits(tiles, asgn, out_dir=test_dir, all_targets=True)
 
         tile_ids = list(tiles.id)
@@ -23,7 +23,8 @@ from fiberassign.targets import (TARGET_TYPE_SCIENCE, TARGET_TYPE_SKY,
                                  default_main_safemask,
                                  default_main_excludemask,
                                  Targets, TargetTree, TargetsAvailable,
-                                 LocationsAvailable, targets_in_tiles)
+                                 LocationsAvailable, targets_in_tiles,
+                                 sort_target_weights)
 
 from .simulate import (test_subdir_create, sim_tiles, sim_targets, test_assign_date)
 
@@ -72,7 +73,7 @@ class TestTargets(unittest.TestCase):
         tiles = load_tiles(tiles_file=tfile)
         # Precompute target positions
         tile_targetids, tile_x, tile_y = targets_in_tiles(hw, tgs, tiles)
-        tgsavail = TargetsAvailable(hw, tiles, tile_targetids, tile_x, tile_y)
+        tgsavail = TargetsAvailable(hw, tgs, tiles, tile_targetids, tile_x, tile_y)
 
         # Free the tree
         del tile_targetids, tile_x, tile_y
@@ -137,6 +138,31 @@ class TestTargets(unittest.TestCase):
         self.assertTrue(not np.any(result))
 
 
+    def test_sort_weights(self):
+        # The radix sort and std::stable_sort give the same order, including
+        # for equal weights, signed zeros and NaN.
+        rng = np.random.RandomState(123456)
+        for n in [0, 1, 2, 17, 255, 256, 257, 1000, 5000]:
+            for nan in [False, True]:
+                w = rng.choice([3400.0, 3000.0, 2000.0, 1.0, -1.0], size=n)
+                w += rng.choice([0.0, 0.25, 0.5], size=n)
+                w[rng.uniform(size=n) < 0.1] = 0.0
+                w[rng.uniform(size=n) < 0.1] = -0.0
+                if nan:
+                    w[rng.uniform(size=n) < 0.05] = np.nan
+                for ascending in [False, True]:
+                    plain = sort_target_weights(w, ascending, n + 1)
+                    radix = sort_target_weights(w, ascending, 0)
+                    self.assertEqual(radix, plain)
+                    self.assertEqual(sort_target_weights(w, ascending), plain)
+                    if not np.any(np.isnan(w)):
+                        if ascending:
+                            check = np.argsort(w, kind="stable")
+                        else:
+                            check = np.argsort(-w, kind="stable")
+                        self.assertEqual(radix, list(check))
+        return
+
 def test_suite():
     """Allows testing of only this module with the command::
 
@@ -12,8 +12,14 @@ from __future__ import absolute_import, division, print_function
 import os
 import sys
 
+import numpy as np
+
 from ._internal import (Logger, Timer, GlobalTimers, Circle, Segments, Shape,
-                        Environment)
+                        Environment, TaskPool, TRACE_MESSAGE,
+                        TRACE_NO_TARGETS, TRACE_LOC_DISABLED, TRACE_NEIGHBOR_TARGET,
+                        TRACE_COLLIDE, TRACE_COLLIDE_EDGE, TRACE_NOT_OK,
+                        TRACE_ASSIGN, TRACE_UNASSIGN, TRACE_MOVE, TRACE_BUMP,
+                        rss_current_bytes, rss_peak_bytes, ScratchArena)
 
 # Multiprocessing environment setup
 
@@ -29,6 +35,44 @@ else:
     default_mp_proc = max(1, _mp.cpu_count() // 2)
 
 
+trace_dtype = np.dtype([
+    ("EVENT", "i4"),
+    ("TILEID", "i4"),
+    ("LOCATION", "i4"),
+    ("AUX", "i4"),
+    ("TARGETID", "i8"),
+    ("ARG", "i8"),
+])
+"""The records of a binary debug trace file."""
+
+
+def read_trace(path):
+    """Read a binary debug trace file.
+
+    See Logger.open_trace() and the TRACE_* event types for the meaning of
+    the columns.
+
+    Args:
+        path (str): The trace file written by the compiled code.
+
+    Returns:
+        (array): A structured array with one row per event.
+
+    """
+    with open(path, "rb") as f:
+        magic = f.read(8)
+        if magic != b"FBATRACE":
+            raise RuntimeError("{} is not a fiberassign trace".format(path))
+        version, recsize = np.frombuffer(f.read(8), dtype="i4")
+        if recsize != trace_dtype.itemsize:
+            raise RuntimeError(
+                "{} has records of {} bytes, expected {}".format(
+                    path, recsize, trace_dtype.itemsize
+                )
+            )
+        return np.fromfile(f, dtype=trace_dtype)
+
+
 def option_list(opts):
     """Convert key, value pairs into a list.
 
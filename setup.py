@@ -12,7 +12,7 @@ import shutil
 # setuptools' sdist command ignores MANIFEST.in
 #
 from distutils.command.sdist import sdist as DistutilsSdist
-from setuptools import setup, find_packages, Extension
+from setuptools import setup, find_packages, Extension, Command
 from setuptools.command.build_ext import build_ext
 from setuptools.command.egg_info import egg_info
 from distutils.command.clean import clean
@@ -219,6 +219,9 @@ class BuildExt(build_ext):
                 linkopts.append('-fopenmp')
             if sys.platform.lower() == 'darwin':
                 linkopts.append('-stdlib=libc++')
+            if 'FIBERASSIGN_NO_DEBUG' in os.environ:
+                # Remove the debug messages and trace at compile time.
+                opts.append('-DFIBERASSIGN_NO_DEBUG')
         elif ct == 'msvc':
             opts.append('/DVERSION_INFO=\\"%s\\"' %
                         self.distribution.get_version())
@@ -232,11 +235,72 @@ class BuildExt(build_ext):
 
         build_ext.build_extensions(self)
 
+class BuildBench(Command):
+    """Build (and optionally run) the C++ microbenchmarks.
+
+    The executable is linked from the same sources as the extension and
+    written to build/fba_microbench.
+    """
+    description = 'build the C++ microbenchmarks'
+    user_options = [
+        ('run-bench', None, 'run the benchmarks after building'),
+        ('threads=', None, 'comma separated thread counts to run'),
+        ('json=', None, 'write the benchmark results to this JSON file'),
+    ]
+    boolean_options = ['run-bench']
+
+    def initialize_options(self):
+        self.run_bench = False
+        self.threads = None
+        self.json = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        import subprocess as sp
+        from distutils.ccompiler import new_compiler
+        from distutils.sysconfig import customize_compiler
+        compiler = new_compiler()
+        customize_compiler(compiler)
+        opts = [cpp_flag(compiler), '-O2']
+        linkopts = []
+        if has_flag(compiler, '-fopenmp'):
+            opts.append('-fopenmp')
+            linkopts.append('-fopenmp')
+        if sys.platform.lower() == 'darwin':
+            opts.extend(['-stdlib=libc++', '-mmacosx-version-min=10.7'])
+            linkopts.append('-stdlib=libc++')
+        if 'FIBERASSIGN_NO_DEBUG' in os.environ:
+            opts.append('-DFIBERASSIGN_NO_DEBUG')
+        sources = [
+            x for x in ext_modules[0].sources
+            if os.path.basename(x) != '_pyfiberassign.cpp'
+        ]
+        sources.append('src/bench/microbench.cpp')
+        objects = compiler.compile(
+            sources, output_dir=os.path.join('build', 'bench'),
+            include_dirs=['src'], extra_postargs=opts
+        )
+        compiler.link_executable(
+            objects, 'fba_microbench', output_dir='build',
+            extra_postargs=linkopts, target_lang='c++'
+        )
+        if self.run_bench:
+            cmd = [os.path.join('build', 'fba_microbench')]
+            if self.threads is not None:
+                cmd.extend(['--threads', self.threads])
+            if self.json is not None:
+                cmd.extend(['--json', self.json])
+            sp.check_call(cmd)
+
+
 ext_modules = [
     Extension(
         'fiberassign._internal',
         [
             'src/utils.cpp',
+            'src/tasks.cpp',
             'src/hardware.cpp',
             'src/tiles.cpp',
             'src/targets.cpp',
@@ -253,6 +317,7 @@ ext_modules = [
 setup_keywords['ext_modules'] = ext_modules
 setup_keywords['cmdclass']['build_ext'] = BuildExt
 setup_keywords['cmdclass']['clean'] = RealClean
+setup_keywords['cmdclass']['bench'] = BuildBench
 
 #
 # Run setup command.
@@ -1,5 +1,6 @@
 #include <string>
 #include <sstream>
+#include <scoped_allocator>
 
 #include <pybind11/pybind11.h>
 #include <pybind11/operators.h>
@@ -8,6 +9,7 @@
 
 #include <pybind11/stl_bind.h>
 
+#include <tasks.h>
 #include <hardware.h>
 #include <tiles.h>
 #include <targets.h>
@@ -46,6 +48,35 @@ PYBIND11_MODULE(_internal, m) {
     m.attr("FIBER_STATE_BROKEN") = py::int_(FIBER_STATE_BROKEN);
     m.attr("FIBER_STATE_RESTRICT") = py::int_(FIBER_STATE_RESTRICT);
 
+    // Wrap the debug trace events
+
+    m.attr("TRACE_MESSAGE") = py::int_(TRACE_MESSAGE);
+    m.attr("TRACE_NO_TARGETS") = py::int_(TRACE_NO_TARGETS);
+    m.attr("TRACE_LOC_DISABLED") = py::int_(TRACE_LOC_DISABLED);
+    m.attr("TRACE_NEIGHBOR_TARGET") = py::int_(TRACE_NEIGHBOR_TARGET);
+    m.attr("TRACE_COLLIDE") = py::int_(TRACE_COLLIDE);
+    m.attr("TRACE_COLLIDE_EDGE") = py::int_(TRACE_COLLIDE_EDGE);
+    m.attr("TRACE_NOT_OK") = py::int_(TRACE_NOT_OK);
+    m.attr("TRACE_ASSIGN") = py::int_(TRACE_ASSIGN);
+    m.attr("TRACE_UNASSIGN") = py::int_(TRACE_UNASSIGN);
+    m.attr("TRACE_MOVE") = py::int_(TRACE_MOVE);
+    m.attr("TRACE_BUMP") = py::int_(TRACE_BUMP);
+
+    m.def("rss_current_bytes", &fba::rss_current_bytes, R"(
+        The current resident memory of this process.
+
+        Returns:
+            (int): The resident memory in bytes, or zero if this is not
+                available on the platform.
+    )");
+
+    m.def("rss_peak_bytes", &fba::rss_peak_bytes, R"(
+        The peak resident memory of this process.
+
+        Returns:
+            (int): The high-water mark of the resident memory in bytes.
+    )");
+
     py::class_ <fba::Timer, fba::Timer::pshr > (m, "Timer", R"(
         Simple timer class.
 
@@ -112,6 +143,83 @@ PYBIND11_MODULE(_internal, m) {
         );
 
 
+    py::class_ <fba::ScratchArena, std::shared_ptr <fba::ScratchArena> > (m,
+        "ScratchArena", R"(
+        Bump allocator for scratch data.
+
+        Memory is handed out from large blocks and all of it is reclaimed by
+        reset().  The assignment uses one of these for the per-tile target
+        and location maps.  This interface is mostly useful for testing.
+
+        Args:
+            block_bytes (int): The size of the first block.
+
+        )")
+        .def(py::init < size_t > (), py::arg("block_bytes")=SCRATCH_ARENA_BLOCK)
+        .def("allocate", [](fba::ScratchArena & self, size_t bytes,
+                            size_t align) {
+                return reinterpret_cast <uintptr_t> (
+                    self.allocate(bytes, align)
+                );
+            }, py::arg("bytes"), py::arg("align"), R"(
+            Allocate memory from the arena.
+
+            Args:
+                bytes (int): The number of bytes.
+                align (int): The alignment, a power of two.
+
+            Returns:
+                (int): The address of the memory.
+
+        )")
+        .def("reset", &fba::ScratchArena::reset, R"(
+            Reclaim everything allocated so far.
+        )")
+        .def("used", &fba::ScratchArena::used, R"(
+            Returns:
+                (int): The bytes handed out since the last reset.
+        )")
+        .def("capacity", &fba::ScratchArena::capacity, R"(
+            Returns:
+                (int): The total size of the blocks.
+        )")
+        .def("fill_map", [](fba::ScratchArena & self,
+                            std::map <int32_t, std::vector <int32_t> > const & data) {
+                // The same layout as the per-tile maps of the assignment.
+                typedef std::vector <int32_t, fba::ArenaAllocator <int32_t> >
+                    scratch_vec;
+                typedef std::map <int32_t, scratch_vec, std::less <int32_t>,
+                    std::scoped_allocator_adaptor <fba::ArenaAllocator <
+                        std::pair <const int32_t, scratch_vec> > > > scratch_map;
+                scratch_map smap{fba::ArenaAllocator <int32_t> (&self)};
+                for (auto const & it : data) {
+                    auto & vec = smap[it.first];
+                    vec.assign(it.second.begin(), it.second.end());
+                    if (vec.get_allocator().arena() != &self) {
+                        throw std::runtime_error(
+                            "fill_map:  vector does not use the arena");
+                    }
+                }
+                std::map <int32_t, std::vector <int32_t> > ret;
+                for (auto const & it : smap) {
+                    ret[it.first].assign(it.second.begin(), it.second.end());
+                }
+                return ret;
+            }, py::arg("data"), R"(
+            Copy a map of vectors into the arena and back.
+
+            The map and its vectors use the arena through a scoped
+            allocator, like the per-tile maps of the assignment.  They are
+            destroyed before returning, so the arena can then be reset.
+
+            Args:
+                data (dict): Lists of integers keyed by integer.
+
+            Returns:
+                (dict): The contents of the map in the arena.
+
+        )");
+
     py::class_ <fba::GlobalTimers,
         std::unique_ptr<fba::GlobalTimers, py::nodelete> > (m, "GlobalTimers",
         R"(
@@ -119,6 +227,9 @@ PYBIND11_MODULE(_internal, m) {
 
         This class stores timers that can be started / stopped anywhere in
         the code to accumulate the total time for different operations.
+        Each thread keeps its own stack of running timers, so a timer
+        started while another one is running is also accumulated as a
+        child of that timer.
         )")
         .def("get", [](){
             return std::unique_ptr<fba::GlobalTimers, py::nodelete>
@@ -126,7 +237,8 @@ PYBIND11_MODULE(_internal, m) {
             }, R"(
             Get the instance of global singleton class.
         )")
-        .def("start", &fba::GlobalTimers::start, py::arg("name"), R"(
+        .def("start", (void (fba::GlobalTimers::*)(std::string const &))
+             &fba::GlobalTimers::start, py::arg("name"), R"(
             Start the specified timer.
 
             If the named timer does not exist, it is first created before
@@ -138,10 +250,12 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
         )")
-        .def("stop", &fba::GlobalTimers::stop, py::arg("name"), R"(
+        .def("stop", (void (fba::GlobalTimers::*)(std::string const &))
+             &fba::GlobalTimers::stop, py::arg("name"), R"(
             Stop the specified timer.
 
-            The timer must already exist.
+            The timer must already exist.  Any timers started on this thread
+            while this one was running are also stopped.
 
             Args:
                 name (str): The name of the global timer.
@@ -172,8 +286,136 @@ PYBIND11_MODULE(_internal, m) {
         .def("stop_all", &fba::GlobalTimers::stop_all, R"(
             Stop all global timers.
         )")
+        .def("clear", &fba::GlobalTimers::clear, R"(
+            Discard the accumulated time of all global timers.
+        )")
         .def("report", &fba::GlobalTimers::report, R"(
             Report results of all global timers to STDOUT.
+
+            This stops all timers and prints the total for each name, followed
+            by the nested timers of each thread.
+        )")
+        .def("summary", [](fba::GlobalTimers const & self) {
+                py::list ret;
+                for (auto const & st : self.summary()) {
+                    py::dict d;
+                    d["thread"] = st.thread;
+                    d["depth"] = st.depth;
+                    d["name"] = st.name;
+                    d["path"] = st.path;
+                    d["calls"] = st.calls;
+                    d["total"] = st.total;
+                    d["min"] = st.min;
+                    d["max"] = st.max;
+                    d["rss_peak"] = st.rss_peak;
+                    d["rss_growth"] = st.rss_growth;
+                    for (int32_t ev = 0; ev < PERF_EVENT_COUNT; ++ev) {
+                        d[fba::PerfCounters::event_name(ev)] = st.perf[ev];
+                    }
+                    d["mean"] = (st.calls > 0)
+                        ? st.total / static_cast <double> (st.calls) : 0.0;
+                    ret.append(d);
+                }
+                return ret;
+            }, R"(
+            Statistics of the nested timers of each thread.
+
+            Each region is listed after its parent.  The path is the list of
+            timer names from the outermost timer, separated by "/".
+
+            Returns:
+                (list): One dictionary per region, with the thread index,
+                    depth, name, path, number of calls and the total, min,
+                    mean and max seconds.  With memory tracking enabled,
+                    "rss_peak" is the peak RSS of the process in bytes at
+                    the end of the region and "rss_growth" is how much the
+                    peak grew during the region (both are zero otherwise).
+                    With performance counters enabled, "cycles",
+                    "instructions", "cache_misses" and "branch_misses" are
+                    the hardware event counts of all calls (-1 otherwise).
+        )")
+        .def("summary_json", &fba::GlobalTimers::summary_json, R"(
+            The output of summary() as a JSON string.
+
+            Returns:
+                (str): The JSON document.
+        )")
+        .def("set_trace", &fba::GlobalTimers::set_trace, py::arg("enable"),
+             R"(
+            Enable or disable recording each timer interval.
+
+            The recorded intervals can be written with write_trace().
+
+            Args:
+                enable (bool): If True, record intervals from now on.
+
+            Returns:
+                None
+        )")
+        .def("trace", &fba::GlobalTimers::trace, R"(
+            Are timer intervals being recorded?
+
+            Returns:
+                (bool): True if tracing is enabled.
+        )")
+        .def("trace_json", &fba::GlobalTimers::trace_json, R"(
+            The recorded timer intervals in Chrome trace event format.
+
+            Returns:
+                (str): The JSON document, which can be loaded in
+                    chrome://tracing or Perfetto.
+        )")
+        .def("write_trace", &fba::GlobalTimers::write_trace, py::arg("path"),
+             R"(
+            Write the recorded timer intervals to a file.
+
+            Args:
+                path (str): The output Chrome trace JSON file.
+
+            Returns:
+                None
+        )")
+        .def("set_memory", &fba::GlobalTimers::set_memory, py::arg("enable"),
+             R"(
+            Enable or disable recording the peak RSS of each region.
+
+            Args:
+                enable (bool): If True, record the peak RSS at the start and
+                    end of regions started from now on.
+
+            Returns:
+                None
+        )")
+        .def("memory", &fba::GlobalTimers::memory, R"(
+            Is the peak RSS of each region being recorded?
+
+            Returns:
+                (bool): True if memory tracking is enabled.
+        )")
+        .def("set_perf_counters", &fba::GlobalTimers::set_perf_counters,
+             py::arg("enable"), R"(
+            Enable or disable counting hardware events in each region.
+
+            This uses the Linux perf_event_open interface to count the
+            cycles, instructions, cache misses and branch misses of each
+            thread.  It is also enabled at import if the environment
+            variable FIBERASSIGN_PERF_COUNTERS is set to a non-zero value.
+            Where the counters are not available (other platforms, or a
+            restrictive kernel.perf_event_paranoid) a warning is logged and
+            the timers work as before.
+
+            Args:
+                enable (bool): If True, count events in regions started from
+                    now on.
+
+            Returns:
+                (bool): False if the counters could not be opened.
+        )")
+        .def("perf_counters", &fba::GlobalTimers::perf_counters, R"(
+            Are hardware events being counted in each region?
+
+            Returns:
+                (bool): True if performance counters are enabled.
         )");
 
 
@@ -238,6 +480,27 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
 
+        )")
+        .def("open_trace", &fba::Logger::open_trace, py::arg("path"), R"(
+            Write the per tile / location / target debug events to a file.
+
+            Each event is written as a binary record, which can be read with
+            fiberassign.utils.read_trace().  Setting $DESI_DEBUG_TRACE to a
+            file name opens the trace at startup.
+
+            Args:
+                path (str): The output file.
+
+            Returns:
+                None
+
+        )")
+        .def("close_trace", &fba::Logger::close_trace, R"(
+            Stop writing debug events and close the trace file.
+
+            Returns:
+                None
+
         )");
 
 
@@ -271,6 +534,142 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
 
+        )")
+        .def("set_affinity", [](fba::Environment & self,
+                                std::string const & policy) {
+                int pol = fba::Environment::affinity_policy(policy);
+                if (pol < 0) {
+                    std::ostringstream o;
+                    o << "Unknown thread affinity policy \"" << policy
+                        << "\"";
+                    fba::Logger::get().error(o.str().c_str());
+                    throw std::runtime_error(o.str().c_str());
+                }
+                self.set_affinity(pol);
+                return;
+            }, py::arg("policy"), R"(
+            Pin the threads to CPUs.
+
+            With "compact", thread i runs on the i-th CPU allowed to this
+            process, filling one NUMA domain before the next.  With "spread",
+            consecutive threads alternate between the domains.  With "none"
+            (the default, unless FIBERASSIGN_AFFINITY is set) the threads
+            may run on any allowed CPU.  When threads are pinned, the
+            availability and assignment state of the tiles is split between
+            the domains and first touched there.
+
+            Args:
+                policy (str): "none", "compact" or "spread".
+
+            Returns:
+                None
+
+        )")
+        .def("affinity", [](fba::Environment const & self) {
+                return fba::Environment::affinity_name(self.affinity());
+            }, R"(
+            Return the thread affinity policy in use.
+        )")
+        .def("ndomain", &fba::Environment::ndomain, R"(
+            Return the number of NUMA domains with CPUs usable by this process.
+        )")
+        .def("domain_cpus", &fba::Environment::domain_cpus,
+            py::arg("domain"), R"(
+            Return the CPUs of one NUMA domain usable by this process.
+
+            Args:
+                domain (int): The domain index.
+
+            Returns:
+                (list): The CPU numbers.
+
+        )")
+        .def("thread_domain", &fba::Environment::thread_domain,
+            py::arg("thread"), R"(
+            Return the NUMA domain of a thread, or -1 if it is not pinned.
+
+            Args:
+                thread (int): The OpenMP thread index.
+
+            Returns:
+                (int): The domain index.
+
+        )")
+        .def("partition", &fba::Environment::partition, py::arg("n"), R"(
+            Split a range of indices between the threads.
+
+            Each NUMA domain gets a contiguous block in proportion to its
+            number of threads, which is split between those threads.
+
+            Args:
+                n (int): The number of indices.
+
+            Returns:
+                (list): The (start, stop) indices of each thread.
+
+        )")
+        .def("topology", &fba::Environment::topology, R"(
+            Describe the NUMA domains and the placement of the threads.
+
+            Returns:
+                (str): The domains, the affinity policy and the CPU on which
+                    each thread is running.
+
+        )");
+
+
+    py::class_ <fba::TaskPool,
+        std::unique_ptr<fba::TaskPool, py::nodelete> > (
+            m, "TaskPool", R"(
+        The work stealing task runtime.
+
+        The expensive per-tile loops of the compiled code run as tasks on
+        the OpenMP threads.  Idle threads steal queued tasks from the others,
+        and dense tiles are split into nested tasks.  This class gives access
+        to the load balance statistics of these loops.
+        )")
+        .def("get", [](){
+            return std::unique_ptr<fba::TaskPool, py::nodelete>
+                (&fba::TaskPool::get());
+            }, R"(
+            Get the instance of global singleton class.
+        )")
+        .def("nworker", &fba::TaskPool::nworker, R"(
+            Return the number of worker threads.
+        )")
+        .def("stats", [](fba::TaskPool const & self) {
+                py::list ret;
+                for (auto const & st : self.stats()) {
+                    py::dict d;
+                    d["name"] = st.name;
+                    d["runs"] = st.runs;
+                    d["nworker"] = st.nworker;
+                    d["roots"] = st.roots;
+                    d["tasks"] = st.tasks;
+                    d["elapsed"] = st.elapsed;
+                    d["max_task"] = st.max_task;
+                    d["worker_tasks"] = st.worker_tasks;
+                    d["worker_steals"] = st.worker_steals;
+                    d["worker_busy"] = st.worker_busy;
+                    d["imbalance"] = st.imbalance();
+                    ret.append(d);
+                }
+                return ret;
+            }, R"(
+            Load balance statistics of each named loop.
+
+            Returns:
+                (list): One dictionary per loop name, with the number of
+                    runs, the number of root tasks and of all tasks, the
+                    elapsed seconds, the longest root task, the tasks,
+                    steals and busy seconds of each worker, and the
+                    imbalance (the largest over the mean busy time).
+        )")
+        .def("clear_stats", &fba::TaskPool::clear_stats, R"(
+            Discard the load balance statistics.
+        )")
+        .def("report", &fba::TaskPool::report, R"(
+            Log the load balance statistics of each named loop.
         )");
 
 
@@ -682,6 +1081,27 @@ PYBIND11_MODULE(_internal, m) {
             py::arg("type"), R"(
             Dictionary of locations for each device type (POS or ETC).
         )")
+        .def("update_state", &fba::Hardware::update_state,
+            py::arg("location"), py::arg("status"), py::arg("theta_pos"),
+            py::arg("phi_pos"), R"(
+            Change the fiber state of some locations.
+
+            The fixed theta / phi angles are used for positioners which are
+            stuck or broken.  The targets available to each location, which
+            were computed when building TargetsAvailable, are not updated.
+            Use Assignment.update_fiber_state() to also repair an existing
+            assignment.
+
+            Args:
+                location (array):  The int32 locations to change.
+                status (array):  The new int32 fiber state bits.
+                theta_pos (array):  The fixed theta angles in degrees.
+                phi_pos (array):  The fixed phi angles in degrees.
+
+            Returns:
+                None
+
+        )")
         .def("time", &fba::Hardware::time, R"(
             Return the time used when loading the focalplane model.
 
@@ -974,6 +1394,33 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
 
+        )")
+        .def("collide_xy", &fba::Hardware::collide_xy, py::arg("loc1"),
+            py::arg("xy1"), py::arg("loc2"), py::arg("xy2"), R"(
+            Check two positioners for a collision.
+
+            Args:
+                loc1 (int): The first location.
+                xy1 (tuple): The (X, Y) tuple at which to place its fiber.
+                loc2 (int): The second location.
+                xy2 (tuple): The (X, Y) tuple at which to place its fiber.
+
+            Returns:
+                (bool): True if the positioners collide, or if either
+                    position cannot be reached.
+
+        )")
+        .def("collide_xy_edges", &fba::Hardware::collide_xy_edges,
+            py::arg("loc"), py::arg("xy"), R"(
+            Check a positioner for a collision with the GFA or petal edges.
+
+            Args:
+                loc (int): The location.
+                xy (tuple): The (X, Y) tuple at which to place the fiber.
+
+            Returns:
+                (bool): True if the positioner hits an edge.
+
         )")
         .def("loc_position_xy_multi", &fba::Hardware::loc_position_xy_multi,
             py::arg("loc"), py::arg("xy"), py::arg("threads"), R"(
@@ -1207,7 +1654,9 @@ PYBIND11_MODULE(_internal, m) {
         .def("is_safe", &fba::Target::is_safe, R"(
             Returns True if this is a safe target, else False.
         )")
-        .def("total_priority", &fba::Target::total_priority, R"(
+        .def("total_priority",
+            static_cast <double (fba::Target::*)() const>
+                (&fba::Target::total_priority), R"(
             Return the total priority based on PRIORITY, SUBPRIORITY, and obs remaining.
         )")
         .def("__repr__",
@@ -1264,7 +1713,7 @@ PYBIND11_MODULE(_internal, m) {
 
         )")
         .def("ids", [](fba::Targets & self) {
-                auto ntarg = self.data.size();
+                auto ntarg = self.rows.size();
                 // Create a numpy array to return
                 py::array_t < int64_t > ret;
                 ret.resize( {ntarg} );
@@ -1272,7 +1721,7 @@ PYBIND11_MODULE(_internal, m) {
                 int64_t * raw = static_cast < int64_t * > (info.ptr);
                 // Copy the target IDs into the numpy buffer
                 size_t indx = 0;
-                for (auto const & it : self.data) {
+                for (auto const & it : self.rows) {
                     raw[indx] = it.first;
                     indx++;
                 }
@@ -1283,12 +1732,13 @@ PYBIND11_MODULE(_internal, m) {
                 Returns an array of all target IDs.
         )")
         .def("get", [](fba::Targets & self, int64_t id) {
-                return self.data[id];
+                return self.data[self.row(id)];
             }, py::return_value_policy::reference_internal, py::arg("id"), R"(
             Get the specified target.
 
             Return a reference to the internal Target object with the
-            specified ID.
+            specified ID.  The reference is only valid until more targets
+            are appended.
 
             Args:
                 id (int): The target ID
@@ -1305,11 +1755,19 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 (str): The survey name.
 
+        )")
+        .def("memory_usage", &fba::Targets::memory_usage, R"(
+            Estimate the memory used by the target properties.
+
+            Returns:
+                (dict): The bytes used by the "data" (target properties),
+                    "rows" (target ID to row) and "science_classes" members.
+
         )")
         .def("__repr__",
             [](fba::Targets const & tgs) {
                 std::ostringstream o;
-                o << "<fiberassign.Targets with " << tgs.data.size() << " objects>";
+                o << "<fiberassign.Targets with " << tgs.rows.size() << " objects>";
                 return o.str();
             }
         );
@@ -1376,6 +1834,18 @@ PYBIND11_MODULE(_internal, m) {
         .def_readonly("order", &fba::Tiles::order, R"(
             Dictionary of tile index for each tile ID.
         )")
+        .def("append", &fba::Tiles::append, py::arg("other"), R"(
+            Append the tiles of another Tiles object.
+
+            The tile IDs must not already exist.
+
+            Args:
+                other (Tiles):  The tiles to append.
+
+            Returns:
+                None
+
+        )")
         .def("__repr__",
             [](fba::Tiles const & tls) {
                 std::ostringstream o;
@@ -1433,7 +1903,7 @@ PYBIND11_MODULE(_internal, m) {
                 std::vector <double> result_dec;
                 self.near(ra_deg, dec_deg, radius_rad, result);
                 for (int64_t targetid : result) {
-                    const fba::Target & t = targets->data[targetid];
+                    const fba::Target & t = targets->data[targets->row(targetid)];
                     if ((tile_obscond & t.obscond) == 0)
                         // Observing conditions required for target
                         // do not match this tile
@@ -1472,16 +1942,25 @@ PYBIND11_MODULE(_internal, m) {
             hw (Hardware):  The hardware model.
             objs (Targets):  The Targets.
             tiles (Tiles):  The tiles to consider.
-            tree (TargetTree):  The HTM tree of object positions.
-
-        )")
-        .def(py::init < fba::Hardware::pshr,
+            tile_targetid (dict):  For each tile ID, the array of target IDs
+                which may land on the tile.
+            tile_x (dict):  For each tile ID, the focalplane X positions of
+                the targets.
+            tile_y (dict):  For each tile ID, the focalplane Y positions of
+                the targets.
+            compact_xy (bool):  If True, store the target positions in single
+                precision.  All reachability and collision checks then use
+                the single precision values.
+
+        )")
+        .def(py::init < fba::Hardware::pshr, fba::Targets::pshr,
              fba::Tiles::pshr, std::map<int64_t, std::vector<int64_t> >,
              std::map<int64_t, std::vector<double> >,
-             std::map<int64_t, std::vector<double> >
-             > (), py::arg("hw"),
+             std::map<int64_t, std::vector<double> >, bool
+             > (), py::arg("hw"), py::arg("objs"),
              py::arg("tiles"), py::arg("tile_targetid"),
-             py::arg("tile_x"), py::arg("tile_y")
+             py::arg("tile_x"), py::arg("tile_y"),
+             py::arg("compact_xy") = false
         )
         .def("hardware", &fba::TargetsAvailable::hardware, R"(
             Return a handle to the Hardware object used.
@@ -1489,6 +1968,12 @@ PYBIND11_MODULE(_internal, m) {
         .def("tiles", &fba::TargetsAvailable::tiles, R"(
             Return a handle to the Tiles object used.
         )")
+        .def("targets", &fba::TargetsAvailable::targets, R"(
+            Return a handle to the Targets object used.
+        )")
+        .def("compact_xy", &fba::TargetsAvailable::compact_xy, R"(
+            Return True if target positions are stored in single precision.
+        )")
         .def("tile_data", &fba::TargetsAvailable::tile_data,
             py::return_value_policy::reference_internal, py::arg("tile"), R"(
             Return the targets available for a given tile.
@@ -1504,6 +1989,33 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 (dict): Dictionary of available targets for each location.
 
+        )")
+        .def("tile_type_data", &fba::TargetsAvailable::tile_type_data,
+            py::arg("tile"), py::arg("tgtype"), py::arg("remaining")=false, R"(
+            Return the targets of one type available for a given tile.
+
+            The lists keep the order of tile_data().  Every location of the
+            tile is included, even if it has no targets of this type.
+
+            Args:
+                tile (int): The tile ID.
+                tgtype (int): The target type (a single bit).
+                remaining (bool): If True and tgtype is science, only
+                    include the targets with observations remaining.
+
+            Returns:
+                (dict): Dictionary of available targets for each location.
+
+        )")
+        .def("memory_usage", &fba::TargetsAvailable::memory_usage, R"(
+            Estimate the memory used by the available targets.
+
+            Returns:
+                (dict): The bytes used by the "data" (targets available to
+                    each tile / location), "tile_xy" (projected target
+                    positions) and "type_data" (the same split by target
+                    type) members.
+
         )");
 
 
@@ -1534,8 +2046,45 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 (list): List of (tile, loc) tuples.
 
+        )")
+        .def("memory_usage", &fba::LocationsAvailable::memory_usage, R"(
+            Estimate the memory used by the available locations.
+
+            Returns:
+                (dict): The bytes used by the "data" (tile / locations
+                    available to each target) and "tile_index" members.
+
         )");
 
+    m.def("sort_target_weights", [](std::vector <double> const & weights,
+                                    bool ascending, size_t radix_min) {
+            std::vector <fba::target_weight> tw(weights.size());
+            for (size_t i = 0; i < weights.size(); ++i) {
+                tw[i] = std::make_pair(static_cast <int32_t> (i), weights[i]);
+            }
+            fba::sort_target_weights(tw, ascending, radix_min);
+            std::vector <int32_t> ret(tw.size());
+            for (size_t i = 0; i < tw.size(); ++i) {
+                ret[i] = tw[i].first;
+            }
+            return ret;
+        }, py::arg("weights"), py::arg("ascending") = false,
+        py::arg("radix_min") = TARGET_WEIGHT_RADIX_MIN, R"(
+        Stable sort of target weights, as used by the assignment.
+
+        Args:
+            weights (array):  The weights.
+            ascending (bool):  Sort from lowest to highest instead of from
+                highest to lowest.
+            radix_min (int):  Lists with at least this many weights are
+                sorted with a radix sort instead of std::stable_sort.  The
+                result is the same either way.
+
+        Returns:
+            (list): The indices of the weights in sorted order.
+
+    )");
+
 
     py::class_ <fba::Assignment, fba::Assignment::pshr > (m,
         "Assignment", R"(
@@ -1597,13 +2146,198 @@ PYBIND11_MODULE(_internal, m) {
                 (dict): Dictionary of assigned target for each location.
 
         )")
+        .def("tile_matching", &fba::Assignment::tile_matching,
+            py::arg("tile"), py::arg("tgtype")=TARGET_TYPE_SCIENCE,
+            py::arg("pos_type")=std::string("POS"),
+            py::arg("use_zero_obsremain")=false, R"(
+            Return the first step of the "matching" solver on one tile.
+
+            This is the maximum priority matching of the available targets
+            to the unassigned locations of the tile, before collisions and
+            the petal / slitblock limits are checked.  Nothing is assigned.
+
+            Args:
+                tile (int): The tile ID.
+                tgtype (int): The target type.
+                pos_type (str): The type of positioner to match.
+                use_zero_obsremain (bool): If True, include targets with no
+                    observations remaining.
+
+            Returns:
+                (dict): The matched target ID of each location.
+
+        )")
+        .def("reassign_stats", &fba::Assignment::reassign_stats, R"(
+            Return counters of the work done when reassigning science targets.
+
+            The keys are "calls" (the number of reassignment attempts),
+            "candidates" (the tile / location pairs available to those
+            targets), "skipped" (candidates on tiles before the start of the
+            search, skipped without being examined), and "checked" (the
+            candidates passed to the collision checks).
+
+            Returns:
+                (dict): The counter values.
+
+        )")
+        .def("memory_usage", &fba::Assignment::memory_usage, R"(
+            Estimate the memory used by the assignment.
+
+            The projected target positions are shared with, and reported by,
+            the TargetsAvailable object.  State which is shared with forks is
+            divided between them.
+
+            Returns:
+                (dict): The bytes used by the "tile_state" (assignment of
+                    each tile), "target_loc" (tile / location of each
+                    target), "obsremain" and "journal" members.
+
+        )")
+        .def("reset_reassign_stats", &fba::Assignment::reset_reassign_stats,
+            R"(
+            Reset the reassignment counters to zero.
+        )")
+        .def("counts", [](fba::Assignment const & self, int32_t start_tile,
+                          int32_t stop_tile) {
+                fba::AssignmentCounts cnt = self.counts(start_tile, stop_tile);
+                size_t ntile = cnt.tile.size();
+                size_t ntype = cnt.types.size();
+                size_t npetal = cnt.npetal;
+                size_t nslit = cnt.nslitblock;
+                auto to_array = [](std::vector <int32_t> const & data,
+                                   std::vector <size_t> const & shape) {
+                    py::array_t <int32_t> ret(shape);
+                    py::buffer_info info = ret.request();
+                    int32_t * raw = static_cast <int32_t *> (info.ptr);
+                    std::copy(data.begin(), data.end(), raw);
+                    return ret;
+                };
+                py::array_t <uint8_t> types(ntype);
+                py::buffer_info info = types.request();
+                uint8_t * raw = static_cast <uint8_t *> (info.ptr);
+                std::copy(cnt.types.begin(), cnt.types.end(), raw);
+                py::dict ret;
+                ret["types"] = types;
+                ret["tile"] = to_array(cnt.tile, {ntile});
+                ret["type"] = to_array(cnt.type, {ntile, ntype});
+                ret["science_only"] = to_array(cnt.science_only, {ntile});
+                ret["petal"] = to_array(cnt.petal, {ntile, ntype, npetal});
+                ret["slitblock"] = to_array(cnt.slitblock,
+                                            {ntile, ntype, npetal, nslit});
+                return ret;
+            }, py::arg("start_tile") = -1, py::arg("stop_tile") = -1, R"(
+            Return the counts of assigned locations as numpy arrays.
+
+            These counts are kept up to date by every assignment, so this
+            only copies them.  A target which has several types (for
+            example a science target which is also a standard) is counted
+            for each of them.  Locations stuck on a good sky position count
+            as sky.
+
+            Args:
+                start_tile (int): Start with this tile ID (default -1 starts
+                    with the first tile).
+                stop_tile (int): Stop with this tile ID (default -1 ends
+                    with the last tile).
+
+            Returns:
+                (dict): "types" is the array of target types along the type
+                    axis (science, standard, sky, suppsky, safe).  "tile" has
+                    the tile IDs in tile order, "type" the counts per
+                    [tile, type], "science_only" the science targets which
+                    are not standards per tile, "petal" the counts per
+                    [tile, type, petal] and "slitblock" the counts per
+                    [tile, type, petal, slitblock].
+
+        )")
+        .def("pass_stats", &fba::Assignment::pass_stats, R"(
+            Return counters of the work done by the assignment passes.
+
+            The keys are "candidates" (location / target pairs considered),
+            "ok_to_assign" (calls to the checks before each assignment),
+            "collisions" (pairs rejected by those checks because of a
+            collision with a neighbor or the petal / GFA edges), "bumps"
+            (science targets removed to make room for another target),
+            "reassignments" (science targets moved to another tile),
+            "assigned" and "unassigned" (every change of the assignment).
+            The counters are cheap to keep and are always enabled.
+
+            Returns:
+                (dict): The counter values.
+
+        )")
+        .def("reset_pass_stats", &fba::Assignment::reset_pass_stats, R"(
+            Reset the pass counters to zero.
+        )")
+        .def("begin", &fba::Assignment::begin, R"(
+            Open a transaction.
+
+            Every assignment and unassignment made after this call is
+            recorded until the matching commit() or rollback().
+            Transactions may be nested.  Targets cannot be added, removed or
+            updated while a transaction is open.
+
+            Returns:
+                None
+
+        )")
+        .def("commit", &fba::Assignment::commit, R"(
+            Close the innermost transaction and keep its changes.
+
+            The changes are still undone by a rollback() of an enclosing
+            transaction.
+
+            Returns:
+                None
+
+        )")
+        .def("rollback", &fba::Assignment::rollback, R"(
+            Close the innermost transaction and undo its changes.
+
+            The assignments, counts and remaining observations are restored
+            to their state when the transaction began.
+
+            Returns:
+                None
+
+        )")
+        .def("transaction_depth", &fba::Assignment::transaction_depth, R"(
+            The number of open transactions.
+
+            Returns:
+                (int): The transaction depth.
+
+        )")
+        .def("fork", &fba::Assignment::fork, R"(
+            Return an independent copy of this assignment.
+
+            The hardware, tiles, targets and target availability are shared,
+            and the assignment of each tile is only copied when the fork or
+            this assignment modifies it.  Forks can be used to compare
+            different options starting from the same assignment, and the
+            assignment methods release the GIL so that forks can run
+            concurrently in different threads.
+
+            The observations remaining for each target are tracked by the
+            fork and are not written to the shared Targets object.  Targets
+            cannot be added, removed or updated while forks exist.
+
+            Returns:
+                (Assignment): The new assignment.
+
+        )")
+        .def("is_fork", &fba::Assignment::is_fork, R"(
+            Returns True if this assignment was created by fork().
+        )")
         .def("assign_unused", &fba::Assignment::assign_unused,
+             py::call_guard <py::gil_scoped_release> (),
              py::arg("tgtype")=TARGET_TYPE_SCIENCE,
              py::arg("max_per_petal")=-1,
              py::arg("max_per_slitblock")=-1,
              py::arg("pos_type")=std::string("POS"),
              py::arg("start_tile")=-1, py::arg("stop_tile")=-1,
-             py::arg("use_zero_obsremain")=false, R"(
+             py::arg("use_zero_obsremain")=false,
+             py::arg("solver")=std::string("greedy"), R"(
             Assign targets to unused locations.
 
             This will attempt to assign targets of the specified type to
@@ -1624,12 +2358,20 @@ PYBIND11_MODULE(_internal, m) {
                     in the sequence of tiles.
                 use_zero_obsremain (bool): If True, and tgtype is science targets,
                     then consider science targets with < 1 observation remaining.
+                solver (str): The per-tile method.  "greedy" assigns targets
+                    in priority order to their closest free location.
+                    "petal" gives the same result as "greedy", but works on
+                    the petals of a tile in parallel threads.  "matching"
+                    first finds a maximum priority matching of targets to
+                    locations, moving earlier targets to other locations
+                    when that frees room for more targets.
 
             Returns:
                 None
 
         )")
         .def("assign_force", &fba::Assignment::assign_force,
+             py::call_guard <py::gil_scoped_release> (),
              py::arg("tgtype")=TARGET_TYPE_SCIENCE,
              py::arg("required_per_petal")=0,
              py::arg("required_per_slitblock")=0,
@@ -1655,8 +2397,39 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
 
+        )")
+        .def("assign_unused_sky", &fba::Assignment::assign_unused_sky,
+             py::call_guard <py::gil_scoped_release> (),
+             py::arg("max_per_petal")=-1, py::arg("max_per_slitblock")=-1,
+             py::arg("pos_type")=std::string("POS"),
+             py::arg("start_tile")=-1, py::arg("stop_tile")=-1, R"(
+            Assign sky and suppsky targets to unused locations.
+
+            This does the work of calling assign_unused() for TARGET_TYPE_SKY
+            and then TARGET_TYPE_SUPPSKY, once with the per-slitblock limit
+            and once with the per-petal limit.  The available targets of each
+            type are found and sorted once per tile and shared by all of the
+            steps, and a target / location pair that fails the collision
+            checks is not checked again on that tile.
+
+            Args:
+                max_per_petal (int): Limit the assignment to this many objects
+                    per petal.  Default is no limit.
+                max_per_slitblock (int): Limit the assignment to this many
+                    objects per slitblock.  Default is no limit.
+                pos_type (str): Only consider this positioner device type.
+                    Default is "POS".
+                start_tile (int): Start assignment at this tile ID in the
+                    sequence of tiles.
+                stop_tile (int): Stop assignment at this tile ID (inclusive)
+                    in the sequence of tiles.
+
+            Returns:
+                None
+
         )")
         .def("redistribute_science", &fba::Assignment::redistribute_science,
+             py::call_guard <py::gil_scoped_release> (),
              py::arg("start_tile")=-1, py::arg("stop_tile")=-1, R"(
             Redistribute science targets to future tiles.
 
@@ -1673,6 +2446,177 @@ PYBIND11_MODULE(_internal, m) {
             Returns:
                 None
 
+        )")
+        .def("refine", &fba::Assignment::refine,
+             py::call_guard <py::gil_scoped_release> (),
+             py::arg("time_budget")=-1.0, py::arg("max_depth")=2,
+             py::arg("start_tile")=-1, py::arg("stop_tile")=-1, R"(
+            Improve the science assignment with a local search.
+
+            On each tile, science targets with observations remaining which
+            are not assigned are placed by moving a chain of up to max_depth
+            assigned science targets to other reachable locations.  If no
+            such chain exists, the lowest priority science target at a
+            reachable location is replaced if its priority is lower.
+            Standards are never moved.  Passes over the tiles repeat until
+            nothing changes or the time budget is used.
+
+            Args:
+                time_budget (float): Stop after this many seconds.  A value
+                    <= 0 means no limit.
+                max_depth (int): The maximum number of assigned targets moved
+                    to place one new target.
+                start_tile (int): Start at this tile ID in the sequence of
+                    tiles.
+                stop_tile (int): Stop at this tile ID (inclusive) in the
+                    sequence of tiles.
+
+            Returns:
+                (dict): The number of passes ("sweeps"), targets added
+                    ("added"), targets moved ("shifted"), targets replaced
+                    ("ejected") and the total gain in priority ("priority").
+
+        )")
+        .def("add_targets", &fba::Assignment::add_targets,
+             py::arg("tile_targetids"), py::arg("tile_x"), py::arg("tile_y"),
+             R"(
+            Add new targets to the existing tiles.
+
+            The targets must already have been appended to the Targets object
+            used by this assignment.  The inputs have the same form as the
+            output of targets_in_tiles(), and may contain only the new
+            targets.  Only the tile / locations that can reach the new targets
+            are updated, and all current assignments are preserved.  Targets
+            already available on a tile are skipped.
+
+            Args:
+                tile_targetids (dict): For each tile ID, the array of new
+                    target IDs.
+                tile_x (dict): For each tile ID, the array of focalplane X
+                    positions of the new targets.
+                tile_y (dict): For each tile ID, the array of focalplane Y
+                    positions of the new targets.
+
+            Returns:
+                None
+
+        )")
+        .def("add_tiles", &fba::Assignment::add_tiles,
+             py::arg("tiles"), py::arg("tile_targetids"), py::arg("tile_x"),
+             py::arg("tile_y"), py::arg("stuck_sky") =
+             std::map<int32_t, std::map<int32_t,bool> >(), R"(
+            Add a new batch of tiles to the assignment.
+
+            The tiles are appended to the Tiles object shared by this
+            assignment and its available targets and locations.  The
+            availability of the existing tiles is reused, and only the new
+            tiles are projected and indexed.  The new tiles start with
+            nothing assigned, and a later assignment pass restricted to them
+            (with start_tile) leaves the existing tiles alone.
+
+            Args:
+                tiles (Tiles): The new tiles.  The tile IDs must not already
+                    exist.
+                tile_targetids (dict): For each new tile ID, the array of
+                    target IDs reachable on that tile.  The targets must exist
+                    in the Targets object.
+                tile_x (dict): For each new tile ID, the array of focalplane
+                    X positions of the targets.
+                tile_y (dict): For each new tile ID, the array of focalplane
+                    Y positions of the targets.
+                stuck_sky (dict): For each new tile ID, a dict of location to
+                    whether a stuck positioner lands on good sky.
+
+            Returns:
+                None
+
+        )")
+        .def("observe", &fba::Assignment::observe,
+             py::arg("tiles"), py::arg("observed"), R"(
+            Record the observation of some tiles.
+
+            The assignment of these tiles is kept and frozen: later assignment
+            passes, redistribution and refinement skip them.  Targets
+            assigned on these tiles which are not in the observed list get
+            that observation back, so that they can be assigned on a later
+            tile.  Call update_targets() afterwards to apply any new
+            priorities.
+
+            Args:
+                tiles (array): The observed tile IDs.
+                observed (array): The target IDs which were successfully
+                    observed on these tiles.
+
+            Returns:
+                None
+
+        )")
+        .def("update_fiber_state", &fba::Assignment::update_fiber_state,
+             py::arg("locs"), py::arg("states"), py::arg("theta_pos"),
+             py::arg("phi_pos"), R"(
+            Change the fiber state of some locations and repair the assignment.
+
+            The state is changed in the Hardware object shared by this
+            assignment (see Hardware.update_state()).  On every tile which is
+            not observed, targets on locations which are now stuck or broken
+            are unassigned, and the neighbors of those locations are checked
+            for collisions with the fixed arm.  Only the freed locations are
+            then refilled with science targets from the existing target
+            availability.  Standards, sky, suppsky and safe targets are not
+            placed here, since their per-petal and per-slitblock limits are
+            not known.  Call assign_unused() for those types afterwards, with
+            the same limits as the original run.  Locations which were
+            already stuck or broken when the TargetsAvailable was built have
+            no available targets.  Stuck positioners on good sky are not
+            counted as sky fibers.
+
+            Args:
+                locs (array): The int32 locations to change.
+                states (array): The new int32 fiber state bits.
+                theta_pos (array): The fixed theta angles in degrees.
+                phi_pos (array): The fixed phi angles in degrees.
+
+            Returns:
+                (dict): The number of locations unassigned ("unassigned"),
+                    neighbors unassigned after a collision ("collisions") and
+                    locations refilled ("refilled").
+
+        )")
+        .def("remove_targets", &fba::Assignment::remove_targets,
+             py::arg("ids"), R"(
+            Remove targets from the assignment and the Targets object.
+
+            Any locations assigned to these targets are unassigned, and the
+            targets are removed from the available target lists.  All other
+            assignments are preserved.
+
+            Args:
+                ids (array): The target IDs to remove.
+
+            Returns:
+                None
+
+        )")
+        .def("update_targets", &fba::Assignment::update_targets,
+             py::arg("ids"), py::arg("obsremain"), py::arg("priority"),
+             py::arg("subpriority"), R"(
+            Update the properties of existing targets.
+
+            The obsremain values are the number of remaining observations
+            before this assignment.  Observations already assigned to a target
+            on tiles which have not been observed are subtracted from the new
+            value.
+
+            Args:
+                ids (array): The target IDs to update.
+                obsremain (array): The new int32 number of remaining
+                    observations.
+                priority (array): The new int32 priorities.
+                subpriority (array): The new float64 subpriorities.
+
+            Returns:
+                None
+
         )");
 
 
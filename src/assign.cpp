@@ -3,6 +3,8 @@
 #include <assign.h>
 
 #include <algorithm>
+#include <chrono>
+#include <set>
 #include <sstream>
 #include <iostream>
 #include <cstdio>
@@ -20,15 +22,12 @@ fba::Assignment::Assignment(fba::Targets::pshr tgs,
     tm.start();
 
     fba::GlobalTimers & gtm = fba::GlobalTimers::get();
-    std::ostringstream gtmname;
 
-    fba::Logger & logger = fba::Logger::get();
     std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
 
-    gtmname.str("");
-    gtmname << "Assignment ctor: total";
-    gtm.start(gtmname.str());
+    static int32_t const gtm_total_region = gtm.region(
+        "Assignment ctor: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
 
     tgs_ = tgs;
     tgsavail_ = tgsavail;
@@ -38,125 +37,105 @@ fba::Assignment::Assignment(fba::Targets::pshr tgs,
     tiles_ = tgsavail_->tiles();
     hw_ = tgsavail_->hardware();
 
-    // Initialize assignment counts
-
-    std::vector <uint8_t> tgtypes;
-    tgtypes.push_back(TARGET_TYPE_SCIENCE);
-    tgtypes.push_back(TARGET_TYPE_STANDARD);
-    tgtypes.push_back(TARGET_TYPE_SKY);
-    tgtypes.push_back(TARGET_TYPE_SUPPSKY);
-    tgtypes.push_back(TARGET_TYPE_SAFE);
-
-    tile_target_xy.clear();
+    // Location types
 
-    size_t ntile = tiles_->id.size();
-    for (auto const & tp : tgtypes) {
-        nassign_tile[tp].clear();
-        nassign_petal[tp].clear();
-        nassign_slitblock[tp].clear();
-        for (size_t t = 0; t < ntile; ++t) {
-            int32_t tile_id = tiles_->id[t];
-            nassign_tile[tp][tile_id] = 0;
-            nassign_petal[tp][tile_id].clear();
-            for (int32_t p = 0; p < hw_->npetal; ++p) {
-                nassign_petal[tp][tile_id][p] = 0;
-            }
-            for (int32_t p = 0; p < hw_->npetal; ++p) {
-                nassign_slitblock[tp][tile_id][p].clear();
-                for (int32_t s = 0; s < hw_->nslitblock; ++s) {
-                    nassign_slitblock[tp][tile_id][p][s] = 0;
-                }
-            }
-            tile_target_xy[tile_id].clear();
-            if (tp != TARGET_TYPE_SKY)
-                continue;
-            // for any stuck positioners that land on good sky,
-            // increment the counter
-            // None on this tile?
-            if (stuck_sky.count(tile_id)==0)
-                continue;
-            for (auto & st : stuck_sky[tile_id]) {
-                // st: < loc_id, bool >
-                int32_t loc = st.first;
-                bool good_sky = st.second;
-                if (!good_sky)
-                    continue;
-                int32_t petal = hw_->loc_petal[loc];
-                int32_t slitblock = hw_->loc_slitblock[loc];
-                if (slitblock == -1) {
-                    // ETC fiber
-                    if (extra_log) {
-                        logmsg.str("");
-                        logmsg << "tile " << tile_id << " loc " << loc
-                               << " petal " << petal << " slitblock " << slitblock
-                               << " is type " << hw_->loc_device_type[loc];
-                        logger.debug_tfg(tile_id, loc, -1, logmsg.str().c_str());
-                    }
-                    continue;
-                }
-                nassign_tile .at(tp).at(tile_id)++;
-                nassign_petal.at(tp).at(tile_id).at(petal)++;
-                nassign_slitblock.at(tp).at(tile_id).at(petal).at(slitblock)++;
-                if (extra_log) {
-                    logmsg.str("");
-                    logmsg << "tile " << tile_id << " loc " << loc
-                           << " on petal " << petal << ", slitblock "
-                           << slitblock << " is STUCK on a good sky.";
-                    logger.debug_tfg(tile_id, loc, -1, logmsg.str().c_str());
-                }
-            }
+    int32_t maxloc = 0;
+    for (auto const & loc : hw_->locations) {
+        if (loc > maxloc) {
+            maxloc = loc;
         }
     }
+    loc_pos_.assign(maxloc + 1, false);
+    for (auto const & loc : hw_->locations) {
+        loc_pos_[loc] = (hw_->loc_device_type.at(loc) == "POS");
+    }
 
-    loc_target.clear();
-    target_loc.clear();
-
-    auto const * ptiles = tiles_.get();
-    auto const * ptgsavail = tgsavail_.get();
-
-    gtmname.str("");
-    gtmname << "Assignment ctor: project targets";
-    gtm.start(gtmname.str());
-
-    #pragma omp parallel for schedule(dynamic) default(none) shared(ntile, ptiles, ptgsavail, logmsg, logger)
-    for (size_t t = 0; t < ntile; ++t) {
-        int32_t tile_id = ptiles->id[t];
-        std::map <int64_t, std::pair <double, double> > local_xy;
+    // Initialize assignment counts
 
-        auto loc_targetid = ptgsavail->data.at(tile_id);
-        auto loc_targetxy = ptgsavail->data_xy.at(tile_id);
+    // The tile and target state is initialized in parallel, so that with
+    // pinned threads it is spread over the NUMA domains in the same way as
+    // the available targets.
 
-        // loc -> vector(targetid)
-        auto it_ids = loc_targetid.begin();
-        // loc -> vector(x,y)
-        auto it_xys = loc_targetxy.begin();
-        for (; it_ids != loc_targetid.end(); it_ids++, it_xys++) {
-            auto it_id = it_ids->second.begin();
-            auto it_xy = it_xys->second.begin();
-            for (; it_id != it_ids->second.end(); it_id++, it_xy++)
-                local_xy[*it_id] = *it_xy;
-        }
-        #pragma omp critical
-        {
-            logmsg.str("");
-            logmsg << "projected targets for tile " << tile_id;
-            logger.debug(logmsg.str().c_str());
-            tile_target_xy.at(tile_id) = local_xy;
-        }
+    size_t ntile = tiles_->id.size();
+    tile_state_.resize_local(ntile);
+    TaskPool::get().run("Assignment ctor: tiles", ntile, [&](size_t t) {
+        init_tile(t, stuck_sky);
+    });
+
+    size_t ntarget = tgs_->data.size();
+    target_loc.resize_local(ntarget);
+    obsremain_.resize_local(ntarget);
+    for (size_t r = 0; r < ntarget; ++r) {
+        obsremain_.mut(r) = tgs_->data[r].obsremain;
     }
 
-    gtm.stop(gtmname.str());
+    is_fork_ = false;
+    family_ = std::make_shared <int> (0);
 
-    gtmname.str("");
-    gtmname << "Assignment ctor: total";
-    gtm.stop(gtmname.str());
+    reset_reassign_stats();
+
+    pass_stats_.resize(std::max(1, Environment::get().max_threads()));
+    reset_pass_stats();
 
     logmsg.str("");
-    logmsg << "Assignment constructor project targets";
+    logmsg << "Assignment constructor";
     tm.stop();
     tm.report(logmsg.str().c_str());
 }
 
+
+void fba::Assignment::init_tile(size_t tile_order,
+    std::map <int32_t, std::map <int32_t, bool> > const & stuck_sky) {
+
+    int32_t tile_id = tiles_->id[tile_order];
+    auto & tstate = tile_state_.mut(tile_order);
+    tstate.loc_target.clear();
+    tstate.loc_used.assign(loc_pos_.size(), false);
+    tstate.observed = false;
+    tstate.nassign.fill(0);
+    tstate.nassign_petal.assign(ASSIGN_COUNT_TYPES * hw_->npetal, 0);
+    tstate.nassign_slitblock.assign(
+        ASSIGN_COUNT_TYPES * hw_->npetal * hw_->nslitblock, 0);
+    tstate.nscience_only = 0;
+    // for any stuck positioners that land on good sky,
+    // increment the counter
+    // None on this tile?
+    auto stile = stuck_sky.find(tile_id);
+    if (stile == stuck_sky.end()) {
+        return;
+    }
+    int32_t tp = count_index(TARGET_TYPE_SKY);
+    for (auto const & st : stile->second) {
+        // st: < loc_id, bool >
+        int32_t loc = st.first;
+        bool good_sky = st.second;
+        if (!good_sky)
+            continue;
+        // This runs on several threads, so the hardware maps must not be
+        // modified.  Unknown locations get the default of zero.
+        auto pit = hw_->loc_petal.find(loc);
+        int32_t petal = (pit == hw_->loc_petal.end()) ? 0 : pit->second;
+        auto sit = hw_->loc_slitblock.find(loc);
+        int32_t slitblock = (sit == hw_->loc_slitblock.end()) ? 0 : sit->second;
+        if (slitblock == -1) {
+            // ETC fiber
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, loc, -1, 0, 0,
+                "tile " << tile_id << " loc " << loc
+                << " petal " << petal << " slitblock " << slitblock
+                << " is type " << hw_->loc_device_type.at(loc));
+            continue;
+        }
+        tstate.nassign[tp]++;
+        tstate.nassign_petal[petal_slot(tp, petal)]++;
+        tstate.nassign_slitblock[slitblock_slot(tp, petal, slitblock)]++;
+        FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, loc, -1, 0, 0,
+            "tile " << tile_id << " loc " << loc
+            << " on petal " << petal << ", slitblock "
+            << slitblock << " is STUCK on a good sky.");
+    }
+    return;
+}
+
 std::map< int32_t, std::map< std::string, int32_t > >
 fba::Assignment::get_counts(int32_t start_tile, int32_t stop_tile) {
     int32_t tstart;
@@ -178,37 +157,270 @@ fba::Assignment::get_counts(int32_t start_tile, int32_t stop_tile) {
 
         counts[tile_id].clear();
 
-        int n_sci_not_std = 0;
-        // count targets that are SCIENCE and not STANDARD
-        for (auto const & it : loc_target[tile_id]) {
-            int64_t target_id = it.second;
-            auto &tgobj = tgs_->data.at(target_id);
-            bool is_sci = tgobj.is_type(TARGET_TYPE_SCIENCE);
-            bool is_std = tgobj.is_type(TARGET_TYPE_STANDARD);
-            if (is_sci && !is_std)
-                n_sci_not_std++;
-        }
-        counts[tile_id]["SCIENCE"] = nassign_tile[TARGET_TYPE_SCIENCE][tile_id];
-        counts[tile_id]["SCIENCE not STANDARD"] = n_sci_not_std;
-        counts[tile_id]["STANDARD"] = nassign_tile[TARGET_TYPE_STANDARD][tile_id];
-        counts[tile_id]["SKY"] = nassign_tile[TARGET_TYPE_SKY][tile_id];
-        counts[tile_id]["SUPPSKY"] = nassign_tile[TARGET_TYPE_SUPPSKY][tile_id];
-        counts[tile_id]["SAFE"] = nassign_tile[TARGET_TYPE_SAFE][tile_id];
+        auto const & tstate = tile_state_[t];
+
+        auto const & nassign = tstate.nassign;
+        counts[tile_id]["SCIENCE"] = nassign[count_index(TARGET_TYPE_SCIENCE)];
+        counts[tile_id]["SCIENCE not STANDARD"] = tstate.nscience_only;
+        counts[tile_id]["STANDARD"] = nassign[count_index(TARGET_TYPE_STANDARD)];
+        counts[tile_id]["SKY"] = nassign[count_index(TARGET_TYPE_SKY)];
+        counts[tile_id]["SUPPSKY"] = nassign[count_index(TARGET_TYPE_SUPPSKY)];
+        counts[tile_id]["SAFE"] = nassign[count_index(TARGET_TYPE_SAFE)];
     }
     return counts;
 }
 
 std::vector <int32_t> fba::Assignment::tiles_assigned() const {
     std::vector <int32_t> ret;
-    for (auto const & it : loc_target) {
-        ret.push_back(it.first);
+    for (size_t t = 0; t < tiles_->id.size(); ++t) {
+        if (tile_state_[t].loc_target.size() > 0) {
+            ret.push_back(tiles_->id[t]);
+        }
+    }
+    return ret;
+}
+
+
+fba::Assignment::tile_state const & fba::Assignment::tile_data(int32_t tile)
+    const {
+    return tile_state_[tiles_->order.at(tile)];
+}
+
+
+fba::Assignment::tile_state & fba::Assignment::tile_data_mut(int32_t tile) {
+    return tile_state_.mut(tiles_->order.at(tile));
+}
+
+
+fba::TileTargetXY const & fba::Assignment::tile_target_xy(int32_t tile) const {
+    return tgsavail_->tile_xy.at(tile);
+}
+
+
+std::map <std::string, int64_t> fba::Assignment::memory_usage() const {
+    std::map <std::string, int64_t> ret;
+    ret["tile_state"] = tile_state_.memory_bytes();
+    ret["target_loc"] = target_loc.memory_bytes();
+    ret["obsremain"] = obsremain_.memory_bytes();
+    ret["journal"] = heap_bytes(journal_) + heap_bytes(journal_marks_);
+    return ret;
+}
+
+
+std::map <std::string, int64_t> fba::Assignment::reassign_stats() const {
+    std::map <std::string, int64_t> ret;
+    ret["calls"] = reassign_calls_;
+    ret["candidates"] = reassign_candidates_;
+    ret["skipped"] = reassign_skipped_;
+    ret["checked"] = reassign_checked_;
+    return ret;
+}
+
+
+void fba::Assignment::reset_reassign_stats() {
+    reassign_calls_ = 0;
+    reassign_candidates_ = 0;
+    reassign_skipped_ = 0;
+    reassign_checked_ = 0;
+    return;
+}
+
+
+std::vector <uint8_t> fba::Assignment::count_types() {
+    return std::vector <uint8_t> {
+        TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD,
+        TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY, TARGET_TYPE_SAFE};
+}
+
+
+int32_t fba::Assignment::count_index(uint8_t tgtype) {
+    switch (tgtype) {
+        case TARGET_TYPE_SCIENCE:
+            return 0;
+        case TARGET_TYPE_STANDARD:
+            return 1;
+        case TARGET_TYPE_SKY:
+            return 2;
+        case TARGET_TYPE_SUPPSKY:
+            return 3;
+        case TARGET_TYPE_SAFE:
+            return 4;
+        default:
+            break;
+    }
+    std::ostringstream logmsg;
+    logmsg << "target type " << (int)tgtype << " has no assignment counts";
+    fba::Logger::get().error(logmsg.str().c_str());
+    throw std::runtime_error(logmsg.str().c_str());
+    return -1;
+}
+
+
+fba::AssignmentCounts fba::Assignment::counts(int32_t start_tile,
+                                              int32_t stop_tile) const {
+    int32_t tstart = 0;
+    int32_t tstop = tiles_->id.size() - 1;
+    if (start_tile >= 0) {
+        tstart = tiles_->order.at(start_tile);
+    }
+    if (stop_tile >= 0) {
+        tstop = tiles_->order.at(stop_tile);
+    }
+
+    fba::AssignmentCounts ret;
+    ret.types = count_types();
+    ret.npetal = hw_->npetal;
+    ret.nslitblock = hw_->nslitblock;
+    for (int32_t t = tstart; t <= tstop; ++t) {
+        auto const & tstate = tile_state_[t];
+        ret.tile.push_back(tiles_->id[t]);
+        ret.type.insert(ret.type.end(), tstate.nassign.begin(),
+                        tstate.nassign.end());
+        ret.science_only.push_back(tstate.nscience_only);
+        ret.petal.insert(ret.petal.end(), tstate.nassign_petal.begin(),
+                         tstate.nassign_petal.end());
+        ret.slitblock.insert(ret.slitblock.end(),
+                             tstate.nassign_slitblock.begin(),
+                             tstate.nassign_slitblock.end());
+    }
+    return ret;
+}
+
+
+std::string fba::Assignment::pass_stat_name(int32_t stat) {
+    static const std::vector <std::string> names = {
+        "candidates", "ok_to_assign", "collisions", "bumps",
+        "reassignments", "assigned", "unassigned"};
+    return names.at(stat);
+}
+
+
+std::map <std::string, int64_t> fba::Assignment::pass_stats() const {
+    std::map <std::string, int64_t> ret;
+    for (int32_t st = 0; st < PASS_STAT_COUNT; ++st) {
+        int64_t tot = 0;
+        for (auto const & w : pass_stats_) {
+            tot += w[st];
+        }
+        ret[pass_stat_name(st)] = tot;
+    }
+    return ret;
+}
+
+
+void fba::Assignment::reset_pass_stats() {
+    for (auto & w : pass_stats_) {
+        w.fill(0);
+    }
+    return;
+}
+
+
+void fba::Assignment::begin() {
+    journal_marks_.push_back(journal_.size());
+    return;
+}
+
+
+void fba::Assignment::commit() {
+    if (journal_marks_.empty()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::string msg("commit() called with no open transaction");
+        logger.error(msg.c_str());
+        throw std::runtime_error(msg.c_str());
+    }
+    journal_marks_.pop_back();
+    if (journal_marks_.empty()) {
+        // The outermost transaction is done, nothing can be undone now.
+        journal_.clear();
+    }
+    return;
+}
+
+
+void fba::Assignment::rollback() {
+    if (journal_marks_.empty()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::string msg("rollback() called with no open transaction");
+        logger.error(msg.c_str());
+        throw std::runtime_error(msg.c_str());
+    }
+    size_t mark = journal_marks_.back();
+    journal_marks_.pop_back();
+
+    // Suspend recording while undoing the operations.
+    std::vector <size_t> marks;
+    marks.swap(journal_marks_);
+
+    for (size_t j = journal_.size(); j > mark; --j) {
+        auto const & entry = journal_[j - 1];
+        if (entry.assign) {
+            unassign_tileloc(hw_.get(), tgs_.get(), entry.tile, entry.loc,
+                entry.type);
+        } else {
+            assign_tileloc(hw_.get(), tgs_.get(), entry.tile, entry.loc,
+                entry.target, entry.type);
+        }
+    }
+    journal_.resize(mark);
+
+    journal_marks_.swap(marks);
+    return;
+}
+
+
+int32_t fba::Assignment::transaction_depth() const {
+    return journal_marks_.size();
+}
+
+
+void fba::Assignment::check_no_transaction(char const * caller) const {
+    if (! journal_marks_.empty()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::ostringstream msg;
+        msg << caller << "() cannot be used inside a transaction";
+        logger.error(msg.str().c_str());
+        throw std::runtime_error(msg.str().c_str());
     }
+    return;
+}
+
+
+fba::Assignment::pshr fba::Assignment::fork() const {
+    // Copying the block tables shares all tile and target state.
+    fba::Assignment::pshr ret(new fba::Assignment(*this));
+    ret->is_fork_ = true;
+    ret->journal_.clear();
+    ret->journal_marks_.clear();
     return ret;
 }
 
 
-std::map <int32_t, int64_t> const & fba::Assignment::tile_location_target(int32_t tile) const {
-    return loc_target.at(tile);
+bool fba::Assignment::is_fork() const {
+    return is_fork_;
+}
+
+
+void fba::Assignment::check_no_fork(char const * caller) const {
+    // The targets and their availability are shared with the forks.
+    if (is_fork_ || (family_.use_count() > 1)) {
+        fba::Logger & logger = fba::Logger::get();
+        std::ostringstream msg;
+        msg << caller << "() cannot be used with a forked assignment";
+        logger.error(msg.str().c_str());
+        throw std::runtime_error(msg.str().c_str());
+    }
+    return;
+}
+
+
+std::map <int32_t, int64_t> fba::Assignment::tile_location_target(int32_t tile) const {
+    // Translate target rows back to IDs.
+    std::map <int32_t, int64_t> ret;
+    for (auto const & it : tile_data(tile).loc_target) {
+        ret[it.first] = tgs_->data[it.second].id;
+    }
+    return ret;
 }
 
 
@@ -216,30 +428,53 @@ void fba::Assignment::tile_available(
     int32_t tile_id,
     uint8_t tgtype,
     std::vector <int32_t> const & locs,
-    std::map <int32_t, std::vector <target_weight> > & tile_target_avail,
-    std::map <int64_t, std::vector <location_weight> > & tile_loc_avail,
+    tile_target_map & tile_target_avail,
+    tile_location_map & tile_loc_avail,
     std::vector <target_weight> & tile_target_weights,
-    bool use_zero_obsremain
+    bool use_zero_obsremain,
+    std::vector <int32_t> * tile_target_locs
 ) const {
-    // Reset output objects
+    // Reset output objects.  Once both maps are empty nothing refers to
+    // their arena, which can then be reused for this tile.
     tile_target_avail.clear();
     tile_loc_avail.clear();
+    ScratchArena * arena = tile_loc_avail.get_allocator().arena();
+    if (tile_target_avail.get_allocator().arena() == arena) {
+        arena->reset();
+    }
     tile_target_weights.clear();
+    if (tile_target_locs != NULL) {
+        tile_target_locs->clear();
+    }
 
     // positioner center locations in curved coordinates
     auto const & loc_pos = hw_->loc_pos_curved_mm;
 
+    auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
+
+    // Iterate over the precomputed rows of this target type where possible,
+    // rather than filtering the full availability list on every pass.  The
+    // lists of science targets with observations remaining follow the
+    // Targets object, which is not updated by forks.
+    bool remaining = (tgtype == TARGET_TYPE_SCIENCE) && ! use_zero_obsremain
+        && ! is_fork_;
+
     auto const & tile_loctg = tgsavail_->data.at(tile_id);
+    auto const & tile_types = tgsavail_->type_data.at(tile_id);
     for (auto const & loc : locs) {
-        for (auto const & tgid : tile_loctg.at(loc)) {
-            auto const & tg = tgs_->data.at(tgid);
+        auto const * lrows = tile_types.at(loc).type_rows(tgtype, remaining);
+        if (lrows == NULL) {
+            lrows = &(tile_loctg.at(loc));
+        }
+        for (auto const & tgrow : (*lrows)) {
+            auto const & tg = tgs_->data[tgrow];
             if ( ! tg.is_type(tgtype)) {
                 // This is not the correct target type.
                 continue;
             }
             if (
                 (tgtype == TARGET_TYPE_SCIENCE)
-                && (tg.obsremain <= 0)
+                && (obsremain_[tgrow] <= 0)
                 && ! use_zero_obsremain
             ) {
                 // Done observing science observations for this target, and we are
@@ -249,16 +484,19 @@ void fba::Assignment::tile_available(
             // distance from target to positioner
             double dist = fbg::dist(
                 loc_pos.at(loc),
-                tile_target_xy.at(tile_id).at(tgid)
+                target_xy.xy(tgrow)
             );
-            double tot_priority = tg.total_priority();
-            tile_loc_avail[tgid].push_back(std::make_pair(loc, dist));
+            double tot_priority = tg.total_priority(obsremain_[tgrow]);
+            tile_loc_avail[tgrow].push_back(std::make_pair(loc, dist));
             tile_target_avail[loc].push_back(
-                std::make_pair(tgid, tot_priority)
+                std::make_pair(tgrow, tot_priority)
             );
             tile_target_weights.push_back(
-                std::make_pair(tgid, tot_priority)
+                std::make_pair(tgrow, tot_priority)
             );
+            if (tile_target_locs != NULL) {
+                tile_target_locs->push_back(loc);
+            }
         }
     }
 
@@ -269,9 +507,8 @@ void fba::Assignment::tile_available(
     }
 
     // Sort available targets for each location by total priority
-    target_weight_compare tg_comp;
     for (auto & loctg : tile_target_avail) {
-        std::stable_sort(loctg.second.begin(), loctg.second.end(), tg_comp);
+        sort_target_weights(loctg.second);
     }
 
     return;
@@ -283,14 +520,15 @@ int32_t fba::Assignment::petal_count(
     int32_t tile,
     int32_t petal
 ) const {
-    int32_t ret = nassign_petal.at(tgtype).at(tile).at(petal);
+    auto const & npetal = tile_data(tile).nassign_petal;
+    int32_t ret = npetal[petal_slot(count_index(tgtype), petal)];
     // If assigning SUPP_SKY targets, also include the "regular"
     // sky count on this petal and vice-versa.
     if (tgtype == TARGET_TYPE_SUPPSKY) {
-        ret += nassign_petal.at(TARGET_TYPE_SKY).at(tile).at(petal);
+        ret += npetal[petal_slot(count_index(TARGET_TYPE_SKY), petal)];
     }
     if (tgtype == TARGET_TYPE_SKY) {
-        ret += nassign_petal.at(TARGET_TYPE_SUPPSKY).at(tile).at(petal);
+        ret += npetal[petal_slot(count_index(TARGET_TYPE_SUPPSKY), petal)];
     }
     return ret;
 }
@@ -340,14 +578,18 @@ int32_t fba::Assignment::slitblock_count(
                << ", slitblock " << slitblock;
         throw std::runtime_error(logmsg.str().c_str());
     }
-    int32_t ret = nassign_slitblock.at(tgtype).at(tile).at(petal).at(slitblock);
+    auto const & nslitblock = tile_data(tile).nassign_slitblock;
+    int32_t ret = nslitblock[slitblock_slot(count_index(tgtype), petal,
+                                            slitblock)];
     // If assigning SUPP_SKY targets, also include the "regular"
     // sky count on this slitblock and vice-versa.
     if (tgtype == TARGET_TYPE_SUPPSKY) {
-        ret += nassign_slitblock.at(TARGET_TYPE_SKY).at(tile).at(petal).at(slitblock);
+        ret += nslitblock[slitblock_slot(count_index(TARGET_TYPE_SKY), petal,
+                                         slitblock)];
     }
     if (tgtype == TARGET_TYPE_SKY) {
-        ret += nassign_slitblock.at(TARGET_TYPE_SUPPSKY).at(tile).at(petal).at(slitblock);
+        ret += nslitblock[slitblock_slot(count_index(TARGET_TYPE_SUPPSKY),
+                                         petal, slitblock)];
     }
     return ret;
 }
@@ -370,19 +612,27 @@ void fba::Assignment::assign_unused(uint8_t tgtype, int32_t max_per_petal,
                                     int32_t max_per_slitblock,
                                     std::string const & pos_type,
                                     int32_t start_tile, int32_t stop_tile,
-                                    bool use_zero_obsremain) {
+                                    bool use_zero_obsremain,
+                                    std::string const & solver) {
     fba::Timer tm;
     tm.start();
 
     fba::GlobalTimers & gtm = fba::GlobalTimers::get();
-    std::ostringstream gtmname;
 
     fba::Logger & logger = fba::Logger::get();
     std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
 
     std::string tgstr = fba::target_string(tgtype);
 
+    if ((solver != "greedy") && (solver != "petal")
+        && (solver != "matching")) {
+        logmsg.str("");
+        logmsg << "assign unused " << tgstr << ":  unknown solver \""
+            << solver << "\"";
+        logger.error(logmsg.str().c_str());
+        throw std::runtime_error(logmsg.str().c_str());
+    }
+
     // Select locations based on positioner type
     auto device_locs = hw_->device_locations(pos_type);
 
@@ -392,9 +642,7 @@ void fba::Assignment::assign_unused(uint8_t tgtype, int32_t max_per_petal,
         << " locations of positioner type \"" << pos_type << "\"";
     logger.info(logmsg.str().c_str());
 
-    gtmname.str("");
-    gtmname << "unused " << tgstr << ": total";
-    gtm.start(gtmname.str());
+    GlobalTimerScope gtm_total(gtm.region("unused " + tgstr + ": total"));
 
     if (max_per_petal < 0) {
         // A negative value indicates that there is no limit.
@@ -425,52 +673,58 @@ void fba::Assignment::assign_unused(uint8_t tgtype, int32_t max_per_petal,
         << stop_tile << " (index " << tstop << ")";
     logger.info(logmsg.str().c_str());
 
-    // Per-tile target availability objects (reset for each tile)
-    std::map <int32_t, std::vector <target_weight> > tile_target_avail;
-    std::map <int64_t, std::vector <location_weight> > tile_loc_avail;
+    // Per-tile target availability objects (reset for each tile).  The
+    // maps allocate from the arena, which is reused for every tile.
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
     std::vector <target_weight> tile_target_weights;
 
+    // Locations of each tile that are unassigned (reset for each tile)
+    std::vector <int32_t> loc_unassigned;
+
+    int32_t gtm_avail = gtm.region(
+        "unused " + tgstr + ": local tile availability");
+
     for (int32_t t = tstart; t <= tstop; ++t) {
         int32_t tile_id = tiles_->id[t];
         double tile_ra = tiles_->ra[t];
         double tile_dec = tiles_->dec[t];
 
-        logmsg.str("");
-        logmsg << "assign unused " << tgstr << ": working on tile " << tile_id
-            << " at RA/DEC = " << tile_ra << " / " << tile_dec;
-        logger.debug(logmsg.str().c_str());
+        FBA_LOG_DEBUG("assign unused " << tgstr << ": working on tile " << tile_id
+            << " at RA/DEC = " << tile_ra << " / " << tile_dec);
+
+        if (tile_data(tile_id).observed) {
+            // Observed tiles are frozen.
+            continue;
+        }
 
         if ((tgsavail_->data.count(tile_id) == 0)
             || (tgsavail_->data.at(tile_id).size() == 0)) {
             // No targets available for the whole tile.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "assign unused " << tgstr << ": tile " << tile_id
-                    << " at RA/DEC = " << tile_ra << ", " << tile_dec
-                    << ": no available targets";
-                logger.debug_tfg(tile_id, -1, -1, logmsg.str().c_str());
-            }
+            FBA_TRACE_TFG(TRACE_NO_TARGETS, tile_id, -1, -1, 0, 0,
+                "assign unused " << tgstr << ": tile " << tile_id
+                << " at RA/DEC = " << tile_ra << ", " << tile_dec
+                << ": no available targets");
             continue;
         }
 
-        gtmname.str("");
-        gtmname << "unused " << tgstr << ": local tile availability";
-        gtm.start(gtmname.str());
+        gtm.start(gtm_avail);
 
         // Compute the locations which are currently unassigned.
 
-        std::vector <int32_t> loc_unassigned;
+        loc_unassigned.clear();
+        auto const & tile_assign = tile_data(tile_id).loc_target;
         for (auto const & loc : device_locs) {
-            if ((loc_target[tile_id].count(loc) == 0) ||
-                (loc_target[tile_id].at(loc) < 0)) {
+            if ((tile_assign.count(loc) == 0) ||
+                (tile_assign.at(loc) < 0)) {
                 loc_unassigned.push_back(loc);
             }
         }
 
-        logmsg.str("");
-        logmsg << "assign unused " << tgstr << ": tile " << tile_id
-            << " considering " << loc_unassigned.size() << " unassigned locations";
-        logger.debug(logmsg.str().c_str());
+        FBA_LOG_DEBUG("assign unused " << tgstr << ": tile " << tile_id
+            << " considering " << loc_unassigned.size() << " unassigned locations");
 
         // Available targets for this tile.  We copy this per-tile data so that
         // we can manipulate it and avoid searching over locations that have already
@@ -488,95 +742,29 @@ void fba::Assignment::assign_unused(uint8_t tgtype, int32_t max_per_petal,
 
         // Sort targets by total priority from highest to lowest.
 
-        target_weight_compare tg_compare;
-        std::stable_sort(
-            tile_target_weights.begin(),
-            tile_target_weights.end(),
-            tg_compare
-        );
-
-        logmsg.str("");
-        logmsg << "assign unused " << tgstr << ": tile " << tile_id << " has "
-            << tile_target_weights.size() << " available targets for these locs";
-        logger.debug(logmsg.str().c_str());
-
-        gtm.stop(gtmname.str());
+        sort_target_weights(tile_target_weights);
 
-        // Reference to projected target X/Y locations for this tile.
-        auto const & target_xy = tile_target_xy.at(tile_id);
-
-        // Locations available to a single target, declared here and reused to avoid
-        // repeated memory allocation.
-        std::vector <int32_t> loc_avail;
+        FBA_LOG_DEBUG("assign unused " << tgstr << ": tile " << tile_id << " has "
+            << tile_target_weights.size() << " available targets for these locs");
 
-        // Assign targets in priority order to available positioners.
+        gtm.stop(gtm_avail);
 
         int32_t nsuccess = 0;
 
-        for (auto const & tgwit : tile_target_weights) {
-            // This target ID
-            auto const & tgid = tgwit.first;
-            // This weight
-            auto const & tgweight = tgwit.second;
-
-            // Look at available locations.  These are already sorted from
-            // closest to furthest.
-            loc_avail.clear();
-            for (auto const & locwt : tile_loc_avail.at(tgid)) {
-                if ((loc_target[tile_id].count(locwt.first) > 0) &&
-                    (loc_target[tile_id].at(locwt.first) >= 0)) {
-                    // Already assigned
-                    continue;
-                }
-                loc_avail.push_back(locwt.first);
-            }
-
-            // For each available location from closest to furthest...
-            for (auto const & loc : loc_avail) {
-                // The petal of this location
-                int32_t p = hw_->loc_petal.at(loc);
-                // Check petal count limits
-                if (max_per_petal && petal_count_max(tgtype, max_per_petal, tile_id, p)) {
-                    continue;
-                }
-
-                // The slitblock of this location
-                int32_t s = hw_->loc_slitblock.at(loc);
-                // Check slitblock count limits, if applicable
-                if ((s >= 0) &&
-                    slitblock_count_max(tgtype, max_per_slitblock, tile_id, p, s)) {
-                    continue;
-                }
-
-                // Can we assign this location to the target?
-                if (ok_to_assign(hw_.get(), tile_id, loc, tgid, target_xy)) {
-                    // Yes, assign it
-                    assign_tileloc(
-                        hw_.get(), tgs_.get(), tile_id, loc, tgid, tgtype
-                    );
-                    nsuccess++;
-                } else {
-                    // There must be a collision or some other problem.
-                    if (extra_log) {
-                        logmsg.str("");
-                        logmsg << "assign unused " << tgstr
-                            << ": target " << tgid << ", weight = " << tgweight
-                            << ": tile " << tile_id << ", loc " << loc
-                            << " NOT ok to assign";
-                        logger.debug_tfg(tile_id, loc, tgid, logmsg.str().c_str());
-                    }
-                }
-            }
+        if (solver == "greedy") {
+            nsuccess = assign_tile_greedy(tile_id, tgtype, max_per_petal,
+                max_per_slitblock, tile_loc_avail, tile_target_weights);
+        } else if (solver == "petal") {
+            nsuccess = assign_tile_petal(tile_id, tgtype, max_per_petal,
+                max_per_slitblock, tile_loc_avail, tile_target_weights);
+        } else {
+            nsuccess = assign_tile_matching(tile_id, tgtype, max_per_petal,
+                max_per_slitblock, tile_loc_avail, tile_target_weights);
         }
-        logmsg.str("");
-        logmsg << "assign unused " << tgstr << ": tile " << tile_id
-            << " had " << nsuccess << " successful assignments";
-        logger.debug(logmsg.str().c_str());
-    }
 
-    gtmname.str("");
-    gtmname << "unused " << tgstr << ": total";
-    gtm.stop(gtmname.str());
+        FBA_LOG_DEBUG("assign unused " << tgstr << ": tile " << tile_id
+            << " had " << nsuccess << " successful assignments");
+    }
 
     logmsg.str("");
     if ((max_per_petal < 1000000) && (max_per_slitblock < 1000000)) {
@@ -599,123 +787,815 @@ void fba::Assignment::assign_unused(uint8_t tgtype, int32_t max_per_petal,
 }
 
 
-// In the case where we have fewer or a comparable number of targets as tile / fibers
-// to assign, the early tiles will be dominated by the high priority targets and later
-// tiles will have the lower priority targets and may be sparsely populated.
-//
-// When bumping science targets to place sky and standards, this will result in some
-// science targets being bumped and left unassigned.  Instead, this function
-// pro-actively moves science targets to available future tile / fibers when the
-// future petal has fewer science assignments.  This will redistribute the science
-// targets more evenly so that placement of standards and sky will require less
-// bumping.
+int32_t fba::Assignment::assign_tile_greedy(int32_t tile_id, uint8_t tgtype,
+    int32_t max_per_petal, int32_t max_per_slitblock,
+    tile_location_map const & tile_loc_avail,
+    std::vector <target_weight> const & tile_target_weights,
+    std::set <std::pair <int32_t, int32_t> > * rejected) {
 
-void fba::Assignment::redistribute_science(int32_t start_tile,
-                                           int32_t stop_tile) {
-    fba::Timer tm;
-    tm.start();
+    std::string tgstr = fba::target_string(tgtype);
 
-    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
-    std::ostringstream gtmname;
+    // Reference to projected target X/Y locations for this tile.
+    auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
 
-    fba::Logger & logger = fba::Logger::get();
-    std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
+    // Locations available to a single target, declared here and reused to avoid
+    // repeated memory allocation.
+    std::vector <int32_t> loc_avail;
 
-    gtmname.str("");
-    gtmname << "redistribute science: total";
-    gtm.start(gtmname.str());
+    // Assign targets in priority order to available positioners.
 
-    // Select locations that are science positioners
-    auto device_locs = hw_->device_locations("POS");
+    int32_t nsuccess = 0;
 
-    // Determine our range of tiles
-    int32_t tstart;
-    int32_t tstop;
-    if (start_tile < 0) {
-        tstart = 0;
-    } else {
-        tstart = tiles_->order.at(start_tile);
-    }
-    if (stop_tile < 0) {
-        tstop = tiles_->id.size() - 1;
-    } else {
-        tstop = tiles_->order.at(stop_tile);
-    }
+    for (auto const & tgwit : tile_target_weights) {
+        // This target row
+        auto const & tgrow = tgwit.first;
+        // This weight
+        auto const & tgweight = tgwit.second;
 
-    logmsg.str("");
-    logmsg << "redist:  working on tiles "
-        << start_tile << " (index " << tstart << ") to "
-        << stop_tile << " (index " << tstop << ")";
-    logger.info(logmsg.str().c_str());
+        // Look at available locations.  These are already sorted from
+        // closest to furthest.
+        loc_avail.clear();
+        auto const & tile_assign = tile_data(tile_id).loc_target;
+        for (auto const & locwt : tile_loc_avail.at(tgrow)) {
+            if ((tile_assign.count(locwt.first) > 0) &&
+                (tile_assign.at(locwt.first) >= 0)) {
+                // Already assigned
+                continue;
+            }
+            loc_avail.push_back(locwt.first);
+        }
+        count_pass(PASS_STAT_CANDIDATES, loc_avail.size());
 
-    for (int32_t t = tstart; t <= tstop; ++t) {
-        int32_t tile_id = tiles_->id[t];
-        double tile_ra = tiles_->ra[t];
-        double tile_dec = tiles_->dec[t];
+        // For each available location from closest to furthest...
+        for (auto const & loc : loc_avail) {
+            // The petal of this location
+            int32_t p = hw_->loc_petal.at(loc);
+            // Check petal count limits
+            if (max_per_petal && petal_count_max(tgtype, max_per_petal, tile_id, p)) {
+                continue;
+            }
 
-        logmsg.str("");
-        logmsg << "redist: working on tile " << tile_id
-            << " at RA/DEC = " << tile_ra << " / " << tile_dec;
-        logger.debug(logmsg.str().c_str());
+            // The slitblock of this location
+            int32_t s = hw_->loc_slitblock.at(loc);
+            // Check slitblock count limits, if applicable
+            if ((s >= 0) &&
+                slitblock_count_max(tgtype, max_per_slitblock, tile_id, p, s)) {
+                continue;
+            }
 
-        if (nassign_tile[TARGET_TYPE_SCIENCE][tile_id] == 0) {
-            // Skip tiles that are fully unassigned.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "redist: tile " << tile_id
-                    << " at RA/DEC = " << tile_ra << ", " << tile_dec
-                    << ": no available targets";
-                logger.debug_tfg(tile_id, -1, -1, logmsg.str().c_str());
+            if ((rejected != NULL)
+                && (rejected->count(std::make_pair(loc, tgrow)) > 0)) {
+                // Already failed the checks below.
+                continue;
+            }
+
+            // Can we assign this location to the target?
+            if (ok_to_assign(hw_.get(), tile_id, loc, tgrow, target_xy)) {
+                // Yes, assign it
+                assign_tileloc(
+                    hw_.get(), tgs_.get(), tile_id, loc, tgrow, tgtype
+                );
+                nsuccess++;
+            } else {
+                if (rejected != NULL) {
+                    rejected->insert(std::make_pair(loc, tgrow));
+                }
+                // There must be a collision or some other problem.
+                FBA_TRACE_TFG(TRACE_NOT_OK, tile_id, loc,
+                    tgs_->data[tgrow].id, 0, 0,
+                    "assign unused " << tgstr
+                    << ": target " << tgs_->data[tgrow].id << ", weight = " << tgweight
+                    << ": tile " << tile_id << ", loc " << loc
+                    << " NOT ok to assign");
             }
-            continue;
         }
+    }
 
-        // Compute the weighting of the assigned science targets.
+    return nsuccess;
+}
 
-        std::vector <target_weight> science_targets;
 
-        for (auto const & loc : device_locs) {
-            if ((loc_target[tile_id].count(loc) > 0) &&
-                (loc_target[tile_id].at(loc) >= 0)) {
-                // We have something assigned here...
-                auto tgid = loc_target[tile_id].at(loc);
-                auto const & tg = tgs_->data.at(tgid);
-                if (tg.is_science() && (! tg.is_standard())) {
-                    // This is a science target and NOT a standard (we don't
+void fba::Assignment::match_tile(int32_t tile_id,
+    tile_location_map const & tile_loc_avail,
+    std::vector <target_weight> const & tile_target_weights,
+    std::vector <int32_t> & tgrows, std::vector <int32_t> & tg_match) const {
+
+    // Every location that can reach a target gives the same weight (the
+    // target priority), so the sets of targets which can be matched to
+    // distinct locations form a transversal matroid.  Adding targets in
+    // priority order, and keeping each one that can be matched along an
+    // augmenting path (which may move previously matched targets to other
+    // locations), gives a maximum weight matching.  Collisions are ignored
+    // here.
+
+    // Unique targets in priority order, with their location lists.  Stuck or
+    // broken locations can never be assigned, so they are excluded from the
+    // matching.
+    tgrows.clear();
+    std::vector <std::vector <int32_t> > tglocs;
+    std::set <int32_t> seen;
+    for (auto const & tgwit : tile_target_weights) {
+        int32_t tgrow = tgwit.first;
+        if (seen.count(tgrow) > 0) {
+            continue;
+        }
+        seen.insert(tgrow);
+        if (target_loc[tgrow].count(tile_id) > 0) {
+            continue;
+        }
+        tgrows.push_back(tgrow);
+        tglocs.emplace_back();
+        auto & locs = tglocs.back();
+        for (auto const & locwt : tile_loc_avail.at(tgrow)) {
+            int32_t st = hw_->state.at(locwt.first);
+            if ((st & FIBER_STATE_STUCK) || (st & FIBER_STATE_BROKEN)) {
+                continue;
+            }
+            locs.push_back(locwt.first);
+        }
+    }
+
+    int32_t ntg = tgrows.size();
+    tg_match.assign(ntg, -1);
+    std::vector <int32_t> loc_match(loc_pos_.size(), -1);
+    std::vector <int32_t> loc_visit(loc_pos_.size(), 0);
+    int32_t visit_stamp = 1;
+
+    // Depth first search for an augmenting path, with an explicit stack.
+    // Each frame holds the target, the next location to try, and the
+    // location through which the target was reached.
+    struct search_frame {
+        int32_t tg;
+        size_t next;
+        int32_t via;
+    };
+    std::vector <search_frame> stack;
+
+    int32_t nmatch = 0;
+
+    for (int32_t root = 0; root < ntg; ++root) {
+        stack.clear();
+        stack.push_back({root, 0, -1});
+        bool found = false;
+        while ((! stack.empty()) && (! found)) {
+            auto & frame = stack.back();
+            auto const & locs = tglocs[frame.tg];
+            if (frame.next >= locs.size()) {
+                stack.pop_back();
+                continue;
+            }
+            int32_t loc = locs[frame.next++];
+            if (loc_visit[loc] == visit_stamp) {
+                continue;
+            }
+            loc_visit[loc] = visit_stamp;
+            if (loc_match[loc] < 0) {
+                // Free location.  Shift the targets along the path.
+                int32_t cur = loc;
+                for (size_t f = stack.size(); f > 0; --f) {
+                    auto const & fr = stack[f - 1];
+                    loc_match[cur] = fr.tg;
+                    tg_match[fr.tg] = cur;
+                    cur = fr.via;
+                }
+                found = true;
+            } else {
+                stack.push_back({loc_match[loc], 0, loc});
+            }
+        }
+        if (found) {
+            nmatch++;
+            // The matching changed, so previously visited locations may now
+            // lead to a free location.  After a failed search they cannot.
+            visit_stamp++;
+        }
+    }
+
+    FBA_LOG_DEBUG("match tile " << tile_id << ": matched " << nmatch
+        << " of " << ntg << " targets");
+
+    return;
+}
+
+
+std::map <int32_t, int64_t> fba::Assignment::tile_matching(int32_t tile,
+    uint8_t tgtype, std::string const & pos_type,
+    bool use_zero_obsremain) const {
+
+    std::map <int32_t, int64_t> ret;
+    if ((tiles_->order.count(tile) == 0)
+        || (tgsavail_->data.count(tile) == 0)) {
+        return ret;
+    }
+
+    // The same inputs as assign_unused() for this tile.
+    std::vector <int32_t> loc_unassigned;
+    auto const & tile_assign = tile_data(tile).loc_target;
+    for (auto const & loc : hw_->device_locations(pos_type)) {
+        if ((tile_assign.count(loc) == 0) || (tile_assign.at(loc) < 0)) {
+            loc_unassigned.push_back(loc);
+        }
+    }
+
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
+    std::vector <target_weight> tile_target_weights;
+    tile_available(tile, tgtype, loc_unassigned, tile_target_avail,
+        tile_loc_avail, tile_target_weights, use_zero_obsremain);
+    sort_target_weights(tile_target_weights);
+
+    std::vector <int32_t> tgrows;
+    std::vector <int32_t> tg_match;
+    match_tile(tile, tile_loc_avail, tile_target_weights, tgrows, tg_match);
+    for (size_t i = 0; i < tgrows.size(); ++i) {
+        if (tg_match[i] >= 0) {
+            ret[tg_match[i]] = tgs_->data[tgrows[i]].id;
+        }
+    }
+    return ret;
+}
+
+
+int32_t fba::Assignment::assign_tile_matching(int32_t tile_id, uint8_t tgtype,
+    int32_t max_per_petal, int32_t max_per_slitblock,
+    tile_location_map const & tile_loc_avail,
+    std::vector <target_weight> const & tile_target_weights) {
+
+    auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
+
+    std::vector <int32_t> tgrows;
+    std::vector <int32_t> tg_match;
+    match_tile(tile_id, tile_loc_avail, tile_target_weights, tgrows, tg_match);
+    int32_t ntg = tgrows.size();
+
+    // Assign the matched pairs in priority order, checking collisions and
+    // the petal / slitblock limits.
+
+    int32_t nsuccess = 0;
+    for (int32_t i = 0; i < ntg; ++i) {
+        int32_t loc = tg_match[i];
+        if (loc < 0) {
+            continue;
+        }
+        count_pass(PASS_STAT_CANDIDATES);
+        int32_t p = hw_->loc_petal.at(loc);
+        if (max_per_petal && petal_count_max(tgtype, max_per_petal, tile_id, p)) {
+            continue;
+        }
+        int32_t s = hw_->loc_slitblock.at(loc);
+        if ((s >= 0) &&
+            slitblock_count_max(tgtype, max_per_slitblock, tile_id, p, s)) {
+            continue;
+        }
+        if (ok_to_assign(hw_.get(), tile_id, loc, tgrows[i], target_xy)) {
+            assign_tileloc(
+                hw_.get(), tgs_.get(), tile_id, loc, tgrows[i], tgtype
+            );
+            nsuccess++;
+        }
+    }
+
+    // Targets which could not be placed at their matched location (due to
+    // collisions or limits) are offered the remaining free locations with
+    // the greedy method.
+    std::vector <target_weight> remaining;
+    for (auto const & tgwit : tile_target_weights) {
+        if (target_loc[tgwit.first].count(tile_id) == 0) {
+            remaining.push_back(tgwit);
+        }
+    }
+    nsuccess += assign_tile_greedy(tile_id, tgtype, max_per_petal,
+        max_per_slitblock, tile_loc_avail, remaining);
+
+    return nsuccess;
+}
+
+
+int32_t fba::Assignment::assign_tile_petal(int32_t tile_id, uint8_t tgtype,
+    int32_t max_per_petal, int32_t max_per_slitblock,
+    tile_location_map const & tile_loc_avail,
+    std::vector <target_weight> const & tile_target_weights) {
+
+    // This gives exactly the same result as assign_tile_greedy().  The choice
+    // for one target depends only on the locations it can reach and their
+    // neighbors, so targets whose locations (and neighbors) are all on one
+    // petal only interact with other targets of that petal.  Each petal
+    // works through its own targets in priority order, concurrently with the
+    // other petals, and stops at the next target shared with another petal.
+    // A shared target is placed serially once every petal it touches has
+    // reached it.  The decisions are made on a dense copy of the tile
+    // assignment and the assignments are made afterwards in priority order.
+
+
+    std::string tgstr = fba::target_string(tgtype);
+
+    auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
+
+    int32_t nloc = loc_pos_.size();
+
+    int32_t npetal = 0;
+    int32_t nslitblock = 0;
+    for (auto const & it : hw_->loc_petal) {
+        if (it.second + 1 > npetal) {
+            npetal = it.second + 1;
+        }
+    }
+    for (auto const & it : hw_->loc_slitblock) {
+        if (it.second + 1 > nslitblock) {
+            nslitblock = it.second + 1;
+        }
+    }
+    if ((npetal > 32) || (fba::Environment::get().current_threads() < 2)) {
+        // The petal sets below are bitmasks.  With one thread the scheduling
+        // is pure overhead.
+        return assign_tile_greedy(tile_id, tgtype, max_per_petal,
+            max_per_slitblock, tile_loc_avail, tile_target_weights);
+    }
+
+    // The petals touched by assigning each location: its own and those of
+    // its neighbors.
+    std::vector <uint32_t> loc_zone(nloc, 0);
+    for (auto const & it : hw_->loc_petal) {
+        uint32_t zone = (1u << it.second);
+        if (hw_->neighbors.count(it.first) > 0) {
+            for (auto const & nb : hw_->neighbors.at(it.first)) {
+                zone |= (1u << hw_->loc_petal.at(nb));
+            }
+        }
+        loc_zone[it.first] = zone;
+    }
+
+    // Dense copy of the tile assignment.
+    std::vector <int32_t> tile_assign(nloc, -1);
+    for (auto const & it : tile_data(tile_id).loc_target) {
+        tile_assign[it.first] = it.second;
+    }
+
+    // Counts added during this call, per petal and slitblock.
+    std::vector <int32_t> petal_add(npetal, 0);
+    std::vector <std::vector <int32_t> > slitblock_add(
+        npetal, std::vector <int32_t> (nslitblock, 0)
+    );
+
+    // The count increment used by the petal and slitblock limits for each
+    // assigned target.  This matches petal_count() and slitblock_count().
+    auto count_inc = [&](int32_t tgrow) {
+        auto const & tg = tgs_->data[tgrow];
+        int32_t inc = tg.is_type(tgtype) ? 1 : 0;
+        if ((tgtype == TARGET_TYPE_SUPPSKY) && tg.is_type(TARGET_TYPE_SKY)) {
+            inc++;
+        }
+        if ((tgtype == TARGET_TYPE_SKY) && tg.is_type(TARGET_TYPE_SUPPSKY)) {
+            inc++;
+        }
+        return inc;
+    };
+
+    // Split the targets by petal.  All entries for one target row have the
+    // same locations, so they go to the same petals.  Track whether each row
+    // is already assigned on this tile through its first entry.
+    size_t nitem = tile_target_weights.size();
+    std::vector <uint32_t> item_zone(nitem, 0);
+    std::vector <size_t> item_first(nitem, 0);
+    std::vector <char> placed(nitem, 0);
+    std::vector <std::vector <size_t> > queue(npetal);
+    {
+        std::map <int32_t, size_t> first;
+        for (size_t i = 0; i < nitem; ++i) {
+            int32_t tgrow = tile_target_weights[i].first;
+            auto fit = first.find(tgrow);
+            if (fit == first.end()) {
+                first[tgrow] = i;
+                item_first[i] = i;
+                if (target_loc[tgrow].count(tile_id) > 0) {
+                    placed[i] = 1;
+                }
+            } else {
+                item_first[i] = fit->second;
+            }
+            uint32_t zone = 0;
+            for (auto const & locwt : tile_loc_avail.at(tgrow)) {
+                zone |= loc_zone[locwt.first];
+            }
+            item_zone[i] = zone;
+            for (int32_t p = 0; p < npetal; ++p) {
+                if (zone & (1u << p)) {
+                    queue[p].push_back(i);
+                }
+            }
+        }
+    }
+
+    // The (target entry, location) pairs accepted by each petal, and by the
+    // serial steps in the last slot.
+    std::vector <std::vector <std::pair <size_t, int32_t> > > accepted(npetal + 1);
+
+    // Available locations of one entry.  Each slot runs on one thread at a
+    // time, so it can reuse its own list.
+    std::vector <std::vector <int32_t> > slot_loc_avail(npetal + 1);
+
+    // The same steps as the loop in assign_tile_greedy() for one entry.
+    auto place_entry = [&](size_t i, int32_t slot) {
+        int32_t tgrow = tile_target_weights[i].first;
+        double tgweight = tile_target_weights[i].second;
+        auto & loc_avail = slot_loc_avail[slot];
+        loc_avail.clear();
+        for (auto const & locwt : tile_loc_avail.at(tgrow)) {
+            if (tile_assign[locwt.first] >= 0) {
+                // Already assigned
+                continue;
+            }
+            loc_avail.push_back(locwt.first);
+        }
+        count_pass(PASS_STAT_CANDIDATES, loc_avail.size());
+        for (auto const & loc : loc_avail) {
+            int32_t p = hw_->loc_petal.at(loc);
+            if (max_per_petal
+                && (petal_count(tgtype, tile_id, p) + petal_add[p]
+                    >= max_per_petal)) {
+                continue;
+            }
+            int32_t s = hw_->loc_slitblock.at(loc);
+            if ((s >= 0) &&
+                (slitblock_count(tgtype, tile_id, p, s) + slitblock_add[p][s]
+                    >= max_per_slitblock)) {
+                continue;
+            }
+            if (ok_to_assign(hw_.get(), tile_id, loc, tgrow, target_xy,
+                &tile_assign)) {
+                accepted[slot].push_back(std::make_pair(i, loc));
+                if (placed[item_first[i]] == 0) {
+                    placed[item_first[i]] = 1;
+                    tile_assign[loc] = tgrow;
+                    int32_t inc = count_inc(tgrow);
+                    petal_add[p] += inc;
+                    if (s >= 0) {
+                        slitblock_add[p][s] += inc;
+                    }
+                }
+            } else {
+                FBA_TRACE_TFG(TRACE_NOT_OK, tile_id, loc,
+                    tgs_->data[tgrow].id, 0, 0,
+                    "assign unused " << tgstr
+                    << ": target " << tgs_->data[tgrow].id << ", weight = "
+                    << tgweight << ": tile " << tile_id << ", loc " << loc
+                    << " NOT ok to assign");
+            }
+        }
+    };
+
+    std::vector <size_t> head(npetal, 0);
+    bool done = false;
+    while (! done) {
+        // Each petal handles its own targets up to the next shared one.
+        TaskPool::get().run("assign unused: petals", npetal, [&](size_t pt) {
+            int32_t p = static_cast <int32_t> (pt);
+            auto const & pq = queue[p];
+            while ((head[p] < pq.size())
+                && (item_zone[pq[head[p]]] == (1u << p))) {
+                place_entry(pq[head[p]], p);
+                head[p]++;
+            }
+        });
+
+        // Place the shared targets that every petal they touch has reached.
+        // These touch disjoint sets of petals.
+        done = true;
+        for (int32_t p = 0; p < npetal; ++p) {
+            if (head[p] >= queue[p].size()) {
+                continue;
+            }
+            done = false;
+            size_t i = queue[p][head[p]];
+            uint32_t zone = item_zone[i];
+            if ((zone & ((1u << p) - 1)) != 0) {
+                // Handled from the lowest petal of the set.
+                continue;
+            }
+            bool ready = true;
+            for (int32_t q = p; q < npetal; ++q) {
+                if ((zone & (1u << q))
+                    && ((head[q] >= queue[q].size()) || (queue[q][head[q]] != i))) {
+                    ready = false;
+                    break;
+                }
+            }
+            if (ready) {
+                place_entry(i, npetal);
+                for (int32_t q = p; q < npetal; ++q) {
+                    if (zone & (1u << q)) {
+                        head[q]++;
+                    }
+                }
+            }
+        }
+    }
+
+    // Make the assignments in the original order.
+    std::vector <std::pair <size_t, int32_t> > all_accepted;
+    for (auto const & acc : accepted) {
+        all_accepted.insert(all_accepted.end(), acc.begin(), acc.end());
+    }
+    std::stable_sort(all_accepted.begin(), all_accepted.end(),
+        [](std::pair <size_t, int32_t> const & lhs,
+           std::pair <size_t, int32_t> const & rhs) {
+            return lhs.first < rhs.first;
+        }
+    );
+    for (auto const & acc : all_accepted) {
+        assign_tileloc(hw_.get(), tgs_.get(), tile_id, acc.second,
+            tile_target_weights[acc.first].first, tgtype);
+    }
+
+    return all_accepted.size();
+}
+
+
+void fba::Assignment::assign_unused_sky(int32_t max_per_petal,
+                                        int32_t max_per_slitblock,
+                                        std::string const & pos_type,
+                                        int32_t start_tile,
+                                        int32_t stop_tile) {
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    // Select locations based on positioner type
+    auto device_locs = hw_->device_locations(pos_type);
+
+    static int32_t const gtm_total_region = gtm.region(
+        "unused sky+suppsky: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // The limits of each step, in the order used by separate calls to
+    // assign_unused():  per slitblock first because it is more specific,
+    // then per petal.  A negative value indicates that there is no limit.
+    std::vector <std::pair <int32_t, int32_t> > limits;
+    if ((max_per_petal > 0) && (max_per_slitblock > 0)) {
+        limits.push_back(std::make_pair(2147483647, max_per_slitblock));
+        limits.push_back(std::make_pair(max_per_petal, 2147483647));
+    } else {
+        limits.push_back(std::make_pair(
+            (max_per_petal < 0) ? 2147483647 : max_per_petal,
+            (max_per_slitblock < 0) ? 2147483647 : max_per_slitblock
+        ));
+    }
+
+    static const std::vector <uint8_t> sky_types = {
+        TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY};
+
+    // Determine our range of tiles
+    int32_t tstart;
+    int32_t tstop;
+    if (start_tile < 0) {
+        tstart = 0;
+    } else {
+        tstart = tiles_->order.at(start_tile);
+    }
+    if (stop_tile < 0) {
+        tstop = tiles_->id.size() - 1;
+    } else {
+        tstop = tiles_->order.at(stop_tile);
+    }
+
+    logmsg.str("");
+    logmsg << "assign unused sky:  working on tiles "
+        << start_tile << " (index " << tstart << ") to "
+        << stop_tile << " (index " << tstop << ")";
+    logger.info(logmsg.str().c_str());
+
+    // Per-tile target availability objects (reset for each tile).  The
+    // maps allocate from the arena, which is reused for every tile.
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
+    std::vector <target_weight> tile_target_weights;
+    std::vector <int32_t> tile_target_locs;
+    std::vector <int32_t> loc_unassigned;
+
+    // The candidates of one type in priority order, and the location of
+    // each one.
+    std::vector <target_weight> order;
+    std::vector <target_weight> sorted_weights;
+    std::vector <int32_t> sorted_locs;
+    std::vector <target_weight> step_weights;
+
+    // The location / target pairs of one tile which failed the collision
+    // checks.  Assignments are only added during this pass, so these pairs
+    // cannot become valid and are not checked again by later steps.
+    std::set <std::pair <int32_t, int32_t> > rejected;
+
+    static int32_t const gtm_avail = gtm.region(
+        "unused sky+suppsky: local tile availability");
+
+    for (int32_t t = tstart; t <= tstop; ++t) {
+        int32_t tile_id = tiles_->id[t];
+
+        if (tile_data(tile_id).observed) {
+            // Observed tiles are frozen.
+            continue;
+        }
+
+        if ((tgsavail_->data.count(tile_id) == 0)
+            || (tgsavail_->data.at(tile_id).size() == 0)) {
+            // No targets available for the whole tile.
+            continue;
+        }
+
+        rejected.clear();
+
+        for (auto const & tgtype : sky_types) {
+            gtm.start(gtm_avail);
+
+            loc_unassigned.clear();
+            {
+                auto const & tile_assign = tile_data(tile_id).loc_target;
+                for (auto const & loc : device_locs) {
+                    if ((tile_assign.count(loc) == 0) ||
+                        (tile_assign.at(loc) < 0)) {
+                        loc_unassigned.push_back(loc);
+                    }
+                }
+            }
+
+            tile_available(
+                tile_id,
+                tgtype,
+                loc_unassigned,
+                tile_target_avail,
+                tile_loc_avail,
+                tile_target_weights,
+                false,
+                &tile_target_locs
+            );
+
+            // Sort the candidate indices by weight.  This is the same stable
+            // order that assign_unused() uses, and keeps the location of each
+            // candidate.
+            size_t ncand = tile_target_weights.size();
+            order.resize(ncand);
+            for (size_t i = 0; i < ncand; ++i) {
+                order[i] = std::make_pair(
+                    (int32_t)i, tile_target_weights[i].second
+                );
+            }
+            sort_target_weights(order);
+            sorted_weights.resize(ncand);
+            sorted_locs.resize(ncand);
+            for (size_t i = 0; i < ncand; ++i) {
+                sorted_weights[i] = tile_target_weights[order[i].first];
+                sorted_locs[i] = tile_target_locs[order[i].first];
+            }
+
+            gtm.stop(gtm_avail);
+
+            for (auto const & lim : limits) {
+                // Only the candidates whose location is still unassigned
+                // take part in this step, as if the availability had been
+                // computed again.
+                step_weights.clear();
+                {
+                    auto const & tile_assign = tile_data(tile_id).loc_target;
+                    for (size_t i = 0; i < ncand; ++i) {
+                        if (tile_assign.count(sorted_locs[i]) == 0) {
+                            step_weights.push_back(sorted_weights[i]);
+                        }
+                    }
+                }
+                assign_tile_greedy(tile_id, tgtype, lim.first, lim.second,
+                                   tile_loc_avail, step_weights, &rejected);
+            }
+        }
+    }
+
+    logmsg.str("");
+    logmsg << "Assign sky and suppsky targets to unused locations";
+    tm.stop();
+    tm.report(logmsg.str().c_str());
+
+    return;
+}
+
+
+// In the case where we have fewer or a comparable number of targets as tile / fibers
+// to assign, the early tiles will be dominated by the high priority targets and later
+// tiles will have the lower priority targets and may be sparsely populated.
+//
+// When bumping science targets to place sky and standards, this will result in some
+// science targets being bumped and left unassigned.  Instead, this function
+// pro-actively moves science targets to available future tile / fibers when the
+// future petal has fewer science assignments.  This will redistribute the science
+// targets more evenly so that placement of standards and sky will require less
+// bumping.
+
+void fba::Assignment::redistribute_science(int32_t start_tile,
+                                           int32_t stop_tile) {
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region(
+        "redistribute science: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // Select locations that are science positioners
+    auto device_locs = hw_->device_locations("POS");
+
+    // Determine our range of tiles
+    int32_t tstart;
+    int32_t tstop;
+    if (start_tile < 0) {
+        tstart = 0;
+    } else {
+        tstart = tiles_->order.at(start_tile);
+    }
+    if (stop_tile < 0) {
+        tstop = tiles_->id.size() - 1;
+    } else {
+        tstop = tiles_->order.at(stop_tile);
+    }
+
+    logmsg.str("");
+    logmsg << "redist:  working on tiles "
+        << start_tile << " (index " << tstart << ") to "
+        << stop_tile << " (index " << tstop << ")";
+    logger.info(logmsg.str().c_str());
+
+    for (int32_t t = tstart; t <= tstop; ++t) {
+        int32_t tile_id = tiles_->id[t];
+        double tile_ra = tiles_->ra[t];
+        double tile_dec = tiles_->dec[t];
+
+        FBA_LOG_DEBUG("redist: working on tile " << tile_id
+            << " at RA/DEC = " << tile_ra << " / " << tile_dec);
+
+        if (tile_data(tile_id).observed) {
+            // Observed tiles are frozen.
+            continue;
+        }
+
+        if (tile_data(tile_id).nassign[count_index(TARGET_TYPE_SCIENCE)] == 0) {
+            // Skip tiles that are fully unassigned.
+            FBA_TRACE_TFG(TRACE_NO_TARGETS, tile_id, -1, -1, 0, 0,
+                "redist: tile " << tile_id
+                << " at RA/DEC = " << tile_ra << ", " << tile_dec
+                << ": no available targets");
+            continue;
+        }
+
+        // Compute the weighting of the assigned science targets.
+
+        std::vector <target_weight> science_targets;
+
+        for (auto const & loc : device_locs) {
+            auto const & tile_assign = tile_data(tile_id).loc_target;
+            if ((tile_assign.count(loc) > 0) &&
+                (tile_assign.at(loc) >= 0)) {
+                // We have something assigned here...
+                auto tgrow = tile_assign.at(loc);
+                auto const & tg = tgs_->data[tgrow];
+                if (tg.is_science() && (! tg.is_standard())) {
+                    // This is a science target and NOT a standard (we don't
                     // try reassign dual targets)
                     science_targets.push_back(
-                        std::make_pair(tgid, tg.total_priority())
+                        std::make_pair(tgrow, tg.total_priority(obsremain_[tgrow]))
                     );
                 }
             }
         }
 
         // Sort the currently assigned science targets by inverse priority order.
-        target_weight_rcompare tg_inverse_comp;
-        std::stable_sort(
-            science_targets.begin(),
-            science_targets.end(),
-            tg_inverse_comp
-        );
+        sort_target_weights(science_targets, true);
 
         for (auto const & tgwit : science_targets) {
-            // This current science target ID
-            auto const & tgid = tgwit.first;
+            // This current science target row
+            auto const & tgrow = tgwit.first;
             // This weight
             // auto const & tgweight = tgwit.second;
 
             // Find the location where this is currently assigned
-            int32_t tgloc = target_loc.at(tgid).at(tile_id);
+            int32_t tgloc = target_loc.at(tgrow).at(tile_id);
 
             // Try to assign this science target to a future tile
             int32_t new_tile;
             int32_t new_loc;
             reassign_science_target(
-                t + 1, tstop, tile_id, tgloc, tgid, false, new_tile, new_loc
+                t + 1, tstop, tile_id, tgloc, tgrow, false, new_tile, new_loc
             );
             if (new_tile != tile_id) {
                 // Some future tile has a better location.  Reassign.
+                count_pass(PASS_STAT_REASSIGNMENTS);
                 unassign_tileloc(
                     hw_.get(),
                     tgs_.get(),
@@ -728,31 +1608,27 @@ void fba::Assignment::redistribute_science(int32_t start_tile,
                     tgs_.get(),
                     new_tile,
                     new_loc,
-                    tgid,
+                    tgrow,
                     TARGET_TYPE_SCIENCE
                 );
-                if (extra_log) {
-                    logmsg.str("");
-                    logmsg << "redist: tile " << tile_id
-                        << " loc " << tgloc
-                        << " moved science " << tgid
-                        << " to tile " << new_tile
-                        << ", loc " << new_loc;
-                    logger.debug_tfg(
-                        tile_id, tgloc, tgid, logmsg.str().c_str()
-                    );
-                    logger.debug_tfg(
-                        new_tile, new_loc, tgid, logmsg.str().c_str()
-                    );
-                }
+                FBA_TRACE_TFG(TRACE_MOVE, tile_id, tgloc,
+                    tgs_->data[tgrow].id, new_tile, new_loc,
+                    "redist: tile " << tile_id
+                    << " loc " << tgloc
+                    << " moved science " << tgs_->data[tgrow].id
+                    << " to tile " << new_tile
+                    << ", loc " << new_loc);
+                FBA_TRACE_TFG(TRACE_MESSAGE, new_tile, new_loc,
+                    tgs_->data[tgrow].id, 0, 0,
+                    "redist: tile " << tile_id
+                    << " loc " << tgloc
+                    << " moved science " << tgs_->data[tgrow].id
+                    << " to tile " << new_tile
+                    << ", loc " << new_loc);
             }
         }
     }
 
-    gtmname.str("");
-    gtmname << "redistribute science: total";
-    gtm.stop(gtmname.str());
-
     tm.stop();
     tm.report("Redistribute science targets");
 
@@ -760,6 +1636,346 @@ void fba::Assignment::redistribute_science(int32_t start_tile,
 }
 
 
+std::map <std::string, int64_t> fba::Assignment::refine(double time_budget,
+    int32_t max_depth, int32_t start_tile, int32_t stop_tile) {
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region("refine: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // Select locations that are science positioners
+    auto device_locs = hw_->device_locations("POS");
+
+    if (max_depth < 0) {
+        max_depth = 0;
+    }
+
+    // Determine our range of tiles
+    int32_t tstart;
+    int32_t tstop;
+    if (start_tile < 0) {
+        tstart = 0;
+    } else {
+        tstart = tiles_->order.at(start_tile);
+    }
+    if (stop_tile < 0) {
+        tstop = tiles_->id.size() - 1;
+    } else {
+        tstop = tiles_->order.at(stop_tile);
+    }
+
+    logmsg.str("");
+    logmsg << "refine:  working on tiles "
+        << start_tile << " (index " << tstart << ") to "
+        << stop_tile << " (index " << tstop << "), time budget "
+        << time_budget << " seconds";
+    logger.info(logmsg.str().c_str());
+
+    auto deadline = std::chrono::steady_clock::now()
+        + std::chrono::duration_cast <std::chrono::steady_clock::duration> (
+            std::chrono::duration <double> (
+                (time_budget > 0.0) ? time_budget : 0.0
+            )
+        );
+    bool out_of_time = false;
+
+    int64_t nsweep = 0;
+    int64_t nadded = 0;
+    int64_t nshift = 0;
+    int64_t neject = 0;
+    int64_t priority_gain = 0;
+
+    // Per-tile target availability objects (reset for each tile).  The
+    // maps allocate from the arena, which is reused for every tile.
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
+    std::vector <target_weight> tile_target_weights;
+
+    // Dense copy of the tile assignment (-1 if unassigned), which the search
+    // edits in place of loc_target.  The tile state is only written once a
+    // move has been chosen, so that tiles shared with a fork are not copied
+    // unless they change.
+    std::vector <int32_t> tile_assign(loc_pos_.size(), -1);
+
+    // Locations already used by the chain of moves being built.
+    std::vector <int32_t> loc_stamp(loc_pos_.size(), 0);
+    int32_t stamp = 0;
+
+    // The (location, target) moves of a successful chain, starting with the
+    // newly assigned target.
+    std::vector <std::pair <int32_t, int32_t> > chain;
+
+    bool changed = true;
+    while (changed && ! out_of_time) {
+        changed = false;
+        nsweep++;
+        for (int32_t t = tstart; (t <= tstop) && ! out_of_time; ++t) {
+            int32_t tile_id = tiles_->id[t];
+
+            if (tile_data(tile_id).observed) {
+                // Observed tiles are frozen.
+                continue;
+            }
+
+            if ((tgsavail_->data.count(tile_id) == 0)
+                || (tgsavail_->data.at(tile_id).size() == 0)) {
+                // No targets available for the whole tile.
+                continue;
+            }
+
+            // All science targets reachable on this tile, including those with
+            // no observations remaining, since assigned targets may be moved.
+            tile_available(tile_id, TARGET_TYPE_SCIENCE, device_locs,
+                tile_target_avail, tile_loc_avail, tile_target_weights, true);
+            sort_target_weights(tile_target_weights);
+
+            auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
+            for (auto const & it : tile_data(tile_id).loc_target) {
+                tile_assign[it.first] = it.second;
+            }
+
+            std::set <int32_t> seen;
+            for (auto const & tgwit : tile_target_weights) {
+                int32_t tgrow = tgwit.first;
+                if (seen.count(tgrow) > 0) {
+                    continue;
+                }
+                seen.insert(tgrow);
+                auto const & tg = tgs_->data[tgrow];
+                if ((obsremain_[tgrow] <= 0)
+                    || (target_loc[tgrow].count(tile_id) > 0)) {
+                    continue;
+                }
+                if (std::chrono::steady_clock::now() > deadline
+                    && (time_budget > 0.0)) {
+                    out_of_time = true;
+                    break;
+                }
+
+                stamp++;
+                chain.clear();
+                if (refine_place(tile_id, tgrow, max_depth, tile_loc_avail,
+                    target_xy, tile_assign, loc_stamp, stamp, chain)) {
+                    // Every location in the chain but the last was taken
+                    // from the target placed in the following step, and the
+                    // search already moved them in the dense copy.  Make the
+                    // moves in the tile state with full bookkeeping.
+                    size_t nchain = chain.size();
+                    tile_assign[chain[nchain - 1].first] =
+                        chain[nchain - 1].second;
+                    for (size_t c = 0; c + 1 < nchain; ++c) {
+                        unassign_tileloc(hw_.get(), tgs_.get(), tile_id,
+                            chain[c].first, TARGET_TYPE_SCIENCE);
+                    }
+                    for (auto const & move : chain) {
+                        assign_tileloc(hw_.get(), tgs_.get(), tile_id,
+                            move.first, move.second, TARGET_TYPE_SCIENCE);
+                    }
+                    FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, chain[0].first,
+                        tg.id, 0, 0,
+                        "refine: tile " << tile_id << " loc "
+                        << chain[0].first << " assigned science " << tg.id
+                        << " after moving " << (nchain - 1)
+                        << " other targets");
+                    nshift += nchain - 1;
+                    nadded++;
+                    priority_gain += tg.priority;
+                    changed = true;
+                    continue;
+                }
+
+                // No chain of moves frees a location.  Replace the lowest
+                // priority science target that this one could take over.  The
+                // subpriority only breaks ties, so it is not a reason to
+                // replace a target.
+                int32_t eject_loc = -1;
+                int32_t eject_row = -1;
+                int32_t eject_priority = tg.priority;
+                for (auto const & locwt : tile_loc_avail.at(tgrow)) {
+                    int32_t loc = locwt.first;
+                    if (tile_assign[loc] < 0) {
+                        continue;
+                    }
+                    int32_t cur = tile_assign[loc];
+                    auto const & curtg = tgs_->data[cur];
+                    if ((! curtg.is_science()) || curtg.is_standard()) {
+                        continue;
+                    }
+                    if (curtg.priority < eject_priority) {
+                        if (ok_to_assign(hw_.get(), tile_id, loc, tgrow,
+                            target_xy, &tile_assign)) {
+                            eject_loc = loc;
+                            eject_row = cur;
+                            eject_priority = curtg.priority;
+                        }
+                    }
+                }
+                if (eject_loc >= 0) {
+                    unassign_tileloc(hw_.get(), tgs_.get(), tile_id, eject_loc,
+                        TARGET_TYPE_SCIENCE);
+                    assign_tileloc(hw_.get(), tgs_.get(), tile_id, eject_loc,
+                        tgrow, TARGET_TYPE_SCIENCE);
+                    tile_assign[eject_loc] = tgrow;
+                    neject++;
+                    count_pass(PASS_STAT_BUMPS);
+                    priority_gain += tg.priority - tgs_->data[eject_row].priority;
+                    changed = true;
+                    FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, eject_loc,
+                        tg.id, 0, 0,
+                        "refine: tile " << tile_id << " loc "
+                        << eject_loc << " replaced science "
+                        << tgs_->data[eject_row].id << " with "
+                        << tg.id);
+                }
+            }
+
+            for (auto const & it : tile_data(tile_id).loc_target) {
+                tile_assign[it.first] = -1;
+            }
+        }
+    }
+
+    logmsg.str("");
+    logmsg << "refine:  " << nsweep << " sweeps added " << nadded
+        << " science targets (shifting " << nshift << "), replaced "
+        << neject << ", priority gain " << priority_gain;
+    if (out_of_time) {
+        logmsg << " (time budget reached)";
+    }
+    logger.info(logmsg.str().c_str());
+
+    tm.stop();
+    tm.report("Refine assignment");
+
+    std::map <std::string, int64_t> ret;
+    ret["sweeps"] = nsweep;
+    ret["added"] = nadded;
+    ret["shifted"] = nshift;
+    ret["ejected"] = neject;
+    ret["priority"] = priority_gain;
+    return ret;
+}
+
+
+bool fba::Assignment::refine_place(int32_t tile_id, int32_t tgrow,
+    int32_t depth,
+    tile_location_map const & tile_loc_avail,
+    fba::TileTargetXY const & target_xy,
+    std::vector <int32_t> & tile_assign, std::vector <int32_t> & loc_stamp,
+    int32_t stamp, std::vector <std::pair <int32_t, int32_t> > & chain) const {
+
+    // The search only edits the dense copy of the tile assignment, which is
+    // all that the collision check reads.  The tile state, counts, remaining
+    // observations and other bookkeeping are updated by the caller once a
+    // chain succeeds.
+
+    if (tile_loc_avail.count(tgrow) == 0) {
+        return false;
+    }
+    auto const & locs = tile_loc_avail.at(tgrow);
+
+    // A free location, from closest to furthest.
+    for (auto const & locwt : locs) {
+        int32_t loc = locwt.first;
+        if ((loc_stamp[loc] == stamp) || (tile_assign[loc] >= 0)) {
+            continue;
+        }
+        if (ok_to_assign(hw_.get(), tile_id, loc, tgrow, target_xy,
+            &tile_assign)) {
+            chain.push_back(std::make_pair(loc, tgrow));
+            return true;
+        }
+    }
+
+    if (depth == 0) {
+        return false;
+    }
+
+    // Take a location from a science target and try to move that target
+    // elsewhere.  The collision check only depends on the neighbors, so it
+    // can be done before the current target is removed.
+    for (auto const & locwt : locs) {
+        int32_t loc = locwt.first;
+        if ((loc_stamp[loc] == stamp) || (tile_assign[loc] < 0)) {
+            continue;
+        }
+        int32_t cur = tile_assign[loc];
+        auto const & curtg = tgs_->data[cur];
+        if ((! curtg.is_science()) || curtg.is_standard()) {
+            continue;
+        }
+        if (! refine_reachable(tile_id, cur, depth - 1, tile_loc_avail,
+            tile_assign)) {
+            // There is no free location at the end of any chain from this
+            // target, so skip the collision checks.
+            continue;
+        }
+        if (! ok_to_assign(hw_.get(), tile_id, loc, tgrow, target_xy,
+            &tile_assign)) {
+            continue;
+        }
+        loc_stamp[loc] = stamp;
+        tile_assign[loc] = tgrow;
+        chain.push_back(std::make_pair(loc, tgrow));
+        if (refine_place(tile_id, cur, depth - 1, tile_loc_avail, target_xy,
+            tile_assign, loc_stamp, stamp, chain)) {
+            return true;
+        }
+        chain.pop_back();
+        tile_assign[loc] = cur;
+    }
+    return false;
+}
+
+
+bool fba::Assignment::refine_reachable(int32_t tile_id, int32_t tgrow,
+    int32_t depth,
+    tile_location_map const & tile_loc_avail,
+    std::vector <int32_t> const & tile_assign
+    ) const {
+    // Whether a chain of at most depth moves, starting from this target,
+    // could end at a free location.  Collisions are not considered.
+    if (tile_loc_avail.count(tgrow) == 0) {
+        return false;
+    }
+    auto const & locs = tile_loc_avail.at(tgrow);
+    for (auto const & locwt : locs) {
+        if ((tile_assign[locwt.first] < 0) && loc_pos_[locwt.first]) {
+            int32_t st = hw_->state.at(locwt.first);
+            if (! ((st & FIBER_STATE_STUCK) || (st & FIBER_STATE_BROKEN))) {
+                return true;
+            }
+        }
+    }
+    if (depth == 0) {
+        return false;
+    }
+    for (auto const & locwt : locs) {
+        int32_t cur = tile_assign[locwt.first];
+        if ((cur < 0) || (cur == tgrow)) {
+            continue;
+        }
+        auto const & curtg = tgs_->data[cur];
+        if ((! curtg.is_science()) || curtg.is_standard()) {
+            continue;
+        }
+        if (refine_reachable(tile_id, cur, depth - 1, tile_loc_avail,
+            tile_assign)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
 void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
                                    int32_t required_per_slitblock,
                                    int32_t start_tile, int32_t stop_tile) {
@@ -768,16 +1984,12 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
 
     fba::Logger & logger = fba::Logger::get();
     std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
 
     fba::GlobalTimers & gtm = fba::GlobalTimers::get();
-    std::ostringstream gtmname;
 
     std::string tgstr = fba::target_string(tgtype);
 
-    gtmname.str("");
-    gtmname << "force " << tgstr << ": total";
-    gtm.start(gtmname.str());
+    GlobalTimerScope gtm_total(gtm.region("force " + tgstr + ": total"));
 
     // Select locations that are science positioners
     auto device_locs = hw_->device_locations("POS");
@@ -802,73 +2014,80 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
         << stop_tile << " (index " << tstop << ")";
     logger.info(logmsg.str().c_str());
 
-    // Per-tile target availability objects (reset for each tile)
-    std::map <int32_t, std::vector <target_weight> > tile_target_avail;
-    std::map <int64_t, std::vector <location_weight> > tile_loc_avail;
+    // Per-tile target availability objects (reset for each tile).  The
+    // maps allocate from the arena, which is reused for every tile.
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
     std::vector <target_weight> tile_target_weights;
 
+    // The assigned science targets and their locations, and the targets
+    // available to a single location, declared here to avoid repeated memory
+    // allocation.
+    std::vector <target_weight> science_targets;
+    std::vector <int32_t> loc_science;
+    std::vector <int32_t> tg_avail;
+
+    int32_t gtm_science = gtm.region(
+        "force " + tgstr + ": local tile compute science assignment");
+    int32_t gtm_avail = gtm.region(
+        "force " + tgstr + ": local tile availability");
+
     for (int32_t t = tstart; t <= tstop; ++t) {
         int32_t tile_id = tiles_->id[t];
         double tile_ra = tiles_->ra[t];
         double tile_dec = tiles_->dec[t];
 
-        logmsg.str("");
-        logmsg << "assign force " << tgstr << ": working on tile " << tile_id
-            << " at RA/DEC = " << tile_ra << " / " << tile_dec;
-        logger.debug(logmsg.str().c_str());
+        FBA_LOG_DEBUG("assign force " << tgstr << ": working on tile " << tile_id
+            << " at RA/DEC = " << tile_ra << " / " << tile_dec);
+
+        if (tile_data(tile_id).observed) {
+            // Observed tiles are frozen.
+            continue;
+        }
 
-        if (nassign_tile[TARGET_TYPE_SCIENCE][tile_id] == 0) {
+        if (tile_data(tile_id).nassign[count_index(TARGET_TYPE_SCIENCE)] == 0) {
             // Skip tiles that are fully unassigned.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "assign force " << tgstr << ": tile " << tile_id
-                    << " at RA/DEC = " << tile_ra << ", " << tile_dec
-                    << ": no available targets";
-                logger.debug_tfg(tile_id, -1, -1, logmsg.str().c_str());
-            }
+            FBA_TRACE_TFG(TRACE_NO_TARGETS, tile_id, -1, -1, 0, 0,
+                "assign force " << tgstr << ": tile " << tile_id
+                << " at RA/DEC = " << tile_ra << ", " << tile_dec
+                << ": no available targets");
             continue;
         }
 
-        gtmname.str("");
-        gtmname << "force " << tgstr << ": local tile compute science assignment";
-        gtm.start(gtmname.str());
+        gtm.start(gtm_science);
 
         // Compute the locations which are currently assigned to science targets.
         // Also compute the inverse-priority weighting of these assigned targets.
 
-        std::vector <target_weight> science_targets;
-        std::vector <int32_t> loc_science;
+        science_targets.clear();
+        loc_science.clear();
 
         for (auto const & loc : device_locs) {
-            if ((loc_target[tile_id].count(loc) > 0) &&
-                (loc_target[tile_id].at(loc) >= 0)) {
+            auto const & tile_assign = tile_data(tile_id).loc_target;
+            if ((tile_assign.count(loc) > 0) &&
+                (tile_assign.at(loc) >= 0)) {
                 // We have something assigned here...
-                auto tgid = loc_target[tile_id].at(loc);
-                auto const & tg = tgs_->data.at(tgid);
+                auto tgrow = tile_assign.at(loc);
+                auto const & tg = tgs_->data[tgrow];
                 if (tg.is_science() && (! tg.is_standard())) {
                     // This is a science target and NOT a standard (we don't
                     // try to bump dual targets)
                     loc_science.push_back(loc);
                     science_targets.push_back(
-                        std::make_pair(tgid, tg.total_priority())
+                        std::make_pair(tgrow, tg.total_priority(obsremain_[tgrow]))
                     );
                 }
             }
         }
 
         // Sort the currently assigned science targets by inverse priority order
-        target_weight_rcompare tg_inverse_comp;
-        std::stable_sort(
-            science_targets.begin(),
-            science_targets.end(),
-            tg_inverse_comp
-        );
+        sort_target_weights(science_targets, true);
 
-        gtm.stop(gtmname.str());
+        gtm.stop(gtm_science);
 
-        gtmname.str("");
-        gtmname << "force " << tgstr << ": local tile availability";
-        gtm.start(gtmname.str());
+        gtm.start(gtm_avail);
 
         // Available targets for this tile.
 
@@ -882,26 +2101,18 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
             false
         );
 
-        gtm.stop(gtmname.str());
+        gtm.stop(gtm_avail);
 
-        logmsg.str("");
-        logmsg << "assign force " << tgstr << ": tile " << tile_id
+        FBA_LOG_DEBUG("assign force " << tgstr << ": tile " << tile_id
             << " has " << science_targets.size()
-            << " currently assigned science locations";
-        logger.debug(logmsg.str().c_str());
+            << " currently assigned science locations");
 
-        logmsg.str("");
-        logmsg << "assign force " << tgstr << ": tile " << tile_id
+        FBA_LOG_DEBUG("assign force " << tgstr << ": tile " << tile_id
             << " these locations have " << tile_target_weights.size()
-            << " available targets";
-        logger.debug(logmsg.str().c_str());
+            << " available targets");
 
         // Reference to projected target X/Y locations for this tile.
-        auto const & target_xy = tile_target_xy.at(tile_id);
-
-        // Targets available to a single location, declared here to avoid
-        // repeated memory allocation.
-        std::vector <int64_t> tg_avail;
+        auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
 
         // The unique petals used for this tile
         std::set <int32_t> unique_petal;
@@ -909,13 +2120,13 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
         std::set <std::pair<int32_t, int32_t> > unique_slitblock;
 
         for (auto const & tgwit : science_targets) {
-            // This current science target ID
-            auto const & tgid = tgwit.first;
+            // This current science target row
+            auto const & tgrow = tgwit.first;
             // This weight
             auto const & tgweight = tgwit.second;
 
             // Find the location where this is currently assigned
-            int32_t tgloc = target_loc.at(tgid).at(tile_id);
+            int32_t tgloc = target_loc.at(tgrow).at(tile_id);
 
             // The petal of this location
             int32_t p = hw_->loc_petal.at(tgloc);
@@ -952,13 +2163,14 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
 
             // For each available target at this current location...
             for (auto const & avtg : tg_avail) {
+                count_pass(PASS_STAT_CANDIDATES);
                 // Can we assign this target?
                 if (ok_to_assign(hw_.get(), tile_id, tgloc, avtg, target_xy)) {
                     // Yes, try to assign the bumped science target to a future tile
                     int32_t new_tile;
                     int32_t new_loc;
                     reassign_science_target(
-                        t + 1, tstop, tile_id, tgloc, tgid, true, new_tile, new_loc
+                        t + 1, tstop, tile_id, tgloc, tgrow, true, new_tile, new_loc
                     );
                     // Now unassign science target.
                     unassign_tileloc(
@@ -968,82 +2180,97 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
                         tgloc,
                         TARGET_TYPE_SCIENCE
                     );
+                    count_pass(PASS_STAT_BUMPS);
                     // Assign the new target
                     assign_tileloc(
                         hw_.get(), tgs_.get(), tile_id, tgloc, avtg, tgtype
                     );
-                    if (extra_log) {
-                        logmsg.str("");
-                        logmsg << "assign force " << tgstr
-                            << ": tile " << tile_id
-                            << " loc " << tgloc
-                            << " petal " << p
-                            << " slitblock " << s
-                            << " bumped science " << tgid
-                            << " with weight " << tgweight
-                            << ", replaced with " << avtg;
-                        logger.debug_tfg(tile_id, tgloc, tgid, logmsg.str().c_str());
-                        logger.debug_tfg(tile_id, tgloc, avtg, logmsg.str().c_str());
-                    }
+                    FBA_TRACE_TFG(TRACE_BUMP, tile_id, tgloc,
+                        tgs_->data[tgrow].id, 0, tgs_->data[avtg].id,
+                        "assign force " << tgstr
+                        << ": tile " << tile_id
+                        << " loc " << tgloc
+                        << " petal " << p
+                        << " slitblock " << s
+                        << " bumped science " << tgs_->data[tgrow].id
+                        << " with weight " << tgweight
+                        << ", replaced with " << tgs_->data[avtg].id);
+                    FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, tgloc,
+                        tgs_->data[avtg].id, 0, 0,
+                        "assign force " << tgstr
+                        << ": tile " << tile_id
+                        << " loc " << tgloc
+                        << " petal " << p
+                        << " slitblock " << s
+                        << " bumped science " << tgs_->data[tgrow].id
+                        << " with weight " << tgweight
+                        << ", replaced with " << tgs_->data[avtg].id);
                     // If we were able, reassign the science target
                     if (new_tile >= 0) {
                         // We were able to find a spot
+                        count_pass(PASS_STAT_REASSIGNMENTS);
                         assign_tileloc(
                             hw_.get(),
                             tgs_.get(),
                             new_tile,
                             new_loc,
-                            tgid,
+                            tgrow,
                             TARGET_TYPE_SCIENCE
                         );
-                        if (extra_log) {
-                            logmsg.str("");
-                            logmsg << "assign force " << tgstr
-                                << ": tile " << tile_id
-                                << " loc " << tgloc
-                                << " petal " << p
-                                << " slitblock " << s
-                                << " reassign bumped science " << tgid
-                                << " to tile " << new_tile
-                                << ", loc " << new_loc;
-                            logger.debug_tfg(
-                                tile_id, tgloc, tgid, logmsg.str().c_str()
-                            );
-                            logger.debug_tfg(
-                                new_tile, new_loc, tgid, logmsg.str().c_str()
-                            );
-                        }
+                        FBA_TRACE_TFG(TRACE_MOVE, tile_id, tgloc,
+                            tgs_->data[tgrow].id, new_tile, new_loc,
+                            "assign force " << tgstr
+                            << ": tile " << tile_id
+                            << " loc " << tgloc
+                            << " petal " << p
+                            << " slitblock " << s
+                            << " reassign bumped science " << tgs_->data[tgrow].id
+                            << " to tile " << new_tile
+                            << ", loc " << new_loc);
+                        FBA_TRACE_TFG(TRACE_MESSAGE, new_tile, new_loc,
+                            tgs_->data[tgrow].id, 0, 0,
+                            "assign force " << tgstr
+                            << ": tile " << tile_id
+                            << " loc " << tgloc
+                            << " petal " << p
+                            << " slitblock " << s
+                            << " reassign bumped science " << tgs_->data[tgrow].id
+                            << " to tile " << new_tile
+                            << ", loc " << new_loc);
                     } else {
-                        if (extra_log) {
-                            logmsg.str("");
-                            logmsg << "assign force " << tgstr
-                                << ": tile " << tile_id
-                                << " loc " << tgloc
-                                << " petal " << p
-                                << " slitblock " << s
-                                << " bumped science " << tgid
-                                << " cannot be reassigned.";
-                            logger.debug_tfg(
-                                tile_id, tgloc, tgid, logmsg.str().c_str()
-                            );
-                        }
-                    }
-                    break;
-                } else {
-                    // There must be a collision or some other problem.
-                    if (extra_log) {
-                        logmsg.str("");
-                        logmsg << "assign force " << tgstr
+                        FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, tgloc,
+                            tgs_->data[tgrow].id, 0, 0,
+                            "assign force " << tgstr
                             << ": tile " << tile_id
                             << " loc " << tgloc
                             << " petal " << p
                             << " slitblock " << s
-                            << " cannot bump science " << tgid
-                            << " (weight " << tgweight << ")"
-                            << " with " << avtg << ": not ok to assign";
-                        logger.debug_tfg(tile_id, tgloc, tgid, logmsg.str().c_str());
-                        logger.debug_tfg(tile_id, tgloc, avtg, logmsg.str().c_str());
+                            << " bumped science " << tgs_->data[tgrow].id
+                            << " cannot be reassigned.");
                     }
+                    break;
+                } else {
+                    // There must be a collision or some other problem.
+                    FBA_TRACE_TFG(TRACE_NOT_OK, tile_id, tgloc,
+                        tgs_->data[avtg].id, 0, 0,
+                        "assign force " << tgstr
+                        << ": tile " << tile_id
+                        << " loc " << tgloc
+                        << " petal " << p
+                        << " slitblock " << s
+                        << " cannot bump science " << tgs_->data[tgrow].id
+                        << " (weight " << tgweight << ")"
+                        << " with " << tgs_->data[avtg].id << ": not ok to assign");
+                    FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, tgloc,
+                        tgs_->data[tgrow].id, 0, 0,
+                        "assign force " << tgstr
+                        << ": tile " << tile_id
+                        << " loc " << tgloc
+                        << " petal " << p
+                        << " slitblock " << s
+                        << " cannot bump science " << tgs_->data[tgrow].id
+                        << " (weight " << tgweight << ")"
+                        << " with " << tgs_->data[avtg].id << ": not ok to assign");
                 }
             }
         }
@@ -1077,10 +2304,6 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
         }
     }
 
-    gtmname.str("");
-    gtmname << "force " << tgstr << ": total";
-    gtm.stop(gtmname.str());
-
     logmsg.str("");
     if ((required_per_petal > 0) && (required_per_slitblock > 0)) {
         logmsg << "Force assignment of " << required_per_petal << " "
@@ -1102,108 +2325,115 @@ void fba::Assignment::assign_force(uint8_t tgtype, int32_t required_per_petal,
 
 
 void fba::Assignment::reassign_science_target(int32_t tstart, int32_t tstop,
-    int32_t tile, int32_t loc, int64_t target, bool force,
-    int32_t & new_tile, int32_t & new_loc) const {
+    int32_t tile, int32_t loc, int32_t target, bool force,
+    int32_t & new_tile, int32_t & new_loc) {
 
     // The "force" option controls whether we want to reassign the science target to
     // a new location even if that location is not as "good" as current assignment.
     // This can happen if the target is being bumped.  If force==true and no new
     // assignment is possible, negative values are returned for new_tile and new_loc.
 
-    fba::Logger & logger = fba::Logger::get();
-    std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
 
-    if (extra_log) {
-        logmsg.str("");
-        logmsg << "reassign: tile " << tile << ", location "
-            << loc << ", target " << target << " considering tile indices "
-            << tstart << " to " << tstop;
-        logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-    }
+    int64_t target_id = tgs_->data[target].id;
+
+    FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+        "reassign: tile " << tile << ", location "
+        << loc << ", target " << target_id << " considering tile indices "
+        << tstart << " to " << tstop);
 
     // Get the number of unused locations on this current petal.
     int32_t petal = hw_->loc_petal.at(loc);
     int32_t passign = petal_count(TARGET_TYPE_SCIENCE, tile, petal);
 
-    // Vector of available tile / loc pairs which have a loc that is a
-    // science positioner.  The available tile / location pairs are already
-    // sorted by tile order.
+    // Vector of available tile / loc pairs which pass the checks below.
     std::vector < std::pair <int32_t, int32_t> > avail;
 
-    auto const & locavailtg = locavail_->data.at(target);
-    std::string pos_str("POS");
+    // Find the available tile / location pairs on tiles after the start
+    // index with a binary search of the tile index, and then visit them in
+    // their original order.
+    auto const & locavailtg = locavail_->data[target];
+    auto const & tindx = locavail_->tile_index[target];
+    auto first = std::upper_bound(
+        tindx.begin(), tindx.end(), tstart,
+        [](int32_t val, std::pair <int32_t, int32_t> const & ti) {
+            return (val < ti.first);
+        }
+    );
+    // pair(position, tile index)
+    std::vector <std::pair <int32_t, int32_t> > cand;
+    for (auto it = first; it != tindx.end(); ++it) {
+        cand.push_back(std::make_pair(it->second, it->first));
+    }
+    std::sort(cand.begin(), cand.end());
+
+    reassign_calls_++;
+    reassign_candidates_ += locavailtg.size();
+    reassign_skipped_ += (locavailtg.size() - cand.size());
+
+    FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+        "reassign: tile " << tile << ", location "
+        << loc << ", target " << target_id << " skipping "
+        << (locavailtg.size() - cand.size())
+        << " available tile/locs prior to tile start index ("
+        << tstart << ")");
+
+    auto const & tgloc = target_loc.at(target);
 
-    for (auto const & av : locavailtg) {
+    for (auto const & c : cand) {
+        auto const & av = locavailtg[c.first];
         int32_t av_tile = av.first;
-        int32_t av_tile_indx = tiles_->order.at(av_tile);
+        int32_t av_tile_indx = c.second;
         int32_t av_loc = av.second;
-        if (nassign_tile.at(TARGET_TYPE_SCIENCE).at(av_tile) == 0) {
-            // This available tile / loc is on a tile with
-            // nothing assigned.  Skip it.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", location "
-                    << loc << ", target " << target
-                    << " available tile " << av_tile
-                    << " has nothing assigned- skipping";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+        if (loc_pos_[av_loc]) {
+            // NOTE:  this check has historically excluded the science
+            // positioners ("POS") rather than the other device types, and
+            // that behavior is preserved here.
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " available tile " << av_tile
+                << " at index " << av_tile_indx
+                << " is not a science positioner (POS)");
             continue;
         }
-        if (loc_target.at(av_tile).count(av_loc) > 0) {
-            // This available tile / loc is already assigned.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " avail tile/loc " << av_tile << "," << av_loc
-                    << " already assigned";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+        auto const & av_state = tile_state_[av_tile_indx];
+        if (av_state.observed) {
+            // This available tile has already been observed.
             continue;
         }
-        if (target_loc.at(target).count(av_tile) > 0) {
-            // We have already assigned a location on this tile to this
-            // target.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " already assigned on available tile " << av_tile;
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+        if (av_state.loc_used[av_loc]) {
+            // This available tile / loc is already assigned.
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " avail tile/loc " << av_tile << "," << av_loc
+                << " already assigned");
             continue;
         }
-        if (av_tile_indx <= tstart) {
-            // This available tile came before our current tile.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " available tile " << av_tile
-                    << " at index " << av_tile_indx
-                    << " is prior to tile start index (" << tstart << ")";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+        if (av_state.nassign[count_index(TARGET_TYPE_SCIENCE)] == 0) {
+            // This available tile / loc is on a tile with
+            // nothing assigned.  Skip it.
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", location "
+                << loc << ", target " << target_id
+                << " available tile " << av_tile
+                << " has nothing assigned- skipping");
             continue;
         }
-        if (pos_str.compare(hw_->loc_device_type.at(av_loc)) == 0) {
-            // Available location is not a science positioner
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " available tile " << av_tile
-                    << " at index " << av_tile_indx
-                    << " is not a science positioner (POS)";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+        if (tgloc.count(av_tile) > 0) {
+            // We have already assigned a location on this tile to this
+            // target.
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " already assigned on available tile " << av_tile);
             continue;
         }
         avail.push_back(av);
     }
 
+    reassign_checked_ += avail.size();
+
     new_tile = -1;
     new_loc = -1;
     int32_t best_passign = 500;
@@ -1216,54 +2446,45 @@ void fba::Assignment::reassign_science_target(int32_t tstart, int32_t tstop,
         // int32_t av_tile_indx = tiles_->order.at(av_tile);
 
         // Projected target locations on the available tile.
-        auto const & av_target_xy = tile_target_xy.at(av_tile);
+        auto const & av_target_xy = tgsavail_->tile_xy.at(av_tile);
 
         if ( ! ok_to_assign(hw_.get(), av_tile, av_loc, target,
                             av_target_xy)) {
             // There must be a collision or some other problem.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " avail tile/loc " << av_tile << "," << av_loc
-                    << " not OK to assign";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " avail tile/loc " << av_tile << "," << av_loc
+                << " not OK to assign");
             continue;
         }
 
         // At this point we know we have a new tile / loc where we can place
         // this target.  Get the number of assigned locations on the petal of this
         // available tile/loc.
-        int32_t av_passign =
-            nassign_petal.at(TARGET_TYPE_SCIENCE).at(av_tile).at(av_petal);
+        int32_t av_passign = tile_data(av_tile).nassign_petal[
+            petal_slot(count_index(TARGET_TYPE_SCIENCE), av_petal)];
 
         if ((av_passign < hw_->nfiber_petal) && (av_passign < best_passign)) {
             // There are some unassigned locs on this available petal,
             // and the number of unassigned is greater than our current best
             // tile/loc.
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " avail tile/loc " << av_tile << "," << av_loc
-                    << " new best alternate location for petal counts ("
-                    << av_passign << " < " << best_passign << ")";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " avail tile/loc " << av_tile << "," << av_loc
+                << " new best alternate location for petal counts ("
+                << av_passign << " < " << best_passign << ")");
             new_tile = av_tile;
             new_loc = av_loc;
             best_passign = av_passign;
         } else {
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "reassign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " avail tile/loc " << av_tile << "," << av_loc
-                    << " skipping alternate loc with more petal counts ("
-                    << av_passign << " >= " << best_passign << ")";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+            FBA_TRACE_TFG(TRACE_MESSAGE, tile, loc, target_id, 0, 0,
+                "reassign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " avail tile/loc " << av_tile << "," << av_loc
+                << " skipping alternate loc with more petal counts ("
+                << av_passign << " >= " << best_passign << ")");
         }
     }
 
@@ -1278,25 +2499,23 @@ void fba::Assignment::reassign_science_target(int32_t tstart, int32_t tstop,
 
 
 bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
-    int32_t loc, int64_t target,
-    std::map <int64_t, std::pair <double, double> > const & target_xy
+    int32_t loc, int32_t target,
+    fba::TileTargetXY const & target_xy,
+    std::vector <int32_t> const * tile_assign
     ) const {
 
-    fba::Logger & logger = fba::Logger::get();
-    std::ostringstream logmsg;
-    bool extra_log = logger.extra_debug();
+    count_pass(PASS_STAT_OK_TO_ASSIGN);
+
+    int64_t target_id = tgs_->data[target].id;
 
     // Is the location stuck or broken?
     if (
         (hw->state.at(loc) & FIBER_STATE_STUCK) ||
         (hw->state.at(loc) & FIBER_STATE_BROKEN)
     ) {
-        if (extra_log) {
-            logmsg.str("");
-            logmsg << "ok_to_assign: tile " << tile << ", loc "
-                << loc << " not OK";
-            logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-        }
+        FBA_TRACE_TFG(TRACE_LOC_DISABLED, tile, loc, target_id, 0, 0,
+            "ok_to_assign: tile " << tile << ", loc "
+            << loc << " not OK");
         return false;
     }
 
@@ -1304,11 +2523,19 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
     // positioner can physically reach every available target.  No need to check that
     // here.
 
-    // Const reference to the assignment for this tile.
-    auto const & ftile = loc_target.at(tile);
+    // The assignment for this tile, either from loc_target or from a dense
+    // copy indexed by location (-1 if unassigned).
+    std::map <int32_t, int32_t> const * ftile = NULL;
+    if (tile_assign == NULL) {
+        ftile = &(tile_data(tile).loc_target);
+    }
 
-    std::vector <int32_t> nbs;
-    std::vector <int64_t> nbtarget;
+    // The neighbors to check and their targets.  These are kept for each
+    // thread, so that they are not allocated on every call.
+    static thread_local std::vector <int32_t> nbs;
+    static thread_local std::vector <int32_t> nbtarget;
+    nbs.clear();
+    nbtarget.clear();
 
     auto const & neighbors = hw->neighbors.at(loc);
 
@@ -1322,18 +2549,17 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
             // Include this neighbor in the list to check
             nbs.push_back(nb);
             nbtarget.push_back(-1);
-        } else if (ftile.count(nb) > 0) {
+        } else if ((tile_assign == NULL) ? (ftile->count(nb) > 0)
+                   : ((*tile_assign)[nb] >= 0)) {
             // This neighbor has some assignment.
-            int64_t nbtg = ftile.at(nb);
+            int32_t nbtg = (tile_assign == NULL) ? ftile->at(nb)
+                : (*tile_assign)[nb];
             if (nbtg == target) {
                 // Target already assigned to a neighbor.
-                if (extra_log) {
-                    logmsg.str("");
-                    logmsg << "ok_to_assign: tile " << tile << ", loc "
-                        << loc << ", target " << target
-                        << " already assigned to neighbor loc " << nb;
-                    logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-                }
+                FBA_TRACE_TFG(TRACE_NEIGHBOR_TARGET, tile, loc, target_id, nb, 0,
+                    "ok_to_assign: tile " << tile << ", loc "
+                    << loc << ", target " << target_id
+                    << " already assigned to neighbor loc " << nb);
                 return false;
             }
             nbs.push_back(nb);
@@ -1347,14 +2573,14 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
 
     bool collide = false;
 
-    fbg::dpair tpos = target_xy.at(target);
+    fbg::dpair tpos = target_xy.xy(target);
 
     // On average, the number of neighbors is 2-3.  Threading overhead seems
     // to negate the benefit here.
     // #pragma omp parallel for reduction(||:collide) schedule(dynamic) default(none) shared(hw, nbs, nbtarget, nnb, tcenter, tpos, target_xy)
     for (size_t b = 0; b < nnb; ++b) {
         int32_t const & nb = nbs[b];
-        int64_t nbt = nbtarget[b];
+        int32_t nbt = nbtarget[b];
         if (nbt < 0) {
             // This neighbor is disabled.  Check for collisions with the neighbor
             // in its fixed theta / phi location.
@@ -1369,18 +2595,18 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
         } else {
             // Neighbor is working, check for collisions with the neighbor in
             // its currently assigned position.
-            auto npos = target_xy.at(nbt);
+            auto npos = target_xy.xy(nbt);
             collide = hw->collide_xy(loc, tpos, nb, npos);
         }
         // Remove these lines if switching back to threading.
         if (collide) {
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "ok_to_assign: tile " << tile << ", loc "
-                    << loc << ", target " << target
-                    << " would collide with target " << nbt;
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+            count_pass(PASS_STAT_COLLISIONS);
+            FBA_TRACE_TFG(TRACE_COLLIDE, tile, loc, target_id, nb,
+                ((nbt < 0) ? -1 : tgs_->data[nbt].id),
+                "ok_to_assign: tile " << tile << ", loc "
+                << loc << ", target " << target_id
+                << " would collide with target "
+                << ((nbt < 0) ? -1 : tgs_->data[nbt].id));
             return false;
         }
     }
@@ -1394,13 +2620,11 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
 
     collide = hw->collide_xy_edges(loc, tpos);
     if (collide) {
-        if (extra_log) {
-            logmsg.str("");
-            logmsg << "ok_to_assign: tile " << tile << ", loc "
-                << loc << ", target " << target
-                << " would collide with GFA or Petal Boundary ";
-            logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-        }
+        count_pass(PASS_STAT_COLLISIONS);
+        FBA_TRACE_TFG(TRACE_COLLIDE_EDGE, tile, loc, target_id, 0, 0,
+            "ok_to_assign: tile " << tile << ", loc "
+            << loc << ", target " << target_id
+            << " would collide with GFA or Petal Boundary ");
         return false;
     }
 
@@ -1410,56 +2634,56 @@ bool fba::Assignment::ok_to_assign (fba::Hardware const * hw, int32_t tile,
 
 
 void fba::Assignment::assign_tileloc(fba::Hardware const * hw,
-    fba::Targets * tgs, int32_t tile, int32_t loc, int64_t target,
+    fba::Targets * tgs, int32_t tile, int32_t loc, int32_t target,
     uint8_t type) {
 
     fba::Logger & logger = fba::Logger::get();
-    bool extra_log = logger.extra_debug();
-    std::ostringstream logmsg;
 
     if (target < 0) {
-        logmsg.str("");
-        logmsg << "cannot assign negative target ID to tile "
+        std::ostringstream logmsg;
+        logmsg << "cannot assign negative target row to tile "
             << tile << ", loc " << loc << ".  Did you mean to unassign?";
         logger.warning(logmsg.str().c_str());
         return;
     }
 
-    auto & ftarg = loc_target[tile];
+    auto & tgobj = tgs->data[target];
+
+    auto const & ftarg = tile_data(tile).loc_target;
 
     if (ftarg.count(loc) > 0) {
-        int64_t cur = ftarg.at(loc);
+        int32_t cur = ftarg.at(loc);
         if (cur >= 0) {
-            logmsg.str("");
+            std::ostringstream logmsg;
             logmsg << "tile " << tile << ", loc " << loc
-                << " already assigned to target " << cur
-                << " cannot assign " << target;
+                << " already assigned to target " << tgs->data[cur].id
+                << " cannot assign " << tgobj.id;
             logger.warning(logmsg.str().c_str());
             return;
         }
     }
 
-    auto & tfiber = target_loc[target];
+    auto const & tfiber = target_loc[target];
 
     if (tfiber.count(tile) > 0) {
-        logmsg.str("");
-        logmsg << "target " << target << " already assigned on tile " << tile;
+        std::ostringstream logmsg;
+        logmsg << "target " << tgobj.id << " already assigned on tile " << tile;
         logger.warning(logmsg.str().c_str());
         return;
     }
 
-    auto & tgobj = tgs->data.at(target);
-
     if ( ! tgobj.is_type(type)) {
-        logmsg.str("");
-        logmsg << "target " << target << " not of type "
+        std::ostringstream logmsg;
+        logmsg << "target " << tgobj.id << " not of type "
             << (int)type;
         logger.error(logmsg.str().c_str());
         throw std::runtime_error(logmsg.str().c_str());
     }
 
-    ftarg[loc] = target;
-    target_loc[target][tile] = loc;
+    auto & tstate = tile_data_mut(tile);
+    tstate.loc_target[loc] = target;
+    tstate.loc_used[loc] = true;
+    target_loc.mut(target)[tile] = loc;
 
     int32_t petal = hw->loc_petal.at(loc);
     int32_t slitblock = hw->loc_slitblock.at(loc);
@@ -1467,33 +2691,36 @@ void fba::Assignment::assign_tileloc(fba::Hardware const * hw,
     // Objects can be more than one type (e.g. standards and science).  When
     // incrementing the counts of object types per tile and petal, we want
     // to update the counts for valid types of this object.
-    static const std::vector <uint8_t> target_types = {
-        TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD,
-        TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY, TARGET_TYPE_SAFE};
-    for (auto const & tt : target_types) {
+    static const std::vector <uint8_t> target_types = count_types();
+    for (int32_t c = 0; c < ASSIGN_COUNT_TYPES; ++c) {
+        uint8_t tt = target_types[c];
         if (tgobj.is_type(tt)) {
-            nassign_tile.at(tt).at(tile)++;
-            nassign_petal.at(tt).at(tile).at(petal)++;
+            tstate.nassign[c]++;
+            tstate.nassign_petal[petal_slot(c, petal)]++;
             if (slitblock >= 0)
-                nassign_slitblock.at(tt).at(tile).at(petal).at(slitblock)++;
-            if (extra_log) {
-                logmsg.str("");
-                logmsg << "assign_tileloc: tile " << tile << ", loc "
-                    << loc << ", target " << target << ", type "
-                    << (int)tt << " N_tile now = "
-                    << nassign_tile.at(tt).at(tile)
-                    << " N_petal now = "
-                       << nassign_petal.at(tt).at(tile).at(petal);
-                if (slitblock >= 0) {
-                    logmsg << " N_slitblock now = "
-                           << nassign_slitblock.at(tt).at(tile).at(petal).at(slitblock);
-                } else
-                    logmsg << " (no slitblock)";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
-            }
+                tstate.nassign_slitblock[slitblock_slot(c, petal, slitblock)]++;
+            FBA_TRACE_TFG(TRACE_ASSIGN, tile, loc, tgobj.id, tt, 0,
+                "assign_tileloc: tile " << tile << ", loc "
+                << loc << ", target " << tgobj.id << ", type "
+                << (int)tt << " N_tile now = "
+                << tstate.nassign[c]
+                << " N_petal now = "
+                << tstate.nassign_petal[petal_slot(c, petal)]
+                << " N_slitblock now = "
+                << ((slitblock >= 0)
+                    ? tstate.nassign_slitblock[slitblock_slot(c, petal, slitblock)]
+                    : -1));
         }
     }
-    tgobj.obsremain--;
+    if (tgobj.is_science() && ! tgobj.is_standard()) {
+        tstate.nscience_only++;
+    }
+    count_pass(PASS_STAT_ASSIGNED);
+    change_obsremain(target, -1);
+
+    if (! journal_marks_.empty()) {
+        journal_.push_back({true, type, tile, loc, target});
+    }
 
     return;
 }
@@ -1503,82 +2730,571 @@ void fba::Assignment::unassign_tileloc(fba::Hardware const * hw,
     fba::Targets * tgs, int32_t tile, int32_t loc, uint8_t type) {
 
     fba::Logger & logger = fba::Logger::get();
-    bool extra_log = logger.extra_debug();
-    std::ostringstream logmsg;
 
-    if (loc_target.count(tile) == 0) {
-        logmsg.str("");
+    if (tiles_->order.count(tile) == 0) {
+        std::ostringstream logmsg;
         logmsg << "tile " << tile
             << " has no locations assigned.  Ignoring unassign";
         logger.warning(logmsg.str().c_str());
         return;
     }
-    auto & ftarg = loc_target.at(tile);
+    auto const & ftarg = tile_data(tile).loc_target;
 
     if (ftarg.count(loc) == 0) {
-        logmsg.str("");
+        std::ostringstream logmsg;
         logmsg << "tile " << tile << ", loc " << loc
             << " already unassigned";
         logger.warning(logmsg.str().c_str());
         return;
     }
 
-    int64_t target = ftarg.at(loc);
+    int32_t target = ftarg.at(loc);
     if (target < 0) {
-        logmsg.str("");
+        std::ostringstream logmsg;
         logmsg << "tile " << tile << ", loc " << loc
             << " already unassigned";
         logger.warning(logmsg.str().c_str());
         return;
     }
 
-    auto & tgobj = tgs->data.at(target);
+    auto & tgobj = tgs->data[target];
 
     if ( ! tgobj.is_type(type)) {
-        logmsg.str("");
-        logmsg << "current target " << target << " not of type "
+        std::ostringstream logmsg;
+        logmsg << "current target " << tgobj.id << " not of type "
             << (int)type << " requested in unassign of tile " << tile
             << ", loc " << loc;
         logger.error(logmsg.str().c_str());
         throw std::runtime_error(logmsg.str().c_str());
     }
 
+    auto & tstate = tile_data_mut(tile);
+
     int32_t petal = hw->loc_petal.at(loc);
     int32_t slitblock = hw->loc_slitblock.at(loc);
 
     // Objects can be more than one type (e.g. standards and science).  When
     // incrementing the counts of object types per tile and petal, we want
     // to update the counts for valid types of this object.
-    static const std::vector <uint8_t> target_types = {
-        TARGET_TYPE_SCIENCE, TARGET_TYPE_STANDARD,
-        TARGET_TYPE_SKY, TARGET_TYPE_SUPPSKY, TARGET_TYPE_SAFE};
-    for (auto const & tt : target_types) {
+    static const std::vector <uint8_t> target_types = count_types();
+    for (int32_t c = 0; c < ASSIGN_COUNT_TYPES; ++c) {
+        uint8_t tt = target_types[c];
         if (tgobj.is_type(tt)) {
-            nassign_tile.at(tt).at(tile)--;
-            nassign_petal.at(tt).at(tile).at(petal)--;
+            tstate.nassign[c]--;
+            tstate.nassign_petal[petal_slot(c, petal)]--;
             if (slitblock >= 0)
-                nassign_slitblock.at(tt).at(tile).at(petal).at(slitblock)--;
-            if (extra_log) {
+                tstate.nassign_slitblock[slitblock_slot(c, petal, slitblock)]--;
+            FBA_TRACE_TFG(TRACE_UNASSIGN, tile, loc, tgobj.id, tt, 0,
+                "unassign_tileloc: tile " << tile << ", loc "
+                << loc << ", target " << tgobj.id << ", type "
+                << (int)tt << " N_tile now = "
+                << tstate.nassign[c]
+                << " N_petal now = "
+                << tstate.nassign_petal[petal_slot(c, petal)]
+                << " N_slitblock now = "
+                << ((slitblock >= 0)
+                    ? tstate.nassign_slitblock[slitblock_slot(c, petal, slitblock)]
+                    : -1));
+        }
+    }
+    if (tgobj.is_science() && ! tgobj.is_standard()) {
+        tstate.nscience_only--;
+    }
+    count_pass(PASS_STAT_UNASSIGNED);
+    change_obsremain(target, 1);
+
+    target_loc.mut(target).erase(tile);
+    tstate.loc_target.erase(loc);
+    tstate.loc_used[loc] = false;
+
+    if (! journal_marks_.empty()) {
+        journal_.push_back({false, type, tile, loc, target});
+    }
+
+    return;
+}
+
+
+void fba::Assignment::change_obsremain(int32_t target, int32_t change) {
+    obsremain_.mut(target) += change;
+
+    if (! is_fork_) {
+        auto & tgobj = tgs_->data[target];
+        bool before = (tgobj.obsremain > 0);
+        tgobj.obsremain += change;
+        bool after = (tgobj.obsremain > 0);
+        if (tgobj.is_science() && (before != after)) {
+            // The target has just run out of observations, or needs
+            // more of them again.
+            tgsavail_->update_remain(locavail_->data[target]);
+        }
+    }
+    return;
+}
+
+
+void fba::Assignment::add_targets(
+    std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+    std::map<int64_t, std::vector<double> > const & tile_x,
+    std::map<int64_t, std::vector<double> > const & tile_y) {
+
+    check_no_transaction("add_targets");
+    check_no_fork("add_targets");
+
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region("add_targets: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // The new targets must already exist in the Targets object.  Targets
+    // which are already projected onto a tile are skipped, so that passing
+    // the same tile / target lists twice is harmless.
+
+    std::map<int64_t, std::vector<int64_t> > new_ids;
+    std::map<int64_t, std::vector<double> > new_x;
+    std::map<int64_t, std::vector<double> > new_y;
+
+    for (auto const & it : tile_targetids) {
+        int32_t tile_id = it.first;
+        if (tiles_->order.count(tile_id) == 0) {
+            logmsg.str("");
+            logmsg << "add_targets:  tile " << tile_id
+                << " is not in this assignment";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        // Tiles added with add_tiles() have no projected targets yet.
+        auto txy = tgsavail_->tile_xy.find(tile_id);
+        auto const & tx = tile_x.at(tile_id);
+        auto const & ty = tile_y.at(tile_id);
+        auto & nid = new_ids[tile_id];
+        auto & nx = new_x[tile_id];
+        auto & ny = new_y[tile_id];
+        for (size_t i = 0; i < it.second.size(); ++i) {
+            int64_t tgid = it.second[i];
+            if (tgs_->rows.count(tgid) == 0) {
                 logmsg.str("");
-                logmsg << "unassign_tileloc: tile " << tile << ", loc "
-                    << loc << ", target " << target << ", type "
-                    << (int)tt << " N_tile now = "
-                    << nassign_tile.at(tt).at(tile)
-                    << " N_petal now = "
-                       << nassign_petal.at(tt).at(tile).at(petal);
-                if (slitblock >= 0)
-                    logmsg << " N_slitblock now = "
-                           << nassign_slitblock.at(tt).at(tile).at(petal).at(slitblock);
-                else
-                    logmsg << " (no slitblock)";
-                logger.debug_tfg(tile, loc, target, logmsg.str().c_str());
+                logmsg << "add_targets:  target " << tgid
+                    << " must be appended to the Targets before adding"
+                    << " it to the assignment";
+                logger.error(logmsg.str().c_str());
+                throw std::runtime_error(logmsg.str().c_str());
+            }
+            if ((txy != tgsavail_->tile_xy.end())
+                && txy->second.has(tgs_->rows.at(tgid))) {
+                continue;
+            }
+            nid.push_back(tgid);
+            nx.push_back(tx.at(i));
+            ny.push_back(ty.at(i));
+        }
+    }
+
+    auto added = tgsavail_->add(new_ids, new_x, new_y);
+    locavail_->add(added);
+
+    // Rows of any newly appended targets.
+    size_t nold = obsremain_.size();
+    target_loc.resize(tgs_->data.size());
+    obsremain_.resize(tgs_->data.size());
+    for (size_t r = nold; r < tgs_->data.size(); ++r) {
+        obsremain_.mut(r) = tgs_->data[r].obsremain;
+    }
+
+    for (auto const & it : added) {
+        int32_t tile_id = it.first;
+        std::set <int32_t> reachable;
+        for (auto const & lit : it.second) {
+            reachable.insert(lit.second.begin(), lit.second.end());
+        }
+        FBA_LOG_DEBUG("add_targets:  tile " << tile_id << " has "
+            << reachable.size() << " new reachable targets");
+    }
+
+    tm.stop();
+    tm.report("Adding targets to assignment");
+
+    return;
+}
+
+
+void fba::Assignment::add_tiles(fba::Tiles const & new_tiles,
+    std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+    std::map<int64_t, std::vector<double> > const & tile_x,
+    std::map<int64_t, std::vector<double> > const & tile_y,
+    std::map<int32_t, std::map<int32_t, bool> > const & stuck_sky) {
+
+    check_no_transaction("add_tiles");
+    check_no_fork("add_tiles");
+
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region("add_tiles: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // Targets can only be given for the new tiles.  Check this before
+    // modifying anything.
+    std::set <int32_t> new_ids(new_tiles.id.begin(), new_tiles.id.end());
+    for (auto const & it : tile_targetids) {
+        if (new_ids.count(it.first) == 0) {
+            logmsg.str("");
+            logmsg << "add_tiles:  targets given for tile " << it.first
+                << " which is not one of the new tiles";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+    }
+
+    // The Tiles object is shared with the available targets and locations,
+    // so this extends all of them.
+    size_t nold = tiles_->id.size();
+    tiles_->append(new_tiles);
+
+    tile_state_.resize(tiles_->id.size());
+    for (size_t t = nold; t < tiles_->id.size(); ++t) {
+        init_tile(t, stuck_sky);
+    }
+
+    // Every new tile gets an entry in the available targets, even if no
+    // targets can reach it.
+    std::map<int64_t, std::vector<int64_t> > ids(tile_targetids);
+    std::map<int64_t, std::vector<double> > x(tile_x);
+    std::map<int64_t, std::vector<double> > y(tile_y);
+    for (auto const & tid : new_tiles.id) {
+        ids[tid];
+        x[tid];
+        y[tid];
+    }
+    add_targets(ids, x, y);
+
+    logmsg.str("");
+    logmsg << "Adding " << new_tiles.id.size() << " tiles to assignment";
+    tm.stop();
+    tm.report(logmsg.str().c_str());
+
+    return;
+}
+
+
+void fba::Assignment::observe(std::vector <int32_t> const & tiles,
+    std::vector <int64_t> const & observed) {
+
+    check_no_transaction("observe");
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    // Check all tiles before modifying anything.
+    for (auto const & tile_id : tiles) {
+        if (tiles_->order.count(tile_id) == 0) {
+            logmsg.str("");
+            logmsg << "observe:  tile " << tile_id
+                << " is not in this assignment";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+    }
+
+    std::set <int64_t> obs(observed.begin(), observed.end());
+
+    for (auto const & tile_id : tiles) {
+        if (tile_data(tile_id).observed) {
+            continue;
+        }
+        auto & tstate = tile_data_mut(tile_id);
+        tstate.observed = true;
+
+        // Assignments stay in place as the record of the observation.
+        // Targets which were assigned but not observed get their
+        // observation back.
+        int32_t nfailed = 0;
+        for (auto const & lt : tstate.loc_target) {
+            int32_t tgrow = lt.second;
+            if (obs.count(tgs_->data[tgrow].id) == 0) {
+                change_obsremain(tgrow, 1);
+                nfailed++;
+            }
+        }
+        FBA_LOG_DEBUG("observe:  tile " << tile_id << " has "
+            << tstate.loc_target.size() << " assigned locations, "
+            << nfailed << " not observed");
+    }
+
+    return;
+}
+
+
+std::map <std::string, int64_t> fba::Assignment::update_fiber_state(
+    std::vector <int32_t> const & locs,
+    std::vector <int32_t> const & states,
+    std::vector <double> const & theta_pos,
+    std::vector <double> const & phi_pos) {
+
+    check_no_transaction("update_fiber_state");
+    check_no_fork("update_fiber_state");
+
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region(
+        "update_fiber_state: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // This checks the inputs before modifying anything.
+    hw_->update_state(locs, states, theta_pos, phi_pos);
+
+    auto const * phw = hw_.get();
+    auto * ptgs = tgs_.get();
+
+    auto disabled = [phw](int32_t loc) {
+        int32_t st = phw->state.at(loc);
+        return ((st & FIBER_STATE_STUCK) || (st & FIBER_STATE_BROKEN));
+    };
+
+    // The neighbors of the locations which are now stuck or broken may
+    // collide with the fixed arm, so their assignments are checked again.
+    // Nothing else on the focalplane can be affected.
+    std::set <int32_t> changed(locs.begin(), locs.end());
+    std::set <int32_t> check;
+    for (auto const & loc : changed) {
+        if (! disabled(loc)) {
+            continue;
+        }
+        for (auto const & nb : hw_->neighbors.at(loc)) {
+            if ((changed.count(nb) == 0) && ! disabled(nb)) {
+                check.insert(nb);
+            }
+        }
+    }
+
+    ScratchArena tile_arena;
+    ArenaAllocator <int32_t> tile_alloc(&tile_arena);
+    tile_target_map tile_target_avail(tile_alloc);
+    tile_location_map tile_loc_avail(tile_alloc);
+    std::vector <target_weight> tile_target_weights;
+
+    int64_t nunassigned = 0;
+    int64_t ncollide = 0;
+    int64_t nrefill = 0;
+
+    for (size_t t = 0; t < tiles_->id.size(); ++t) {
+        int32_t tile_id = tiles_->id[t];
+        if (tile_data(tile_id).observed) {
+            // Observed tiles are frozen.
+            continue;
+        }
+        if (tile_data(tile_id).loc_target.empty()) {
+            // Nothing assigned on this tile yet.
+            continue;
+        }
+
+        // Locations which are free to be refilled.
+        std::vector <int32_t> freed;
+
+        for (auto const & loc : changed) {
+            auto const & ftarg = tile_data(tile_id).loc_target;
+            auto lt = ftarg.find(loc);
+            if (disabled(loc)) {
+                if (lt != ftarg.end()) {
+                    unassign_tileloc(phw, ptgs, tile_id, loc,
+                                     ptgs->data[lt->second].type);
+                    nunassigned++;
+                }
+            } else if (lt == ftarg.end()) {
+                freed.push_back(loc);
+            }
+        }
+
+        auto const & target_xy = tgsavail_->tile_xy.at(tile_id);
+        for (auto const & nb : check) {
+            auto const & ftarg = tile_data(tile_id).loc_target;
+            auto lt = ftarg.find(nb);
+            if (lt == ftarg.end()) {
+                continue;
+            }
+            int32_t tgrow = lt->second;
+            if (! ok_to_assign(phw, tile_id, nb, tgrow, target_xy)) {
+                FBA_TRACE_TFG(TRACE_MESSAGE, tile_id, nb,
+                    ptgs->data[tgrow].id, 0, 0,
+                    "update_fiber_state:  tile " << tile_id << ", loc "
+                    << nb << " collides with a disabled neighbor");
+                unassign_tileloc(phw, ptgs, tile_id, nb,
+                                 ptgs->data[tgrow].type);
+                ncollide++;
+                freed.push_back(nb);
+            }
+        }
+
+        if (freed.empty()) {
+            continue;
+        }
+
+        // Only science targets are refilled here.  The standards and sky
+        // targets are subject to per-petal and per-slitblock limits which
+        // are not known to this function, so the freed locations are left
+        // to later calls of assign_unused() for those types.
+        std::vector <int32_t> refill_locs;
+        for (auto const & loc : freed) {
+            if (loc_pos_[loc]) {
+                refill_locs.push_back(loc);
+            }
+        }
+        if (refill_locs.empty()) {
+            continue;
+        }
+        tile_available(
+            tile_id,
+            TARGET_TYPE_SCIENCE,
+            refill_locs,
+            tile_target_avail,
+            tile_loc_avail,
+            tile_target_weights,
+            false
+        );
+        sort_target_weights(tile_target_weights);
+        nrefill += assign_tile_greedy(tile_id, TARGET_TYPE_SCIENCE,
+            2147483647, 2147483647, tile_loc_avail, tile_target_weights);
+    }
+
+    std::map <std::string, int64_t> stats;
+    stats["unassigned"] = nunassigned;
+    stats["collisions"] = ncollide;
+    stats["refilled"] = nrefill;
+
+    logmsg.str("");
+    logmsg << "update_fiber_state:  " << changed.size() << " locations changed, "
+        << nunassigned << " unassigned, " << ncollide
+        << " neighbors unassigned after collisions, " << nrefill
+        << " refilled";
+    logger.info(logmsg.str().c_str());
+
+    tm.stop();
+    tm.report("Updating fiber state of assignment");
+
+    return stats;
+}
+
+
+void fba::Assignment::remove_targets(std::vector <int64_t> const & id) {
+    check_no_transaction("remove_targets");
+    check_no_fork("remove_targets");
+
+    fba::Timer tm;
+    tm.start();
+
+    fba::GlobalTimers & gtm = fba::GlobalTimers::get();
+
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    static int32_t const gtm_total_region = gtm.region("remove_targets: total");
+    GlobalTimerScope gtm_total(gtm_total_region);
+
+    // Check all IDs before modifying anything.
+    std::vector <int32_t> rows;
+    for (auto const & tgid : id) {
+        if (tgs_->rows.count(tgid) == 0) {
+            logmsg.str("");
+            logmsg << "remove_targets:  target " << tgid
+                << " does not exist";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        rows.push_back(tgs_->rows.at(tgid));
+    }
+
+    auto const * phw = hw_.get();
+    auto * ptgs = tgs_.get();
+
+    // Free any locations currently assigned to these targets.  All other
+    // assignments are left untouched.
+    for (auto const & tgrow : rows) {
+        if (tgrow >= (int32_t)target_loc.size()) {
+            continue;
+        }
+        auto const & tgobj = ptgs->data[tgrow];
+        std::vector <std::pair <int32_t, int32_t> > tl;
+        for (auto const & it : target_loc[tgrow]) {
+            tl.push_back(std::make_pair(it.first, it.second));
+        }
+        for (auto const & it : tl) {
+            FBA_TRACE_TFG(TRACE_MESSAGE, it.first, it.second, tgobj.id, 0, 0,
+                "remove_targets:  unassigning target " << tgobj.id
+                << " from tile " << it.first << ", loc " << it.second);
+            unassign_tileloc(phw, ptgs, it.first, it.second, tgobj.type);
+        }
+        target_loc.mut(tgrow).clear();
+    }
+
+    auto removed = locavail_->remove(rows);
+    tgsavail_->remove(removed);
+
+    ptgs->remove(id);
+
+    tm.stop();
+    tm.report("Removing targets from assignment");
+
+    return;
+}
+
+
+void fba::Assignment::update_targets(
+    std::vector <int64_t> const & id,
+    std::vector <int32_t> const & obsremain,
+    std::vector <int32_t> const & priority,
+    std::vector <double> const & subpriority) {
+
+    check_no_transaction("update_targets");
+    check_no_fork("update_targets");
+
+    // The new obsremain values are the number of observations remaining
+    // before this assignment.  Account for the locations already assigned
+    // to each target on tiles which are not yet observed, which have
+    // decremented the value stored in the Targets object.  Ordering by total priority happens during each
+    // assignment pass, so only the lists of science targets with
+    // observations remaining need to be refreshed.
+
+    std::vector <int32_t> remain(obsremain);
+    for (size_t t = 0; (t < id.size()) && (t < remain.size()); ++t) {
+        auto idrow = tgs_->rows.find(id[t]);
+        if ((idrow != tgs_->rows.end())
+            && (idrow->second < (int32_t)target_loc.size())) {
+            for (auto const & tl : target_loc[idrow->second]) {
+                if (! tile_data(tl.first).observed) {
+                    remain[t]--;
+                }
             }
         }
     }
-    tgobj.obsremain++;
+    tgs_->update(id, remain, priority, subpriority);
 
-    target_loc[target].erase(tile);
-    ftarg.erase(loc);
+    for (auto const & tgid : id) {
+        int32_t tgrow = tgs_->rows.at(tgid);
+        if (tgrow < (int32_t)obsremain_.size()) {
+            obsremain_.mut(tgrow) = tgs_->data[tgrow].obsremain;
+        }
+        if ((tgrow < (int32_t)locavail_->data.size())
+            && tgs_->data[tgrow].is_science()) {
+            tgsavail_->update_remain(locavail_->data[tgrow]);
+        }
+    }
 
     return;
 }
@@ -1586,7 +3302,7 @@ void fba::Assignment::unassign_tileloc(fba::Hardware const * hw,
 
 void fba::Assignment::targets_to_project(
     fba::Targets const * tgs,
-    std::map <int32_t, std::vector <int64_t> > const & tgsavail,
+    std::map <int32_t, std::vector <int32_t> > const & tgsavail,
     std::vector <int32_t> const & locs,
     std::vector <int64_t> & tgids,
     std::vector <double> & tgra,
@@ -1594,7 +3310,7 @@ void fba::Assignment::targets_to_project(
     // This function computes the target IDs that need to be projected
     // for a given set of locations on a tile.
 
-    std::set <int64_t> seen;
+    std::set <int32_t> seen;
     tgids.clear();
     tgra.clear();
     tgdec.clear();
@@ -1604,14 +3320,14 @@ void fba::Assignment::targets_to_project(
         if (tgsavail.count(lid) > 0) {
             // The available targets for this location.
             auto const & avail = tgsavail.at(lid);
-            for (auto const & id : avail) {
-                if (seen.count(id) == 0) {
+            for (auto const & row : avail) {
+                if (seen.count(row) == 0) {
                     // This target has not yet been processed.
-                    auto const & tg = tgs->data.at(id);
-                    tgids.push_back(id);
+                    auto const & tg = tgs->data[row];
+                    tgids.push_back(tg.id);
                     tgra.push_back(tg.ra);
                     tgdec.push_back(tg.dec);
-                    seen.insert(id);
+                    seen.insert(row);
                 }
             }
         }
@@ -8,9 +8,15 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <array>
 #include <memory>
+#include <scoped_allocator>
+#include <atomic>
+#include <stdexcept>
 
 #include <utils.h>
+#include <tasks.h>
 #include <hardware.h>
 #include <tiles.h>
 #include <targets.h>
@@ -18,6 +24,150 @@
 
 namespace fiberassign {
 
+// The number of target classes counted by the assignment:  science,
+// standard, sky, suppsky and safe, in that order.
+
+#define ASSIGN_COUNT_TYPES 5
+
+// Counters of the work done by the assignment passes.  CANDIDATES are the
+// location / target pairs considered, OK_TO_ASSIGN the calls to the checks
+// before an assignment and COLLISIONS the pairs rejected by those checks
+// because of a collision with a neighbor or the edges of the petal and GFA.
+// BUMPS are science targets removed to make room for another target, and
+// REASSIGNMENTS science targets moved to a location on another tile.
+// ASSIGNED and UNASSIGNED count every change of the assignment.
+
+#define PASS_STAT_CANDIDATES 0
+#define PASS_STAT_OK_TO_ASSIGN 1
+#define PASS_STAT_COLLISIONS 2
+#define PASS_STAT_BUMPS 3
+#define PASS_STAT_REASSIGNMENTS 4
+#define PASS_STAT_ASSIGNED 5
+#define PASS_STAT_UNASSIGNED 6
+#define PASS_STAT_COUNT 7
+
+
+// The assignment counts of a range of tiles, in tile order, as dense row
+// major arrays for export.
+
+struct AssignmentCounts {
+    // The target classes along the type axis.
+    std::vector <uint8_t> types;
+    int32_t npetal;
+    int32_t nslitblock;
+    // tile[tile] = tile ID
+    std::vector <int32_t> tile;
+    // type[tile][type] = count
+    std::vector <int32_t> type;
+    // science_only[tile] = count of science targets which are not standards
+    std::vector <int32_t> science_only;
+    // petal[tile][type][petal] = count
+    std::vector <int32_t> petal;
+    // slitblock[tile][type][petal][slitblock] = count
+    std::vector <int32_t> slitblock;
+};
+
+
+// A vector whose elements are stored in blocks of B elements.  Copies of
+// this object share the blocks, and a block is copied the first time it is
+// modified through an object which does not hold the only reference to it.
+// Copies only use memory for the blocks they change, and different copies
+// may be modified concurrently from different threads.
+
+template <typename T, size_t B>
+class SharedBlocks {
+
+    public :
+
+        SharedBlocks() : size_(0) {}
+
+        size_t size() const {
+            return size_;
+        }
+
+        void resize(size_t n, T const & value = T()) {
+            // Reset the unused tail of the last block.
+            for (size_t i = size_; (i < n) && ((i % B) != 0); ++i) {
+                mut(i) = value;
+            }
+            blocks_.resize((n + B - 1) / B);
+            for (auto & blk : blocks_) {
+                if (! blk) {
+                    blk = std::make_shared <block> ();
+                    blk->fill(value);
+                }
+            }
+            size_ = n;
+            return;
+        }
+
+        // Resize an empty container, allocating and filling the blocks in
+        // TaskPool tasks, so that each block is first touched on the NUMA
+        // domain of the worker that handles it.
+        void resize_local(size_t n, T const & value = T()) {
+            if (size_ > 0) {
+                throw std::runtime_error("resize_local requires an empty SharedBlocks");
+            }
+            blocks_.resize((n + B - 1) / B);
+            TaskPool::get().run("SharedBlocks resize",
+                                blocks_.size(), [&](size_t b) {
+                blocks_[b] = std::make_shared <block> ();
+                blocks_[b]->fill(value);
+            });
+            size_ = n;
+            return;
+        }
+
+        T const & operator[] (size_t i) const {
+            return (*blocks_[i / B])[i % B];
+        }
+
+        T const & at(size_t i) const {
+            if (i >= size_) {
+                throw std::out_of_range("SharedBlocks index out of range");
+            }
+            return (*this)[i];
+        }
+
+        // Writable access to one element, copying its block if it is shared.
+        // References returned by operator[] for this block are not valid
+        // after this call.
+        T & mut(size_t i) {
+            auto & blk = blocks_[i / B];
+            if (blk.use_count() > 1) {
+                blk = std::make_shared <block> (*blk);
+            } else {
+                // Other copies release the block after reading it.
+                std::atomic_thread_fence(std::memory_order_acquire);
+            }
+            return (*blk)[i % B];
+        }
+
+        // Estimated heap memory in bytes.  Each block is divided between the
+        // copies which share it, so that the sum over an assignment and its
+        // forks is the memory actually used.
+        size_t memory_bytes() const {
+            size_t ret = blocks_.capacity() * sizeof(std::shared_ptr <block>);
+            for (auto const & blk : blocks_) {
+                // The block shares one allocation with its control block.
+                size_t bytes = heap_node_bytes + sizeof(block)
+                    + heap_bytes(*blk);
+                ret += bytes / static_cast <size_t> (blk.use_count());
+            }
+            return ret;
+        }
+
+    private :
+
+        typedef std::array <T, B> block;
+
+        std::vector <std::shared_ptr <block> > blocks_;
+
+        size_t size_;
+
+};
+
+
 // This class holds the current assignment information and methods for
 // refinement.
 
@@ -39,7 +189,8 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
                            int32_t max_per_slitblock = -1,
                            std::string const & pos_type = std::string("POS"),
                            int32_t start_tile = -1, int32_t stop_tile = -1,
-                           bool use_zero_obsremain = false);
+                           bool use_zero_obsremain = false,
+                           std::string const & solver = std::string("greedy"));
 
         void assign_force(uint8_t tgtype, int32_t required_per_petal = 0,
                           int32_t required_per_slitblock = 0,
@@ -48,6 +199,71 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
         void redistribute_science(int32_t start_tile = -1,
                                   int32_t stop_tile = -1);
 
+        // Assign SKY and then SUPPSKY targets to unused locations in one pass
+        // over the tiles.  When both limits are positive, each type is first
+        // assigned up to max_per_slitblock and then up to max_per_petal, as
+        // with separate assign_unused() calls.  The availability of each type
+        // is computed and sorted once per tile and shared by both limits.
+        void assign_unused_sky(int32_t max_per_petal = -1,
+                               int32_t max_per_slitblock = -1,
+                               std::string const & pos_type = std::string("POS"),
+                               int32_t start_tile = -1,
+                               int32_t stop_tile = -1);
+
+        // Local search over an existing assignment.  On each tile, science
+        // targets which are not assigned are placed by shifting a chain of up
+        // to max_depth assigned science targets to other locations, or by
+        // replacing a lower priority science target.  Sweeps repeat until
+        // nothing changes or time_budget seconds (if positive) have passed.
+        std::map <std::string, int64_t> refine(double time_budget = -1.0,
+                                               int32_t max_depth = 2,
+                                               int32_t start_tile = -1,
+                                               int32_t stop_tile = -1);
+
+        void add_targets(
+            std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+            std::map<int64_t, std::vector<double> > const & tile_x,
+            std::map<int64_t, std::vector<double> > const & tile_y);
+
+        void remove_targets(std::vector <int64_t> const & id);
+
+        // Change the state of some locations in the shared Hardware and
+        // repair the assignment of every tile which is not observed.
+        // Targets on locations which are now stuck or broken are
+        // unassigned, the neighbors of those locations are checked against
+        // the fixed arm, and only the freed locations are refilled with
+        // science targets from the existing availability.  Standards and
+        // sky targets have per-petal limits, so they are left to a later
+        // assign_unused() call.  Returns the number of locations
+        // unassigned, unassigned after collisions and refilled.
+        std::map <std::string, int64_t> update_fiber_state(
+            std::vector <int32_t> const & locs,
+            std::vector <int32_t> const & states,
+            std::vector <double> const & theta_pos,
+            std::vector <double> const & phi_pos);
+
+        // Streaming use over several epochs.  add_tiles() appends new tiles
+        // (and the targets reachable from them) to the shared Tiles object
+        // and to this assignment, reusing the availability already computed
+        // for the existing tiles.  observe() marks tiles as observed, after
+        // which their assignment is frozen.  Targets assigned on those tiles
+        // which are not in the observed list get that observation back.
+        void add_tiles(Tiles const & new_tiles,
+            std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+            std::map<int64_t, std::vector<double> > const & tile_x,
+            std::map<int64_t, std::vector<double> > const & tile_y,
+            std::map<int32_t, std::map<int32_t, bool> > const & stuck_sky
+            = std::map<int32_t, std::map<int32_t,bool> >());
+
+        void observe(std::vector <int32_t> const & tiles,
+                     std::vector <int64_t> const & observed);
+
+        void update_targets(
+            std::vector <int64_t> const & id,
+            std::vector <int32_t> const & obsremain,
+            std::vector <int32_t> const & priority,
+            std::vector <double> const & subpriority);
+
         Hardware::pshr hardware() const;
 
         Targets::pshr targets() const;
@@ -60,19 +276,104 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
 
         std::vector <int32_t> tiles_assigned() const;
 
-        std::map <int32_t, int64_t> const & tile_location_target(int32_t tile) const;
+        std::map <int32_t, int64_t> tile_location_target(int32_t tile) const;
+
+        // The first step of the "matching" solver on one tile:  a maximum
+        // priority matching of the available targets to the unassigned
+        // locations, ignoring collisions and the petal / slitblock limits.
+        // Returns the target ID matched to each location.  Nothing is
+        // assigned.
+        std::map <int32_t, int64_t> tile_matching(int32_t tile,
+            uint8_t tgtype = TARGET_TYPE_SCIENCE,
+            std::string const & pos_type = std::string("POS"),
+            bool use_zero_obsremain = false) const;
+
+        // The counts of assigned locations for each target class per tile,
+        // petal and slitblock.  These are kept up to date by every
+        // assignment, so this only copies them.
+        AssignmentCounts counts(int32_t start_tile = -1,
+                                int32_t stop_tile = -1) const;
+
+        // The target classes of the count arrays, in order.
+        static std::vector <uint8_t> count_types();
+
+        // The PASS_STAT_* counters, summed over threads, by name.
+        std::map <std::string, int64_t> pass_stats() const;
+
+        void reset_pass_stats();
+
+        static std::string pass_stat_name(int32_t stat);
+
+        // Counters of the work done when reassigning science targets:
+        // the number of calls, the tile / location candidates considered,
+        // the candidates skipped by the tile index search, and the
+        // candidates passed to the collision checks.
+        std::map <std::string, int64_t> reassign_stats() const;
+
+        void reset_reassign_stats();
+
+        // Transactions.  Every assignment and unassignment made after begin()
+        // is recorded, and rollback() undoes them in reverse order.
+        // Transactions may be nested.  Targets cannot be added, removed or
+        // updated while a transaction is open.
+        void begin();
+
+        void commit();
 
-        std::map <int32_t, std::map <int32_t, int64_t> > loc_target;
+        void rollback();
 
-        std::map <int64_t, std::map <int32_t, int32_t> > target_loc;
+        int32_t transaction_depth() const;
 
-        std::map <int32_t, std::map <int64_t, std::pair <double, double> > >
-            tile_target_xy;
+        // A copy of this assignment which can be modified independently, for
+        // example to compare different options from the same starting point.
+        // The hardware, tiles, targets and availability are shared, and the
+        // assignment of each tile and the per-target state are shared until
+        // one of the copies modifies them.  An assignment and its forks may
+        // be used concurrently from different threads, as long as each one
+        // is only used by one thread at a time.  Targets cannot be added, removed or
+        // updated in a fork, or in an assignment which has live forks.  The
+        // observations remaining for each target are tracked by the fork and
+        // are not written to the shared Targets.
+        pshr fork() const;
+
+        // Whether this assignment was created by fork().
+        bool is_fork() const;
+
+        // Projected target positions for a tile.  These are shared with the
+        // TargetsAvailable object.
+        TileTargetXY const & tile_target_xy(int32_t tile) const;
+
+        // Estimated heap memory of each member in bytes.  The target
+        // positions are owned by the TargetsAvailable object, and state
+        // shared with forks is divided between them.
+        std::map <std::string, int64_t> memory_usage() const;
 
     private :
 
         typedef std::pair <int32_t, double> location_weight;
 
+        // The available targets and locations of one tile.  These are
+        // rebuilt for every tile and pass, so they allocate from a
+        // ScratchArena owned by the caller, which tile_available() resets
+        // after clearing them.
+
+        typedef std::vector <target_weight, ArenaAllocator <target_weight> >
+            scratch_target_weights;
+
+        typedef std::vector <location_weight,
+            ArenaAllocator <location_weight> > scratch_location_weights;
+
+        typedef std::map <int32_t, scratch_target_weights, std::less <int32_t>,
+            std::scoped_allocator_adaptor <ArenaAllocator <
+                std::pair <const int32_t, scratch_target_weights> > > >
+            tile_target_map;
+
+        typedef std::map <int32_t, scratch_location_weights,
+            std::less <int32_t>,
+            std::scoped_allocator_adaptor <ArenaAllocator <
+                std::pair <const int32_t, scratch_location_weights> > > >
+            tile_location_map;
+
         struct location_distance_compare {
             // Define this method here so that it is inline.
             bool operator() (location_weight const & lhs,
@@ -85,9 +386,72 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
             int32_t tile_id,
             uint8_t tgtype,
             std::vector <int32_t> const & locs,
-            std::map <int32_t, std::vector <target_weight> > & tile_target_avail,
-            std::map <int64_t, std::vector <location_weight> > & tile_loc_avail,
-            std::vector <target_weight> & tile_target_weights, bool use_zero_obsremain
+            tile_target_map & tile_target_avail,
+            tile_location_map & tile_loc_avail,
+            std::vector <target_weight> & tile_target_weights, bool use_zero_obsremain,
+            std::vector <int32_t> * tile_target_locs = NULL
+        ) const;
+
+        // If rejected is given, location / target pairs in it are skipped and
+        // pairs which fail ok_to_assign() are added to it.
+        int32_t assign_tile_greedy(
+            int32_t tile_id,
+            uint8_t tgtype,
+            int32_t max_per_petal,
+            int32_t max_per_slitblock,
+            tile_location_map const & tile_loc_avail,
+            std::vector <target_weight> const & tile_target_weights,
+            std::set <std::pair <int32_t, int32_t> > * rejected = NULL
+        );
+
+        int32_t assign_tile_petal(
+            int32_t tile_id,
+            uint8_t tgtype,
+            int32_t max_per_petal,
+            int32_t max_per_slitblock,
+            tile_location_map const & tile_loc_avail,
+            std::vector <target_weight> const & tile_target_weights
+        );
+
+        // The maximum priority matching of the targets in
+        // tile_target_weights.  tgrows has the unassigned targets in
+        // priority order and tg_match the location of each one (-1 if it
+        // is not matched).
+        void match_tile(
+            int32_t tile_id,
+            tile_location_map const & tile_loc_avail,
+            std::vector <target_weight> const & tile_target_weights,
+            std::vector <int32_t> & tgrows,
+            std::vector <int32_t> & tg_match
+        ) const;
+
+        int32_t assign_tile_matching(
+            int32_t tile_id,
+            uint8_t tgtype,
+            int32_t max_per_petal,
+            int32_t max_per_slitblock,
+            tile_location_map const & tile_loc_avail,
+            std::vector <target_weight> const & tile_target_weights
+        );
+
+        bool refine_place(
+            int32_t tile_id,
+            int32_t tgrow,
+            int32_t depth,
+            tile_location_map const & tile_loc_avail,
+            TileTargetXY const & target_xy,
+            std::vector <int32_t> & tile_assign,
+            std::vector <int32_t> & loc_stamp,
+            int32_t stamp,
+            std::vector <std::pair <int32_t, int32_t> > & chain
+        ) const;
+
+        bool refine_reachable(
+            int32_t tile_id,
+            int32_t tgrow,
+            int32_t depth,
+            tile_location_map const & tile_loc_avail,
+            std::vector <int32_t> const & tile_assign
         ) const;
 
         int32_t petal_count(
@@ -122,8 +486,9 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
             Hardware const * hw,
             int32_t tile,
             int32_t loc,
-            int64_t target,
-            std::map <int64_t, std::pair <double, double> > const & target_xy
+            int32_t target,
+            TileTargetXY const & target_xy,
+            std::vector <int32_t> const * tile_assign = NULL
         ) const;
 
         void assign_tileloc(
@@ -131,7 +496,7 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
             Targets * tgs,
             int32_t tile,
             int32_t loc,
-            int64_t target,
+            int32_t target,
             uint8_t type
         );
 
@@ -143,9 +508,16 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
             uint8_t type
         );
 
+        void change_obsremain(int32_t target, int32_t change);
+
+        void init_tile(
+            size_t tile_order,
+            std::map <int32_t, std::map <int32_t, bool> > const & stuck_sky
+        );
+
         void targets_to_project(
             Targets const * tgs,
-            std::map <int32_t, std::vector <int64_t> > const & tgsavail,
+            std::map <int32_t, std::vector <int32_t> > const & tgsavail,
             std::vector <int32_t> const & locs,
             std::vector <int64_t> & tgids,
             std::vector <double> & tgra,
@@ -157,22 +529,86 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
             int32_t tstop,
             int32_t tile,
             int32_t loc,
-            int64_t target,
+            int32_t target,
             bool force,
             int32_t & new_tile,
             int32_t & new_loc
-        ) const;
+        );
+
+        // The assignment of one tile.  The structures refer to targets by
+        // their row in the Targets object, not by target ID.
+        struct tile_state {
+            // loc_target[loc] = target_row
+            std::map <int32_t, int32_t> loc_target;
+
+            // loc_used[loc] = true if the location is assigned.
+            std::vector <bool> loc_used;
+
+            // The number of assigned locations per tile, spectrograph
+            // (petal) and slitblock for each target class.  The class is
+            // the position c = count_index(target_type).
+            // nassign[c] = count
+            std::array <int32_t, ASSIGN_COUNT_TYPES> nassign;
+            // nassign_petal[c * npetal + petal_id] = count
+            std::vector <int32_t> nassign_petal;
+            // nassign_slitblock[(c * npetal + petal_id) * nslitblock
+            //                   + slitblock_id] = count
+            std::vector <int32_t> nassign_slitblock;
+
+            // The number of assigned targets which are science targets and
+            // not standards.
+            int32_t nscience_only;
+
+            // True once the tile has been passed to observe().
+            bool observed;
+
+            friend size_t heap_bytes(tile_state const & val) {
+                return heap_bytes(val.loc_target)
+                    + heap_bytes(val.loc_used)
+                    + heap_bytes(val.nassign)
+                    + heap_bytes(val.nassign_petal)
+                    + heap_bytes(val.nassign_slitblock);
+            }
+        };
+
+        // The state of each tile, indexed by the tile order.
+        SharedBlocks <tile_state, 1> tile_state_;
+
+        // The position of a target class in the count arrays.
+        static int32_t count_index(uint8_t tgtype);
+
+        size_t petal_slot(int32_t ctype, int32_t petal) const {
+            return static_cast <size_t> (ctype * hw_->npetal + petal);
+        }
 
-        // The number of assigned locations per tile and spectrograph (petal)
-        // For each target class.
-        std::map <uint8_t, std::map <int32_t, int32_t> > nassign_tile;
-        // [target_type][tile_id][petal_id] = count
-        std::map <uint8_t,
-            std::map <int32_t, std::map <int32_t, int32_t> > > nassign_petal;
-        // [target_type][tile_id][petal_id][slitblock_id] = count
-        std::map <uint8_t,
-            std::map <int32_t,
-            std::map <int32_t, std::map <int32_t, int32_t> > > > nassign_slitblock;
+        size_t slitblock_slot(int32_t ctype, int32_t petal,
+                              int32_t slitblock) const {
+            return static_cast <size_t> (
+                (ctype * hw_->npetal + petal) * hw_->nslitblock + slitblock
+            );
+        }
+
+        tile_state const & tile_data(int32_t tile) const;
+
+        // Writable state of a tile.  This copies the state if it is shared
+        // with a fork, so references from tile_data() should not be held
+        // across calls which modify the assignment.
+        tile_state & tile_data_mut(int32_t tile);
+
+        // target_loc[target_row][tile] = loc
+        SharedBlocks <std::map <int32_t, int32_t>, 256> target_loc;
+
+        // obsremain_[target_row] = the observations remaining for this target.
+        // The original assignment also keeps the Targets object up to date.
+        SharedBlocks <int32_t, 1024> obsremain_;
+
+        // True if this was created by fork().
+        bool is_fork_;
+
+        // Shared by an assignment and all of its forks.
+        std::shared_ptr <int> family_;
+
+        void check_no_fork(char const * caller) const;
 
         // shared handle to the hardware configuration.
         Hardware::pshr hw_;
@@ -189,6 +625,43 @@ class Assignment : public std::enable_shared_from_this <Assignment> {
         // shared handle to the available locations for targets.
         LocationsAvailable::pshr locavail_;
 
+        // loc_pos_[loc] = true if the location is a science positioner.
+        std::vector <bool> loc_pos_;
+
+        // Reassignment cost counters.
+        int64_t reassign_calls_;
+        int64_t reassign_candidates_;
+        int64_t reassign_skipped_;
+        int64_t reassign_checked_;
+
+        // Pass counters of each TaskPool worker.  The vector storage is not
+        // aligned to a cache line (there is no over-aligned new in C++14),
+        // so each row is padded to two lines.  The counters in use are then
+        // always more than a line apart, and the workers of the petal
+        // solver do not share them.
+        mutable std::vector <std::array <int64_t, 16> > pass_stats_;
+
+        void count_pass(int32_t stat, int64_t n = 1) const {
+            pass_stats_[TaskPool::worker()][stat] += n;
+        }
+
+        // One assignment or unassignment recorded in the transaction journal.
+        struct journal_entry {
+            bool assign;
+            uint8_t type;
+            int32_t tile;
+            int32_t loc;
+            int32_t target;
+        };
+
+        // The journal of the open transactions, and the journal size when
+        // each of them began.  Nothing is recorded when no transaction is
+        // open.
+        std::vector <journal_entry> journal_;
+        std::vector <size_t> journal_marks_;
+
+        void check_no_transaction(char const * caller) const;
+
 };
 
 }
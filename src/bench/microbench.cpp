@@ -0,0 +1,666 @@
+// Licensed under a 3-clause BSD style license - see LICENSE.rst
+
+// Microbenchmarks for the compiled hot paths.  A synthetic focalplane and
+// target catalog are generated in memory, following the conventions of
+// py/fiberassign/test/simulate.py (relative target densities, science
+// priority fractions, a sprinkling of stuck and broken positioners).  Each
+// kernel is then run at every requested thread count and the throughput is
+// reported as a table and optionally as JSON, for comparison between builds.
+//
+// This is built with "python setup.py bench" and is not part of the
+// extension module.
+
+#include <assign.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+
+namespace fba = fiberassign;
+
+namespace fbg = fiberassign::geom;
+
+
+namespace {
+
+// Nominal plate scale used to place targets on the focalplane.
+double const platescale_mm_deg = 250.0;
+
+// Positioner pitch on the hexagonal grid.
+double const pitch_mm = 10.4;
+
+
+struct Options {
+    int32_t ntile;
+    double radius_mm;
+    double density;
+    int32_t seed;
+    double min_seconds;
+    std::vector <int> threads;
+    std::string json;
+    std::string filter;
+};
+
+
+struct Result {
+    std::string name;
+    int threads;
+    int64_t ops;
+    int32_t reps;
+    double seconds;
+};
+
+
+// Everything the kernels need.
+struct Sim {
+    fba::Hardware::pshr hw;
+    fba::Tiles::pshr tiles;
+    fba::Targets::pshr tgs;
+    std::map <int64_t, std::vector <int64_t> > tile_targetids;
+    std::map <int64_t, std::vector <double> > tile_x;
+    std::map <int64_t, std::vector <double> > tile_y;
+};
+
+
+void usage() {
+    std::cout
+        << "Usage: fba_microbench [options]\n"
+        << "  --tiles N        Number of tiles (default 4)\n"
+        << "  --radius MM      Focalplane radius in mm (default 410)\n"
+        << "  --density D      Science targets per square degree (default 5000)\n"
+        << "  --threads LIST   Comma separated thread counts (default 1,2,4,...,max)\n"
+        << "  --min-time S     Minimum seconds per measurement (default 0.5)\n"
+        << "  --seed N         Random seed (default 12345)\n"
+        << "  --filter NAME    Only run kernels whose name contains NAME\n"
+        << "  --json PATH      Write the results to a JSON file\n";
+    return;
+}
+
+
+std::vector <int> parse_threads(std::string const & str) {
+    std::vector <int> ret;
+    std::istringstream in(str);
+    std::string tok;
+    while (std::getline(in, tok, ',')) {
+        if (tok.size() > 0) {
+            ret.push_back(std::max(1, atoi(tok.c_str())));
+        }
+    }
+    return ret;
+}
+
+
+int max_threads() {
+    return fba::Environment::get().max_threads();
+}
+
+
+// The TaskPool sizes itself from the Environment, so the thread count must
+// go through there rather than only through OpenMP.
+
+void set_threads(int nt) {
+    fba::Environment::get().set_threads(nt);
+    return;
+}
+
+
+// A hexagonal grid of positioners split into 10 petals, with about 1% stuck
+// and 0.7% broken fibers and an ETC device every 97 devices.
+
+fba::Hardware::pshr sim_hardware(double radius_mm, int32_t seed) {
+    std::mt19937 rng(seed);
+    std::vector <int32_t> location;
+    std::vector <int32_t> petal;
+    std::vector <int32_t> device;
+    std::vector <int32_t> slitblock;
+    std::vector <int32_t> blockfiber;
+    std::vector <int32_t> fiber;
+    std::vector <std::string> device_type;
+    std::vector <double> x_mm;
+    std::vector <double> y_mm;
+    std::vector <int32_t> status;
+    std::vector <double> theta_offset;
+    std::vector <double> theta_min;
+    std::vector <double> theta_max;
+    std::vector <double> theta_pos;
+    std::vector <double> theta_arm;
+    std::vector <double> phi_offset;
+    std::vector <double> phi_min;
+    std::vector <double> phi_max;
+    std::vector <double> phi_pos;
+    std::vector <double> phi_arm;
+    std::vector <fbg::shape> excl_theta;
+    std::vector <fbg::shape> excl_phi;
+    std::vector <fbg::shape> excl_gfa;
+    std::vector <fbg::shape> excl_petal;
+
+    // Simple keepout polygons, centered on the positioner.
+    fbg::circle_list theta_circ = {
+        fbg::circle(std::make_pair(0.0, 0.0), 1.2)
+    };
+    fbg::segments_list theta_seg = {
+        fbg::segments({{0.0, -0.9}, {3.0, -0.9}, {3.0, 0.9}, {0.0, 0.9},
+                       {0.0, -0.9}})
+    };
+    fbg::circle_list phi_circ = {
+        fbg::circle(std::make_pair(3.0, 0.0), 0.97)
+    };
+    fbg::segments_list phi_seg = {
+        fbg::segments({{0.0, -0.6}, {3.0, -0.6}, {3.0, 0.6}, {0.0, 0.6},
+                       {0.0, -0.6}})
+    };
+
+    std::map <int32_t, int32_t> petal_count;
+    int32_t n = static_cast <int32_t> (radius_mm / pitch_mm) + 1;
+    for (int32_t i = -n; i <= n; ++i) {
+        for (int32_t j = -n; j <= n; ++j) {
+            double px = pitch_mm * (i + 0.5 * (j & 1));
+            double py = pitch_mm * j * 0.5 * std::sqrt(3.0);
+            double r = std::hypot(px, py);
+            if ((r > radius_mm) || (r < 5.0)) {
+                continue;
+            }
+            double ang = std::atan2(py, px) * 180.0 / M_PI;
+            if (ang < 0) {
+                ang += 360.0;
+            }
+            int32_t p = static_cast <int32_t> (ang / 36.0) % 10;
+            int32_t d = petal_count[p]++;
+            location.push_back(p * 1000 + d);
+            petal.push_back(p);
+            device.push_back(d);
+            slitblock.push_back(d % 20);
+            blockfiber.push_back(d / 20);
+            fiber.push_back(p * 500 + d);
+            device_type.push_back((d % 97 == 5) ? "ETC" : "POS");
+            x_mm.push_back(px);
+            y_mm.push_back(py);
+            int32_t st = FIBER_STATE_OK;
+            if ((rng() % 100) == 0) {
+                st = FIBER_STATE_STUCK;
+            } else if ((rng() % 150) == 0) {
+                st = FIBER_STATE_BROKEN;
+            }
+            status.push_back(st);
+            double petalrot = std::fmod((7 + p) * 36.0, 360.0);
+            theta_offset.push_back(-170.0 + petalrot);
+            theta_min.push_back(-190.0);
+            theta_max.push_back(190.0);
+            theta_arm.push_back(3.0);
+            phi_offset.push_back(-5.0);
+            phi_min.push_back(-15.0);
+            phi_max.push_back(185.0);
+            phi_arm.push_back(3.0);
+            if (st == FIBER_STATE_OK) {
+                theta_pos.push_back(0.0);
+                phi_pos.push_back(0.0);
+            } else {
+                theta_pos.push_back(static_cast <double> (rng() % 360) - 180.0);
+                phi_pos.push_back(static_cast <double> (rng() % 180));
+            }
+            excl_theta.push_back(
+                fbg::shape(std::make_pair(0.0, 0.0), theta_circ, theta_seg));
+            excl_phi.push_back(
+                fbg::shape(std::make_pair(0.0, 0.0), phi_circ, phi_seg));
+            excl_gfa.push_back(fbg::shape());
+            excl_petal.push_back(fbg::shape());
+        }
+    }
+
+    // A linear radial platescale.
+    std::vector <double> ps_radius;
+    std::vector <double> ps_theta;
+    std::vector <double> arclen;
+    for (int32_t i = 0; i <= 100; ++i) {
+        double t = 2.0 * static_cast <double> (i) / 100.0;
+        ps_theta.push_back(t);
+        ps_radius.push_back(t * platescale_mm_deg);
+        arclen.push_back(t * platescale_mm_deg);
+    }
+
+    return fba::Hardware::pshr(new fba::Hardware(
+        "2020-01-01T00:00:00+00:00", location, petal, device, slitblock,
+        blockfiber, fiber, device_type, x_mm, y_mm, status, theta_offset,
+        theta_min, theta_max, theta_pos, theta_arm, phi_offset, phi_min,
+        phi_max, phi_pos, phi_arm, ps_radius, ps_theta, arclen, excl_theta,
+        excl_phi, excl_gfa, excl_petal));
+}
+
+
+// Tiles on a small dither pattern, with uniformly distributed targets
+// covering all of them.  The relative densities of standards, sky and
+// supplemental sky and the science priority fractions match the unit tests.
+
+Sim sim_catalog(Options const & opts) {
+    Sim sim;
+    std::mt19937_64 rng(opts.seed);
+    std::uniform_real_distribution <double> uniform(0.0, 1.0);
+
+    sim.hw = sim_hardware(opts.radius_mm, opts.seed);
+
+    double tile_rad = opts.radius_mm / platescale_mm_deg;
+    std::vector <int32_t> tile_id;
+    std::vector <double> tile_ra;
+    std::vector <double> tile_dec;
+    std::vector <int32_t> tile_obs;
+    std::vector <std::string> tile_time;
+    std::vector <double> tile_theta;
+    std::vector <double> tile_ha;
+    for (int32_t t = 0; t < opts.ntile; ++t) {
+        tile_id.push_back(1000 + t);
+        tile_ra.push_back(150.0 + tile_rad * 0.3 * (t % 4));
+        tile_dec.push_back(30.0 + tile_rad * 0.3 * ((t / 4) % 4));
+        tile_obs.push_back(1);
+        tile_time.push_back("2020-01-01T00:00:00");
+        tile_theta.push_back(0.0);
+        tile_ha.push_back(0.0);
+    }
+    sim.tiles = fba::Tiles::pshr(new fba::Tiles(tile_id, tile_ra, tile_dec,
+        tile_obs, tile_time, tile_theta, tile_ha));
+
+    double ramin = 150.0 - tile_rad;
+    double ramax = 150.0 + 2.0 * tile_rad;
+    double decmin = 30.0 - tile_rad;
+    double decmax = 30.0 + 2.0 * tile_rad;
+    double area = (ramax - ramin) * (decmax - decmin);
+
+    // (type, priority, numobs, density relative to the science density)
+    struct TargetClass {
+        uint8_t type;
+        int32_t priority;
+        int32_t numobs;
+        double frac;
+    };
+    std::vector <TargetClass> classes = {
+        {TARGET_TYPE_SCIENCE, 3000, 1, 0.200},
+        {TARGET_TYPE_SCIENCE, 3200, 1, 0.100},
+        {TARGET_TYPE_SCIENCE, 3400, 1, 0.500},
+        {TARGET_TYPE_SCIENCE, 3400, 3, 0.200},
+        {TARGET_TYPE_STANDARD, 1500, 1, 1.000},
+        {TARGET_TYPE_SKY, 0, 1, 0.020},
+        {TARGET_TYPE_SUPPSKY, 0, 1, 1.000}
+    };
+
+    sim.tgs = fba::Targets::pshr(new fba::Targets());
+    int64_t offset = 0;
+    double reach = opts.radius_mm + 8.0;
+    for (auto const & cls : classes) {
+        size_t nt = static_cast <size_t> (cls.frac * opts.density * area);
+        std::vector <int64_t> id(nt);
+        std::vector <double> ra(nt);
+        std::vector <double> dec(nt);
+        std::vector <int64_t> bits(nt, 1);
+        std::vector <int32_t> obsremain(nt, cls.numobs);
+        std::vector <int32_t> priority(nt, cls.priority);
+        std::vector <double> subpriority(nt);
+        std::vector <int32_t> obscond(nt, 1);
+        std::vector <uint8_t> type(nt, cls.type);
+        for (size_t i = 0; i < nt; ++i) {
+            id[i] = offset + static_cast <int64_t> (i);
+            ra[i] = ramin + (ramax - ramin) * uniform(rng);
+            dec[i] = decmin + (decmax - decmin) * uniform(rng);
+            subpriority[i] = uniform(rng);
+        }
+        offset += static_cast <int64_t> (nt);
+        sim.tgs->append("main", id, ra, dec, bits, obsremain, priority,
+                        subpriority, obscond, type);
+        for (size_t i = 0; i < nt; ++i) {
+            for (int32_t t = 0; t < opts.ntile; ++t) {
+                double dx = (ra[i] - tile_ra[t]) * platescale_mm_deg;
+                double dy = (dec[i] - tile_dec[t]) * platescale_mm_deg;
+                if (std::hypot(dx, dy) < reach) {
+                    sim.tile_targetids[tile_id[t]].push_back(id[i]);
+                    sim.tile_x[tile_id[t]].push_back(dx);
+                    sim.tile_y[tile_id[t]].push_back(dy);
+                }
+            }
+        }
+    }
+    return sim;
+}
+
+
+// Run one kernel repeatedly until the minimum time has elapsed, at every
+// thread count.  The kernel returns the number of operations it performed.
+
+void measure(Options const & opts, std::string const & name,
+             std::function <int64_t (int)> kernel,
+             std::vector <Result> & results) {
+    if ((opts.filter.size() > 0)
+        && (name.find(opts.filter) == std::string::npos)) {
+        return;
+    }
+    int prev_threads = fba::Environment::get().current_threads();
+    for (auto const & nt : opts.threads) {
+        set_threads(nt);
+        // Warm up caches and lazily built state.
+        kernel(nt);
+        fba::Timer tm;
+        Result res;
+        res.name = name;
+        res.threads = nt;
+        res.ops = 0;
+        res.reps = 0;
+        tm.start();
+        do {
+            res.ops += kernel(nt);
+            res.reps++;
+            tm.stop();
+            res.seconds = tm.seconds();
+            tm.start();
+        } while (res.seconds < opts.min_seconds);
+        tm.stop();
+        double rate = static_cast <double> (res.ops) / res.seconds;
+        double base = rate;
+        for (auto const & prev : results) {
+            if ((prev.name == name) && (prev.threads == opts.threads[0])) {
+                base = static_cast <double> (prev.ops) / prev.seconds;
+            }
+        }
+        printf("%-28s %4d %12lld %10.4f %14.1f %8.2f\n", name.c_str(), nt,
+               static_cast <long long> (res.ops), res.seconds, rate,
+               rate / base);
+        fflush(stdout);
+        results.push_back(res);
+    }
+    set_threads(prev_threads);
+    return;
+}
+
+
+void write_json(Options const & opts, Sim const & sim,
+                std::vector <Result> const & results) {
+    std::ofstream out(opts.json);
+    if (! out.good()) {
+        std::ostringstream msg;
+        msg << "Cannot open JSON output " << opts.json;
+        throw std::runtime_error(msg.str().c_str());
+    }
+    out.precision(10);
+    out << "{\n";
+    out << "  \"config\": {\"tiles\": " << opts.ntile
+        << ", \"radius_mm\": " << opts.radius_mm
+        << ", \"density\": " << opts.density
+        << ", \"seed\": " << opts.seed
+        << ", \"locations\": " << sim.hw->nloc
+        << ", \"targets\": " << sim.tgs->data.size() << "},\n";
+    out << "  \"results\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        auto const & res = results[i];
+        out << ((i == 0) ? "\n" : ",\n");
+        out << "    {\"name\": \"" << res.name << "\""
+            << ", \"threads\": " << res.threads
+            << ", \"ops\": " << res.ops
+            << ", \"reps\": " << res.reps
+            << ", \"seconds\": " << res.seconds
+            << ", \"ops_per_sec\": "
+            << (static_cast <double> (res.ops) / res.seconds) << "}";
+    }
+    out << "\n  ]\n}\n";
+    return;
+}
+
+}
+
+
+int main(int argc, char ** argv) {
+    Options opts;
+    opts.ntile = 4;
+    opts.radius_mm = 410.0;
+    opts.density = 5000.0;
+    opts.seed = 12345;
+    opts.min_seconds = 0.5;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if ((arg == "-h") || (arg == "--help")) {
+            usage();
+            return 0;
+        }
+        if (i + 1 >= argc) {
+            usage();
+            return 1;
+        }
+        std::string val(argv[++i]);
+        if (arg == "--tiles") {
+            opts.ntile = std::max(1, atoi(val.c_str()));
+        } else if (arg == "--radius") {
+            opts.radius_mm = atof(val.c_str());
+        } else if (arg == "--density") {
+            opts.density = atof(val.c_str());
+        } else if (arg == "--threads") {
+            opts.threads = parse_threads(val);
+        } else if (arg == "--min-time") {
+            opts.min_seconds = atof(val.c_str());
+        } else if (arg == "--seed") {
+            opts.seed = atoi(val.c_str());
+        } else if (arg == "--filter") {
+            opts.filter = val;
+        } else if (arg == "--json") {
+            opts.json = val;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (opts.threads.size() == 0) {
+        int maxt = max_threads();
+        for (int nt = 1; nt < maxt; nt *= 2) {
+            opts.threads.push_back(nt);
+        }
+        opts.threads.push_back(maxt);
+    }
+
+    // The constructors report their own timing at the info level, which
+    // would be interleaved with the results.  Respect an explicit choice.
+    setenv("DESI_LOGLEVEL", "WARNING", 0);
+
+    fba::Timer tm;
+    tm.start();
+    Sim sim = sim_catalog(opts);
+    tm.stop();
+    printf("Simulated %d locations, %d tiles, %lu targets in %0.2f s\n",
+           sim.hw->nloc, opts.ntile,
+           static_cast <unsigned long> (sim.tgs->data.size()), tm.seconds());
+
+    auto tgsavail = fba::TargetsAvailable::pshr(new fba::TargetsAvailable(
+        sim.hw, sim.tgs, sim.tiles, sim.tile_targetids, sim.tile_x,
+        sim.tile_y));
+    auto locavail = fba::LocationsAvailable::pshr(
+        new fba::LocationsAvailable(tgsavail));
+
+    // Inputs for the geometry kernels: every (location, neighbor) pair with
+    // a random reachable position for each, and the moved exclusion shapes
+    // for the pairs where both positioners can move.
+
+    std::mt19937_64 rng(opts.seed + 1);
+    std::uniform_real_distribution <double> uniform(0.0, 1.0);
+
+    auto random_xy = [&](int32_t loc) {
+        auto const & center = sim.hw->loc_pos_cs5_mm.at(loc);
+        double reach = sim.hw->loc_theta_arm.at(loc)
+            + sim.hw->loc_phi_arm.at(loc);
+        double r = reach * std::sqrt(uniform(rng));
+        double a = 2.0 * M_PI * uniform(rng);
+        return std::make_pair(center.first + r * std::cos(a),
+                              center.second + r * std::sin(a));
+    };
+
+    std::vector <int32_t> pair_loc1;
+    std::vector <int32_t> pair_loc2;
+    std::vector <fbg::dpair> pair_xy1;
+    std::vector <fbg::dpair> pair_xy2;
+    std::vector <fbg::shape> shp1;
+    std::vector <fbg::shape> shp2;
+    for (auto const & loc : sim.hw->locations) {
+        for (auto const & nb : sim.hw->neighbors.at(loc)) {
+            auto xy1 = random_xy(loc);
+            auto xy2 = random_xy(nb);
+            pair_loc1.push_back(loc);
+            pair_loc2.push_back(nb);
+            pair_xy1.push_back(xy1);
+            pair_xy2.push_back(xy2);
+            fbg::shape th1;
+            fbg::shape ph1;
+            fbg::shape th2;
+            fbg::shape ph2;
+            if (! sim.hw->loc_position_xy(loc, xy1, th1, ph1)
+                && ! sim.hw->loc_position_xy(nb, xy2, th2, ph2)) {
+                shp1.push_back(ph1);
+                shp2.push_back(ph2);
+            }
+        }
+    }
+
+    // Single location queries.
+    std::vector <int32_t> query_loc;
+    std::vector <fbg::dpair> query_xy;
+    for (size_t i = 0; i < 4 * sim.hw->locations.size(); ++i) {
+        int32_t loc = sim.hw->locations[i % sim.hw->locations.size()];
+        query_loc.push_back(loc);
+        query_xy.push_back(random_xy(loc));
+    }
+
+    // Focalplane KD tree for the first tile, queried at every location.
+    int64_t first_tile = sim.tiles->id[0];
+    std::vector <fba::KdTreePoint> tree_points;
+    {
+        auto const & ids = sim.tile_targetids.at(first_tile);
+        auto const & tx = sim.tile_x.at(first_tile);
+        auto const & ty = sim.tile_y.at(first_tile);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            fba::KdTreePoint pt;
+            pt.id = sim.tgs->rows.at(ids[i]);
+            pt.pos[0] = tx[i];
+            pt.pos[1] = ty[i];
+            tree_points.push_back(pt);
+        }
+    }
+    KDtree <fba::KdTreePoint> kdtree(tree_points, 2);
+    double patrol = 6.0;
+
+    // Sky tree, queried with the tile radius at random points in the
+    // footprint, as is done when selecting the targets of each tile.
+    fba::TargetTree htmtree(sim.tgs);
+    std::vector <fbg::dpair> query_radec;
+    double tile_rad = opts.radius_mm / platescale_mm_deg;
+    for (size_t i = 0; i < 16; ++i) {
+        query_radec.push_back(std::make_pair(
+            150.0 + tile_rad * uniform(rng),
+            30.0 + tile_rad * uniform(rng)));
+    }
+    double htm_radius = tile_rad * M_PI / 180.0;
+
+    printf("%-28s %4s %12s %10s %14s %8s\n", "kernel", "thr", "ops",
+           "seconds", "ops/sec", "speedup");
+
+    std::vector <Result> results;
+
+    measure(opts, "geom_intersect",
+        [&](int nt) {
+            int64_t n = static_cast <int64_t> (shp1.size());
+            int64_t hits = 0;
+            #pragma omp parallel for schedule(static) num_threads(nt) reduction(+:hits)
+            for (int64_t i = 0; i < n; ++i) {
+                if (fbg::intersect(shp1[i], shp2[i])) {
+                    hits++;
+                }
+            }
+            return (hits >= 0) ? n : 0;
+        }, results);
+
+    measure(opts, "hardware_collide_xy",
+        [&](int nt) {
+            int64_t n = static_cast <int64_t> (pair_loc1.size());
+            int64_t hits = 0;
+            #pragma omp parallel for schedule(static) num_threads(nt) reduction(+:hits)
+            for (int64_t i = 0; i < n; ++i) {
+                if (sim.hw->collide_xy(pair_loc1[i], pair_xy1[i],
+                                       pair_loc2[i], pair_xy2[i])) {
+                    hits++;
+                }
+            }
+            return (hits >= 0) ? n : 0;
+        }, results);
+
+    measure(opts, "hardware_position_xy_bad",
+        [&](int nt) {
+            int64_t n = static_cast <int64_t> (query_loc.size());
+            int64_t hits = 0;
+            #pragma omp parallel for schedule(static) num_threads(nt) reduction(+:hits)
+            for (int64_t i = 0; i < n; ++i) {
+                if (sim.hw->position_xy_bad(query_loc[i], query_xy[i])) {
+                    hits++;
+                }
+            }
+            return (hits >= 0) ? n : 0;
+        }, results);
+
+    measure(opts, "kdtree_near_with_data",
+        [&](int nt) {
+            int64_t n = static_cast <int64_t> (query_loc.size());
+            int64_t found = 0;
+            #pragma omp parallel for schedule(static) num_threads(nt) reduction(+:found)
+            for (int64_t i = 0; i < n; ++i) {
+                auto const & center = sim.hw->loc_pos_cs5_mm.at(query_loc[i]);
+                double pos[2] = {center.first, center.second};
+                found += kdtree.near_with_data(pos, 0.0, patrol).size();
+            }
+            return (found >= 0) ? n : 0;
+        }, results);
+
+    measure(opts, "htmtree_near",
+        [&](int nt) {
+            int64_t n = static_cast <int64_t> (query_radec.size());
+            int64_t found = 0;
+            #pragma omp parallel for schedule(static) num_threads(nt) reduction(+:found)
+            for (int64_t i = 0; i < n; ++i) {
+                std::vector <int64_t> result;
+                htmtree.near(query_radec[i].first, query_radec[i].second,
+                             htm_radius, result);
+                found += result.size();
+            }
+            return (found >= 0) ? n : 0;
+        }, results);
+
+    // The remaining kernels are threaded internally, so the thread count is
+    // only set globally.  One operation is one tile.
+
+    measure(opts, "targets_available_ctor",
+        [&](int) {
+            fba::TargetsAvailable tav(sim.hw, sim.tgs, sim.tiles,
+                sim.tile_targetids, sim.tile_x, sim.tile_y);
+            return static_cast <int64_t> (opts.ntile);
+        }, results);
+
+    measure(opts, "locations_available_ctor",
+        [&](int) {
+            fba::LocationsAvailable lav(tgsavail);
+            return static_cast <int64_t> (opts.ntile);
+        }, results);
+
+    // An assignment modifies the shared target state, so every repetition
+    // works on a fresh fork of an empty assignment.
+    fba::Assignment base(sim.tgs, tgsavail, locavail);
+
+    measure(opts, "assign_unused_science",
+        [&](int) {
+            auto asgn = base.fork();
+            asgn->assign_unused(TARGET_TYPE_SCIENCE);
+            return static_cast <int64_t> (opts.ntile);
+        }, results);
+
+    if (opts.json.size() > 0) {
+        write_json(opts, sim, results);
+        printf("Wrote %s\n", opts.json.c_str());
+    }
+
+    return 0;
+}
@@ -16,6 +16,27 @@ namespace fba = fiberassign;
 namespace fbg = fiberassign::geom;
 
 
+namespace {
+
+// Working copies of the exclusion polygons used by the collision checks on
+// the calling thread.  Moving a positioner starts by assigning the polygons
+// of its location to these, which reuses their memory instead of allocating
+// new shapes for every check.
+struct collide_shapes {
+    fbg::shape theta1;
+    fbg::shape phi1;
+    fbg::shape theta2;
+    fbg::shape phi2;
+};
+
+collide_shapes & thread_collide_shapes() {
+    static thread_local collide_shapes shp;
+    return shp;
+}
+
+}
+
+
 fba::Hardware::Hardware(std::string const & timestr,
                         std::vector <int32_t> const & location,
                         std::vector <int32_t> const & petal,
@@ -280,6 +301,48 @@ std::vector <int32_t> fba::Hardware::device_locations(
     return ret;
 }
 
+void fba::Hardware::update_state(std::vector <int32_t> const & location,
+                                 std::vector <int32_t> const & status,
+                                 std::vector <double> const & theta_pos,
+                                 std::vector <double> const & phi_pos) {
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    // Check everything before modifying anything.
+    if ((status.size() != location.size())
+        || (theta_pos.size() != location.size())
+        || (phi_pos.size() != location.size())) {
+        logmsg.str("");
+        logmsg << "update_state:  the status, theta and phi arrays must have "
+            << "one value per location";
+        logger.error(logmsg.str().c_str());
+        throw std::runtime_error(logmsg.str().c_str());
+    }
+    for (auto const & loc : location) {
+        if (state.count(loc) == 0) {
+            logmsg.str("");
+            logmsg << "update_state:  location " << loc << " does not exist";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+    }
+
+    for (size_t i = 0; i < location.size(); ++i) {
+        int32_t loc = location[i];
+        state[loc] = status[i];
+        // As in the constructor, the fixed angles are only used for stuck
+        // or broken positioners.
+        loc_theta_pos[loc] = theta_pos[i] * M_PI / 180.0;
+        loc_phi_pos[loc] = phi_pos[i] * M_PI / 180.0;
+        logmsg.str("");
+        logmsg << "update_state:  location " << loc << " now has state "
+            << status[i];
+        logger.debug(logmsg.str().c_str());
+    }
+    return;
+}
+
+
 // Small helper function to seek to the correct elements for linear interpolation.
 void helper_vec_seek(
     std::vector <double> const & data,
@@ -962,8 +1025,9 @@ bool fba::Hardware::loc_position_thetaphi(
 bool fba::Hardware::collide_xy(int32_t loc1, fbg::dpair const & xy1,
                                int32_t loc2, fbg::dpair const & xy2) const {
 
-    fbg::shape shptheta1(loc_theta_excl.at(loc1));
-    fbg::shape shpphi1(loc_phi_excl.at(loc1));
+    collide_shapes & shp = thread_collide_shapes();
+    fbg::shape & shptheta1 = shp.theta1;
+    fbg::shape & shpphi1 = shp.phi1;
     bool failed1 = loc_position_xy(loc1, xy1, shptheta1, shpphi1);
     if (failed1) {
         // A positioner movement failure means that the angles needed to reach
@@ -972,8 +1036,8 @@ bool fba::Hardware::collide_xy(int32_t loc1, fbg::dpair const & xy1,
         return true;
     }
 
-    fbg::shape shptheta2(loc_theta_excl.at(loc2));
-    fbg::shape shpphi2(loc_phi_excl.at(loc2));
+    fbg::shape & shptheta2 = shp.theta2;
+    fbg::shape & shpphi2 = shp.phi2;
     bool failed2 = loc_position_xy(loc2, xy2, shptheta2, shpphi2);
     if (failed2) {
         // A positioner movement failure means that the angles needed to reach
@@ -1003,8 +1067,9 @@ bool fba::Hardware::collide_xy_edges(
         int32_t loc, fbg::dpair const & xy
     ) const {
 
-    fbg::shape shptheta(loc_theta_excl.at(loc));
-    fbg::shape shpphi(loc_phi_excl.at(loc));
+    collide_shapes & shp = thread_collide_shapes();
+    fbg::shape & shptheta = shp.theta1;
+    fbg::shape & shpphi = shp.phi1;
     bool failed = loc_position_xy(loc, xy, shptheta, shpphi);
     if (failed) {
         // A positioner movement failure means that the angles needed to reach
@@ -1016,8 +1081,8 @@ bool fba::Hardware::collide_xy_edges(
     // We were able to move positioner into place.  Now check for
     // intersections with the GFA and petal boundaries.
 
-    fbg::shape shpgfa(loc_gfa_excl.at(loc));
-    fbg::shape shppetal(loc_petal_excl.at(loc));
+    fbg::shape const & shpgfa = loc_gfa_excl.at(loc);
+    fbg::shape const & shppetal = loc_petal_excl.at(loc);
 
     // The central body (theta arm) should never hit the GFA or petal edge,
     // so we only need to check the phi arm.
@@ -1037,8 +1102,9 @@ bool fba::Hardware::collide_thetaphi(
         int32_t loc1, double theta1, double phi1,
         int32_t loc2, double theta2, double phi2) const {
 
-    fbg::shape shptheta1(loc_theta_excl.at(loc1));
-    fbg::shape shpphi1(loc_phi_excl.at(loc1));
+    collide_shapes & shp = thread_collide_shapes();
+    fbg::shape & shptheta1 = shp.theta1;
+    fbg::shape & shpphi1 = shp.phi1;
     bool failed1 = loc_position_thetaphi(loc1, theta1, phi1, shptheta1,
                                          shpphi1);
     if (failed1) {
@@ -1048,8 +1114,8 @@ bool fba::Hardware::collide_thetaphi(
         return true;
     }
 
-    fbg::shape shptheta2(loc_theta_excl.at(loc2));
-    fbg::shape shpphi2(loc_phi_excl.at(loc2));
+    fbg::shape & shptheta2 = shp.theta2;
+    fbg::shape & shpphi2 = shp.phi2;
     bool failed2 = loc_position_thetaphi(loc2, theta2, phi2, shptheta2,
                                          shpphi2);
     if (failed2) {
@@ -1081,15 +1147,16 @@ bool fba::Hardware::collide_xy_thetaphi(
         int32_t loc2, double theta2, double phi2,
         bool ignore_thetaphi_range) const {
 
-    fbg::shape shptheta1(loc_theta_excl.at(loc1));
-    fbg::shape shpphi1(loc_phi_excl.at(loc1));
+    collide_shapes & shp = thread_collide_shapes();
+    fbg::shape & shptheta1 = shp.theta1;
+    fbg::shape & shpphi1 = shp.phi1;
     bool failed1 = loc_position_xy(loc1, xy1, shptheta1, shpphi1);
     if (failed1) {
         return true;
     }
 
-    fbg::shape shptheta2(loc_theta_excl.at(loc2));
-    fbg::shape shpphi2(loc_phi_excl.at(loc2));
+    fbg::shape & shptheta2 = shp.theta2;
+    fbg::shape & shpphi2 = shp.phi2;
     bool failed2 = loc_position_thetaphi(loc2, theta2, phi2, shptheta2,
                                          shpphi2, ignore_thetaphi_range);
     if (failed2 && !ignore_thetaphi_range) {
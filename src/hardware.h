@@ -188,6 +188,16 @@ class Hardware : public std::enable_shared_from_this <Hardware> {
         // Get the Locations for a particular device type
         std::vector <int32_t> device_locations(std::string const & type) const;
 
+        // Change the state of some locations, along with the fixed theta / phi
+        // angles in degrees used for stuck or broken positioners.  Objects
+        // built from this Hardware read the state when they need it, except
+        // for the targets available to each location, which are not
+        // recomputed.
+        void update_state(std::vector <int32_t> const & location,
+                          std::vector <int32_t> const & status,
+                          std::vector <double> const & theta_pos,
+                          std::vector <double> const & phi_pos);
+
         // The (constant) total number of locations.
         int32_t nloc;
 
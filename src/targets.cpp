@@ -3,8 +3,10 @@
 #include <cmath>
 #include <cstdint>
 #include <limits>
+#include <cstring>
 
 #include <utils.h>
+#include <tasks.h>
 #include <tiles.h>
 #include <targets.h>
 #include <assert.h>
@@ -13,6 +15,10 @@ namespace fba = fiberassign;
 
 namespace fbg = fiberassign::geom;
 
+// The locations of a tile are split into tasks of this many locations, so
+// that the work of a dense tile is shared between threads.
+#define TILE_AVAIL_LOC_BLOCK 250
+
 
 std::string fba::target_string(uint8_t type) {
     std::string ret;
@@ -99,17 +105,22 @@ bool fba::Target::is_type(uint8_t t) const {
 
 
 double fba::Target::total_priority() const {
+    return total_priority(obsremain);
+}
+
+
+double fba::Target::total_priority(int32_t remain) const {
     // This is where we could control the depth-first vs. breadth-first
     // behavior.  Default is breadth-first:
-    return (double)(priority * 100 + obsremain) + subpriority;
+    return (double)(priority * 100 + remain) + subpriority;
     //
     // Instead, we probably want to use some bit in the target bits to
     // select whether to prioritize depth vs breadth first.
     // For example:
     // if (bits & DEPTH_FIRST_MASK) {
-    //     return (double)(priority * 100 + (100 - obsremain)) + subpriority;
+    //     return (double)(priority * 100 + (100 - remain)) + subpriority;
     // } else {
-    //     return (double)(priority * 100 + obsremain) + subpriority;
+    //     return (double)(priority * 100 + remain) + subpriority;
     // }
 }
 
@@ -148,17 +159,15 @@ void fba::Targets::append(std::string const & tsurvey,
         if (type[t] == 0) {
             // This target is not one of the recognized categories (science,
             // standard, sky, suppsky, or safe).  Skip it.
-            logmsg.str("");
-            logmsg << "Survey " << survey
+            FBA_LOG_DEBUG("Survey " << survey
                 << " target ID " << id[t]
-                << " type not identified- SKIPPING";
-            logger.debug(logmsg.str().c_str());
+                << " type not identified- SKIPPING");
             continue;
         }
-        if (data.count(id[t]) > 0) {
+        if (rows.count(id[t]) > 0) {
             // This target already exists.  This is an error.
             logmsg.str("");
-            auto const & tg = data.at(id[t]);
+            auto const & tg = data[rows.at(id[t])];
             logmsg << "Target ID " << id[t]
                 << " already exists with properties: ("
                 << tg.ra << "," << tg.dec << ") (" << tg.priority << ","
@@ -176,9 +185,10 @@ void fba::Targets::append(std::string const & tsurvey,
             logger.error(logmsg.str().c_str());
             throw std::runtime_error(logmsg.str().c_str());
         } else {
-            data[id[t]] = Target(id[t], ra[t], dec[t], targetbits[t],
-                                 obsremain[t], priority[t], subpriority[t],
-                                 obscond[t], type[t]);
+            rows[id[t]] = data.size();
+            data.push_back(Target(id[t], ra[t], dec[t], targetbits[t],
+                                  obsremain[t], priority[t], subpriority[t],
+                                  obscond[t], type[t]));
         }
         if ((priority[t] > 0) && ((type[t] & TARGET_TYPE_SCIENCE) != 0)) {
             // Only consider science targets in the list of target classes.
@@ -195,13 +205,100 @@ void fba::Targets::append(std::string const & tsurvey,
 }
 
 
-fba::TargetTree::TargetTree(Targets::pshr objs, double min_tree_size) {
-    Timer tm;
-    tm.start();
+void fba::Targets::remove(std::vector <int64_t> const & id) {
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
 
+    for (auto const & tid : id) {
+        if (rows.count(tid) == 0) {
+            logmsg.str("");
+            logmsg << "Cannot remove target ID " << tid
+                << ", which does not exist";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        // Leave the row in place, so that the rows of other targets remain
+        // valid.
+        data[rows.at(tid)] = Target();
+        rows.erase(tid);
+    }
+    return;
+}
+
+
+void fba::Targets::update(std::vector <int64_t> const & id,
+                          std::vector <int32_t> const & obsremain,
+                          std::vector <int32_t> const & priority,
+                          std::vector <double> const & subpriority) {
     fba::Logger & logger = fba::Logger::get();
     std::ostringstream logmsg;
 
+    if ((obsremain.size() != id.size()) || (priority.size() != id.size())
+        || (subpriority.size() != id.size())) {
+        logmsg.str("");
+        logmsg << "Targets update:  all arrays must have the same length";
+        logger.error(logmsg.str().c_str());
+        throw std::runtime_error(logmsg.str().c_str());
+    }
+
+    for (size_t t = 0; t < id.size(); ++t) {
+        if (rows.count(id[t]) == 0) {
+            logmsg.str("");
+            logmsg << "Cannot update target ID " << id[t]
+                << ", which does not exist";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        auto & tg = data[rows.at(id[t])];
+        tg.obsremain = obsremain[t];
+        tg.priority = priority[t];
+        tg.subpriority = subpriority[t];
+        if ((tg.priority > 0) && tg.is_science()) {
+            if (science_classes.count(tg.priority) == 0) {
+                science_classes.insert(tg.priority);
+            }
+        }
+    }
+    return;
+}
+
+
+int32_t fba::Targets::row(int64_t id) const {
+    auto it = rows.find(id);
+    if (it == rows.end()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::ostringstream logmsg;
+        logmsg << "Target ID " << id << " does not exist";
+        logger.error(logmsg.str().c_str());
+        throw std::runtime_error(logmsg.str().c_str());
+    }
+    return it->second;
+}
+
+
+std::vector <int64_t> fba::Targets::ids() const {
+    std::vector <int64_t> ret;
+    ret.reserve(rows.size());
+    for (auto const & it : rows) {
+        ret.push_back(it.first);
+    }
+    return ret;
+}
+
+
+std::map <std::string, int64_t> fba::Targets::memory_usage() const {
+    std::map <std::string, int64_t> ret;
+    ret["data"] = heap_bytes(data);
+    ret["rows"] = heap_bytes(rows);
+    ret["science_classes"] = heap_bytes(science_classes);
+    return ret;
+}
+
+
+fba::TargetTree::TargetTree(Targets::pshr objs, double min_tree_size) {
+    Timer tm;
+    tm.start();
+
     mintreesz_ = min_tree_size;
 
     treelist_.resize(0);
@@ -212,20 +309,19 @@ fba::TargetTree::TargetTree(Targets::pshr objs, double min_tree_size) {
     double deg2rad = M_PI / 180.0;
     double stheta;
 
-    for (auto const & obj : objs->data) {
-        tp.id = obj.first;
-        theta = (90.0 - obj.second.dec) * deg2rad;
-        phi = (obj.second.ra) * deg2rad;
+    // Add objects in target ID order.
+    for (auto const & idrow : objs->rows) {
+        auto const & obj = objs->data[idrow.second];
+        tp.id = obj.id;
+        theta = (90.0 - obj.dec) * deg2rad;
+        phi = (obj.ra) * deg2rad;
         stheta = ::sin(theta);
         tp.nhat[0] = ::cos(phi) * stheta;
         tp.nhat[1] = ::sin(phi) * stheta;
         tp.nhat[2] = ::cos(theta);
-        if (logger.extra_debug()) {
-            logmsg.str("");
-            logmsg << "add target ID " << obj.first << " to tree at "
-                << "RA = " << obj.second.ra << ", DEC = " << obj.second.dec;
-            logger.debug_tfg(-1, -1, obj.first, logmsg.str().c_str());
-        }
+        FBA_TRACE_TFG(TRACE_MESSAGE, -1, -1, obj.id, 0, 0,
+            "add target ID " << obj.id << " to tree at "
+            << "RA = " << obj.ra << ", DEC = " << obj.dec);
         treelist_.push_back(tp);
     }
 
@@ -260,20 +356,217 @@ void fba::TargetTree::near(double ra_deg, double dec_deg, double radius_rad,
     return;
 }
 
+fba::TileTargetXY::TileTargetXY(bool compact) {
+    compact_ = compact;
+    rows_.clear();
+    xy_.clear();
+    xy_compact_.clear();
+}
+
+
+bool fba::TileTargetXY::compact() const {
+    return compact_;
+}
+
+
+size_t fba::TileTargetXY::size() const {
+    return rows_.size();
+}
+
+
+double fba::TileTargetXY::stored(double val) const {
+    if (compact_) {
+        return static_cast <double> (static_cast <float> (val));
+    }
+    return val;
+}
+
+
+int32_t fba::TileTargetXY::index(int32_t row) const {
+    auto pos = std::lower_bound(rows_.begin(), rows_.end(), row);
+    if ((pos == rows_.end()) || (*pos != row)) {
+        return -1;
+    }
+    return static_cast <int32_t> (pos - rows_.begin());
+}
+
+
+bool fba::TileTargetXY::has(int32_t row) const {
+    return (index(row) >= 0);
+}
+
+
+fbg::dpair fba::TileTargetXY::xy(int32_t row) const {
+    int32_t idx = index(row);
+    if (idx < 0) {
+        std::ostringstream msg;
+        msg << "target row " << row << " has no position on this tile";
+        throw std::out_of_range(msg.str().c_str());
+    }
+    return xy_index(idx);
+}
+
+
+fbg::dpair fba::TileTargetXY::xy_index(size_t idx) const {
+    if (compact_) {
+        return std::make_pair(
+            static_cast <double> (xy_compact_[2 * idx]),
+            static_cast <double> (xy_compact_[2 * idx + 1])
+        );
+    }
+    return std::make_pair(xy_[2 * idx], xy_[2 * idx + 1]);
+}
+
+
+std::vector <int32_t> const & fba::TileTargetXY::rows() const {
+    return rows_;
+}
+
+
+void fba::TileTargetXY::insert(
+    std::vector <std::pair <int32_t, fbg::dpair> > entries) {
+    // Merge the existing entries with the new ones, keeping the first
+    // occurrence of each row.
+    size_t nold = rows_.size();
+    entries.reserve(nold + entries.size());
+    for (size_t i = 0; i < nold; ++i) {
+        entries.push_back(std::make_pair(rows_[i], xy_index(i)));
+    }
+    std::stable_sort(entries.begin(), entries.end(),
+        [](std::pair <int32_t, fbg::dpair> const & a,
+           std::pair <int32_t, fbg::dpair> const & b) {
+            return a.first < b.first;
+        }
+    );
+
+    rows_.clear();
+    xy_.clear();
+    xy_compact_.clear();
+    for (auto const & ent : entries) {
+        if ((rows_.size() > 0) && (rows_.back() == ent.first)) {
+            continue;
+        }
+        rows_.push_back(ent.first);
+        if (compact_) {
+            xy_compact_.push_back(static_cast <float> (ent.second.first));
+            xy_compact_.push_back(static_cast <float> (ent.second.second));
+        } else {
+            xy_.push_back(ent.second.first);
+            xy_.push_back(ent.second.second);
+        }
+    }
+    rows_.shrink_to_fit();
+    xy_.shrink_to_fit();
+    xy_compact_.shrink_to_fit();
+    return;
+}
+
+
+void fba::TileTargetXY::erase(int32_t row) {
+    int32_t idx = index(row);
+    if (idx < 0) {
+        return;
+    }
+    rows_.erase(rows_.begin() + idx);
+    if (compact_) {
+        xy_compact_.erase(xy_compact_.begin() + 2 * idx,
+                          xy_compact_.begin() + 2 * idx + 2);
+    } else {
+        xy_.erase(xy_.begin() + 2 * idx, xy_.begin() + 2 * idx + 2);
+    }
+    return;
+}
+
+
+size_t fba::TileTargetXY::memory_bytes() const {
+    return heap_bytes(rows_) + heap_bytes(xy_) + heap_bytes(xy_compact_);
+}
+
+
+void fba::LocTypeTargets::append(int32_t row, Target const & tg) {
+    if (tg.is_science()) {
+        science.push_back(row);
+        if (tg.obsremain > 0) {
+            science_remain.push_back(row);
+        }
+    }
+    if (tg.is_standard()) {
+        standard.push_back(row);
+    }
+    if (tg.is_sky()) {
+        sky.push_back(row);
+    }
+    if (tg.is_suppsky()) {
+        suppsky.push_back(row);
+    }
+    if (tg.is_safe()) {
+        safe.push_back(row);
+    }
+    return;
+}
+
+
+void fba::LocTypeTargets::erase(int32_t row) {
+    for (auto * lst : {&science, &standard, &sky, &suppsky, &safe,
+                       &science_remain}) {
+        auto pos = std::find(lst->begin(), lst->end(), row);
+        if (pos != lst->end()) {
+            lst->erase(pos);
+        }
+    }
+    return;
+}
+
+
+void fba::LocTypeTargets::update_remain(std::vector <Target> const & tgdata) {
+    science_remain.clear();
+    for (auto const & row : science) {
+        if (tgdata[row].obsremain > 0) {
+            science_remain.push_back(row);
+        }
+    }
+    return;
+}
+
+
+std::vector <int32_t> const * fba::LocTypeTargets::type_rows(uint8_t type,
+    bool remaining) const {
+    switch (type) {
+        case TARGET_TYPE_SCIENCE:
+            return (remaining) ? &science_remain : &science;
+        case TARGET_TYPE_STANDARD:
+            return &standard;
+        case TARGET_TYPE_SKY:
+            return &sky;
+        case TARGET_TYPE_SUPPSKY:
+            return &suppsky;
+        case TARGET_TYPE_SAFE:
+            return &safe;
+        default:
+            return NULL;
+    }
+}
+
+
 fba::TargetsAvailable::TargetsAvailable(Hardware::pshr hw,
+                                        Targets::pshr objs,
                                         Tiles::pshr tiles,
                                         std::map<int64_t, std::vector<int64_t> > tile_targetids,
                                         std::map<int64_t, std::vector<double> > tile_x,
-                                        std::map<int64_t, std::vector<double> > tile_y) {
+                                        std::map<int64_t, std::vector<double> > tile_y,
+                                        bool compact_xy) {
     Timer tm;
     tm.start();
 
     fba::Logger & logger = fba::Logger::get();
 
     data.clear();
+    tile_xy.clear();
 
     tiles_ = tiles;
     hw_ = hw;
+    tgs_ = objs;
+    compact_xy_ = compact_xy;
 
     size_t ntile = tiles_->id.size();
     size_t nloc = hw_->nloc;
@@ -281,192 +574,341 @@ fba::TargetsAvailable::TargetsAvailable(Hardware::pshr hw,
     // patrol buffer
     double patrol_buffer = hw_->patrol_buffer_mm;
 
-    std::vector <int32_t> loc(nloc);
-    std::vector <double> loc_center_x(nloc);
-    std::vector <double> loc_center_y(nloc);
-    std::vector <double> loc_patrol(nloc);
+    loc_.resize(nloc);
+    loc_center_x_.resize(nloc);
+    loc_center_y_.resize(nloc);
+    loc_patrol_.resize(nloc);
 
     for (size_t j = 0; j < nloc; ++j) {
-        loc[j] = hw_->locations[j];
-        loc_center_x[j] = hw_->loc_pos_curved_mm[loc[j]].first;
-        loc_center_y[j] = hw_->loc_pos_curved_mm[loc[j]].second;
-        loc_patrol[j] = hw_->loc_theta_arm[loc[j]] + hw_->loc_phi_arm[loc[j]]
-            - patrol_buffer;
+        loc_[j] = hw_->locations[j];
+        loc_center_x_[j] = hw_->loc_pos_curved_mm[loc_[j]].first;
+        loc_center_y_[j] = hw_->loc_pos_curved_mm[loc_[j]].second;
+        loc_patrol_[j] = hw_->loc_theta_arm[loc_[j]]
+            + hw_->loc_phi_arm[loc_[j]] - patrol_buffer;
+    }
+
+    // Create the entries for every tile up front, so that the threads below
+    // only modify the contents of their own tile.
+
+    for (size_t i = 0; i < ntile; ++i) {
+        int32_t tid = tiles_->id[i];
+        if (data.count(tid) > 0) {
+            throw std::runtime_error("Available target data already exists for tile");
+        }
+        data[tid].clear();
+        tile_xy.emplace(tid, TileTargetXY(compact_xy_));
+        type_data[tid].clear();
+        tile_targetids[tid];
+        tile_x[tid];
+        tile_y[tid];
     }
 
     // shared_ptr reference counting is not threadsafe.  Here we extract
     // a copy of the "raw" pointers needed inside the parallel region.
 
     Tiles * ptiles = tiles.get();
-    Hardware * phw = hw_.get();
-
-    #pragma omp parallel default(shared)
-    {
-        // We re-use these thread-local vectors to reduce the number
-        // of times we are realloc'ing memory for every fiber.
-        std::vector <int64_t> nearby;
-        std::vector <KdTreePoint> nearby_tree_points;
-        std::vector <KdTreePoint> nearby_data;
+    Targets const * ptgs = objs.get();
+
+    // Each tile records any missing target ID in its own slot, so that the
+    // threads never write to shared data.
+    std::vector <int64_t> missing(ntile, -1);
+
+    // The per-tile data is allocated (and so first touched) by the thread
+    // which computes the tile.  With pinned threads, the tiles start out
+    // split between NUMA domains so that later passes over the tiles find
+    // it local.  Each tile spawns tasks for blocks of its locations, which
+    // idle threads steal, so that a dense tile does not hold up the rest.
+    TaskPool::get().run("TargetsAvailable: tiles", ntile, [&](size_t i) {
+        int32_t tid = ptiles->id[i];
+        if (tile_avail(tid, tile_targetids.at(tid), tile_x.at(tid),
+                       tile_y.at(tid), data.at(tid), tile_xy.at(tid),
+                       missing[i])) {
+            auto & ttypes = type_data.at(tid);
+            for (auto const & lit : data.at(tid)) {
+                auto & ltypes = ttypes[lit.first];
+                for (auto const & tgrow : lit.second) {
+                    ltypes.append(tgrow, ptgs->data[tgrow]);
+                }
+            }
+        }
+    });
 
-        std::ostringstream logmsg;
+    for (size_t i = 0; i < ntile; ++i) {
+        if (missing[i] >= 0) {
+            std::ostringstream msg;
+            msg << "targets avail:  target ID " << missing[i]
+                << " is not in the Targets object";
+            logger.error(msg.str().c_str());
+            throw std::runtime_error(msg.str().c_str());
+        }
+    }
 
-        // Thread local properties.
-        int32_t tid;
+    for (size_t i = 0; i < ntile; ++i) {
+        int32_t tid = ptiles->id[i];
+        size_t total_avail = 0;
+        for (size_t j = 0; j < nloc; ++j) {
+            if (data.at(tid).count(loc_[j]) > 0) {
+                total_avail += data.at(tid).at(loc_[j]).size();
+            }
+        }
+        FBA_LOG_DEBUG("targets avail:  tile " << tid
+            << ", " << total_avail << " total available targets");
+    }
 
-        // Thread local data for available targets- reduced at the end.
-        std::map <int32_t, std::map <int32_t,
-                                     std::vector <int64_t> > > thread_data;
-        std::map <int32_t, std::map <int32_t,
-                                     std::vector <
-                                         std::pair<double, double> > > > thread_data_xy;
+    tm.stop();
+    tm.report("Computing targets available to all tile / locations");
+}
 
-        #pragma omp for schedule(dynamic)
-        for (size_t i = 0; i < ntile; ++i) {
-            tid = ptiles->id[i];
-            thread_data[tid].clear();
-            thread_data_xy[tid].clear();
 
-            if (tile_targetids[tid].size() == 0) {
-                // No targets for this tile.
-                continue;
-            }
+bool fba::TargetsAvailable::tile_avail(int32_t tile,
+    std::vector <int64_t> const & ids,
+    std::vector <double> const & x,
+    std::vector <double> const & y,
+    std::map <int32_t, std::vector <int32_t> > & loc_rows,
+    TileTargetXY & txy,
+    int64_t & missing) const {
 
-            assert(tile_targetids[tid].size() == tile_x[tid].size());
-            assert(tile_targetids[tid].size() == tile_y[tid].size());
-
-            nearby_tree_points.clear();
-            KdTreePoint cur;
-            auto vx = tile_x[tid].begin();
-            auto vy = tile_y[tid].begin();
-            for (auto vid = tile_targetids[tid].begin();
-                 vid != tile_targetids[tid].end(); vid++, vx++, vy++) {
-                cur.id = *vid;
-                cur.pos[0] = *vx;
-                cur.pos[1] = *vy;
-                nearby_tree_points.push_back(cur);
-            }
+    loc_rows.clear();
 
-            KDtree <KdTreePoint> nearby_tree(nearby_tree_points, 2);
+    if (ids.size() == 0) {
+        // No targets for this tile.
+        return true;
+    }
 
-            size_t locs_with_targets = 0;
+    assert(ids.size() == x.size());
+    assert(ids.size() == y.size());
+
+    Hardware const * phw = hw_.get();
+    Targets const * ptgs = tgs_.get();
+    size_t nloc = loc_.size();
+
+    std::vector <KdTreePoint> nearby_tree_points;
+
+    KdTreePoint cur;
+    auto vx = x.begin();
+    auto vy = y.begin();
+    for (auto vid = ids.begin(); vid != ids.end(); vid++, vx++, vy++) {
+        // Translate target IDs to rows once, here.  This is called from
+        // threaded code, so a missing ID is returned rather than thrown.
+        auto idrow = ptgs->rows.find(*vid);
+        if (idrow == ptgs->rows.end()) {
+            missing = *vid;
+            return false;
+        }
+        cur.id = idrow->second;
+        // Use the stored precision for all decisions, so that the
+        // reachability computed here is consistent with later collision
+        // checks.
+        cur.pos[0] = txy.stored(*vx);
+        cur.pos[1] = txy.stored(*vy);
+        nearby_tree_points.push_back(cur);
+    }
 
-            double loc_pos[2];
+    KDtree <KdTreePoint> nearby_tree(nearby_tree_points, 2);
 
-            for (size_t j = 0; j < nloc; ++j) {
-                thread_data[tid][loc[j]].resize(0);
-                thread_data_xy[tid][loc[j]].resize(0);
-                loc_pos[0] = loc_center_x[j];
-                loc_pos[1] = loc_center_y[j];
+    // Create the entry of every location before the locations are split
+    // between tasks.
+    std::vector <std::vector <int32_t> * > loc_lrows(nloc);
+    for (size_t j = 0; j < nloc; ++j) {
+        loc_lrows[j] = &loc_rows[loc_[j]];
+    }
 
-                // Lookup targets near this location in focalplane
-                // coordinates.
-                nearby_data = nearby_tree.near_with_data(loc_pos, 0.0, loc_patrol[j]);
-                if (nearby_data.size() == 0) {
-                    // No targets for this location
-                    continue;
-                }
+    size_t nblock = (nloc + TILE_AVAIL_LOC_BLOCK - 1) / TILE_AVAIL_LOC_BLOCK;
+    std::vector <std::vector <std::pair <int32_t, fbg::dpair> > >
+        reachable(nblock);
 
-                // The kdtree gets us the targets that are close to
-                // our region of interest around each positioner.  Now
-                // go through these targets and check whether the
-                // positioner can move to each one.  We DO NOT sort
-                // targets by priority, since the total priority will
-                // change as observations are made.  Instead, this
-                // sorting is done for each tile during assignment.
-
-                for (auto const & tnear : nearby_data) {
-                    fbg::dpair obj_xy;
-                    obj_xy.first  = tnear.pos[0];
-                    obj_xy.second = tnear.pos[1];
-                    bool fail = phw->position_xy_bad(loc[j], obj_xy);
-                    if (fail) {
-                        if (logger.extra_debug()) {
-                            logmsg.str("");
-                            logmsg << std::setprecision(2) << std::fixed;
-                            logmsg << "targets avail:  tile " << tid
-                                << ", loc " << loc[j] << ", kdtree target "
-                                << tnear.id << " not physically reachable by positioner";
-                            logger.debug_tfg(tid, loc[j], tnear.id,
-                                             logmsg.str().c_str());
-                        }
-                    } else {
-                        thread_data[tid][loc[j]].push_back(tnear.id);
-                        thread_data_xy[tid][loc[j]].push_back(std::make_pair(tnear.pos[0], tnear.pos[1]));
-                    }
-                }
+    TaskPool::get().run("TargetsAvailable: locations", nblock,
+                        [&](size_t blk) {
+        std::vector <KdTreePoint> nearby_data;
+        double loc_pos[2];
+        auto & breach = reachable[blk];
+        size_t jstop = std::min(nloc, (blk + 1) * TILE_AVAIL_LOC_BLOCK);
+        for (size_t j = blk * TILE_AVAIL_LOC_BLOCK; j < jstop; ++j) {
+            auto & lrows = *loc_lrows[j];
+            loc_pos[0] = loc_center_x_[j];
+            loc_pos[1] = loc_center_y_[j];
+
+            // Lookup targets near this location in focalplane
+            // coordinates.
+            nearby_data = nearby_tree.near_with_data(loc_pos, 0.0,
+                                                     loc_patrol_[j]);
+            if (nearby_data.size() == 0) {
+                // No targets for this location
+                continue;
+            }
 
-                if (thread_data[tid][loc[j]].size() > 0) {
-                    locs_with_targets++;
+            // The kdtree gets us the targets that are close to
+            // our region of interest around each positioner.  Now
+            // go through these targets and check whether the
+            // positioner can move to each one.  We DO NOT sort
+            // targets by priority, since the total priority will
+            // change as observations are made.  Instead, this
+            // sorting is done for each tile during assignment.
+
+            for (auto const & tnear : nearby_data) {
+                fbg::dpair obj_xy;
+                obj_xy.first  = tnear.pos[0];
+                obj_xy.second = tnear.pos[1];
+                bool fail = phw->position_xy_bad(loc_[j], obj_xy);
+                if (fail) {
+                    FBA_TRACE_TFG(TRACE_NOT_OK, tile, loc_[j],
+                        ptgs->data[tnear.id].id, 0, 0,
+                        "targets avail:  tile " << tile
+                        << ", loc " << loc_[j] << ", kdtree target "
+                        << ptgs->data[tnear.id].id
+                        << " not physically reachable by positioner");
+                } else {
+                    lrows.push_back(tnear.id);
+                    breach.push_back(std::make_pair(tnear.id, obj_xy));
                 }
             }
         }
+    });
 
-        // Now reduce across threads.
-        #pragma omp critical
-        {
-            for (auto const & it : thread_data) {
-                int32_t ttile = it.first;
+    // Insert in location order, as if the locations were done in turn.
+    std::vector <std::pair <int32_t, fbg::dpair> > all_reachable;
+    for (auto const & breach : reachable) {
+        all_reachable.insert(all_reachable.end(), breach.begin(), breach.end());
+    }
+    txy.insert(all_reachable);
+    return true;
+}
 
-                if (data.count(ttile) > 0) {
-                    throw std::runtime_error("Available target data already exists for tile");
-                }
 
-                data[ttile].clear();
+std::map <int32_t, std::map <int32_t, std::vector <int32_t> > >
+fba::TargetsAvailable::add(
+    std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+    std::map<int64_t, std::vector<double> > const & tile_x,
+    std::map<int64_t, std::vector<double> > const & tile_y) {
+    Timer tm;
+    tm.start();
 
-                auto const & fmap = it.second;
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
 
-                for (size_t f = 0; f < nloc; ++f) {
-                    int32_t lid = loc[f];
-                    if (fmap.count(lid) == 0) {
-                        // This location had no targets.
-                        continue;
-                    }
-                    data[ttile][lid] = fmap.at(lid);
-                }
-            }
-            thread_data.clear();
-            for (auto const & it : thread_data_xy) {
-                int32_t ttile = it.first;
-                if (data_xy.count(ttile) > 0) {
-                    throw std::runtime_error("Available target data already exists for tile");
-                }
-                data_xy[ttile].clear();
-                auto const & fmap = it.second;
-                for (size_t f = 0; f < nloc; ++f) {
-                    int32_t lid = loc[f];
-                    if (fmap.count(lid) == 0) {
-                        // This location had no targets.
-                        continue;
-                    }
-                    data_xy[ttile][lid] = fmap.at(lid);
-                }
+    std::map <int32_t, std::map <int32_t, std::vector <int32_t> > > added;
+
+    // Only tiles with new targets are touched.  Create the output entries
+    // before the parallel region so that each thread works on its own tile.
+
+    std::vector <int32_t> tkeys;
+    for (auto const & it : tile_targetids) {
+        int32_t tid = it.first;
+        if (tiles_->order.count(tid) == 0) {
+            logmsg.str("");
+            logmsg << "targets avail add:  tile " << tid
+                << " is not in the list of tiles";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        if ((tile_x.count(tid) == 0) || (tile_y.count(tid) == 0)
+            || (tile_x.at(tid).size() != it.second.size())
+            || (tile_y.at(tid).size() != it.second.size())) {
+            logmsg.str("");
+            logmsg << "targets avail add:  tile " << tid
+                << " has inconsistent target ID and position arrays";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        // Tiles appended to the Tiles object get (possibly empty) entries.
+        data[tid];
+        tile_xy.emplace(tid, TileTargetXY(compact_xy_));
+        type_data[tid];
+        if (it.second.size() == 0) {
+            continue;
+        }
+        tkeys.push_back(tid);
+        added[tid].clear();
+    }
+
+    size_t ntile = tkeys.size();
+
+    // Check the IDs before modifying anything.
+    for (auto const & tid : tkeys) {
+        for (auto const & tgid : tile_targetids.at(tid)) {
+            if (tgs_->rows.count(tgid) == 0) {
+                logmsg.str("");
+                logmsg << "targets avail add:  target ID " << tgid
+                    << " is not in the Targets object";
+                logger.error(logmsg.str().c_str());
+                throw std::runtime_error(logmsg.str().c_str());
             }
-            thread_data_xy.clear();
         }
     }
 
-    for (size_t i = 0; i < ntile; ++i) {
-        int32_t tid = ptiles->id[i];
-        if (data.count(tid) == 0) {
-            continue;
+    TaskPool::get().run("TargetsAvailable: add", ntile, [&](size_t i) {
+        int32_t tid = tkeys[i];
+        std::map <int32_t, std::vector <int32_t> > new_rows;
+        TileTargetXY new_xy(compact_xy_);
+        int64_t tmiss;
+
+        tile_avail(tid, tile_targetids.at(tid), tile_x.at(tid),
+                   tile_y.at(tid), new_rows, new_xy, tmiss);
+
+        auto & tdata = data.at(tid);
+        auto & txy = tile_xy.at(tid);
+        auto & ttypes = type_data.at(tid);
+        auto & tadded = added.at(tid);
+
+        for (auto const & lit : new_rows) {
+            int32_t lid = lit.first;
+            auto & lrows = tdata[lid];
+            auto & ltypes = ttypes[lid];
+            if (lit.second.size() == 0) {
+                continue;
+            }
+            lrows.insert(lrows.end(), lit.second.begin(), lit.second.end());
+            for (auto const & tgrow : lit.second) {
+                ltypes.append(tgrow, tgs_->data[tgrow]);
+            }
+            tadded[lid] = lit.second;
         }
-        size_t total_avail = 0;
-        for (size_t j = 0; j < nloc; ++j) {
-            if (data.at(tid).count(loc[j]) > 0) {
-                total_avail += data.at(tid).at(loc[j]).size();
+
+        std::vector <std::pair <int32_t, fbg::dpair> > entries;
+        for (size_t n = 0; n < new_xy.size(); ++n) {
+            entries.push_back(
+                std::make_pair(new_xy.rows()[n], new_xy.xy_index(n))
+            );
+        }
+        txy.insert(entries);
+    });
+
+    tm.stop();
+    tm.report("Adding targets available to tile / locations");
+
+    return added;
+}
+
+
+void fba::TargetsAvailable::remove(std::map <int32_t,
+    std::vector <std::pair <int32_t, int32_t> > > const & target_tl) {
+
+    for (auto const & it : target_tl) {
+        int32_t tgrow = it.first;
+        for (auto const & tl : it.second) {
+            auto & lrows = data.at(tl.first).at(tl.second);
+            auto pos = std::find(lrows.begin(), lrows.end(), tgrow);
+            if (pos == lrows.end()) {
+                continue;
             }
+            lrows.erase(pos);
+            tile_xy.at(tl.first).erase(tgrow);
+            type_data.at(tl.first).at(tl.second).erase(tgrow);
         }
-        std::ostringstream msg;
-        msg.str("");
-        msg << "targets avail:  tile " << tid
-            << ", " << total_avail << " total available targets";
-        logger.debug(msg.str().c_str());
     }
+    return;
+}
 
-    tm.stop();
-    tm.report("Computing targets available to all tile / locations");
+
+void fba::TargetsAvailable::update_remain(
+    std::vector <std::pair <int32_t, int32_t> > const & tile_locs) {
+    for (auto const & tl : tile_locs) {
+        type_data.at(tl.first).at(tl.second).update_remain(tgs_->data);
+    }
+    return;
 }
 
+
 fba::Hardware::pshr fba::TargetsAvailable::hardware() const {
     return hw_;
 }
@@ -475,13 +917,64 @@ fba::Tiles::pshr fba::TargetsAvailable::tiles() const {
     return tiles_;
 }
 
+fba::Targets::pshr fba::TargetsAvailable::targets() const {
+    return tgs_;
+}
+
+bool fba::TargetsAvailable::compact_xy() const {
+    return compact_xy_;
+}
+
+
+std::map <std::string, int64_t> fba::TargetsAvailable::memory_usage() const {
+    std::map <std::string, int64_t> ret;
+    ret["data"] = heap_bytes(data);
+    ret["tile_xy"] = heap_bytes(tile_xy);
+    ret["type_data"] = heap_bytes(type_data);
+    return ret;
+}
+
 
 std::map <int32_t, std::vector <int64_t> > fba::TargetsAvailable::tile_data(int32_t tile) const {
+    std::map <int32_t, std::vector <int64_t> > ret;
     if (data.count(tile) == 0) {
-        return std::map <int32_t, std::vector <int64_t> >();
-    } else {
-        return data.at(tile);
+        return ret;
+    }
+    // Translate target rows back to IDs.
+    for (auto const & it : data.at(tile)) {
+        auto & lids = ret[it.first];
+        lids.reserve(it.second.size());
+        for (auto const & tgrow : it.second) {
+            lids.push_back(tgs_->data[tgrow].id);
+        }
+    }
+    return ret;
+}
+
+
+std::map <int32_t, std::vector <int64_t> > fba::TargetsAvailable::tile_type_data(
+    int32_t tile, uint8_t type, bool remaining) const {
+    std::map <int32_t, std::vector <int64_t> > ret;
+    if (type_data.count(tile) == 0) {
+        return ret;
+    }
+    for (auto const & it : type_data.at(tile)) {
+        auto const * rows = it.second.type_rows(type, remaining);
+        if (rows == NULL) {
+            fba::Logger & logger = fba::Logger::get();
+            std::ostringstream logmsg;
+            logmsg << "tile_type_data:  target type " << (int)type
+                << " is not a single type";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
+        }
+        auto & lids = ret[it.first];
+        lids.reserve(rows->size());
+        for (auto const & tgrow : *rows) {
+            lids.push_back(tgs_->data[tgrow].id);
+        }
     }
+    return ret;
 }
 
 
@@ -489,10 +982,12 @@ fba::LocationsAvailable::LocationsAvailable(fba::TargetsAvailable::pshr tgsavail
     fba::Timer tm;
     tm.start();
 
-    fba::Logger & logger = fba::Logger::get();
-
     data.clear();
 
+    tiles_ = tgsavail->tiles();
+    tgs_ = tgsavail->targets();
+    data.resize(tgs_->data.size());
+
     // In order to play well with OpenMP for loops, construct a simple vector of
     // std::map keys for the available objects.
     std::vector <int32_t> tfkeys;
@@ -507,94 +1002,248 @@ fba::LocationsAvailable::LocationsAvailable(fba::TargetsAvailable::pshr tgsavail
 
     auto * ptgsavail = tgsavail.get();
 
-    #pragma omp parallel default(none) shared(logger, ptgsavail, ntile, tfkeys)
-    {
-        // Our thread-local data, to be reduced at the end.
-        std::map < int64_t,
-            std::vector < std::pair <int32_t, int32_t> > > thread_data;
-        std::ostringstream logmsg;
+    auto const * ptgs = tgs_.get();
 
-        auto const & avail = ptgsavail->data;
+    // Each worker collects the tile / locations of the tiles it handles, and
+    // these are merged at the end.  With pinned threads, the workers start
+    // on the same tiles that they computed in the TargetsAvailable
+    // constructor.
+    TaskPool & pool = TaskPool::get();
+    std::vector < std::map < int32_t,
+        std::vector < std::pair <int32_t, int32_t> > > > worker_data(
+            pool.nworker());
 
-        #pragma omp for schedule(dynamic)
-        for (size_t tindx = 0; tindx < ntile; ++tindx) {
-            int32_t tid = tfkeys[tindx];
-            if (avail.count(tid) == 0) {
-                continue;
-            }
-            auto tavail = avail.at(tid);
-            for (auto const & ltg : tavail) {
-                auto loc = ltg.first;
-                for (auto const & tg : ltg.second) {
-                    if (thread_data.count(tg) == 0) {
-                        thread_data[tg].resize(0);
-                    }
-                    if (logger.extra_debug()) {
-                        logmsg.str("");
-                        logmsg << "target " << tg
-                            << " has available tile / location "
-                            << tid << ", " << loc;
-                        logger.debug_tfg(tid, loc, tg, logmsg.str().c_str());
-                    }
-                    thread_data[tg].push_back(std::make_pair(tid, loc));
-                }
+    auto const & avail = ptgsavail->data;
+
+    pool.run("LocationsAvailable: tiles", ntile, [&](size_t tindx) {
+        auto & thread_data = worker_data[TaskPool::worker()];
+        int32_t tid = tfkeys[tindx];
+        if (avail.count(tid) == 0) {
+            return;
+        }
+        auto const & tavail = avail.at(tid);
+        for (auto const & ltg : tavail) {
+            auto loc = ltg.first;
+            for (auto const & tg : ltg.second) {
+                FBA_TRACE_TFG(TRACE_MESSAGE, tid, loc,
+                    ptgs->data[tg].id, 0, 0,
+                    "target " << ptgs->data[tg].id
+                    << " has available tile / location "
+                    << tid << ", " << loc);
+                thread_data[tg].push_back(std::make_pair(tid, loc));
             }
         }
-
-        // Now reduce across threads.
-        #pragma omp critical
-        {
-            for (auto const & it : thread_data) {
-                int64_t tg = it.first;
-                if (data.count(tg) == 0) {
-                    data[tg].resize(0);
-                }
-                for (auto const & ft : it.second) {
-                    data[tg].push_back(ft);
-                }
+    });
+
+    // Now reduce across workers.
+    for (auto & thread_data : worker_data) {
+        for (auto const & it : thread_data) {
+            int32_t tg = it.first;
+            for (auto const & ft : it.second) {
+                data[tg].push_back(ft);
             }
-            thread_data.clear();
         }
+        thread_data.clear();
     }
 
     // Sort the available tile / locations by tile order, since the original
     // order will depend on thread concurrency.
 
-    auto tls = tgsavail->tiles();
-    auto torder = tls->order;
-    auto tids = tls->id;
+    tile_index.resize(data.size());
+    for (size_t tg = 0; tg < data.size(); ++tg) {
+        sort_target(data[tg]);
+        index_target(tg);
+    }
+
+    tm.stop();
+    tm.report("Computing tile / locations available to all objects");
+}
+
+
+void fba::LocationsAvailable::sort_target(
+    std::vector < std::pair <int32_t, int32_t> > & av) const {
+
+    auto const & torder = tiles_->order;
+    auto const & tids = tiles_->id;
 
     fba::tile_loc_compare tlcomp;
 
     std::vector <tile_loc> temptl;
+    for (auto const & tf : av) {
+        temptl.push_back(
+            std::make_pair(torder.at(tf.first), tf.second)
+        );
+    }
+    std::stable_sort(temptl.begin(), temptl.end(), tlcomp);
+    av.clear();
+    for (auto const & tf : temptl) {
+        av.push_back(
+            std::make_pair(tids.at(tf.first), tf.second)
+        );
+    }
+    return;
+}
 
-    for (auto & tgav : data) {
-        auto & av = tgav.second;
-        temptl.clear();
-        for (auto const & tf : av) {
-            temptl.push_back(
-                std::make_pair(torder.at(tf.first), tf.second)
-            );
+
+void fba::LocationsAvailable::index_target(int32_t row) {
+    auto const & torder = tiles_->order;
+    auto const & av = data[row];
+    auto & tindx = tile_index[row];
+    tindx.clear();
+    for (size_t i = 0; i < av.size(); ++i) {
+        tindx.push_back(std::make_pair(torder.at(av[i].first), (int32_t)i));
+    }
+    std::stable_sort(tindx.begin(), tindx.end(),
+        [](std::pair <int32_t, int32_t> const & a,
+           std::pair <int32_t, int32_t> const & b) {
+            return a.first < b.first;
         }
-        std::stable_sort(temptl.begin(), temptl.end(), tlcomp);
-        av.clear();
-        for (auto const & tf : temptl) {
-            av.push_back(
-                std::make_pair(tids.at(tf.first), tf.second)
-            );
+    );
+    return;
+}
+
+
+void fba::LocationsAvailable::add(std::map <int32_t, std::map <int32_t,
+    std::vector <int32_t> > > const & tile_loc_targets) {
+
+    // Rows of any newly appended targets.
+    data.resize(tgs_->data.size());
+    tile_index.resize(tgs_->data.size());
+
+    // Append the new tile / locations in tile order and then re-sort only
+    // the targets that were touched.
+
+    std::set <int32_t> touched;
+    for (auto const & tid : tiles_->id) {
+        if (tile_loc_targets.count(tid) == 0) {
+            continue;
+        }
+        for (auto const & ltg : tile_loc_targets.at(tid)) {
+            for (auto const & tg : ltg.second) {
+                data[tg].push_back(std::make_pair(tid, ltg.first));
+                touched.insert(tg);
+            }
         }
     }
 
-    tm.stop();
-    tm.report("Computing tile / locations available to all objects");
+    for (auto const & tg : touched) {
+        sort_target(data[tg]);
+        index_target(tg);
+    }
+    return;
+}
+
+
+std::map < int32_t, std::vector < std::pair <int32_t, int32_t> > >
+    fba::LocationsAvailable::remove(std::vector <int32_t> const & rows) {
+
+    std::map < int32_t, std::vector < std::pair <int32_t, int32_t> > > ret;
+    for (auto const & tg : rows) {
+        if ((tg < 0) || (tg >= (int32_t)data.size())) {
+            continue;
+        }
+        ret[tg].swap(data[tg]);
+        tile_index[tg].clear();
+    }
+    return ret;
 }
 
 
 std::vector <std::pair <int32_t, int32_t> >
     fba::LocationsAvailable::target_data(int64_t target) const {
-    if (data.count(target) == 0) {
+    auto it = tgs_->rows.find(target);
+    if ((it == tgs_->rows.end()) || (it->second >= (int32_t)data.size())) {
         return std::vector <std::pair <int32_t, int32_t> >();
     } else {
-        return data.at(target);
+        return data[it->second];
     }
 }
+
+
+std::map <std::string, int64_t> fba::LocationsAvailable::memory_usage() const {
+    std::map <std::string, int64_t> ret;
+    ret["data"] = heap_bytes(data);
+    ret["tile_index"] = heap_bytes(tile_index);
+    return ret;
+}
+
+
+void fba::sort_target_weights(std::vector <target_weight> & weights,
+                              bool ascending, size_t radix_min) {
+    size_t nw = weights.size();
+
+    // Below this size, the radix passes cost more than they save.
+    if ((nw == 0) || (nw < radix_min)) {
+        if (ascending) {
+            std::stable_sort(weights.begin(), weights.end(),
+                             fba::target_weight_rcompare());
+        } else {
+            std::stable_sort(weights.begin(), weights.end(),
+                             fba::target_weight_compare());
+        }
+        return;
+    }
+
+    // Map each weight to an unsigned integer with the same ordering as the
+    // double values (inverted for descending order).  A stable LSD radix
+    // sort on these keys then gives exactly the same result as a stable
+    // comparison sort, including the order of equal weights.
+
+    std::vector <uint64_t> keys(nw);
+    for (size_t i = 0; i < nw; ++i) {
+        double val = weights[i].second;
+        if (std::isnan(val)) {
+            // NaN does not have a strict weak ordering.  Use the plain sort.
+            if (ascending) {
+                std::stable_sort(weights.begin(), weights.end(),
+                                 fba::target_weight_rcompare());
+            } else {
+                std::stable_sort(weights.begin(), weights.end(),
+                                 fba::target_weight_compare());
+            }
+            return;
+        }
+        if (val == 0.0) {
+            // -0.0 and 0.0 compare equal.
+            val = 0.0;
+        }
+        uint64_t bits;
+        std::memcpy(&bits, &val, sizeof(bits));
+        if (bits & 0x8000000000000000ULL) {
+            bits = ~bits;
+        } else {
+            bits |= 0x8000000000000000ULL;
+        }
+        keys[i] = (ascending) ? bits : ~bits;
+    }
+
+    std::vector <target_weight> tmp_weights(nw);
+    std::vector <uint64_t> tmp_keys(nw);
+
+    // 11 bit digits, 6 passes.
+    static const int radix_bits = 11;
+    static const uint64_t radix_mask = (1 << radix_bits) - 1;
+    std::vector <size_t> offset(radix_mask + 2);
+
+    for (int shift = 0; shift < 64; shift += radix_bits) {
+        std::fill(offset.begin(), offset.end(), 0);
+        for (size_t i = 0; i < nw; ++i) {
+            offset[((keys[i] >> shift) & radix_mask) + 1]++;
+        }
+        if (offset[((keys[0] >> shift) & radix_mask) + 1] == nw) {
+            // All keys have the same digit, nothing to do for this pass.
+            continue;
+        }
+        for (size_t d = 0; d <= radix_mask; ++d) {
+            offset[d + 1] += offset[d];
+        }
+        for (size_t i = 0; i < nw; ++i) {
+            size_t dest = offset[(keys[i] >> shift) & radix_mask]++;
+            tmp_weights[dest] = weights[i];
+            tmp_keys[dest] = keys[i];
+        }
+        weights.swap(tmp_weights);
+        keys.swap(tmp_keys);
+    }
+    return;
+}
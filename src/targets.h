@@ -76,6 +76,9 @@ class Target {
 
         double total_priority() const;
 
+        // The total priority with the given number of observations remaining.
+        double total_priority(int32_t remain) const;
+
 };
 
 
@@ -102,10 +105,34 @@ class Targets : public std::enable_shared_from_this <Targets> {
             std::vector <uint8_t> const & type
         );
 
-        std::map <int64_t, Target> data;
+        void remove (std::vector <int64_t> const & id);
+
+        void update (
+            std::vector <int64_t> const & id,
+            std::vector <int32_t> const & obsremain,
+            std::vector <int32_t> const & priority,
+            std::vector <double> const & subpriority
+        );
+
+        // The row of a target ID.  Throws if the ID does not exist.
+        int32_t row(int64_t id) const;
+
+        // The IDs of all current targets, sorted.
+        std::vector <int64_t> ids() const;
+
+        // data[row] = Target.  Internal structures refer to targets by row.
+        // Removed targets keep their row, with an ID of -1 and a type of 0.
+        std::vector <Target> data;
+
+        // rows[target_id] = row
+        std::map <int64_t, int32_t> rows;
+
         std::set <int32_t> science_classes;
         std::string survey;
 
+        // Estimated heap memory of each member in bytes.
+        std::map <std::string, int64_t> memory_usage() const;
+
 };
 
 
@@ -142,13 +169,112 @@ class TargetTree : public std::enable_shared_from_this <TargetTree> {
 };
 
 
-// Data for one point of the KD tree.
+// Data for one point of the KD tree.  The id is the target row.
 
 typedef struct {
     int64_t id;
     double pos[2];
 } KdTreePoint;
 
+
+// Focalplane positions of the targets reachable on one tile, sorted by
+// target row.  The positions are stored in double precision, or in single
+// precision when the compact mode is selected.  Single precision values near
+// the edge of the focalplane (~420mm) have a resolution of ~0.03 microns.
+
+class TileTargetXY {
+
+    public :
+
+        TileTargetXY(bool compact = false);
+
+        bool compact() const;
+
+        size_t size() const;
+
+        // The value that is actually stored for a coordinate.
+        double stored(double val) const;
+
+        // Index of a target row, or -1 if the row is not present.
+        int32_t index(int32_t row) const;
+
+        bool has(int32_t row) const;
+
+        // Position of a target row.  Throws if the row is not present.
+        fbg::dpair xy(int32_t row) const;
+
+        // Position of the target at an index.
+        fbg::dpair xy_index(size_t idx) const;
+
+        std::vector <int32_t> const & rows() const;
+
+        // Insert (row, position) entries.  Rows which are already present
+        // are ignored.
+        void insert(std::vector <std::pair <int32_t, fbg::dpair> > entries);
+
+        void erase(int32_t row);
+
+        // Estimated heap memory in bytes.
+        size_t memory_bytes() const;
+
+    private :
+
+        bool compact_;
+
+        std::vector <int32_t> rows_;
+
+        // Interleaved x / y values, only one of these is used.
+        std::vector <double> xy_;
+        std::vector <float> xy_compact_;
+
+};
+
+inline size_t heap_bytes(TileTargetXY const & val) {
+    return val.memory_bytes();
+}
+
+
+// The target rows available to one location, split by target type.  Each
+// list keeps the order of the full availability list, so iterating one list
+// visits the same targets in the same order as filtering the full list.
+
+class LocTypeTargets {
+
+    public :
+
+        // Append a target row to the lists matching its type.
+        void append(int32_t row, Target const & tg);
+
+        // Remove a target row from all lists.
+        void erase(int32_t row);
+
+        // Rebuild the list of science targets with observations remaining.
+        void update_remain(std::vector <Target> const & tgdata);
+
+        // The rows of one target type, optionally only the science targets
+        // with observations remaining.  Returns NULL if the type has more
+        // than one bit set.
+        std::vector <int32_t> const * type_rows(uint8_t type,
+                                                bool remaining) const;
+
+        std::vector <int32_t> science;
+        std::vector <int32_t> standard;
+        std::vector <int32_t> sky;
+        std::vector <int32_t> suppsky;
+        std::vector <int32_t> safe;
+
+        // Science targets with obsremain > 0.
+        std::vector <int32_t> science_remain;
+
+};
+
+inline size_t heap_bytes(LocTypeTargets const & val) {
+    return heap_bytes(val.science) + heap_bytes(val.standard)
+        + heap_bytes(val.sky) + heap_bytes(val.suppsky)
+        + heap_bytes(val.safe) + heap_bytes(val.science_remain);
+}
+
+
 // Class holding the object IDs available for each tile and location.
 
 
@@ -159,30 +285,84 @@ class TargetsAvailable : public std::enable_shared_from_this <TargetsAvailable>
         typedef std::shared_ptr <TargetsAvailable> pshr;
 
         TargetsAvailable(Hardware::pshr hw,
+                         Targets::pshr objs,
                          Tiles::pshr tiles,
                          std::map<int64_t, std::vector<int64_t> > tile_targetids,
                          std::map<int64_t, std::vector<double> > tile_x,
-                         std::map<int64_t, std::vector<double> > tile_y);
+                         std::map<int64_t, std::vector<double> > tile_y,
+                         bool compact_xy = false);
 
         Hardware::pshr hardware() const;
 
         Tiles::pshr tiles() const;
 
+        Targets::pshr targets() const;
+
+        bool compact_xy() const;
+
         std::map <int32_t, std::vector <int64_t> > tile_data(int32_t tile) const;
 
-        // data[tile][loc] = vector< target_id >
-        std::map <int32_t, std::map <int32_t, std::vector <int64_t> > > data;
+        // The same for the targets of one type from type_data, optionally
+        // only the science targets with observations remaining.
+        std::map <int32_t, std::vector <int64_t> > tile_type_data(
+            int32_t tile, uint8_t type, bool remaining = false) const;
+
+        // Add new targets to existing tiles, or to tiles which were
+        // appended to the Tiles object since construction.  Only the
+        // locations on the given tiles which can reach the new targets are
+        // modified.  The return value contains just the newly added
+        // entries, with the same layout as the data member.
+        std::map <int32_t, std::map <int32_t, std::vector <int32_t> > > add(
+            std::map<int64_t, std::vector<int64_t> > const & tile_targetids,
+            std::map<int64_t, std::vector<double> > const & tile_x,
+            std::map<int64_t, std::vector<double> > const & tile_y);
+
+        // Remove target rows from the specified tile / locations.
+        void remove(std::map <int32_t,
+            std::vector <std::pair <int32_t, int32_t> > > const & target_tl);
+
+        // Refresh the science targets with observations remaining on the
+        // given tile / locations.  This must be called whenever the obsremain
+        // of a science target crosses zero.
+        void update_remain(
+            std::vector <std::pair <int32_t, int32_t> > const & tile_locs);
+
+        // data[tile][loc] = vector< target_row >
+        std::map <int32_t, std::map <int32_t, std::vector <int32_t> > > data;
 
-        // data_xy[tile][loc] = vector< pair( x, y) >
-        std::map <int32_t, std::map <int32_t, std::vector <
-            std::pair<double, double> > > > data_xy;
+        // tile_xy[tile] = positions of all targets available on the tile
+        std::map <int32_t, TileTargetXY> tile_xy;
+
+        // type_data[tile][loc] = target rows split by type
+        std::map <int32_t, std::map <int32_t, LocTypeTargets> > type_data;
+
+        // Estimated heap memory of each member in bytes.
+        std::map <std::string, int64_t> memory_usage() const;
 
     private :
 
+        bool tile_avail(int32_t tile,
+            std::vector <int64_t> const & ids,
+            std::vector <double> const & x,
+            std::vector <double> const & y,
+            std::map <int32_t, std::vector <int32_t> > & loc_rows,
+            TileTargetXY & txy,
+            int64_t & missing) const;
+
         Hardware::pshr hw_;
 
+        Targets::pshr tgs_;
+
         Tiles::pshr tiles_;
 
+        bool compact_xy_;
+
+        // Location centers and patrol radii, cached for the KD tree queries.
+        std::vector <int32_t> loc_;
+        std::vector <double> loc_center_x_;
+        std::vector <double> loc_center_y_;
+        std::vector <double> loc_patrol_;
+
 };
 
 
@@ -199,14 +379,44 @@ class LocationsAvailable : public std::enable_shared_from_this <LocationsAvailab
         std::vector <std::pair <int32_t, int32_t> >
             target_data(int64_t target) const;
 
-        std::map < int64_t, std::vector < std::pair <int32_t, int32_t> > > data;
+        // Add tile / locations for target rows, as returned by
+        // TargetsAvailable::add().
+        void add(std::map <int32_t, std::map <int32_t,
+            std::vector <int32_t> > > const & tile_loc_targets);
+
+        // Remove target rows and return their former tile / locations.
+        std::map < int32_t, std::vector < std::pair <int32_t, int32_t> > >
+            remove(std::vector <int32_t> const & rows);
+
+        // data[target_row] = vector< pair(tile, loc) >
+        std::vector < std::vector < std::pair <int32_t, int32_t> > > data;
+
+        // tile_index[target_row] = vector< pair(tile index, position in
+        // data[target_row]) >, sorted by tile index.  This allows searching
+        // for the tile / locations on a range of tiles.
+        std::vector < std::vector < std::pair <int32_t, int32_t> > >
+            tile_index;
+
+        // Estimated heap memory of each member in bytes.
+        std::map <std::string, int64_t> memory_usage() const;
+
+    private :
+
+        void sort_target(std::vector < std::pair <int32_t, int32_t> > & av)
+            const;
+
+        void index_target(int32_t row);
+
+        Targets::pshr tgs_;
+
+        Tiles::pshr tiles_;
 
 };
 
 
 // Helper functions for sorting targets based on total priority.
 
-typedef std::pair <int64_t, double> target_weight;
+typedef std::pair <int32_t, double> target_weight;
 
 struct target_weight_compare {
     // Define this method here so that it is inline.
@@ -224,6 +434,43 @@ struct target_weight_rcompare {
     }
 };
 
+// Stable sort of target weights from highest to lowest (or lowest to
+// highest), with exactly the same result as std::stable_sort using the
+// comparisons above.  Lists of at least radix_min elements are sorted with a
+// radix sort.  On simulated priority + subpriority weights the radix sort
+// breaks even with std::stable_sort at about 256 elements and takes half the
+// time from about 1000.  The lists of one location are shorter than this, so
+// in practice it is used for the lists of a whole tile.
+
+#define TARGET_WEIGHT_RADIX_MIN 256
+
+void sort_target_weights(std::vector <target_weight> & weights,
+                         bool ascending = false,
+                         size_t radix_min = TARGET_WEIGHT_RADIX_MIN);
+
+// The same for lists with another allocator.  Large lists are sorted in a
+// temporary copy.
+
+template <typename A>
+void sort_target_weights(std::vector <target_weight, A> & weights,
+                         bool ascending = false,
+                         size_t radix_min = TARGET_WEIGHT_RADIX_MIN) {
+    if (weights.size() < radix_min) {
+        if (ascending) {
+            std::stable_sort(weights.begin(), weights.end(),
+                             target_weight_rcompare());
+        } else {
+            std::stable_sort(weights.begin(), weights.end(),
+                             target_weight_compare());
+        }
+        return;
+    }
+    std::vector <target_weight> tmp(weights.begin(), weights.end());
+    sort_target_weights(tmp, ascending, radix_min);
+    std::copy(tmp.begin(), tmp.end(), weights.begin());
+    return;
+}
+
 // Helper functions for sorting tile / location pairs
 
 typedef std::pair <int32_t, int32_t> tile_loc;
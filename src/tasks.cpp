@@ -0,0 +1,405 @@
+// Licensed under a 3-clause BSD style license - see LICENSE.rst
+
+#include <cstdio>
+
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include <tasks.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+namespace fba = fiberassign;
+
+
+namespace {
+
+// The worker index of the calling thread during a run, or -1.
+thread_local int32_t current_worker = -1;
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration <double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+}
+
+
+double fba::TaskStats::imbalance() const {
+    if (worker_busy.size() == 0) {
+        return 1.0;
+    }
+    double tot = 0.0;
+    double mx = 0.0;
+    for (auto const & b : worker_busy) {
+        tot += b;
+        mx = std::max(mx, b);
+    }
+    if (tot <= 0.0) {
+        return 1.0;
+    }
+    return mx * static_cast <double> (worker_busy.size()) / tot;
+}
+
+
+fba::TaskGroup::TaskGroup() {
+    pending_ = 0;
+}
+
+
+fba::TaskGroup::~TaskGroup() {
+    // Tasks refer to the group, so they must finish before it goes away.
+    // Any error was already reported or is lost with the group.
+    try {
+        wait();
+    } catch (...) {
+    }
+}
+
+
+void fba::TaskGroup::fail(std::exception_ptr err) {
+    std::lock_guard <std::mutex> lock(error_mutex_);
+    if (! error_) {
+        error_ = err;
+    }
+    return;
+}
+
+
+void fba::TaskGroup::spawn(std::function <void()> task) {
+    int32_t w = current_worker;
+    if (w < 0) {
+        // Not inside the pool.
+        try {
+            task();
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        return;
+    }
+    pending_++;
+    TaskPool::task tsk;
+    tsk.fn = std::move(task);
+    tsk.group = this;
+    TaskPool::get().push(w, std::move(tsk));
+    return;
+}
+
+
+void fba::TaskGroup::wait() {
+    int32_t w = current_worker;
+    if (w >= 0) {
+        TaskPool & pool = TaskPool::get();
+        while (pending_ > 0) {
+            if (! pool.run_one(w)) {
+                std::this_thread::yield();
+            }
+        }
+    }
+    std::exception_ptr err;
+    {
+        std::lock_guard <std::mutex> lock(error_mutex_);
+        err = error_;
+        error_ = std::exception_ptr();
+    }
+    if (err) {
+        std::rethrow_exception(err);
+    }
+    return;
+}
+
+
+fba::TaskPool::TaskPool() {
+    nworker_ = 0;
+    running_ = false;
+}
+
+
+fba::TaskPool & fba::TaskPool::get() {
+    static fba::TaskPool instance;
+    return instance;
+}
+
+
+int32_t fba::TaskPool::worker() {
+    return (current_worker < 0) ? 0 : current_worker;
+}
+
+
+int32_t fba::TaskPool::nworker() const {
+    int32_t nw = nworker_;
+    if (nw > 0) {
+        return nw;
+    }
+    return std::max(1, Environment::get().current_threads());
+}
+
+
+void fba::TaskPool::push(int32_t w, task && tsk) {
+    worker_data & wd = *workers_[w];
+    std::lock_guard <std::mutex> lock(wd.mutex);
+    wd.queue.push_back(std::move(tsk));
+    return;
+}
+
+
+bool fba::TaskPool::pop(int32_t w, task & tsk) {
+    worker_data & wd = *workers_[w];
+    std::lock_guard <std::mutex> lock(wd.mutex);
+    if (wd.queue.empty()) {
+        return false;
+    }
+    tsk = std::move(wd.queue.back());
+    wd.queue.pop_back();
+    return true;
+}
+
+
+bool fba::TaskPool::steal(int32_t w, task & tsk) {
+    for (auto const & v : workers_[w]->victims) {
+        worker_data & vd = *workers_[v];
+        std::lock_guard <std::mutex> lock(vd.mutex);
+        if (vd.queue.empty()) {
+            continue;
+        }
+        tsk = std::move(vd.queue.front());
+        vd.queue.pop_front();
+        workers_[w]->steals++;
+        return true;
+    }
+    return false;
+}
+
+
+bool fba::TaskPool::run_one(int32_t w) {
+    task tsk;
+    if (! pop(w, tsk)) {
+        if (! steal(w, tsk)) {
+            return false;
+        }
+    }
+    worker_data & wd = *workers_[w];
+    auto start = std::chrono::steady_clock::now();
+    wd.depth++;
+    try {
+        tsk.fn();
+    } catch (...) {
+        tsk.group->fail(std::current_exception());
+    }
+    wd.depth--;
+    wd.tasks++;
+    if (wd.depth == 0) {
+        // Nested tasks are included in the time of their root task.
+        double dt = seconds_since(start);
+        wd.busy += dt;
+        wd.max_task = std::max(wd.max_task, dt);
+    }
+    tsk.group->pending_--;
+    return true;
+}
+
+
+void fba::TaskPool::run(std::string const & name, size_t n,
+                        std::function <void(size_t)> const & body) {
+    if (n == 0) {
+        return;
+    }
+
+    if (current_worker >= 0) {
+        // Nested inside a task of the current run.
+        TaskGroup group;
+        for (size_t i = 0; i < n; ++i) {
+            group.spawn([&body, i]() {
+                body(i);
+            });
+        }
+        group.wait();
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    Environment & env = Environment::get();
+    int32_t nw = std::max(1, env.current_threads());
+    bool expected = false;
+    if ((nw == 1) || (! running_.compare_exchange_strong(expected, true))) {
+        for (size_t i = 0; i < n; ++i) {
+            body(i);
+        }
+        if (nw == 1) {
+            std::lock_guard <std::mutex> lock(stats_mutex_);
+            auto & st = stats_[name];
+            if (st.runs == 0) {
+                st.name = name;
+                st.nworker = 1;
+                st.worker_tasks.assign(1, 0);
+                st.worker_steals.assign(1, 0);
+                st.worker_busy.assign(1, 0.0);
+            }
+            double dt = seconds_since(start);
+            st.runs++;
+            st.roots += n;
+            st.tasks += n;
+            st.elapsed += dt;
+            st.worker_tasks[0] += n;
+            st.worker_busy[0] += dt;
+        }
+        return;
+    }
+
+    // Set up the workers.  Idle workers try the others on their own NUMA
+    // domain before the rest, starting from their neighbors.
+    while (static_cast <int32_t> (workers_.size()) < nw) {
+        workers_.emplace_back(new worker_data());
+    }
+    for (int32_t w = 0; w < nw; ++w) {
+        worker_data & wd = *workers_[w];
+        wd.queue.clear();
+        wd.victims.clear();
+        wd.depth = 0;
+        wd.tasks = 0;
+        wd.steals = 0;
+        wd.busy = 0.0;
+        wd.max_task = 0.0;
+        int32_t dom = env.thread_domain(w);
+        for (int32_t k = 1; k < nw; ++k) {
+            int32_t v = (w + k) % nw;
+            if (env.thread_domain(v) == dom) {
+                wd.victims.push_back(v);
+            }
+        }
+        for (int32_t k = 1; k < nw; ++k) {
+            int32_t v = (w + k) % nw;
+            if (env.thread_domain(v) != dom) {
+                wd.victims.push_back(v);
+            }
+        }
+    }
+    nworker_ = nw;
+
+    // Each worker starts on its own block of the root tasks, in order.
+    TaskGroup root;
+    root.pending_ = static_cast <int64_t> (n);
+    std::vector <std::pair <size_t, size_t> > parts = env.partition(n);
+    for (int32_t w = 0; w < nw; ++w) {
+        worker_data & wd = *workers_[w];
+        for (size_t i = parts[w].second; i > parts[w].first; --i) {
+            task tsk;
+            size_t indx = i - 1;
+            tsk.fn = [&body, indx]() {
+                body(indx);
+            };
+            tsk.group = &root;
+            wd.queue.push_back(std::move(tsk));
+        }
+    }
+
+    // If the runtime gives us fewer threads, the others steal the tasks
+    // of the missing workers.
+    #pragma omp parallel default(shared) num_threads(nw)
+    {
+        int32_t w = 0;
+        #ifdef _OPENMP
+        w = omp_get_thread_num();
+        #endif
+        current_worker = w;
+        while (root.pending_ > 0) {
+            if (! run_one(w)) {
+                std::this_thread::yield();
+            }
+        }
+        current_worker = -1;
+    }
+
+    record(name, n, seconds_since(start));
+    nworker_ = 0;
+    running_ = false;
+
+    root.wait();
+    return;
+}
+
+
+void fba::TaskPool::record(std::string const & name, size_t n,
+                           double elapsed) {
+    int32_t nw = nworker_;
+    std::lock_guard <std::mutex> lock(stats_mutex_);
+    auto & st = stats_[name];
+    if (st.runs == 0) {
+        st.name = name;
+        st.nworker = nw;
+    }
+    if (st.nworker < nw) {
+        st.nworker = nw;
+    }
+    st.worker_tasks.resize(st.nworker, 0);
+    st.worker_steals.resize(st.nworker, 0);
+    st.worker_busy.resize(st.nworker, 0.0);
+    st.runs++;
+    st.roots += n;
+    st.elapsed += elapsed;
+    for (int32_t w = 0; w < nw; ++w) {
+        worker_data const & wd = *workers_[w];
+        st.tasks += wd.tasks;
+        st.worker_tasks[w] += wd.tasks;
+        st.worker_steals[w] += wd.steals;
+        st.worker_busy[w] += wd.busy;
+        st.max_task = std::max(st.max_task, wd.max_task);
+    }
+    return;
+}
+
+
+std::vector <fba::TaskStats> fba::TaskPool::stats() const {
+    std::lock_guard <std::mutex> lock(stats_mutex_);
+    std::vector <fba::TaskStats> ret;
+    for (auto const & it : stats_) {
+        ret.push_back(it.second);
+    }
+    return ret;
+}
+
+
+void fba::TaskPool::clear_stats() {
+    std::lock_guard <std::mutex> lock(stats_mutex_);
+    stats_.clear();
+    return;
+}
+
+
+void fba::TaskPool::report() const {
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream msg;
+    for (auto const & st : stats()) {
+        int64_t steals = 0;
+        double busy_min = 0.0;
+        double busy_max = 0.0;
+        double busy_tot = 0.0;
+        for (size_t w = 0; w < st.worker_busy.size(); ++w) {
+            steals += st.worker_steals[w];
+            double b = st.worker_busy[w];
+            busy_min = (w == 0) ? b : std::min(busy_min, b);
+            busy_max = std::max(busy_max, b);
+            busy_tot += b;
+        }
+        double busy_mean = 0.0;
+        if (st.worker_busy.size() > 0) {
+            busy_mean = busy_tot / static_cast <double> (st.worker_busy.size());
+        }
+        msg.str("");
+        msg.precision(3);
+        msg << std::fixed << "Tasks " << st.name << ":  " << st.runs
+            << " runs, " << st.roots << " root / " << st.tasks
+            << " total tasks on " << st.nworker << " workers, "
+            << st.elapsed << " seconds, busy min / mean / max = "
+            << busy_min << " / " << busy_mean << " / " << busy_max
+            << ", imbalance " << st.imbalance() << ", " << steals
+            << " steals, longest task " << st.max_task;
+        logger.info(msg.str().c_str());
+    }
+    return;
+}
@@ -0,0 +1,152 @@
+// Licensed under a 3-clause BSD style license - see LICENSE.rst
+
+#ifndef TASKS_H
+#define TASKS_H
+
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <exception>
+
+#include <utils.h>
+
+
+namespace fiberassign {
+
+// Load balance statistics of all TaskPool::run() calls with one name.
+
+struct TaskStats {
+    std::string name;
+    int64_t runs;
+    int32_t nworker;
+    // The root tasks, and all tasks including those spawned by other tasks.
+    int64_t roots;
+    int64_t tasks;
+    double elapsed;
+    // The longest root task, which bounds the elapsed time from below.
+    double max_task;
+    // For each worker, the tasks executed, the tasks stolen from other
+    // workers and the seconds spent running root tasks.
+    std::vector <int64_t> worker_tasks;
+    std::vector <int64_t> worker_steals;
+    std::vector <double> worker_busy;
+
+    // The ratio of the largest to the mean busy time of the workers (1.0
+    // for a perfect balance).
+    double imbalance() const;
+};
+
+
+// A set of tasks to wait for.  Tasks spawned from a task running in the
+// TaskPool are queued on that worker, where idle workers can steal them.
+// Otherwise they run immediately on the calling thread.  The first
+// exception thrown by a task is rethrown by wait().
+
+class TaskGroup {
+
+    public :
+
+        TaskGroup();
+        ~TaskGroup();
+
+        void spawn(std::function <void()> task);
+
+        // Wait for all spawned tasks, running queued tasks in the meantime.
+        void wait();
+
+    private :
+
+        TaskGroup(TaskGroup const &) = delete;
+        TaskGroup & operator=(TaskGroup const &) = delete;
+
+        void fail(std::exception_ptr err);
+
+        std::atomic <int64_t> pending_;
+        std::exception_ptr error_;
+        std::mutex error_mutex_;
+
+        friend class TaskPool;
+};
+
+
+// A work stealing task runtime on the OpenMP threads.  Each worker owns a
+// queue of tasks:  it runs the most recently queued task first, and idle
+// workers steal the oldest tasks of other workers, trying the workers on
+// their own NUMA domain first.  The root tasks of a run start out split
+// between the workers with Environment::partition(), so that with pinned
+// threads each tile is first handled on its own domain.
+
+class TaskPool {
+
+    public :
+
+        // Singleton access
+        static TaskPool & get();
+
+        // Run body(i) for every i in [0, n) as root tasks and wait for them.
+        // Called from inside a task, this spawns nested tasks instead.  If
+        // another thread is already running the pool, or only one thread
+        // is used, the loop runs serially on the calling thread.
+        void run(std::string const & name, size_t n,
+                 std::function <void(size_t)> const & body);
+
+        // The index of the worker running the calling task, which is less
+        // than nworker().  Outside of a run this is zero.  This can be used
+        // to select per-worker scratch space.
+        static int32_t worker();
+        int32_t nworker() const;
+
+        std::vector <TaskStats> stats() const;
+        void clear_stats();
+
+        // Log the statistics of every run name.
+        void report() const;
+
+    private :
+
+        // This class is a singleton- constructor is private.
+        TaskPool();
+
+        struct task {
+            std::function <void()> fn;
+            TaskGroup * group;
+        };
+
+        struct worker_data {
+            std::mutex mutex;
+            std::deque <task> queue;
+            // Workers to steal from, in order of preference.
+            std::vector <int32_t> victims;
+            int32_t depth;
+            int64_t tasks;
+            int64_t steals;
+            double busy;
+            double max_task;
+        };
+
+        void push(int32_t w, task && tsk);
+        bool pop(int32_t w, task & tsk);
+        bool steal(int32_t w, task & tsk);
+        bool run_one(int32_t w);
+        void record(std::string const & name, size_t n, double elapsed);
+
+        std::vector <std::unique_ptr <worker_data> > workers_;
+        std::atomic <int32_t> nworker_;
+        std::atomic <bool> running_;
+
+        std::map <std::string, TaskStats> stats_;
+        mutable std::mutex stats_mutex_;
+
+        friend class TaskGroup;
+};
+
+
+}
+#endif
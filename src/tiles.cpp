@@ -14,9 +14,6 @@ fba::Tiles::Tiles(std::vector <int32_t> ids, std::vector <double> ras,
                   std::vector <double> thetaobs,
                   std::vector <double> hourangobs) {
 
-    fba::Logger & logger = fba::Logger::get();
-    std::ostringstream logmsg;
-
     id = ids;
     ra = ras;
     dec = decs;
@@ -28,10 +25,39 @@ fba::Tiles::Tiles(std::vector <int32_t> ids, std::vector <double> ras,
     // Construct the mapping of tile ID to position in the given sequence
     for (size_t i = 0; i < id.size(); ++i) {
         order[id[i]] = i;
-        if (logger.extra_debug()) {
+        FBA_TRACE_TFG(TRACE_MESSAGE, id[i], -1, -1, 0, 0,
+            "Tiles:  index " << i << " = ID " << id[i]);
+    }
+}
+
+
+void fba::Tiles::append(fba::Tiles const & other) {
+    fba::Logger & logger = fba::Logger::get();
+    std::ostringstream logmsg;
+
+    // Check all IDs before modifying anything.
+    for (auto const & tid : other.id) {
+        if (order.count(tid) > 0) {
             logmsg.str("");
-            logmsg << "Tiles:  index " << i << " = ID " << id[i];
-            logger.debug_tfg(id[i], -1, -1, logmsg.str().c_str());
+            logmsg << "Tiles:  cannot append tile " << tid
+                << " which already exists";
+            logger.error(logmsg.str().c_str());
+            throw std::runtime_error(logmsg.str().c_str());
         }
     }
+
+    for (size_t i = 0; i < other.id.size(); ++i) {
+        order[other.id[i]] = id.size();
+        id.push_back(other.id[i]);
+        ra.push_back(other.ra[i]);
+        dec.push_back(other.dec[i]);
+        obscond.push_back(other.obscond[i]);
+        obstime.push_back(other.obstime[i]);
+        obstheta.push_back(other.obstheta[i]);
+        obshourang.push_back(other.obshourang[i]);
+        FBA_TRACE_TFG(TRACE_MESSAGE, other.id[i], -1, -1, 0, 0,
+            "Tiles:  index " << order[other.id[i]] << " = ID "
+            << other.id[i]);
+    }
+    return;
 }
@@ -31,6 +31,10 @@ class Tiles : public std::enable_shared_from_this <Tiles> {
               std::vector <double> thetaobs,
               std::vector <double> hourangobs);
 
+        // Append the tiles of another object.  The tile IDs must not already
+        // exist.
+        void append(Tiles const & other);
+
         std::vector <int32_t> id;
         std::vector <double> ra;
         std::vector <double> dec;
@@ -6,9 +6,23 @@
 #include <cstring>
 
 #include <sstream>
+#include <fstream>
+#include <iomanip>
 
 #include <algorithm>
 
+#include <sys/resource.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <cerrno>
+#include <dirent.h>
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
 #ifdef _OPENMP
 #include <omp.h>
 #endif
@@ -107,12 +121,138 @@ void fba::Timer::report(char const * message) {
 }
 
 
+namespace {
+
+// Parse a kernel CPU list such as "0-3,8,10-11".
+
+std::vector <int> parse_cpulist(std::string const & str) {
+    std::vector <int> ret;
+    std::istringstream in(str);
+    std::string item;
+    while (std::getline(in, item, ',')) {
+        int first;
+        int last;
+        if (sscanf(item.c_str(), "%d-%d", &first, &last) == 2) {
+            for (int c = first; c <= last; ++c) {
+                ret.push_back(c);
+            }
+        } else if (sscanf(item.c_str(), "%d", &first) == 1) {
+            ret.push_back(first);
+        }
+    }
+    return ret;
+}
+
+
+std::string format_cpulist(std::vector <int> const & cpus) {
+    std::ostringstream o;
+    size_t i = 0;
+    while (i < cpus.size()) {
+        size_t j = i;
+        while ((j + 1 < cpus.size()) && (cpus[j + 1] == cpus[j] + 1)) {
+            j++;
+        }
+        if (i > 0) {
+            o << ",";
+        }
+        o << cpus[i];
+        if (j > i) {
+            o << "-" << cpus[j];
+        }
+        i = j + 1;
+    }
+    return o.str();
+}
+
+}
+
+
 fba::Environment::Environment() {
     max_threads_ = 1;
     #ifdef _OPENMP
     max_threads_ = omp_get_max_threads();
     #endif
     cur_threads_ = max_threads_;
+    affinity_ = AFFINITY_NONE;
+
+    // The CPUs this process may run on.
+    std::vector <int> allowed;
+    #ifdef __linux__
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) == 0) {
+        for (int c = 0; c < CPU_SETSIZE; ++c) {
+            if (CPU_ISSET(c, &mask)) {
+                allowed.push_back(c);
+            }
+        }
+    }
+    #endif
+    if (allowed.size() == 0) {
+        for (int c = 0; c < max_threads_; ++c) {
+            allowed.push_back(c);
+        }
+    }
+    std::set <int> allowed_set(allowed.begin(), allowed.end());
+
+    // The NUMA domains, ignoring those (memory only) without allowed CPUs.
+    std::map <int, std::vector <int> > nodes;
+    #ifdef __linux__
+    char const * sysnode = "/sys/devices/system/node";
+    DIR * dir = opendir(sysnode);
+    if (dir != NULL) {
+        struct dirent * ent;
+        while ((ent = readdir(dir)) != NULL) {
+            int nd;
+            char extra;
+            if (sscanf(ent->d_name, "node%d%c", &nd, &extra) != 1) {
+                continue;
+            }
+            std::ostringstream path;
+            path << sysnode << "/" << ent->d_name << "/cpulist";
+            std::ifstream f(path.str());
+            std::string line;
+            if (f.good() && std::getline(f, line)) {
+                for (auto const & c : parse_cpulist(line)) {
+                    if (allowed_set.count(c) > 0) {
+                        nodes[nd].push_back(c);
+                    }
+                }
+            }
+        }
+        closedir(dir);
+    }
+    #endif
+    for (auto const & it : nodes) {
+        for (auto const & c : it.second) {
+            cpu_domain_[c] = static_cast <int> (domain_cpus_.size());
+        }
+        domain_cpus_.push_back(it.second);
+    }
+    // CPUs which were not listed in any domain go in the last one.
+    for (auto const & c : allowed) {
+        if (cpu_domain_.count(c) == 0) {
+            if (domain_cpus_.size() == 0) {
+                domain_cpus_.resize(1);
+            }
+            cpu_domain_[c] = static_cast <int> (domain_cpus_.size() - 1);
+            domain_cpus_.back().push_back(c);
+        }
+    }
+
+    char * val = ::getenv("FIBERASSIGN_AFFINITY");
+    if ((val != NULL) && (strlen(val) > 0)) {
+        int policy = affinity_policy(std::string(val));
+        if (policy < 0) {
+            auto & log = fba::Logger::get();
+            std::ostringstream o;
+            o << "Unknown FIBERASSIGN_AFFINITY \"" << val
+                << "\", threads will not be pinned";
+            log.warning(o.str().c_str());
+        } else {
+            set_affinity(policy);
+        }
+    }
 }
 
 fba::Environment & fba::Environment::get() {
@@ -142,12 +282,456 @@ void fba::Environment::set_threads(int nthread) {
     omp_set_num_threads(nthread);
     #endif
     cur_threads_ = nthread;
+    if (affinity_ != AFFINITY_NONE) {
+        pin_threads();
+    }
+    return;
+}
+
+
+int fba::Environment::affinity_policy(std::string const & name) {
+    if (name == "none") {
+        return AFFINITY_NONE;
+    } else if (name == "compact") {
+        return AFFINITY_COMPACT;
+    } else if (name == "spread") {
+        return AFFINITY_SPREAD;
+    }
+    return -1;
+}
+
+
+std::string fba::Environment::affinity_name(int policy) {
+    switch (policy) {
+        case AFFINITY_NONE:
+            return std::string("none");
+        case AFFINITY_COMPACT:
+            return std::string("compact");
+        case AFFINITY_SPREAD:
+            return std::string("spread");
+        default:
+            return std::string("unknown");
+    }
+}
+
+
+void fba::Environment::set_affinity(int policy) {
+    if ((policy != AFFINITY_NONE) && (policy != AFFINITY_COMPACT)
+        && (policy != AFFINITY_SPREAD)) {
+        auto & log = fba::Logger::get();
+        std::ostringstream o;
+        o << "Invalid thread affinity policy " << policy;
+        log.error(o.str().c_str());
+        throw std::runtime_error(o.str().c_str());
+    }
+
+    // The order in which threads are given CPUs.
+    std::vector <int> order;
+    if (policy == AFFINITY_SPREAD) {
+        size_t maxlen = 0;
+        for (auto const & dc : domain_cpus_) {
+            maxlen = std::max(maxlen, dc.size());
+        }
+        for (size_t k = 0; k < maxlen; ++k) {
+            for (auto const & dc : domain_cpus_) {
+                if (k < dc.size()) {
+                    order.push_back(dc[k]);
+                }
+            }
+        }
+    } else {
+        for (auto const & dc : domain_cpus_) {
+            order.insert(order.end(), dc.begin(), dc.end());
+        }
+    }
+    thread_cpus_.clear();
+    for (int t = 0; t < max_threads_; ++t) {
+        thread_cpus_.push_back(order[t % order.size()]);
+    }
+
+    affinity_ = policy;
+    // With no policy this restores the threads to all allowed CPUs.
+    pin_threads();
+    return;
+}
+
+
+int fba::Environment::affinity() const {
+    return affinity_;
+}
+
+
+void fba::Environment::pin_threads() {
+    #ifdef __linux__
+    cpu_set_t all;
+    CPU_ZERO(&all);
+    for (auto const & it : cpu_domain_) {
+        CPU_SET(it.first, &all);
+    }
+    int policy = affinity_;
+    std::vector <int> const & tcpus = thread_cpus_;
+    // The OpenMP runtime reuses the same threads for later parallel regions
+    // of the same size, so pinning them here is persistent.
+    #pragma omp parallel default(shared) num_threads(cur_threads_)
+    {
+        int t = 0;
+        #ifdef _OPENMP
+        t = omp_get_thread_num();
+        #endif
+        cpu_set_t mask;
+        if ((policy == AFFINITY_NONE) || (tcpus.size() == 0)) {
+            mask = all;
+        } else {
+            CPU_ZERO(&mask);
+            CPU_SET(tcpus[t % tcpus.size()], &mask);
+        }
+        sched_setaffinity(0, sizeof(mask), &mask);
+    }
+    #endif
+    return;
+}
+
+
+int fba::Environment::ndomain() const {
+    return static_cast <int> (domain_cpus_.size());
+}
+
+
+std::vector <int> const & fba::Environment::domain_cpus(int domain) const {
+    if ((domain < 0) || (domain >= ndomain())) {
+        std::ostringstream o;
+        o << "NUMA domain " << domain << " is out of range";
+        throw std::runtime_error(o.str().c_str());
+    }
+    return domain_cpus_[domain];
+}
+
+
+int fba::Environment::thread_domain(int thread) const {
+    if ((affinity_ == AFFINITY_NONE) || (thread_cpus_.size() == 0)) {
+        return -1;
+    }
+    return cpu_domain_.at(thread_cpus_[thread % thread_cpus_.size()]);
+}
+
+
+std::vector <std::pair <size_t, size_t> > fba::Environment::partition(
+    size_t n) const {
+    size_t nthread = static_cast <size_t> (cur_threads_);
+
+    // The threads of each domain, in thread order.  Without pinning, all
+    // threads are treated as one domain.
+    std::map <int, std::vector <size_t> > dthreads;
+    for (size_t t = 0; t < nthread; ++t) {
+        dthreads[std::max(0, thread_domain(static_cast <int> (t)))]
+            .push_back(t);
+    }
+
+    std::vector <std::pair <size_t, size_t> > ret(nthread);
+    size_t done = 0;
+    for (auto const & it : dthreads) {
+        size_t dstart = (n * done) / nthread;
+        size_t dn = (n * (done + it.second.size())) / nthread - dstart;
+        size_t nt = it.second.size();
+        for (size_t k = 0; k < nt; ++k) {
+            ret[it.second[k]] = std::make_pair(
+                dstart + (dn * k) / nt, dstart + (dn * (k + 1)) / nt
+            );
+        }
+        done += nt;
+    }
+    return ret;
+}
+
+
+std::string fba::Environment::topology() {
+    std::ostringstream o;
+    size_t nallowed = cpu_domain_.size();
+    o << ndomain() << " NUMA domain(s), " << nallowed << " allowed CPUs, "
+        << cur_threads_ << " threads, affinity \""
+        << affinity_name(affinity_) << "\"";
+    for (int d = 0; d < ndomain(); ++d) {
+        o << "\n  domain " << d << ": CPUs "
+            << format_cpulist(domain_cpus_[d]);
+    }
+    std::vector <int> running(cur_threads_, -1);
+    #ifdef __linux__
+    #pragma omp parallel default(shared) num_threads(cur_threads_)
+    {
+        int t = 0;
+        #ifdef _OPENMP
+        t = omp_get_thread_num();
+        #endif
+        running[t] = sched_getcpu();
+    }
+    #endif
+    for (int t = 0; t < cur_threads_; ++t) {
+        o << "\n  thread " << t << ": on CPU " << running[t];
+        if (running[t] >= 0) {
+            auto dit = cpu_domain_.find(running[t]);
+            if (dit != cpu_domain_.end()) {
+                o << " (domain " << dit->second << ")";
+            }
+        }
+        if (affinity_ != AFFINITY_NONE) {
+            o << ", pinned to CPU "
+                << thread_cpus_[t % thread_cpus_.size()];
+        }
+    }
+    return o.str();
+}
+
+
+int64_t fba::rss_current_bytes() {
+    // Only available from /proc on Linux.
+    int64_t ret = 0;
+    FILE * f = fopen("/proc/self/statm", "r");
+    if (f != NULL) {
+        long total;
+        long resident;
+        if (fscanf(f, "%ld %ld", &total, &resident) == 2) {
+            ret = static_cast <int64_t> (resident)
+                * static_cast <int64_t> (sysconf(_SC_PAGESIZE));
+        }
+        fclose(f);
+    }
+    return ret;
+}
+
+
+int64_t fba::rss_peak_bytes() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+    #ifdef __APPLE__
+    // Reported in bytes.
+    return static_cast <int64_t> (usage.ru_maxrss);
+    #else
+    // Reported in kilobytes.
+    return static_cast <int64_t> (usage.ru_maxrss) * 1024;
+    #endif
+}
+
+
+fba::ScratchArena::ScratchArena(size_t block_bytes) {
+    block_bytes_ = (block_bytes > 0) ? block_bytes : SCRATCH_ARENA_BLOCK;
+    offset_ = 0;
+    used_ = 0;
+}
+
+
+fba::ScratchArena::~ScratchArena() {
+    for (auto & blk : blocks_) {
+        free(blk.first);
+    }
+}
+
+
+void fba::ScratchArena::add_block(size_t bytes) {
+    char * data = static_cast <char *> (malloc(bytes));
+    if (data == NULL) {
+        throw std::bad_alloc();
+    }
+    blocks_.push_back(std::make_pair(data, bytes));
+    offset_ = 0;
+    return;
+}
+
+
+void * fba::ScratchArena::allocate(size_t bytes, size_t align) {
+    if (bytes == 0) {
+        bytes = 1;
+    }
+    if (blocks_.size() > 0) {
+        auto & blk = blocks_.back();
+        uintptr_t start = reinterpret_cast <uintptr_t> (blk.first);
+        uintptr_t ptr = (start + offset_ + align - 1) & ~(uintptr_t)(align - 1);
+        size_t end = (ptr - start) + bytes;
+        if (end <= blk.second) {
+            offset_ = end;
+            used_ += bytes;
+            return reinterpret_cast <void *> (ptr);
+        }
+    }
+    // Grow geometrically, so that the number of blocks stays small before
+    // the first reset.
+    size_t bsize = block_bytes_;
+    if (blocks_.size() > 0) {
+        bsize = std::max(bsize, 2 * blocks_.back().second);
+    }
+    bsize = std::max(bsize, bytes + align);
+    add_block(bsize);
+    auto & blk = blocks_.back();
+    uintptr_t start = reinterpret_cast <uintptr_t> (blk.first);
+    uintptr_t ptr = (start + align - 1) & ~(uintptr_t)(align - 1);
+    offset_ = (ptr - start) + bytes;
+    used_ += bytes;
+    return reinterpret_cast <void *> (ptr);
+}
+
+
+void fba::ScratchArena::reset() {
+    if (blocks_.size() > 1) {
+        size_t total = capacity();
+        for (auto & blk : blocks_) {
+            free(blk.first);
+        }
+        blocks_.clear();
+        add_block(total);
+    }
+    offset_ = 0;
+    used_ = 0;
+    return;
+}
+
+
+size_t fba::ScratchArena::used() const {
+    return used_;
+}
+
+
+size_t fba::ScratchArena::capacity() const {
+    size_t ret = 0;
+    for (auto const & blk : blocks_) {
+        ret += blk.second;
+    }
+    return ret;
+}
+
+
+fba::PerfCounters::PerfCounters() {
+    leader_ = -1;
+}
+
+
+fba::PerfCounters::~PerfCounters() {
+    // Members of the group are closed before the leader.
+    for (auto it = fds_.rbegin(); it != fds_.rend(); ++it) {
+        close(*it);
+    }
+}
+
+
+char const * fba::PerfCounters::event_name(int32_t event) {
+    switch (event) {
+        case PERF_EVENT_CYCLES:
+            return "cycles";
+        case PERF_EVENT_INSTRUCTIONS:
+            return "instructions";
+        case PERF_EVENT_CACHE_MISSES:
+            return "cache_misses";
+        case PERF_EVENT_BRANCH_MISSES:
+            return "branch_misses";
+        default:
+            return "unknown";
+    }
+}
+
+
+bool fba::PerfCounters::open() {
+    if (leader_ >= 0) {
+        return true;
+    }
+    #ifdef __linux__
+    uint64_t const config[PERF_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int first_errno = 0;
+    for (int32_t ev = 0; ev < PERF_EVENT_COUNT; ++ev) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config[ev];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP
+            | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        // This thread only, on any CPU.  The events are scheduled together
+        // as one group, so that their ratios are consistent.
+        int fd = static_cast <int> (
+            syscall(__NR_perf_event_open, &attr, 0, -1, leader_, 0)
+        );
+        if (fd < 0) {
+            if (first_errno == 0) {
+                first_errno = errno;
+            }
+            continue;
+        }
+        if (leader_ < 0) {
+            leader_ = fd;
+        }
+        fds_.push_back(fd);
+        events_.push_back(ev);
+    }
+    if (leader_ < 0) {
+        std::ostringstream o;
+        o << "perf_event_open failed: " << strerror(first_errno);
+        error_ = o.str();
+        return false;
+    }
+    return true;
+    #else
+    error_ = "perf_event_open is only available on Linux";
+    return false;
+    #endif
+}
+
+
+bool fba::PerfCounters::available() const {
+    return (leader_ >= 0);
+}
+
+
+std::string const & fba::PerfCounters::error() const {
+    return error_;
+}
+
+
+void fba::PerfCounters::read(int64_t * values) const {
+    for (int32_t ev = 0; ev < PERF_EVENT_COUNT; ++ev) {
+        values[ev] = -1;
+    }
+    if (leader_ < 0) {
+        return;
+    }
+    // Layout of the group read:  nr, time_enabled, time_running, value[nr]
+    uint64_t buf[3 + PERF_EVENT_COUNT];
+    ssize_t len = ::read(leader_, buf, sizeof(buf));
+    if (len < static_cast <ssize_t> (3 * sizeof(uint64_t))) {
+        return;
+    }
+    uint64_t nr = buf[0];
+    if ((nr != events_.size()) || (buf[2] == 0)) {
+        return;
+    }
+    // Scale up if the group was multiplexed with other events.
+    double scale = 1.0;
+    if (buf[2] < buf[1]) {
+        scale = static_cast <double> (buf[1]) / static_cast <double> (buf[2]);
+    }
+    for (size_t i = 0; i < nr; ++i) {
+        values[events_[i]] = static_cast <int64_t> (
+            static_cast <double> (buf[3 + i]) * scale
+        );
+    }
     return;
 }
 
 
 fba::GlobalTimers::GlobalTimers() {
-    data.clear();
+    epoch_ = std::chrono::steady_clock::now();
+    trace_ = false;
+    memory_ = false;
+    perf_ = false;
+    char * val = ::getenv("FIBERASSIGN_PERF_COUNTERS");
+    if ((val != NULL) && (strlen(val) > 0) && (strcmp(val, "0") != 0)) {
+        set_perf_counters(true);
+    }
 }
 
 
@@ -157,69 +741,616 @@ fba::GlobalTimers & fba::GlobalTimers::get() {
 }
 
 
-void fba::GlobalTimers::start(std::string const & name) {
-    if (data.count(name) == 0) {
-        data[name].clear();
+fba::GlobalTimers::thread_data & fba::GlobalTimers::local() {
+    // The timer data of each thread is registered on first use.
+    static thread_local thread_data * td = NULL;
+    if (td == NULL) {
+        std::lock_guard <std::mutex> lock(mutex_);
+        threads_.emplace_back(new thread_data());
+        td = threads_.back().get();
+        td->id = static_cast <int32_t> (threads_.size() - 1);
+    }
+    return (*td);
+}
+
+
+int32_t fba::GlobalTimers::region(std::string const & name) {
+    std::lock_guard <std::mutex> lock(mutex_);
+    auto it = region_ids_.find(name);
+    if (it != region_ids_.end()) {
+        return it->second;
     }
-    data.at(name).start();
+    int32_t id = static_cast <int32_t> (region_names_.size());
+    region_ids_[name] = id;
+    region_names_.push_back(name);
+    return id;
+}
+
+
+void fba::GlobalTimers::start(std::string const & name) {
+    start(region(name));
     return;
 }
 
 
 void fba::GlobalTimers::stop(std::string const & name) {
-    if (data.count(name) == 0) {
-        std::ostringstream o;
-        o << "Cannot stop timer " << name << " which does not exist";
-        throw std::runtime_error(o.str().c_str());
+    int32_t id;
+    {
+        std::lock_guard <std::mutex> lock(mutex_);
+        auto it = region_ids_.find(name);
+        if (it == region_ids_.end()) {
+            std::ostringstream o;
+            o << "Cannot stop timer " << name << " which does not exist";
+            throw std::runtime_error(o.str().c_str());
+        }
+        id = it->second;
+    }
+    stop(id);
+    return;
+}
+
+
+void fba::GlobalTimers::start(int32_t region) {
+    thread_data & td = local();
+    std::lock_guard <std::mutex> lock(td.mutex);
+
+    // Like a single timer, starting a region which is already running on
+    // this thread does nothing.
+    for (auto const & fr : td.stack) {
+        if (td.nodes[fr.node].region == region) {
+            return;
+        }
+    }
+
+    int32_t parent = -1;
+    if (td.stack.size() > 0) {
+        parent = td.stack.back().node;
+    }
+    std::vector <int32_t> & siblings = (parent < 0)
+        ? td.roots : td.nodes[parent].children;
+
+    int32_t nd = -1;
+    for (auto const & sib : siblings) {
+        if (td.nodes[sib].region == region) {
+            nd = sib;
+            break;
+        }
+    }
+    if (nd < 0) {
+        nd = static_cast <int32_t> (td.nodes.size());
+        node n;
+        n.parent = parent;
+        n.region = region;
+        n.calls = 0;
+        n.total = 0.0;
+        n.min = 0.0;
+        n.max = 0.0;
+        n.rss_peak = 0;
+        n.rss_growth = 0;
+        n.perf.fill(-1);
+        td.nodes.push_back(n);
+        // The reference may have been invalidated by the push_back.
+        if (parent < 0) {
+            td.roots.push_back(nd);
+        } else {
+            td.nodes[parent].children.push_back(nd);
+        }
+    }
+
+    frame fr;
+    fr.node = nd;
+    fr.rss_start = memory_ ? rss_peak_bytes() : -1;
+    fr.perf_start.fill(-1);
+    if (perf_) {
+        // The counters follow the thread which opens them.
+        if (! td.perf) {
+            td.perf.reset(new PerfCounters());
+            td.perf->open();
+        }
+        read_perf(td, fr.perf_start);
+    }
+    fr.start = std::chrono::steady_clock::now();
+    td.stack.push_back(fr);
+    return;
+}
+
+
+void fba::GlobalTimers::stop(int32_t region) {
+    time_point now = std::chrono::steady_clock::now();
+    thread_data & td = local();
+    std::lock_guard <std::mutex> lock(td.mutex);
+
+    // Stopping a region also stops any regions started inside it.  A region
+    // which is not running on this thread is ignored.
+    for (size_t depth = td.stack.size(); depth > 0; --depth) {
+        if (td.nodes[td.stack[depth - 1].node].region == region) {
+            close_frames(td, depth - 1, now);
+            break;
+        }
+    }
+    return;
+}
+
+
+void fba::GlobalTimers::close_frames(thread_data & td, size_t depth,
+                                     time_point now) {
+    bool tr = trace_;
+    int64_t rss = -1;
+    if (memory_ && (td.stack.size() > depth)) {
+        rss = rss_peak_bytes();
+    }
+    std::array <int64_t, PERF_EVENT_COUNT> counts;
+    counts.fill(-1);
+    if (perf_ && (td.stack.size() > depth)) {
+        read_perf(td, counts);
+    }
+    while (td.stack.size() > depth) {
+        frame const & fr = td.stack.back();
+        node & n = td.nodes[fr.node];
+        std::chrono::duration <double> elapsed = now - fr.start;
+        double dt = elapsed.count();
+        if ((n.calls == 0) || (dt < n.min)) {
+            n.min = dt;
+        }
+        if ((n.calls == 0) || (dt > n.max)) {
+            n.max = dt;
+        }
+        n.total += dt;
+        n.calls++;
+        if ((rss >= 0) && (fr.rss_start >= 0)) {
+            n.rss_peak = std::max(n.rss_peak, rss);
+            n.rss_growth += rss - fr.rss_start;
+        }
+        for (int32_t ev = 0; ev < PERF_EVENT_COUNT; ++ev) {
+            if ((counts[ev] >= 0) && (fr.perf_start[ev] >= 0)) {
+                if (n.perf[ev] < 0) {
+                    n.perf[ev] = 0;
+                }
+                n.perf[ev] += counts[ev] - fr.perf_start[ev];
+            }
+        }
+        if (tr) {
+            event ev;
+            ev.region = n.region;
+            ev.start = std::chrono::duration_cast
+                <std::chrono::nanoseconds> (fr.start - epoch_).count();
+            ev.stop = std::chrono::duration_cast
+                <std::chrono::nanoseconds> (now - epoch_).count();
+            td.events.push_back(ev);
+        }
+        td.stack.pop_back();
+    }
+    return;
+}
+
+
+void fba::GlobalTimers::flat_totals(std::vector <double> & total,
+                                    std::vector <int64_t> & calls,
+                                    std::vector <bool> & running) const {
+    // The caller holds the registry lock.
+    total.assign(region_names_.size(), 0.0);
+    calls.assign(region_names_.size(), 0);
+    running.assign(region_names_.size(), false);
+    for (auto const & td : threads_) {
+        std::lock_guard <std::mutex> lock(td->mutex);
+        for (auto const & n : td->nodes) {
+            total[n.region] += n.total;
+            calls[n.region] += n.calls;
+        }
+        for (auto const & fr : td->stack) {
+            running[td->nodes[fr.node].region] = true;
+        }
     }
-    data.at(name).stop();
     return;
 }
 
 
 double fba::GlobalTimers::seconds(std::string const & name) const {
-    if (data.count(name) == 0) {
+    std::lock_guard <std::mutex> lock(mutex_);
+    auto it = region_ids_.find(name);
+    if (it == region_ids_.end()) {
         std::ostringstream o;
         o << "Cannot get seconds for timer " << name
             << " which does not exist";
         throw std::runtime_error(o.str().c_str());
     }
-    return data.at(name).seconds();
+    std::vector <double> total;
+    std::vector <int64_t> calls;
+    std::vector <bool> running;
+    flat_totals(total, calls, running);
+    if (running[it->second]) {
+        throw std::runtime_error("Timer is still running!");
+    }
+    return total[it->second];
 }
 
 
 bool fba::GlobalTimers::is_running(std::string const & name) const {
-    if (data.count(name) == 0) {
+    std::lock_guard <std::mutex> lock(mutex_);
+    auto it = region_ids_.find(name);
+    if (it == region_ids_.end()) {
         return false;
     }
-    return data.at(name).is_running();
+    for (auto const & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        for (auto const & fr : td->stack) {
+            if (td->nodes[fr.node].region == it->second) {
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
 
 void fba::GlobalTimers::stop_all() {
-    for (auto & tm : data) {
-        tm.second.stop();
+    time_point now = std::chrono::steady_clock::now();
+    std::lock_guard <std::mutex> lock(mutex_);
+    for (auto & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        close_frames(*td, 0, now);
     }
     return;
 }
 
 
+void fba::GlobalTimers::clear() {
+    std::lock_guard <std::mutex> lock(mutex_);
+    for (auto & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        td->nodes.clear();
+        td->roots.clear();
+        td->stack.clear();
+        td->events.clear();
+    }
+    return;
+}
+
+
+namespace {
+
+// Ratios of the event counts which tell whether a region is limited by
+// memory access (few instructions per cycle, many cache misses) or by
+// computation.
+
+void perf_report(std::ostream & o,
+                 std::array <int64_t, PERF_EVENT_COUNT> const & perf) {
+    int64_t cyc = perf[PERF_EVENT_CYCLES];
+    int64_t ins = perf[PERF_EVENT_INSTRUCTIONS];
+    int64_t cmiss = perf[PERF_EVENT_CACHE_MISSES];
+    int64_t bmiss = perf[PERF_EVENT_BRANCH_MISSES];
+    if ((cyc < 0) && (ins < 0)) {
+        return;
+    }
+    o << std::setprecision(2);
+    if (cyc >= 0) {
+        o << ", " << static_cast <double> (cyc) * 1.0e-6 << " Mcycles";
+    }
+    if (ins > 0) {
+        double kins = static_cast <double> (ins) * 1.0e-3;
+        if (cyc > 0) {
+            o << ", IPC " << static_cast <double> (ins)
+                / static_cast <double> (cyc);
+        }
+        if (cmiss >= 0) {
+            o << ", cache misses / kinst "
+                << static_cast <double> (cmiss) / kins;
+        }
+        if (bmiss >= 0) {
+            o << ", branch misses / kinst "
+                << static_cast <double> (bmiss) / kins;
+        }
+    }
+    o << std::setprecision(6);
+    return;
+}
+
+}
+
+
 void fba::GlobalTimers::report() {
     stop_all();
+    fba::Logger & logger = fba::Logger::get();
+    std::lock_guard <std::mutex> lock(mutex_);
+
+    std::vector <double> total;
+    std::vector <int64_t> calls;
+    std::vector <bool> running;
+    flat_totals(total, calls, running);
+
     std::vector <std::string> names;
-    for (auto const & tm : data) {
-        names.push_back(tm.first);
+    for (auto const & it : region_ids_) {
+        if (calls[it.second] > 0) {
+            names.push_back(it.first);
+        }
     }
     std::stable_sort(names.begin(), names.end());
+
     std::ostringstream msg;
+    msg.precision(2);
     for (auto const & nm : names) {
+        int32_t id = region_ids_.at(nm);
         msg.str("");
-        msg << "Global timer: " << nm;
-        data.at(nm).report(msg.str().c_str());
+        msg << std::fixed << "Global timer: " << nm << ":  " << total[id]
+            << " seconds (" << calls[id] << " calls)";
+        logger.info(msg.str().c_str());
+    }
+
+    // The nested regions of each thread.
+    msg.precision(6);
+    for (auto const & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        if (td->roots.size() == 0) {
+            continue;
+        }
+        msg.str("");
+        msg << "Global timer tree for thread " << td->id << ":";
+        logger.info(msg.str().c_str());
+        std::vector <std::pair <int32_t, int32_t> > todo;
+        for (auto it = td->roots.rbegin(); it != td->roots.rend(); ++it) {
+            todo.push_back(std::make_pair(*it, 1));
+        }
+        while (todo.size() > 0) {
+            int32_t nd = todo.back().first;
+            int32_t depth = todo.back().second;
+            todo.pop_back();
+            node const & n = td->nodes[nd];
+            msg.str("");
+            msg << std::fixed << std::string(2 * depth, ' ')
+                << region_names_[n.region] << ":  " << n.total
+                << " seconds (" << n.calls << " calls, min / mean / max = "
+                << n.min << " / " << n.total / static_cast <double> (n.calls)
+                << " / " << n.max << ")";
+            if (n.rss_peak > 0) {
+                msg << std::setprecision(1) << ", peak RSS "
+                    << static_cast <double> (n.rss_peak) / 1048576.0
+                    << " MB (+"
+                    << static_cast <double> (n.rss_growth) / 1048576.0
+                    << " MB)" << std::setprecision(6);
+            }
+            perf_report(msg, n.perf);
+            logger.info(msg.str().c_str());
+            for (auto it = n.children.rbegin(); it != n.children.rend();
+                 ++it) {
+                todo.push_back(std::make_pair(*it, depth + 1));
+            }
+        }
+    }
+    return;
+}
+
+
+std::vector <fba::GlobalTimerStats> fba::GlobalTimers::summary() const {
+    std::lock_guard <std::mutex> lock(mutex_);
+    std::vector <fba::GlobalTimerStats> ret;
+    for (auto const & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        // Depth first, so that every region follows its parent.
+        std::vector <std::pair <int32_t, std::string> > todo;
+        for (auto it = td->roots.rbegin(); it != td->roots.rend(); ++it) {
+            todo.push_back(std::make_pair(*it, std::string("")));
+        }
+        while (todo.size() > 0) {
+            int32_t nd = todo.back().first;
+            std::string path = todo.back().second;
+            todo.pop_back();
+            node const & n = td->nodes[nd];
+            fba::GlobalTimerStats st;
+            st.thread = td->id;
+            st.depth = 0;
+            for (int32_t p = n.parent; p >= 0; p = td->nodes[p].parent) {
+                st.depth++;
+            }
+            st.name = region_names_[n.region];
+            if (path.size() > 0) {
+                path += "/";
+            }
+            path += st.name;
+            st.path = path;
+            st.calls = n.calls;
+            st.total = n.total;
+            st.min = n.min;
+            st.max = n.max;
+            st.rss_peak = n.rss_peak;
+            st.rss_growth = n.rss_growth;
+            st.perf = n.perf;
+            ret.push_back(st);
+            for (auto it = n.children.rbegin(); it != n.children.rend();
+                 ++it) {
+                todo.push_back(std::make_pair(*it, path));
+            }
+        }
+    }
+    return ret;
+}
+
+
+namespace {
+
+void json_string(std::ostream & o, std::string const & str) {
+    o << '"';
+    for (auto const & c : str) {
+        if ((c == '"') || (c == '\\')) {
+            o << '\\' << c;
+        } else if (static_cast <unsigned char> (c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", static_cast <int> (c));
+            o << buf;
+        } else {
+            o << c;
+        }
     }
+    o << '"';
     return;
 }
 
+}
+
+
+std::string fba::GlobalTimers::summary_json() const {
+    std::vector <fba::GlobalTimerStats> stats = summary();
+    std::ostringstream o;
+    o.precision(9);
+    o << "{\"regions\": [";
+    for (size_t i = 0; i < stats.size(); ++i) {
+        auto const & st = stats[i];
+        double mean = 0.0;
+        if (st.calls > 0) {
+            mean = st.total / static_cast <double> (st.calls);
+        }
+        if (i > 0) {
+            o << ",";
+        }
+        o << "\n  {\"thread\": " << st.thread << ", \"depth\": " << st.depth
+            << ", \"name\": ";
+        json_string(o, st.name);
+        o << ", \"path\": ";
+        json_string(o, st.path);
+        o << ", \"calls\": " << st.calls << ", \"total\": " << st.total
+            << ", \"min\": " << st.min << ", \"mean\": " << mean
+            << ", \"max\": " << st.max << ", \"rss_peak\": " << st.rss_peak
+            << ", \"rss_growth\": " << st.rss_growth;
+        for (int32_t ev = 0; ev < PERF_EVENT_COUNT; ++ev) {
+            o << ", \"" << PerfCounters::event_name(ev) << "\": "
+                << st.perf[ev];
+        }
+        o << "}";
+    }
+    o << "\n]}\n";
+    return o.str();
+}
+
+
+void fba::GlobalTimers::set_trace(bool enable) {
+    trace_ = enable;
+    return;
+}
+
+
+bool fba::GlobalTimers::trace() const {
+    return trace_;
+}
+
+
+void fba::GlobalTimers::set_memory(bool enable) {
+    memory_ = enable;
+    return;
+}
+
+
+bool fba::GlobalTimers::memory() const {
+    return memory_;
+}
+
+
+bool fba::GlobalTimers::set_perf_counters(bool enable) {
+    if (! enable) {
+        perf_ = false;
+        return true;
+    }
+    // Check that the counters can be opened, starting with this thread.
+    thread_data & td = local();
+    std::lock_guard <std::mutex> lock(td.mutex);
+    if (! td.perf) {
+        td.perf.reset(new PerfCounters());
+        td.perf->open();
+    }
+    if (! td.perf->available()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::ostringstream msg;
+        msg << "Hardware performance counters are not available ("
+            << td.perf->error() << ")";
+        logger.warning(msg.str().c_str());
+        perf_ = false;
+        return false;
+    }
+    perf_ = true;
+    return true;
+}
+
+
+bool fba::GlobalTimers::perf_counters() const {
+    return perf_;
+}
+
+
+void fba::GlobalTimers::read_perf(thread_data const & td,
+    std::array <int64_t, PERF_EVENT_COUNT> & values) const {
+    // The caller holds the lock of the thread data.
+    if (td.perf) {
+        td.perf->read(values.data());
+    } else {
+        values.fill(-1);
+    }
+    return;
+}
+
+
+std::string fba::GlobalTimers::trace_json() const {
+    // Chrome trace event format, which can also be loaded in Perfetto.
+    std::lock_guard <std::mutex> lock(mutex_);
+    std::ostringstream o;
+    o << std::fixed;
+    o.precision(3);
+    o << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    bool first = true;
+    for (auto const & td : threads_) {
+        std::lock_guard <std::mutex> tlock(td->mutex);
+        if (td->events.size() == 0) {
+            continue;
+        }
+        if (! first) {
+            o << ",";
+        }
+        first = false;
+        o << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, "
+            << "\"tid\": " << td->id << ", \"args\": {\"name\": \"thread "
+            << td->id << "\"}}";
+        for (auto const & ev : td->events) {
+            o << ",\n{\"name\": ";
+            json_string(o, region_names_[ev.region]);
+            o << ", \"cat\": \"fiberassign\", \"ph\": \"X\", \"pid\": 0, "
+                << "\"tid\": " << td->id << ", \"ts\": "
+                << 1.0e-3 * static_cast <double> (ev.start) << ", \"dur\": "
+                << 1.0e-3 * static_cast <double> (ev.stop - ev.start) << "}";
+        }
+    }
+    o << "\n]}\n";
+    return o.str();
+}
+
+
+void fba::GlobalTimers::write_trace(std::string const & path) const {
+    std::ofstream f(path);
+    if (! f.is_open()) {
+        fba::Logger & logger = fba::Logger::get();
+        std::ostringstream msg;
+        msg << "Cannot open timer trace file " << path;
+        logger.error(msg.str().c_str());
+        throw std::runtime_error(msg.str().c_str());
+    }
+    f << trace_json();
+    f.close();
+    return;
+}
+
+
+fba::GlobalTimerScope::GlobalTimerScope(int32_t region) {
+    region_ = region;
+    fba::GlobalTimers::get().start(region_);
+}
+
+
+fba::GlobalTimerScope::GlobalTimerScope(std::string const & name) {
+    region_ = fba::GlobalTimers::get().region(name);
+    fba::GlobalTimers::get().start(region_);
+}
+
+
+fba::GlobalTimerScope::~GlobalTimerScope() {
+    fba::GlobalTimers::get().stop(region_);
+}
+
 
 fba::Logger::Logger() {
     // Prefix for messages
@@ -276,6 +1407,14 @@ fba::Logger::Logger() {
         extra_ = true;
     }
 
+    // Optional binary trace of the per tile / location / target events.
+    trace_on_ = false;
+    trace_file_ = NULL;
+    val = ::getenv("DESI_DEBUG_TRACE");
+    if (val != NULL) {
+        open_trace(std::string(val));
+    }
+
     if (extra_) {
         fprintf(stdout, "%s: Extra debug options enabled.  RUN TIME WILL INCREASE BY AN ORDER OF MAGNITUDE!\n", prefix_.c_str());
         fflush(stdout);
@@ -288,33 +1427,97 @@ fba::Logger::Logger() {
 }
 
 
+fba::Logger::~Logger() {
+    close_trace();
+}
+
+
 fba::Logger & fba::Logger::get() {
     static fba::Logger instance;
     return instance;
 }
 
 
+bool fba::Logger::debug_tfg_enabled(int32_t tile, int32_t loc,
+    int64_t target) const {
+    if ((! extra_) || (level_ > log_level::debug)) {
+        return false;
+    }
+    if (debug_all_) {
+        return true;
+    }
+    if ((debug_tile_ >= 0) && (debug_tile_ == tile)) {
+        return true;
+    }
+    if ((debug_loc_ >= 0) && (debug_loc_ == loc)) {
+        return true;
+    }
+    if ((debug_target_ >= 0) && (debug_target_ == target)) {
+        return true;
+    }
+    return false;
+}
+
+
 void fba::Logger::debug_tfg(int32_t tile, int32_t loc, int64_t target,
     char const * msg) {
-    if (level_ <= log_level::debug) {
-        bool doprint = false;
-        if (debug_all_) {
-            doprint = true;
-        } else {
-            if ((debug_tile_ >= 0) && (debug_tile_ == tile)) {
-                doprint = true;
-            }
-            if ((debug_loc_ >= 0) && (debug_loc_ == loc)) {
-                doprint = true;
-            }
-            if ((debug_target_ >= 0) && (debug_target_ == target)) {
-                doprint = true;
-            }
-        }
-        if (doprint) {
-            fprintf(stdout, "%sDEBUG: %s\n", prefix_.c_str(), msg);
-            fflush(stdout);
-        }
+    if (debug_tfg_enabled(tile, loc, target)) {
+        fprintf(stdout, "%sDEBUG: %s\n", prefix_.c_str(), msg);
+        fflush(stdout);
+    }
+    return;
+}
+
+
+void fba::Logger::trace_tfg(int32_t event, int32_t tile, int32_t loc,
+    int64_t target, int32_t aux, int64_t arg) {
+    if (! trace_on_) {
+        return;
+    }
+    fba::trace_record rec;
+    rec.event = event;
+    rec.tile = tile;
+    rec.loc = loc;
+    rec.aux = aux;
+    rec.target = target;
+    rec.arg = arg;
+    std::lock_guard <std::mutex> lock(trace_mutex_);
+    if (trace_file_ != NULL) {
+        fwrite(&rec, sizeof(fba::trace_record), 1, trace_file_);
+    }
+    return;
+}
+
+
+void fba::Logger::open_trace(std::string const & path) {
+    close_trace();
+    std::lock_guard <std::mutex> lock(trace_mutex_);
+    trace_file_ = fopen(path.c_str(), "wb");
+    if (trace_file_ == NULL) {
+        std::ostringstream o;
+        o << "Cannot open debug trace file " << path;
+        error(o.str().c_str());
+        throw std::runtime_error(o.str().c_str());
+    }
+    // The header is a magic string, the format version and the size of
+    // each record.
+    char const magic[8] = {'F', 'B', 'A', 'T', 'R', 'A', 'C', 'E'};
+    int32_t version = 1;
+    int32_t recsize = sizeof(fba::trace_record);
+    fwrite(magic, 1, 8, trace_file_);
+    fwrite(&version, sizeof(int32_t), 1, trace_file_);
+    fwrite(&recsize, sizeof(int32_t), 1, trace_file_);
+    trace_on_ = true;
+    return;
+}
+
+
+void fba::Logger::close_trace() {
+    std::lock_guard <std::mutex> lock(trace_mutex_);
+    trace_on_ = false;
+    if (trace_file_ != NULL) {
+        fclose(trace_file_);
+        trace_file_ = NULL;
     }
     return;
 }
@@ -4,15 +4,21 @@
 #define UTILS_H
 
 #include <cstdint>
+#include <cstdio>
 #include <cmath>
 
 #include <iostream>
+#include <sstream>
 #include <chrono>
 #include <memory>
+#include <mutex>
+#include <atomic>
 #include <exception>
 #include <vector>
 #include <array>
 #include <map>
+#include <set>
+#include <string>
 
 
 namespace fiberassign {
@@ -28,6 +34,16 @@ void myexception (std::exception const & e);
 
 void myexception (std::exception & e);
 
+// Thread placement policies.  With NONE, threads are left to the OS and
+// the OpenMP runtime.  COMPACT pins thread i to the i-th allowed CPU,
+// filling one NUMA domain before the next.  SPREAD pins consecutive threads
+// to alternate domains.
+
+#define AFFINITY_NONE 0
+#define AFFINITY_COMPACT 1
+#define AFFINITY_SPREAD 2
+
+
 // Simple environment control
 
 class Environment {
@@ -41,15 +57,281 @@ class Environment {
         void set_threads(int nthread);
         int current_threads();
 
+        // Pin the OpenMP threads with one of the AFFINITY_* policies.  The
+        // initial policy is read from FIBERASSIGN_AFFINITY ("none",
+        // "compact" or "spread").
+        void set_affinity(int policy);
+        int affinity() const;
+
+        // The NUMA domains (from /sys on Linux, otherwise a single domain)
+        // and the CPUs of each which this process may use.
+        int ndomain() const;
+        std::vector <int> const & domain_cpus(int domain) const;
+
+        // The domain of an OpenMP thread under the current policy, or -1
+        // if threads are not pinned.
+        int thread_domain(int thread) const;
+
+        // Split [0, n) into one contiguous block per thread.  Each domain
+        // gets a block in proportion to its number of threads, which is
+        // then split between those threads.
+        std::vector <std::pair <size_t, size_t> > partition(size_t n) const;
+
+        // A description of the domains, the policy and the CPU on which
+        // each thread is currently running.
+        std::string topology();
+
+        static int affinity_policy(std::string const & name);
+        static std::string affinity_name(int policy);
+
     private :
 
         // This class is a singleton- constructor is private.
         Environment();
 
+        void pin_threads();
+
         int max_threads_;
         int cur_threads_;
+        int affinity_;
+
+        std::vector <std::vector <int> > domain_cpus_;
+        std::map <int, int> cpu_domain_;
+        // The CPU of each thread index under the current policy.
+        std::vector <int> thread_cpus_;
+};
+
+
+// Resident memory of this process in bytes:  the current value and the
+// high-water mark.  These return zero if not supported on the platform.
+
+int64_t rss_current_bytes();
+
+int64_t rss_peak_bytes();
+
+
+// Hardware events counted for each timed region when performance counters
+// are enabled.
+
+#define PERF_EVENT_CYCLES 0
+#define PERF_EVENT_INSTRUCTIONS 1
+#define PERF_EVENT_CACHE_MISSES 2
+#define PERF_EVENT_BRANCH_MISSES 3
+#define PERF_EVENT_COUNT 4
+
+
+// The hardware performance counters of the calling thread, read through
+// the Linux perf_event_open interface.  The counters run from open() until
+// destruction.  Where the interface is missing or not permitted, or an
+// event is not supported by the CPU, the value of that event is -1.
+
+class PerfCounters {
+
+    public :
+
+        PerfCounters();
+        ~PerfCounters();
+
+        // Open the counters for the calling thread.  Returns false (and
+        // sets the error message) if no event could be opened.
+        bool open();
+        bool available() const;
+        std::string const & error() const;
+
+        // Read the current values of all PERF_EVENT_COUNT events.
+        void read(int64_t * values) const;
+
+        static char const * event_name(int32_t event);
+
+    private :
+
+        PerfCounters(PerfCounters const &) = delete;
+        PerfCounters & operator=(PerfCounters const &) = delete;
+
+        int leader_;
+        std::vector <int> fds_;
+        // The event of each value in the group read.
+        std::vector <int32_t> events_;
+        std::string error_;
+};
+
+
+// Estimates of the heap memory owned by a value, for memory reports.  The
+// size of the value itself is not included.  Node based containers are
+// charged for one allocation per element with the usual tree node overhead.
+// Types without an overload are assumed to own no heap memory.
+
+size_t const heap_node_bytes = 32;
+
+template <typename T>
+size_t heap_bytes(T const &) {
+    return 0;
+}
+
+inline size_t heap_bytes(std::string const & val);
+
+template <typename T, typename A>
+size_t heap_bytes(std::vector <T, A> const & val);
+
+template <typename A>
+size_t heap_bytes(std::vector <bool, A> const & val);
+
+template <typename T, size_t N>
+size_t heap_bytes(std::array <T, N> const & val);
+
+template <typename T1, typename T2>
+size_t heap_bytes(std::pair <T1, T2> const & val);
+
+template <typename K, typename V, typename C, typename A>
+size_t heap_bytes(std::map <K, V, C, A> const & val);
+
+template <typename K, typename C, typename A>
+size_t heap_bytes(std::set <K, C, A> const & val);
+
+inline size_t heap_bytes(std::string const & val) {
+    // Short strings are stored in the object.
+    return (val.capacity() > 15) ? val.capacity() + 1 : 0;
+}
+
+template <typename T, typename A>
+size_t heap_bytes(std::vector <T, A> const & val) {
+    size_t ret = val.capacity() * sizeof(T);
+    for (auto const & v : val) {
+        ret += heap_bytes(v);
+    }
+    return ret;
+}
+
+template <typename A>
+size_t heap_bytes(std::vector <bool, A> const & val) {
+    return val.capacity() / 8;
+}
+
+template <typename T, size_t N>
+size_t heap_bytes(std::array <T, N> const & val) {
+    size_t ret = 0;
+    for (auto const & v : val) {
+        ret += heap_bytes(v);
+    }
+    return ret;
+}
+
+template <typename T1, typename T2>
+size_t heap_bytes(std::pair <T1, T2> const & val) {
+    return heap_bytes(val.first) + heap_bytes(val.second);
+}
+
+template <typename K, typename V, typename C, typename A>
+size_t heap_bytes(std::map <K, V, C, A> const & val) {
+    size_t ret = val.size() * (heap_node_bytes + sizeof(std::pair <K, V>));
+    for (auto const & v : val) {
+        ret += heap_bytes(v.first) + heap_bytes(v.second);
+    }
+    return ret;
+}
+
+template <typename K, typename C, typename A>
+size_t heap_bytes(std::set <K, C, A> const & val) {
+    size_t ret = val.size() * (heap_node_bytes + sizeof(K));
+    for (auto const & v : val) {
+        ret += heap_bytes(v);
+    }
+    return ret;
+}
+
+
+// Default size of the first block of a ScratchArena.
+
+#define SCRATCH_ARENA_BLOCK 65536
+
+// A bump allocator for scratch data which is discarded all at once.  Memory
+// is handed out from large blocks and is never freed individually.  After
+// reset() all of it can be handed out again.  If more than one block was
+// needed since the previous reset, the blocks are replaced by a single one
+// large enough for all of them, so that a loop which resets the arena on
+// every iteration soon stops calling the system allocator.  An arena must
+// only be used by one thread at a time.
+
+class ScratchArena {
+
+    public :
+
+        ScratchArena(size_t block_bytes = SCRATCH_ARENA_BLOCK);
+        ~ScratchArena();
+
+        void * allocate(size_t bytes, size_t align);
+
+        // Everything allocated before is invalid after this.
+        void reset();
+
+        // The bytes handed out since the last reset, and the total size of
+        // the blocks.
+        size_t used() const;
+        size_t capacity() const;
+
+    private :
+
+        ScratchArena(ScratchArena const &) = delete;
+        ScratchArena & operator=(ScratchArena const &) = delete;
+
+        void add_block(size_t bytes);
+
+        size_t block_bytes_;
+        std::vector <std::pair <char *, size_t> > blocks_;
+        size_t offset_;
+        size_t used_;
+};
+
+
+// Standard allocator interface to a ScratchArena, so that STL containers
+// can be used for scratch data.  Deallocation does nothing, the memory is
+// reclaimed when the arena is reset.  Containers must be emptied or
+// destroyed before resetting their arena.  For containers of containers,
+// wrap this in std::scoped_allocator_adaptor so that the elements use the
+// same arena.
+
+template <typename T>
+class ArenaAllocator {
+
+    public :
+
+        typedef T value_type;
+
+        explicit ArenaAllocator(ScratchArena * arena) : arena_(arena) {}
+
+        template <typename U>
+        ArenaAllocator(ArenaAllocator <U> const & other)
+            : arena_(other.arena()) {}
+
+        T * allocate(size_t n) {
+            return static_cast <T *> (
+                arena_->allocate(n * sizeof(T), alignof(T))
+            );
+        }
+
+        void deallocate(T *, size_t) {}
+
+        ScratchArena * arena() const {
+            return arena_;
+        }
+
+    private :
+
+        ScratchArena * arena_;
 };
 
+template <typename T, typename U>
+bool operator==(ArenaAllocator <T> const & lhs,
+                ArenaAllocator <U> const & rhs) {
+    return lhs.arena() == rhs.arena();
+}
+
+template <typename T, typename U>
+bool operator!=(ArenaAllocator <T> const & lhs,
+                ArenaAllocator <U> const & rhs) {
+    return lhs.arena() != rhs.arena();
+}
+
 
 // Simple class to help with timing parts of the code.
 
@@ -78,6 +360,33 @@ class Timer {
 };
 
 
+// Statistics of one timed region, as it was nested on one thread.
+
+struct GlobalTimerStats {
+    int32_t thread;
+    int32_t depth;
+    std::string name;
+    std::string path;
+    int64_t calls;
+    double total;
+    double min;
+    double max;
+    // With memory tracking enabled, the process peak RSS in bytes at the
+    // end of the region (the largest over all calls), and the total growth
+    // of the peak RSS during the calls.
+    int64_t rss_peak;
+    int64_t rss_growth;
+    // With performance counters enabled, the total hardware event counts of
+    // all calls (indexed by PERF_EVENT_*), or -1 if not counted.
+    std::array <int64_t, PERF_EVENT_COUNT> perf;
+};
+
+
+// Global registry of named timers.  Each name is interned as a region ID.
+// Every thread keeps its own stack of running regions, so that timers
+// started within other timers are accumulated separately for each parent,
+// and timers used concurrently on several threads do not interfere.
+
 class GlobalTimers {
 
     public :
@@ -85,22 +394,149 @@ class GlobalTimers {
         // Singleton access
         static GlobalTimers & get();
 
+        int32_t region(std::string const & name);
+
         void start(std::string const & name);
         void stop(std::string const & name);
+        void start(int32_t region);
+        void stop(int32_t region);
         double seconds(std::string const & name) const;
         bool is_running(std::string const & name) const;
 
         void stop_all();
+        void clear();
 
         void report();
 
+        std::vector <GlobalTimerStats> summary() const;
+        std::string summary_json() const;
+
+        void set_trace(bool enable);
+        bool trace() const;
+        std::string trace_json() const;
+        void write_trace(std::string const & path) const;
+
+        // Record the peak RSS at the start and end of every region.
+        void set_memory(bool enable);
+        bool memory() const;
+
+        // Count hardware events in every region.  This is enabled at
+        // startup if FIBERASSIGN_PERF_COUNTERS is set to a non-zero value.
+        // Returns false if the counters are not available to this thread.
+        bool set_perf_counters(bool enable);
+        bool perf_counters() const;
+
     private :
 
         // This class is a singleton- constructor is private.
         GlobalTimers();
 
-        // The timer data
-        std::map <std::string, Timer> data;
+        typedef std::chrono::steady_clock::time_point time_point;
+
+        // One region on the stack of a thread, under a given parent.
+        struct node {
+            int32_t parent;
+            int32_t region;
+            int64_t calls;
+            double total;
+            double min;
+            double max;
+            int64_t rss_peak;
+            int64_t rss_growth;
+            std::array <int64_t, PERF_EVENT_COUNT> perf;
+            std::vector <int32_t> children;
+        };
+
+        struct frame {
+            int32_t node;
+            time_point start;
+            // Peak RSS at the start, or -1 if memory was not tracked.
+            int64_t rss_start;
+            // Event counts at the start, or -1 if not counted.
+            std::array <int64_t, PERF_EVENT_COUNT> perf_start;
+        };
+
+        struct event {
+            int32_t region;
+            int64_t start;
+            int64_t stop;
+        };
+
+        struct thread_data {
+            int32_t id;
+            std::vector <node> nodes;
+            std::vector <int32_t> roots;
+            std::vector <frame> stack;
+            std::vector <event> events;
+            // Opened on the first region started with counters enabled.
+            std::unique_ptr <PerfCounters> perf;
+            mutable std::mutex mutex;
+        };
+
+        thread_data & local();
+        void read_perf(thread_data const & td,
+            std::array <int64_t, PERF_EVENT_COUNT> & values) const;
+        void close_frames(thread_data & td, size_t depth, time_point now);
+        void flat_totals(std::vector <double> & total,
+            std::vector <int64_t> & calls, std::vector <bool> & running) const;
+
+        // Interned region names.
+        std::map <std::string, int32_t> region_ids_;
+        std::vector <std::string> region_names_;
+
+        // Per-thread timer data, which lives as long as the registry.
+        std::vector <std::unique_ptr <thread_data> > threads_;
+
+        time_point epoch_;
+        std::atomic <bool> trace_;
+        std::atomic <bool> memory_;
+        std::atomic <bool> perf_;
+
+        // Assignments may run concurrently on several threads.
+        mutable std::mutex mutex_;
+};
+
+
+// Time the enclosing scope as a global timer region.
+
+class GlobalTimerScope {
+
+    public :
+
+        GlobalTimerScope(int32_t region);
+        GlobalTimerScope(std::string const & name);
+        ~GlobalTimerScope();
+
+    private :
+
+        int32_t region_;
+};
+
+
+// Structured debug events about one tile / location / target.  These are
+// written to the binary trace file (see Logger::open_trace) as records of
+// (event, tile, loc, aux, target, arg), where the meaning of aux and arg
+// depends on the event.
+
+#define TRACE_MESSAGE 0          // No structured data.
+#define TRACE_NO_TARGETS 1       // The tile has no available targets.
+#define TRACE_LOC_DISABLED 2     // The location is stuck or broken.
+#define TRACE_NEIGHBOR_TARGET 3  // Target already on neighbor location aux.
+#define TRACE_COLLIDE 4          // Collides with neighbor aux, target arg.
+#define TRACE_COLLIDE_EDGE 5     // Collides with a GFA or petal boundary.
+#define TRACE_NOT_OK 6           // Rejected by the collision checks.
+#define TRACE_ASSIGN 7           // Assigned, aux is the target type.
+#define TRACE_UNASSIGN 8         // Unassigned, aux is the target type.
+#define TRACE_MOVE 9             // Moved to tile aux, location arg.
+#define TRACE_BUMP 10            // Bumped and replaced with target arg.
+
+struct trace_record {
+    int32_t event;
+    int32_t tile;
+    int32_t loc;
+    int32_t aux;
+    int64_t target;
+    int64_t arg;
 };
 
 
@@ -120,9 +556,28 @@ class Logger {
         // Singleton access
         static Logger & get();
 
+        ~Logger();
+
         void debug_tfg(int32_t tile, int32_t loc, int64_t target,
             char const * msg);
 
+        bool debug_tfg_enabled(int32_t tile, int32_t loc,
+            int64_t target) const;
+
+        void trace_tfg(int32_t event, int32_t tile, int32_t loc,
+            int64_t target, int32_t aux, int64_t arg);
+
+        void open_trace(std::string const & path);
+        void close_trace();
+
+        // These are checked before any message is formatted.
+        bool debug_enabled() const {
+            return (level_ <= log_level::debug);
+        }
+        bool tfg_enabled() const {
+            return (extra_ || trace_on_);
+        }
+
         void debug(char const * msg);
         void info(char const * msg);
         void warning(char const * msg);
@@ -144,9 +599,57 @@ class Logger {
         bool debug_all_;
         bool extra_;
 
+        std::atomic <bool> trace_on_;
+        FILE * trace_file_;
+        std::mutex trace_mutex_;
+
 };
 
 
+// Lazy debug logging.  The message arguments are streamed into a string
+// only if the message will be printed.  Building with FIBERASSIGN_NO_DEBUG
+// defined removes these messages (and the binary trace) at compile time.
+
+#ifdef FIBERASSIGN_NO_DEBUG
+#define FBA_DEBUG_ENABLED false
+#else
+#define FBA_DEBUG_ENABLED true
+#endif
+
+#define FBA_LOG_DEBUG(...) \
+    do { \
+        if (FBA_DEBUG_ENABLED) { \
+            ::fiberassign::Logger & fba_lg_ = ::fiberassign::Logger::get(); \
+            if (fba_lg_.debug_enabled()) { \
+                std::ostringstream fba_msg_; \
+                fba_msg_ << __VA_ARGS__; \
+                fba_lg_.debug(fba_msg_.str().c_str()); \
+            } \
+        } \
+    } while (0)
+
+// A debug message about one tile / location / target.  The structured event
+// is written to the trace file if one is open, and the message is printed
+// if that tile, location or target was selected with DESI_DEBUG_*.
+
+#define FBA_TRACE_TFG(event, tile, loc, target, aux, arg, ...) \
+    do { \
+        if (FBA_DEBUG_ENABLED) { \
+            ::fiberassign::Logger & fba_lg_ = ::fiberassign::Logger::get(); \
+            if (fba_lg_.tfg_enabled()) { \
+                fba_lg_.trace_tfg((event), (tile), (loc), (target), (aux), \
+                    (arg)); \
+                if (fba_lg_.debug_tfg_enabled((tile), (loc), (target))) { \
+                    std::ostringstream fba_msg_; \
+                    fba_msg_ << __VA_ARGS__; \
+                    fba_lg_.debug_tfg((tile), (loc), (target), \
+                        fba_msg_.str().c_str()); \
+                } \
+            } \
+        } \
+    } while (0)
+
+
 // This namespace is for all the geometry helper functions.
 namespace geom {
 